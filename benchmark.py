@@ -3,20 +3,21 @@
 from subprocess import *
 import os
 import sys
-import time
-import csv
+import json
+import tempfile
 
 def bench(benchPath):
 
-    startTime = time.time()
+    # The VM times the benchmark iterations itself, so that process
+    # startup and package loading are not included in the timings
+    outFile, outPath = tempfile.mkstemp(suffix='.json')
+    os.close(outFile)
 
-    benchCmd = './zeta %s' % benchPath
+    benchCmd = './zeta --bench --bench-out=%s %s' % (outPath, benchPath)
     pipe = Popen(benchCmd, shell=True, stdout=PIPE, stderr=PIPE)
 
     # Wait until the benchmark terminates
-    pipe.wait()
-
-    endTime = time.time()
+    pipe.communicate()
 
     # Verify the return code
     ret = pipe.returncode
@@ -26,10 +27,11 @@ def bench(benchPath):
         sys.stdout.write(output)
         raise Exception('invalid return code: ' + str(ret))
 
-    # Compute the time in milliseconds
-    deltaTime = 1000 * (endTime - startTime)
+    with open(outPath) as f:
+        result = json.load(f)
+    os.remove(outPath)
 
-    return deltaTime
+    return result
 
 # Computes the geometric mean of a list of values
 def geoMean(numList):
@@ -62,25 +64,41 @@ def runBenchs():
         'benchmarks/func_audio.pls -- 10',
         'benchmarks/rand_floats.pls -- 20',
         'benchmarks/zsdf.pls -- 512',
+        'benchmarks/zsdf_par.pls -- 512',
     ]
 
     timeVals = []
+    results = []
+
+    sys.stdout.write(''.ljust(40) + '  median      p95   stddev\n')
 
     for benchPath in benchList:
 
         sys.stdout.write(benchPath.ljust(40))
         sys.stdout.flush()
 
-        timeMs = bench(benchPath)
-        timeVals += [timeMs]
+        result = bench(benchPath)
+        results += [result]
 
-        sys.stdout.write('%6d ms\n' % timeMs)
+        times = result['time_ms']
+        timeVals += [times['median']]
+
+        sys.stdout.write('%6d ms %5d ms %5.1f ms\n' % (
+            times['median'],
+            times['p95'],
+            times['stddev']
+        ))
 
     meanTime = geoMean(timeVals)
-    sys.stdout.write(49 * '-' + '\n')
+    sys.stdout.write(66 * '-' + '\n')
     sys.stdout.write('geometric mean'.ljust(40))
     sys.stdout.write('%6d ms\n' % meanTime)
 
+    # Save all of the results, to track regressions across runs
+    if len(sys.argv) > 1:
+        with open(sys.argv[1], 'w') as f:
+            json.dump(results, f, indent=2)
+
 # TODO: trigger make clean, make -j4 to make sure we have a fresh build
 # Note: could ./configure with NDEBUG to disable assertions
 
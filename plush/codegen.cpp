@@ -1,5 +1,6 @@
 #include <cassert>
 #include <vector>
+#include <unordered_set>
 #include <string>
 #include <iostream>
 #include "codegen.h"
@@ -15,10 +16,16 @@ private:
 
     std::vector<std::string> instrs;
 
+    /// Serialized block, once finalized
+    std::string text;
+
     bool finalized = false;
 
 public:
 
+    /// Blocks this block branches to
+    std::vector<Block*> succs;
+
     Block()
     {
         idNo = lastIdNo++;
@@ -28,6 +35,8 @@ public:
 
     bool isFinalized() const { return finalized; }
 
+    const std::string& getText() const { return text; }
+
     void add(std::string instrStr)
     {
         if (finalized)
@@ -43,19 +52,19 @@ public:
         instrs.push_back("{ " + instrStr + " }");
     };
 
-    void finalize(std::string& out)
+    void finalize()
     {
         assert (!finalized);
         assert (instrs.size() > 0);
 
-        out += getHandle() + " = {\n";
-        out += "  instrs: [\n";
+        text += getHandle() + " = {\n";
+        text += "  instrs: [\n";
 
         for (auto str: instrs)
-            out += "    " + str + ",\n";
+            text += "    " + str + ",\n";
 
-        out += "  ]\n";
-        out += "};\n\n";
+        text += "  ]\n";
+        text += "};\n\n";
 
         finalized = true;
     }
@@ -81,6 +90,12 @@ private:
 
 public:
 
+    /// Function name, if known, used to identify the function in profiles
+    std::string name;
+
+    /// Locals which are known to always hold int32 values
+    std::unordered_set<std::string> int32Locals;
+
     Function(
         std::vector<std::string> params,
         Block* entryBlock
@@ -93,6 +108,8 @@ public:
 
     std::string getHandle() { return "fun_" + std::to_string(idNo); }
 
+    Block* getEntryBlock() { return entryBlock; }
+
     /// Register a local variable declaration
     void registerDecl(std::string identName)
     {
@@ -117,10 +134,31 @@ public:
         return localIdxs[identName];
     }
 
+    /// Test if a local variable always holds an int32 value
+    bool isInt32Local(std::string identName)
+    {
+        return int32Locals.find(identName) != int32Locals.end();
+    }
+
     void finalize(std::string& out)
     {
         assert (entryBlock != nullptr);
 
+        // Output the blocks reachable from the entry block. Blocks which
+        // nothing branches to, such as code following a loop that never
+        // exits, or the untaken side of a constant test, are left out.
+        std::vector<Block*> blocks = { entryBlock };
+        std::unordered_set<Block*> visited = { entryBlock };
+        for (size_t i = 0; i < blocks.size(); ++i)
+        {
+            assert (blocks[i]->isFinalized());
+            out += blocks[i]->getText();
+
+            for (auto succ : blocks[i]->succs)
+                if (visited.insert(succ).second)
+                    blocks.push_back(succ);
+        }
+
         std::string paramsStr = "[";
         for (size_t i = 0; i < params.size(); ++i)
         {
@@ -136,12 +174,35 @@ public:
         out += "  entry:@" + entryBlock->getHandle() + ",\n";
         out += "  params:" + paramsStr + ",\n";
         out += "  num_locals:" + std::to_string(numLocals) + ",\n";
+        if (name != "")
+            out += "  name:'" + name + "',\n";
         out += "};\n\n";
 
         entryBlock = nullptr;
     }
 };
 
+// Functions created for function expressions
+std::unordered_map<FunExpr*, Function*> funObjs;
+
+// Unit variables always holding the same function expression
+std::unordered_map<std::string, FunExpr*> constFuns;
+
+/**
+Get the function created for a function expression. Functions can be
+referenced before the code for them is generated.
+*/
+Function* getFunction(FunExpr* funExpr)
+{
+    auto itr = funObjs.find(funExpr);
+    if (itr != funObjs.end())
+        return itr->second;
+
+    auto fun = new Function(funExpr->params, new Block());
+    funObjs[funExpr] = fun;
+    return fun;
+}
+
 class CodeGenCtx
 {
 public:
@@ -265,88 +326,780 @@ public:
             );
         }
 
-        /// Serialize the basic block
-        curBlock->finalize(this->out);
+        if (target0)
+            curBlock->succs.push_back(target0);
+        if (target1)
+            curBlock->succs.push_back(target1);
+
+        /// Serialize the basic block
+        curBlock->finalize();
+    }
+};
+
+/**
+Register variable declarations within a function body
+*/
+void registerDecls(Function* fun, ASTStmt* stmt, bool unitFun)
+{
+    if (auto blockStmt = dynamic_cast<BlockStmt*>(stmt))
+    {
+        for (auto stmt : blockStmt->stmts)
+            registerDecls(fun, stmt, unitFun);
+        return;
+    }
+
+    if (auto varStmt = dynamic_cast<VarStmt*>(stmt))
+    {
+        // If this is not a unit function, create a new local
+        if (!unitFun)
+            fun->registerDecl(varStmt->identName);
+        return;
+    }
+
+    if (dynamic_cast<ExprStmt*>(stmt) != nullptr)
+    {
+        return;
+    }
+
+    if (auto ifStmt = dynamic_cast<IfStmt*>(stmt))
+    {
+        registerDecls(fun, ifStmt->thenStmt, unitFun);
+        registerDecls(fun, ifStmt->elseStmt, unitFun);
+        return;
+    }
+
+    if (auto forStmt = dynamic_cast<ForStmt*>(stmt))
+    {
+        registerDecls(fun, forStmt->initStmt, unitFun);
+        registerDecls(fun, forStmt->bodyStmt, unitFun);
+        return;
+    }
+
+    if (dynamic_cast<ContStmt*>(stmt) != nullptr)
+    {
+        return;
+    }
+
+    if (dynamic_cast<BreakStmt*>(stmt) != nullptr)
+    {
+        return;
+    }
+
+    if (auto tryStmt = dynamic_cast<TryStmt*>(stmt))
+    {
+        registerDecls(fun, tryStmt->bodyStmt, unitFun);
+        registerDecls(fun, tryStmt->catchStmt, unitFun);
+
+        // If this is not a unit function, create a new local
+        if (!unitFun)
+            fun->registerDecl(tryStmt->catchVar);
+
+        return;
+    }
+
+    if (dynamic_cast<ReturnStmt*>(stmt) != nullptr)
+    {
+        return;
+    }
+
+    if (dynamic_cast<ThrowStmt*>(stmt) != nullptr)
+    {
+        return;
+    }
+
+    if (dynamic_cast<IRStmt*>(stmt) != nullptr)
+    {
+        return;
+    }
+
+    assert (false && "unhandled statement type in registerDecls");
+}
+
+/// Test if an expression is an integer constant in the int32 range
+bool isInt32Const(ASTExpr* expr, int32_t& val)
+{
+    auto intExpr = dynamic_cast<IntExpr*>(expr);
+    if (!intExpr || intExpr->val < INT32_MIN || intExpr->val > INT32_MAX)
+        return false;
+
+    val = (int32_t)intExpr->val;
+    return true;
+}
+
+/// Test if an expression is the true or false constant
+bool isBoolConst(ASTExpr* expr, bool& val)
+{
+    auto identExpr = dynamic_cast<IdentExpr*>(expr);
+    if (!identExpr)
+        return false;
+
+    if (identExpr->name == "true" || identExpr->name == "false")
+    {
+        val = (identExpr->name == "true");
+        return true;
+    }
+
+    return false;
+}
+
+ASTExpr* newBoolConst(bool val)
+{
+    return new IdentExpr(val? "true":"false");
+}
+
+// Forward declaration
+void foldStmt(ASTStmt* stmt);
+
+/**
+Fold operations on constant operands. Integer arithmetic wraps around
+like the int32 instructions do. Operations whose outcome is left to the
+VM, such as a modulo by zero or a shift by more than 31 bits, are kept.
+*/
+ASTExpr* foldExpr(ASTExpr* expr)
+{
+    if (auto unOp = dynamic_cast<UnOpExpr*>(expr))
+    {
+        unOp->expr = foldExpr(unOp->expr);
+
+        int32_t val;
+        bool boolVal;
+
+        if (unOp->op == &OP_NEG && isInt32Const(unOp->expr, val))
+            return new IntExpr((int32_t)(0 - (uint32_t)val));
+
+        // Note: 0 - 0.0f is positive zero
+        auto floatExpr = dynamic_cast<FloatExpr*>(unOp->expr);
+        if (unOp->op == &OP_NEG && floatExpr && floatExpr->val != 0)
+            return new FloatExpr(-floatExpr->val);
+
+        if (unOp->op == &OP_BIT_NOT && isInt32Const(unOp->expr, val))
+            return new IntExpr(~val);
+
+        if (unOp->op == &OP_NOT && isBoolConst(unOp->expr, boolVal))
+            return newBoolConst(!boolVal);
+
+        return expr;
+    }
+
+    if (auto binOp = dynamic_cast<BinOpExpr*>(expr))
+    {
+        auto op = binOp->op;
+
+        // The rhs of a member expression is a field name
+        binOp->lhsExpr = foldExpr(binOp->lhsExpr);
+        if (op != &OP_MEMBER)
+            binOp->rhsExpr = foldExpr(binOp->rhsExpr);
+
+        auto lhsExpr = binOp->lhsExpr;
+        auto rhsExpr = binOp->rhsExpr;
+
+        bool boolVal;
+        if (op == &OP_AND && isBoolConst(lhsExpr, boolVal))
+            return boolVal? rhsExpr:lhsExpr;
+        if (op == &OP_OR && isBoolConst(lhsExpr, boolVal))
+            return boolVal? lhsExpr:rhsExpr;
+
+        auto lhsStr = dynamic_cast<StringExpr*>(lhsExpr);
+        auto rhsStr = dynamic_cast<StringExpr*>(rhsExpr);
+        if (op == &OP_ADD && lhsStr && rhsStr)
+            return new StringExpr(lhsStr->val + rhsStr->val);
+
+        int32_t x, y;
+        if (!isInt32Const(lhsExpr, x) || !isInt32Const(rhsExpr, y))
+            return expr;
+
+        auto ux = (uint32_t)x;
+        auto uy = (uint32_t)y;
+        auto validShift = (y >= 0 && y < 32);
+
+        if (op == &OP_ADD)
+            return new IntExpr((int32_t)(ux + uy));
+        if (op == &OP_SUB)
+            return new IntExpr((int32_t)(ux - uy));
+        if (op == &OP_MUL)
+            return new IntExpr((int32_t)(ux * uy));
+        if (op == &OP_MOD && y != 0 && !(x == INT32_MIN && y == -1))
+            return new IntExpr(x % y);
+        if (op == &OP_BIT_AND)
+            return new IntExpr(x & y);
+        if (op == &OP_BIT_OR)
+            return new IntExpr(x | y);
+        if (op == &OP_BIT_XOR)
+            return new IntExpr(x ^ y);
+        if (op == &OP_BIT_SHL && validShift)
+            return new IntExpr((int32_t)(ux << y));
+        if (op == &OP_BIT_SHR && validShift)
+            return new IntExpr(x >> y);
+        if (op == &OP_BIT_USHR && validShift)
+            return new IntExpr((int32_t)(ux >> y));
+
+        if (op == &OP_EQ)
+            return newBoolConst(x == y);
+        if (op == &OP_NE)
+            return newBoolConst(x != y);
+        if (op == &OP_LT)
+            return newBoolConst(x < y);
+        if (op == &OP_LE)
+            return newBoolConst(x <= y);
+        if (op == &OP_GT)
+            return newBoolConst(x > y);
+        if (op == &OP_GE)
+            return newBoolConst(x >= y);
+
+        return expr;
+    }
+
+    if (auto arrExpr = dynamic_cast<ArrayExpr*>(expr))
+    {
+        for (auto& elemExpr : arrExpr->exprs)
+            elemExpr = foldExpr(elemExpr);
+        return expr;
+    }
+
+    if (auto objExpr = dynamic_cast<ObjectExpr*>(expr))
+    {
+        for (auto& valExpr : objExpr->exprs)
+            valExpr = foldExpr(valExpr);
+        return expr;
+    }
+
+    if (auto funExpr = dynamic_cast<FunExpr*>(expr))
+    {
+        foldStmt(funExpr->body);
+        return expr;
+    }
+
+    if (auto callExpr = dynamic_cast<CallExpr*>(expr))
+    {
+        for (auto& argExpr : callExpr->argExprs)
+            argExpr = foldExpr(argExpr);
+        callExpr->funExpr = foldExpr(callExpr->funExpr);
+        return expr;
+    }
+
+    if (auto callExpr = dynamic_cast<MethodCallExpr*>(expr))
+    {
+        callExpr->baseExpr = foldExpr(callExpr->baseExpr);
+        for (auto& argExpr : callExpr->argExprs)
+            argExpr = foldExpr(argExpr);
+        return expr;
+    }
+
+    if (auto irExpr = dynamic_cast<IRExpr*>(expr))
+    {
+        for (auto& argExpr : irExpr->argExprs)
+            argExpr = foldExpr(argExpr);
+        return expr;
+    }
+
+    // Constants, identifiers and imports
+    return expr;
+}
+
+/**
+Fold the constant expressions in a statement
+*/
+void foldStmt(ASTStmt* stmt)
+{
+    if (auto blockStmt = dynamic_cast<BlockStmt*>(stmt))
+    {
+        for (auto stmt : blockStmt->stmts)
+            foldStmt(stmt);
+        return;
+    }
+
+    if (auto varStmt = dynamic_cast<VarStmt*>(stmt))
+    {
+        varStmt->initExpr = foldExpr(varStmt->initExpr);
+        return;
+    }
+
+    if (auto exprStmt = dynamic_cast<ExprStmt*>(stmt))
+    {
+        exprStmt->expr = foldExpr(exprStmt->expr);
+        return;
+    }
+
+    if (auto ifStmt = dynamic_cast<IfStmt*>(stmt))
+    {
+        ifStmt->testExpr = foldExpr(ifStmt->testExpr);
+        foldStmt(ifStmt->thenStmt);
+        foldStmt(ifStmt->elseStmt);
+        return;
+    }
+
+    if (auto forStmt = dynamic_cast<ForStmt*>(stmt))
+    {
+        foldStmt(forStmt->initStmt);
+        forStmt->testExpr = foldExpr(forStmt->testExpr);
+        forStmt->incrExpr = foldExpr(forStmt->incrExpr);
+        foldStmt(forStmt->bodyStmt);
+        return;
+    }
+
+    if (auto tryStmt = dynamic_cast<TryStmt*>(stmt))
+    {
+        foldStmt(tryStmt->bodyStmt);
+        foldStmt(tryStmt->catchStmt);
+        return;
+    }
+
+    if (auto returnStmt = dynamic_cast<ReturnStmt*>(stmt))
+    {
+        returnStmt->expr = foldExpr(returnStmt->expr);
+        return;
+    }
+
+    if (auto throwStmt = dynamic_cast<ThrowStmt*>(stmt))
+    {
+        throwStmt->expr = foldExpr(throwStmt->expr);
+        return;
+    }
+
+    if (auto irStmt = dynamic_cast<IRStmt*>(stmt))
+    {
+        for (auto& argExpr : irStmt->argExprs)
+            argExpr = foldExpr(argExpr);
+        return;
+    }
+
+    // Loop break and continue statements
+}
+
+/// Test if an expression always produces an int32 value
+bool isInt32Expr(Function* fun, ASTExpr* expr)
+{
+    int32_t val;
+    if (isInt32Const(expr, val))
+        return true;
+
+    if (auto identExpr = dynamic_cast<IdentExpr*>(expr))
+        return fun->isInt32Local(identExpr->name);
+
+    if (auto unOp = dynamic_cast<UnOpExpr*>(expr))
+    {
+        if (unOp->op == &OP_NEG || unOp->op == &OP_BIT_NOT)
+            return isInt32Expr(fun, unOp->expr);
+        return false;
+    }
+
+    if (auto binOp = dynamic_cast<BinOpExpr*>(expr))
+    {
+        auto op = binOp->op;
+
+        // The value of an assignment is the value assigned
+        if (op == &OP_ASSIGN)
+            return isInt32Expr(fun, binOp->rhsExpr);
+
+        // Operators producing int32 values from int32 operands
+        if (op == &OP_ADD || op == &OP_SUB || op == &OP_MUL ||
+            op == &OP_MOD || op == &OP_BIT_AND || op == &OP_BIT_OR ||
+            op == &OP_BIT_XOR || op == &OP_BIT_SHL || op == &OP_BIT_SHR ||
+            op == &OP_BIT_USHR)
+        {
+            return (
+                isInt32Expr(fun, binOp->lhsExpr) &&
+                isInt32Expr(fun, binOp->rhsExpr)
+            );
+        }
+    }
+
+    return false;
+}
+
+/// Local variable definitions and uses found in a function body
+struct LocalUses
+{
+    Function* fun;
+
+    /// Values assigned to locals, null when not known statically
+    std::vector<std::pair<std::string, ASTExpr*>> defs;
+
+    /// Locals used where their declaration may not have executed yet
+    std::unordered_set<std::string> undeclared;
+};
+
+void findUses(
+    LocalUses& uses,
+    ASTExpr* expr,
+    const std::unordered_set<std::string>& declared
+)
+{
+    if (auto identExpr = dynamic_cast<IdentExpr*>(expr))
+    {
+        if (uses.fun->hasLocal(identExpr->name) &&
+            declared.find(identExpr->name) == declared.end())
+            uses.undeclared.insert(identExpr->name);
+        return;
+    }
+
+    if (auto unOp = dynamic_cast<UnOpExpr*>(expr))
+    {
+        findUses(uses, unOp->expr, declared);
+        return;
+    }
+
+    if (auto binOp = dynamic_cast<BinOpExpr*>(expr))
+    {
+        auto identExpr = dynamic_cast<IdentExpr*>(binOp->lhsExpr);
+        if (binOp->op == &OP_ASSIGN && identExpr &&
+            uses.fun->hasLocal(identExpr->name))
+            uses.defs.push_back({ identExpr->name, binOp->rhsExpr });
+
+        findUses(uses, binOp->lhsExpr, declared);
+        if (binOp->op != &OP_MEMBER)
+            findUses(uses, binOp->rhsExpr, declared);
+        return;
+    }
+
+    if (auto arrExpr = dynamic_cast<ArrayExpr*>(expr))
+    {
+        for (auto elemExpr : arrExpr->exprs)
+            findUses(uses, elemExpr, declared);
+        return;
+    }
+
+    if (auto objExpr = dynamic_cast<ObjectExpr*>(expr))
+    {
+        for (auto valExpr : objExpr->exprs)
+            findUses(uses, valExpr, declared);
+        return;
+    }
+
+    if (auto callExpr = dynamic_cast<CallExpr*>(expr))
+    {
+        for (auto argExpr : callExpr->argExprs)
+            findUses(uses, argExpr, declared);
+        findUses(uses, callExpr->funExpr, declared);
+        return;
+    }
+
+    if (auto callExpr = dynamic_cast<MethodCallExpr*>(expr))
+    {
+        findUses(uses, callExpr->baseExpr, declared);
+        for (auto argExpr : callExpr->argExprs)
+            findUses(uses, argExpr, declared);
+        return;
+    }
+
+    if (auto irExpr = dynamic_cast<IRExpr*>(expr))
+    {
+        for (auto argExpr : irExpr->argExprs)
+            findUses(uses, argExpr, declared);
+        return;
+    }
+
+    // Nested functions have their own locals
+}
+
+/**
+Find the local variable definitions and uses in a statement. The set of
+declared locals holds the locals whose declaration dominates the code
+being visited. Declarations in nested statements only dominate the rest
+of that statement, with the exception of for-loop initializers, which
+are visible after the loop.
+*/
+void findUses(
+    LocalUses& uses,
+    ASTStmt* stmt,
+    std::unordered_set<std::string>& declared
+)
+{
+    if (auto blockStmt = dynamic_cast<BlockStmt*>(stmt))
+    {
+        auto blockDeclared = declared;
+        for (auto stmt : blockStmt->stmts)
+            findUses(uses, stmt, blockDeclared);
+        return;
+    }
+
+    if (auto varStmt = dynamic_cast<VarStmt*>(stmt))
+    {
+        findUses(uses, varStmt->initExpr, declared);
+
+        if (uses.fun->hasLocal(varStmt->identName))
+        {
+            uses.defs.push_back({ varStmt->identName, varStmt->initExpr });
+            declared.insert(varStmt->identName);
+        }
+
+        return;
+    }
+
+    if (auto exprStmt = dynamic_cast<ExprStmt*>(stmt))
+    {
+        findUses(uses, exprStmt->expr, declared);
+        return;
+    }
+
+    if (auto ifStmt = dynamic_cast<IfStmt*>(stmt))
+    {
+        findUses(uses, ifStmt->testExpr, declared);
+        auto thenDeclared = declared;
+        findUses(uses, ifStmt->thenStmt, thenDeclared);
+        auto elseDeclared = declared;
+        findUses(uses, ifStmt->elseStmt, elseDeclared);
+        return;
+    }
+
+    if (auto forStmt = dynamic_cast<ForStmt*>(stmt))
+    {
+        findUses(uses, forStmt->initStmt, declared);
+        findUses(uses, forStmt->testExpr, declared);
+        auto bodyDeclared = declared;
+        findUses(uses, forStmt->bodyStmt, bodyDeclared);
+        findUses(uses, forStmt->incrExpr, declared);
+        return;
+    }
+
+    if (auto tryStmt = dynamic_cast<TryStmt*>(stmt))
+    {
+        auto bodyDeclared = declared;
+        findUses(uses, tryStmt->bodyStmt, bodyDeclared);
+
+        // The catch variable holds the exception value
+        auto catchDeclared = declared;
+        if (uses.fun->hasLocal(tryStmt->catchVar))
+        {
+            uses.defs.push_back({ tryStmt->catchVar, nullptr });
+            catchDeclared.insert(tryStmt->catchVar);
+        }
+        findUses(uses, tryStmt->catchStmt, catchDeclared);
+        return;
+    }
+
+    if (auto returnStmt = dynamic_cast<ReturnStmt*>(stmt))
+    {
+        findUses(uses, returnStmt->expr, declared);
+        return;
+    }
+
+    if (auto throwStmt = dynamic_cast<ThrowStmt*>(stmt))
+    {
+        findUses(uses, throwStmt->expr, declared);
+        return;
+    }
+
+    if (auto irStmt = dynamic_cast<IRStmt*>(stmt))
+    {
+        for (auto argExpr : irStmt->argExprs)
+            findUses(uses, argExpr, declared);
+        return;
+    }
+
+    // Loop break and continue statements
+}
+
+/**
+Infer which locals of a function always hold int32 values. A local
+qualifies if its declaration dominates all of its uses, and every value
+assigned to it is an int32, assuming the same of the other qualifying
+locals. Parameters and catch variables never qualify.
+*/
+void inferTypes(Function* fun, FunExpr* funExpr)
+{
+    LocalUses uses;
+    uses.fun = fun;
+
+    for (auto paramName : funExpr->params)
+        uses.defs.push_back({ paramName, nullptr });
+
+    std::unordered_set<std::string> declared(
+        funExpr->params.begin(),
+        funExpr->params.end()
+    );
+    findUses(uses, funExpr->body, declared);
+
+    // Start from all the locals, and remove those assigned values
+    // which may not be int32, until no more locals are removed
+    auto& int32Locals = fun->int32Locals;
+    for (auto& def : uses.defs)
+        if (uses.undeclared.find(def.first) == uses.undeclared.end())
+            int32Locals.insert(def.first);
+
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+
+        for (auto& def : uses.defs)
+        {
+            if (!fun->isInt32Local(def.first))
+                continue;
+
+            if (!def.second || !isInt32Expr(fun, def.second))
+            {
+                int32Locals.erase(def.first);
+                changed = true;
+            }
+        }
+    }
+}
+
+/// Variable definitions found in a unit
+struct VarDefs
+{
+    /// Number of declarations and assignments of each variable name
+    std::unordered_map<std::string, size_t> numDefs;
+
+    /// Functions assigned by unit-level declarations
+    std::unordered_map<std::string, FunExpr*> unitFuns;
+};
+
+void findDefs(VarDefs& defs, ASTStmt* stmt, bool unitLevel);
+
+void findDefs(VarDefs& defs, ASTExpr* expr)
+{
+    if (auto unOp = dynamic_cast<UnOpExpr*>(expr))
+    {
+        findDefs(defs, unOp->expr);
+        return;
+    }
+
+    if (auto binOp = dynamic_cast<BinOpExpr*>(expr))
+    {
+        auto identExpr = dynamic_cast<IdentExpr*>(binOp->lhsExpr);
+        if (binOp->op == &OP_ASSIGN && identExpr)
+            defs.numDefs[identExpr->name]++;
+
+        findDefs(defs, binOp->lhsExpr);
+        if (binOp->op != &OP_MEMBER)
+            findDefs(defs, binOp->rhsExpr);
+        return;
+    }
+
+    if (auto arrExpr = dynamic_cast<ArrayExpr*>(expr))
+    {
+        for (auto elemExpr : arrExpr->exprs)
+            findDefs(defs, elemExpr);
+        return;
+    }
+
+    if (auto objExpr = dynamic_cast<ObjectExpr*>(expr))
+    {
+        for (auto valExpr : objExpr->exprs)
+            findDefs(defs, valExpr);
+        return;
+    }
+
+    if (auto funExpr = dynamic_cast<FunExpr*>(expr))
+    {
+        findDefs(defs, funExpr->body, false);
+        return;
+    }
+
+    if (auto callExpr = dynamic_cast<CallExpr*>(expr))
+    {
+        for (auto argExpr : callExpr->argExprs)
+            findDefs(defs, argExpr);
+        findDefs(defs, callExpr->funExpr);
+        return;
+    }
+
+    if (auto callExpr = dynamic_cast<MethodCallExpr*>(expr))
+    {
+        findDefs(defs, callExpr->baseExpr);
+        for (auto argExpr : callExpr->argExprs)
+            findDefs(defs, argExpr);
+        return;
+    }
+
+    if (auto irExpr = dynamic_cast<IRExpr*>(expr))
+    {
+        for (auto argExpr : irExpr->argExprs)
+            findDefs(defs, argExpr);
+        return;
     }
-};
+}
 
 /**
-Register variable declarations within a function body
+Count the definitions of variable names in a statement, including
+those of locals in nested functions, which may shadow unit variables
 */
-void registerDecls(Function* fun, ASTStmt* stmt, bool unitFun)
+void findDefs(VarDefs& defs, ASTStmt* stmt, bool unitLevel)
 {
     if (auto blockStmt = dynamic_cast<BlockStmt*>(stmt))
     {
         for (auto stmt : blockStmt->stmts)
-            registerDecls(fun, stmt, unitFun);
+            findDefs(defs, stmt, unitLevel);
         return;
     }
 
     if (auto varStmt = dynamic_cast<VarStmt*>(stmt))
     {
-        // If this is not a unit function, create a new local
-        if (!unitFun)
-            fun->registerDecl(varStmt->identName);
-        return;
-    }
+        defs.numDefs[varStmt->identName]++;
 
-    if (dynamic_cast<ExprStmt*>(stmt) != nullptr)
-    {
-        return;
-    }
+        auto funExpr = dynamic_cast<FunExpr*>(varStmt->initExpr);
+        if (unitLevel && funExpr)
+            defs.unitFuns[varStmt->identName] = funExpr;
 
-    if (auto ifStmt = dynamic_cast<IfStmt*>(stmt))
-    {
-        registerDecls(fun, ifStmt->thenStmt, unitFun);
-        registerDecls(fun, ifStmt->elseStmt, unitFun);
+        findDefs(defs, varStmt->initExpr);
         return;
     }
 
-    if (auto forStmt = dynamic_cast<ForStmt*>(stmt))
+    if (auto exprStmt = dynamic_cast<ExprStmt*>(stmt))
     {
-        registerDecls(fun, forStmt->initStmt, unitFun);
-        registerDecls(fun, forStmt->bodyStmt, unitFun);
+        findDefs(defs, exprStmt->expr);
         return;
     }
 
-    if (dynamic_cast<ContStmt*>(stmt) != nullptr)
+    if (auto ifStmt = dynamic_cast<IfStmt*>(stmt))
     {
+        findDefs(defs, ifStmt->testExpr);
+        findDefs(defs, ifStmt->thenStmt, unitLevel);
+        findDefs(defs, ifStmt->elseStmt, unitLevel);
         return;
     }
 
-    if (dynamic_cast<BreakStmt*>(stmt) != nullptr)
+    if (auto forStmt = dynamic_cast<ForStmt*>(stmt))
     {
+        findDefs(defs, forStmt->initStmt, unitLevel);
+        findDefs(defs, forStmt->testExpr);
+        findDefs(defs, forStmt->incrExpr);
+        findDefs(defs, forStmt->bodyStmt, unitLevel);
         return;
     }
 
     if (auto tryStmt = dynamic_cast<TryStmt*>(stmt))
     {
-        registerDecls(fun, tryStmt->bodyStmt, unitFun);
-        registerDecls(fun, tryStmt->catchStmt, unitFun);
-
-        // If this is not a unit function, create a new local
-        if (!unitFun)
-            fun->registerDecl(tryStmt->catchVar);
-
+        findDefs(defs, tryStmt->bodyStmt, unitLevel);
+        defs.numDefs[tryStmt->catchVar]++;
+        findDefs(defs, tryStmt->catchStmt, unitLevel);
         return;
     }
 
-    if (dynamic_cast<ReturnStmt*>(stmt) != nullptr)
+    if (auto returnStmt = dynamic_cast<ReturnStmt*>(stmt))
     {
+        findDefs(defs, returnStmt->expr);
         return;
     }
 
-    if (dynamic_cast<ThrowStmt*>(stmt) != nullptr)
+    if (auto throwStmt = dynamic_cast<ThrowStmt*>(stmt))
     {
+        findDefs(defs, throwStmt->expr);
         return;
     }
 
-    if (dynamic_cast<IRStmt*>(stmt) != nullptr)
+    if (auto irStmt = dynamic_cast<IRStmt*>(stmt))
     {
+        for (auto argExpr : irStmt->argExprs)
+            findDefs(defs, argExpr);
         return;
     }
+}
 
-    assert (false && "unhandled statement type in registerDecls");
+/**
+Find the unit variables which are declared once with a function, and
+never assigned. References to these are generated as function constants,
+rather than reads of the global object.
+*/
+void findConstFuns(FunExpr* unitAST)
+{
+    VarDefs defs;
+    findDefs(defs, unitAST->body, true);
+
+    for (auto& pair : defs.unitFuns)
+        if (defs.numDefs[pair.first] == 1)
+            constFuns[pair.first] = pair.second;
 }
 
 // Forward declarations
@@ -357,6 +1110,15 @@ void genLogicalOr(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr);
 void genObjExpr(CodeGenCtx& ctx, ASTExpr* protoExpr, ObjectExpr* objExpr);
 void genAssign(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr);
 
+/// Name an anonymous function expression after the variable or
+/// property it gets assigned to
+void nameFunExpr(ASTExpr* expr, std::string name)
+{
+    auto funExpr = dynamic_cast<FunExpr*>(expr);
+    if (funExpr && funExpr->name == "")
+        funExpr->name = name;
+}
+
 /**
 Generate code for a code unit
 */
@@ -368,6 +1130,12 @@ std::string genUnit(FunExpr* unitAST)
 
     Function* unitFun = new Function(std::vector<std::string>(), entryBlock);
 
+    // Fold constant expressions
+    foldStmt(unitAST->body);
+
+    // Find the variables holding constant functions
+    findConstFuns(unitAST);
+
     // Register the variable declarations
     registerDecls(unitFun, unitAST->body, true);
 
@@ -402,11 +1170,25 @@ std::string genUnit(FunExpr* unitAST)
     return out;
 }
 
-void runtimeCall(CodeGenCtx& ctx, std::string funName, size_t numArgs)
+/// Generate a read of a unit variable
+void genGlobalRead(CodeGenCtx& ctx, std::string name)
 {
+    auto itr = constFuns.find(name);
+    if (itr != constFuns.end())
+    {
+        auto fun = getFunction(itr->second);
+        ctx.addStr("op:'push', val:@" + fun->getHandle());
+        return;
+    }
+
     ctx.addStr("op:'push', val:@global_obj");
-    ctx.addStr("op:'push', val:'rt_" + funName + "'");
+    ctx.addStr("op:'push', val:'" + name + "'");
     ctx.addOp("get_field");
+}
+
+void runtimeCall(CodeGenCtx& ctx, std::string funName, size_t numArgs)
+{
+    genGlobalRead(ctx, "rt_" + funName);
 
     auto contBlock = new Block();
     ctx.addBranch(
@@ -420,6 +1202,393 @@ void runtimeCall(CodeGenCtx& ctx, std::string funName, size_t numArgs)
     ctx.merge(contBlock);
 }
 
+/// Test if an expression can be evaluated again without side effects
+bool isSimpleExpr(Function* fun, ASTExpr* expr)
+{
+    if (dynamic_cast<IntExpr*>(expr) ||
+        dynamic_cast<FloatExpr*>(expr) ||
+        dynamic_cast<StringExpr*>(expr))
+        return true;
+
+    if (auto identExpr = dynamic_cast<IdentExpr*>(expr))
+    {
+        return (
+            fun->hasLocal(identExpr->name) ||
+            identExpr->name == "true" ||
+            identExpr->name == "false" ||
+            identExpr->name == "undef"
+        );
+    }
+
+    return false;
+}
+
+/// Test if an expression reads a local variable
+bool isLocalExpr(Function* fun, ASTExpr* expr)
+{
+    auto identExpr = dynamic_cast<IdentExpr*>(expr);
+    return identExpr && fun->hasLocal(identExpr->name);
+}
+
+/// Test if an expression could produce an int32 value
+bool mayBeInt32(ASTExpr* expr)
+{
+    if (dynamic_cast<FloatExpr*>(expr) ||
+        dynamic_cast<StringExpr*>(expr) ||
+        dynamic_cast<ArrayExpr*>(expr) ||
+        dynamic_cast<ObjectExpr*>(expr) ||
+        dynamic_cast<FunExpr*>(expr))
+        return false;
+
+    auto identExpr = dynamic_cast<IdentExpr*>(expr);
+    return !(identExpr && (
+        identExpr->name == "true" ||
+        identExpr->name == "false" ||
+        identExpr->name == "undef"
+    ));
+}
+
+/**
+Test the tag of a value, and continue in a new block if the value has
+the tag, or branch to the fail block if it doesn't. The value is either
+a local, which lets the VM specialize code on the tag of the local, or
+a copy of a stack value.
+*/
+void genTagTest(
+    CodeGenCtx& ctx,
+    std::string valInstr,
+    std::string tag,
+    Block* failBlock
+)
+{
+    auto passBlock = new Block();
+    ctx.addStr(valInstr);
+    ctx.addStr("op:'has_tag', tag:'" + tag + "'");
+    ctx.addBranch("if_true", "then", passBlock, "else", failBlock);
+    ctx.merge(passBlock);
+}
+
+std::string getLocalInstr(CodeGenCtx& ctx, ASTExpr* expr)
+{
+    auto identExpr = dynamic_cast<IdentExpr*>(expr);
+    assert (identExpr && ctx.fun->hasLocal(identExpr->name));
+    auto localIdx = ctx.fun->getLocalIdx(identExpr->name);
+    return "op:'get_local', idx:" + std::to_string(localIdx);
+}
+
+/**
+Generate the result of a boolean operation, either as a value or as a
+conditional branch when branch targets are given
+*/
+void genBoolResult(
+    CodeGenCtx& ctx,
+    bool negate,
+    Block* thenBlock,
+    Block* elseBlock
+)
+{
+    if (thenBlock)
+    {
+        if (negate)
+            std::swap(thenBlock, elseBlock);
+        ctx.addBranch("if_true", "then", thenBlock, "else", elseBlock);
+        return;
+    }
+
+    if (negate)
+    {
+        ctx.addPush("$false");
+        ctx.addOp("eq_bool");
+    }
+}
+
+/**
+Generate a binary operation with an inlined fast path. When the operand
+tags are not all known, they are tested, and the operation is performed
+by the runtime function for other operand types. Empty tag strings mark
+operands known to have the required tag. Boolean results can be negated,
+or branched on if branch targets are given.
+*/
+void genFastPathOp(
+    CodeGenCtx& ctx,
+    ASTExpr* lhsExpr,
+    std::string lhsTag,
+    ASTExpr* rhsExpr,
+    std::string rhsTag,
+    std::string opName,
+    std::string rtName,
+    bool negate = false,
+    Block* thenBlock = nullptr,
+    Block* elseBlock = nullptr
+)
+{
+    // If both operand tags are known, no tests are needed
+    if (lhsTag == "" && rhsTag == "")
+    {
+        genExpr(ctx, lhsExpr);
+        genExpr(ctx, rhsExpr);
+        ctx.addOp(opName);
+        genBoolResult(ctx, negate, thenBlock, elseBlock);
+        return;
+    }
+
+    auto slowBlock = new Block();
+    auto joinBlock = thenBlock? nullptr:new Block();
+
+    // If the operands are locals or constants, test the tags of the
+    // locals before pushing them, so their tags are known on the fast path
+    auto simpleOperands = (
+        isSimpleExpr(ctx.fun, lhsExpr) &&
+        isSimpleExpr(ctx.fun, rhsExpr) &&
+        (lhsTag == "" || isLocalExpr(ctx.fun, lhsExpr)) &&
+        (rhsTag == "" || isLocalExpr(ctx.fun, rhsExpr))
+    );
+
+    if (simpleOperands)
+    {
+        if (lhsTag != "")
+            genTagTest(ctx, getLocalInstr(ctx, lhsExpr), lhsTag, slowBlock);
+        if (rhsTag != "")
+            genTagTest(ctx, getLocalInstr(ctx, rhsExpr), rhsTag, slowBlock);
+        genExpr(ctx, lhsExpr);
+        genExpr(ctx, rhsExpr);
+    }
+    else
+    {
+        genExpr(ctx, lhsExpr);
+        genExpr(ctx, rhsExpr);
+        if (lhsTag != "")
+            genTagTest(ctx, "op:'dup', idx:1", lhsTag, slowBlock);
+        if (rhsTag != "")
+            genTagTest(ctx, "op:'dup', idx:0", rhsTag, slowBlock);
+    }
+
+    ctx.addOp(opName);
+    genBoolResult(ctx, negate, thenBlock, elseBlock);
+    if (joinBlock)
+        ctx.addBranch("jump", "to", joinBlock);
+
+    auto slowCtx = ctx.subCtx(slowBlock);
+    if (simpleOperands)
+    {
+        genExpr(slowCtx, lhsExpr);
+        genExpr(slowCtx, rhsExpr);
+    }
+    runtimeCall(slowCtx, rtName, 2);
+    if (thenBlock)
+        slowCtx.addBranch("if_true", "then", thenBlock, "else", elseBlock);
+    else
+        slowCtx.addBranch("jump", "to", joinBlock);
+
+    if (joinBlock)
+        ctx.merge(joinBlock);
+}
+
+/**
+Generate an arithmetic or comparison operator with an int32 fast path.
+Operands known to be int32 values are not tested.
+*/
+void genIntOp(
+    CodeGenCtx& ctx,
+    ASTExpr* lhsExpr,
+    ASTExpr* rhsExpr,
+    std::string opName,
+    std::string rtName,
+    bool negate = false,
+    Block* thenBlock = nullptr,
+    Block* elseBlock = nullptr
+)
+{
+    // Operands of other types are left to the runtime function
+    if (!mayBeInt32(lhsExpr) || !mayBeInt32(rhsExpr))
+    {
+        genExpr(ctx, lhsExpr);
+        genExpr(ctx, rhsExpr);
+        runtimeCall(ctx, rtName, 2);
+        if (thenBlock)
+            ctx.addBranch("if_true", "then", thenBlock, "else", elseBlock);
+        return;
+    }
+
+    genFastPathOp(
+        ctx,
+        lhsExpr,
+        isInt32Expr(ctx.fun, lhsExpr)? "":"int32",
+        rhsExpr,
+        isInt32Expr(ctx.fun, rhsExpr)? "":"int32",
+        opName,
+        rtName,
+        negate,
+        thenBlock,
+        elseBlock
+    );
+}
+
+/**
+Generate a read of a named property of the value on top of the stack.
+Fields found on the object itself are read with get_field and a literal
+field name, which the VM turns into an inline-cached field read. Other
+cases, such as inherited fields, are left to the runtime function. The
+base local, if any, is the local holding the base value.
+*/
+void genGetProp(CodeGenCtx& ctx, std::string name, ASTExpr* baseLocal)
+{
+    auto slowBlock = new Block();
+    auto getBlock = new Block();
+    auto joinBlock = new Block();
+
+    auto baseInstr = (
+        baseLocal? getLocalInstr(ctx, baseLocal):"op:'dup', idx:0"
+    );
+
+    // Array lengths are read directly
+    if (name == "length")
+    {
+        auto objBlock = new Block();
+        genTagTest(ctx, baseInstr, "array", objBlock);
+        ctx.addOp("array_len");
+        ctx.addBranch("jump", "to", joinBlock);
+        ctx.merge(objBlock);
+    }
+
+    genTagTest(ctx, baseInstr, "object", slowBlock);
+    ctx.addStr("op:'dup', idx:0");
+    ctx.addStr("op:'push', val:'" + name + "'");
+    ctx.addOp("has_field");
+    ctx.addBranch("if_true", "then", getBlock, "else", slowBlock);
+
+    auto getCtx = ctx.subCtx(getBlock);
+    getCtx.addStr("op:'push', val:'" + name + "'");
+    getCtx.addOp("get_field");
+    getCtx.addBranch("jump", "to", joinBlock);
+
+    auto slowCtx = ctx.subCtx(slowBlock);
+    slowCtx.addStr("op:'push', val:'" + name + "'");
+    runtimeCall(slowCtx, "getProp", 2);
+    slowCtx.addBranch("jump", "to", joinBlock);
+
+    ctx.merge(joinBlock);
+}
+
+/**
+Generate a conditional branch on the value of a test expression.
+Comparisons branch on the result of their fast path directly, and
+constant tests jump to the block they select.
+*/
+void genCondBranch(
+    CodeGenCtx& ctx,
+    ASTExpr* testExpr,
+    Block* thenBlock,
+    Block* elseBlock
+)
+{
+    bool boolVal;
+    if (isBoolConst(testExpr, boolVal))
+    {
+        ctx.addBranch("jump", "to", boolVal? thenBlock:elseBlock);
+        return;
+    }
+
+    if (auto unOp = dynamic_cast<UnOpExpr*>(testExpr))
+    {
+        if (unOp->op == &OP_NOT)
+        {
+            genCondBranch(ctx, unOp->expr, elseBlock, thenBlock);
+            return;
+        }
+    }
+
+    if (auto binOp = dynamic_cast<BinOpExpr*>(testExpr))
+    {
+        auto op = binOp->op;
+        auto lhsExpr = binOp->lhsExpr;
+        auto rhsExpr = binOp->rhsExpr;
+
+        if (op == &OP_AND || op == &OP_OR)
+        {
+            auto rhsBlock = new Block();
+            if (op == &OP_AND)
+                genCondBranch(ctx, lhsExpr, rhsBlock, elseBlock);
+            else
+                genCondBranch(ctx, lhsExpr, thenBlock, rhsBlock);
+            ctx.merge(rhsBlock);
+            genCondBranch(ctx, rhsExpr, thenBlock, elseBlock);
+            return;
+        }
+
+        // Expressions of the form typeof x == "type_string" are
+        // generated as tag tests, which the VM branches on directly
+        auto typeofExpr = dynamic_cast<UnOpExpr*>(lhsExpr);
+        auto isTagTest = (
+            typeofExpr && typeofExpr->op == &OP_TYPEOF &&
+            dynamic_cast<StringExpr*>(rhsExpr)
+        );
+
+        // Comparisons, by int32 instruction and runtime function
+        std::string i32Op;
+        std::string rtName;
+        auto negate = false;
+        if (op == &OP_EQ && !isTagTest)
+            i32Op = "eq_i32", rtName = "eq";
+        else if (op == &OP_NE)
+            i32Op = "eq_i32", rtName = "ne", negate = true;
+        else if (op == &OP_LT)
+            i32Op = "lt_i32", rtName = "lt";
+        else if (op == &OP_LE)
+            i32Op = "le_i32", rtName = "le";
+        else if (op == &OP_GT)
+            i32Op = "gt_i32", rtName = "gt";
+        else if (op == &OP_GE)
+            i32Op = "ge_i32", rtName = "ge";
+
+        if (i32Op != "")
+        {
+            genIntOp(
+                ctx,
+                lhsExpr,
+                rhsExpr,
+                i32Op,
+                rtName,
+                negate,
+                thenBlock,
+                elseBlock
+            );
+            return;
+        }
+    }
+
+    genExpr(ctx, testExpr);
+    ctx.addBranch("if_true", "then", thenBlock, "else", elseBlock);
+}
+
+/**
+Generate an expression whose value is discarded
+*/
+void genDiscard(CodeGenCtx& ctx, ASTExpr* expr)
+{
+    // Evaluating a local or a constant has no effect
+    if (isSimpleExpr(ctx.fun, expr))
+        return;
+
+    // Assignments to locals don't need to leave a copy of their value
+    if (auto binOp = dynamic_cast<BinOpExpr*>(expr))
+    {
+        auto identExpr = dynamic_cast<IdentExpr*>(binOp->lhsExpr);
+        if (binOp->op == &OP_ASSIGN && identExpr &&
+            ctx.fun->hasLocal(identExpr->name))
+        {
+            nameFunExpr(binOp->rhsExpr, identExpr->name);
+            genExpr(ctx, binOp->rhsExpr);
+            auto localIdx = ctx.fun->getLocalIdx(identExpr->name);
+            ctx.addStr("op:'set_local', idx:" + std::to_string(localIdx));
+            return;
+        }
+    }
+
+    genExpr(ctx, expr);
+    ctx.addOp("pop");
+}
+
 void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
 {
     if (auto intExpr = dynamic_cast<IntExpr*>(expr))
@@ -497,9 +1666,7 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
         }
         else
         {
-            ctx.addStr("op:'push', val:@global_obj");
-            ctx.addStr("op:'push', val:'" + identExpr->name + "'");
-            ctx.addOp("get_field");
+            genGlobalRead(ctx, identExpr->name);
         }
 
         return;
@@ -510,8 +1677,20 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
         // Logical not
         if (unOp->op == &OP_NOT)
         {
-            genExpr(ctx, unOp->expr);
-            runtimeCall(ctx, "not", 1);
+            // Branch on the operand, as the runtime function does
+            auto trueBlock = new Block();
+            auto falseBlock = new Block();
+            auto joinBlock = new Block();
+            genCondBranch(ctx, unOp->expr, falseBlock, trueBlock);
+
+            auto trueCtx = ctx.subCtx(trueBlock);
+            trueCtx.addPush("$true");
+            trueCtx.addBranch("jump", "to", joinBlock);
+            auto falseCtx = ctx.subCtx(falseBlock);
+            falseCtx.addPush("$false");
+            falseCtx.addBranch("jump", "to", joinBlock);
+
+            ctx.merge(joinBlock);
             return;
         }
 
@@ -519,9 +1698,8 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
         if (unOp->op == &OP_NEG)
         {
             // Generate 0 - x
-            ctx.addPush("0");
-            genExpr(ctx, unOp->expr);
-            runtimeCall(ctx, "sub", 2);
+            IntExpr zeroExpr(0);
+            genIntOp(ctx, &zeroExpr, unOp->expr, "sub_i32", "sub");
             return;
         }
 
@@ -529,7 +1707,10 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
         if (unOp->op == &OP_BIT_NOT)
         {
             genExpr(ctx, unOp->expr);
-            runtimeCall(ctx, "bit_not", 1);
+            if (isInt32Expr(ctx.fun, unOp->expr))
+                ctx.addOp("not_i32");
+            else
+                runtimeCall(ctx, "bit_not", 1);
             return;
         }
 
@@ -580,50 +1761,38 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
             }
 
             // Equality comparison
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "eq", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "eq_i32", "eq");
             return;
         }
 
         // Inequality comparison
         if (binOp->op == &OP_NE)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "ne", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "eq_i32", "ne", true);
             return;
         }
 
         if (binOp->op == &OP_LT)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "lt", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "lt_i32", "lt");
             return;
         }
 
         if (binOp->op == &OP_LE)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "le", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "le_i32", "le");
             return;
         }
 
         if (binOp->op == &OP_GT)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "gt", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "gt_i32", "gt");
             return;
         }
 
         if (binOp->op == &OP_GE)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "ge", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "ge_i32", "ge");
             return;
         }
 
@@ -645,25 +1814,19 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
 
         if (binOp->op == &OP_ADD)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "add", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "add_i32", "add");
             return;
         }
 
         if (binOp->op == &OP_SUB)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "sub", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "sub_i32", "sub");
             return;
         }
 
         if (binOp->op == &OP_MUL)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "mul", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "mul_i32", "mul");
             return;
         }
 
@@ -677,57 +1840,43 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
 
         if (binOp->op == &OP_MOD)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "mod", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "mod_i32", "mod");
             return;
         }
 
         if (binOp->op == &OP_BIT_SHL)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "shl", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "shl_i32", "shl");
             return;
         }
 
         if (binOp->op == &OP_BIT_SHR)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "shr", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "shr_i32", "shr");
             return;
         }
 
         if (binOp->op == &OP_BIT_USHR)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "ushr", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "ushr_i32", "ushr");
             return;
         }
 
         if (binOp->op == &OP_BIT_AND)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "and", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "and_i32", "and");
             return;
         }
 
         if (binOp->op == &OP_BIT_OR)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "or", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "or_i32", "or");
             return;
         }
 
         if (binOp->op == &OP_BIT_XOR)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "xor", 2);
+            genIntOp(ctx, binOp->lhsExpr, binOp->rhsExpr, "xor_i32", "xor");
             return;
         }
 
@@ -738,18 +1887,28 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
             auto identExpr = dynamic_cast<IdentExpr*>(binOp->rhsExpr);
             if (!identExpr)
                 throw ParseError("invalid rhs in member expression");
-            ctx.addStr("op:'push', val:'" + identExpr->name + "'");
 
-            runtimeCall(ctx, "getProp", 2);
+            genGetProp(
+                ctx,
+                identExpr->name,
+                isLocalExpr(ctx.fun, binOp->lhsExpr)? binOp->lhsExpr:nullptr
+            );
             return;
         }
 
         // Indexing operator: a[b]
         if (binOp->op == &OP_INDEX)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "getElem", 2);
+            // Array elements are read directly
+            genFastPathOp(
+                ctx,
+                binOp->lhsExpr,
+                "array",
+                binOp->rhsExpr,
+                isInt32Expr(ctx.fun, binOp->rhsExpr)? "":"int32",
+                "get_elem",
+                "getElem"
+            );
             return;
         }
 
@@ -799,12 +1958,9 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
     // Function/closure expression
     if (auto funExpr = dynamic_cast<FunExpr*>(expr))
     {
-        Block* entryBlock = new Block();
-
-        Function* fun = new Function(
-            funExpr->params,
-            entryBlock
-        );
+        Function* fun = getFunction(funExpr);
+        Block* entryBlock = fun->getEntryBlock();
+        fun->name = funExpr->name;
 
         // Register the parameter variables
         for (auto paramName : funExpr->params)
@@ -813,6 +1969,9 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
         // Register the variable declarations in the function body
         registerDecls(fun, funExpr->body, false);
 
+        // Find the locals which always hold int32 values
+        inferTypes(fun, funExpr);
+
         CodeGenCtx funCtx(
             ctx.out,
             fun,
@@ -879,11 +2038,17 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
         // Duplicate the base (this) value
         ctx.addStr("op:'dup', idx:" + std::to_string(args.size()));
 
-        // Push the property name
-        ctx.addStr("op:'push', val:'" + callExpr->nameStr + "'");
+        // The base local can be tested if the arguments can't change it
+        auto baseLocal = isLocalExpr(ctx.fun, callExpr->baseExpr);
+        for (auto argExpr : args)
+            baseLocal = baseLocal && isSimpleExpr(ctx.fun, argExpr);
 
         // Get the function/method value
-        runtimeCall(ctx, "getProp", 2);
+        genGetProp(
+            ctx,
+            callExpr->nameStr,
+            baseLocal? callExpr->baseExpr:nullptr
+        );
 
         auto contBlock = new Block();
         ctx.addBranch(
@@ -948,6 +2113,8 @@ void genStmt(CodeGenCtx& ctx, ASTStmt* stmt)
 
     if (auto varStmt = dynamic_cast<VarStmt*>(stmt))
     {
+        nameFunExpr(varStmt->initExpr, varStmt->identName);
+
         if (ctx.fun->hasLocal(varStmt->identName))
         {
             genExpr(ctx, varStmt->initExpr);
@@ -981,27 +2148,24 @@ void genStmt(CodeGenCtx& ctx, ASTStmt* stmt)
 
     if (auto exprStmt = dynamic_cast<ExprStmt*>(stmt))
     {
-        genExpr(ctx, exprStmt->expr);
-        ctx.addOp("pop");
+        genDiscard(ctx, exprStmt->expr);
         return;
     }
 
     if (auto ifStmt = dynamic_cast<IfStmt*>(stmt))
     {
-        // Evaluate the test expression
-        genExpr(ctx, ifStmt->testExpr);
-
         auto thenBlock = new Block();
+        auto elseBlock = new Block();
+
+        // Branch on the test expression
+        genCondBranch(ctx, ifStmt->testExpr, thenBlock, elseBlock);
+
         auto thenCtx = ctx.subCtx(thenBlock);
         genStmt(thenCtx, ifStmt->thenStmt);
 
-        auto elseBlock = new Block();
         auto elseCtx = ctx.subCtx(elseBlock);
         genStmt(elseCtx, ifStmt->elseStmt);
 
-        // Insert the conditional branching instruction
-        ctx.addBranch("if_true", "then", thenBlock, "else", elseBlock);
-
         auto joinBlock = new Block();
         ctx.merge(joinBlock);
 
@@ -1025,13 +2189,10 @@ void genStmt(CodeGenCtx& ctx, ASTStmt* stmt)
         // Generate the initialization statement
         genStmt(ctx, forStmt->initStmt);
 
-        // Evaluate the test expression
+        // Branch on the test expression
         ctx.addBranch("jump", "to", testBlock);
         auto testCtx = ctx.subCtx(testBlock);
-        genExpr(testCtx, forStmt->testExpr);
-
-        // Insert the conditional branching instruction
-        testCtx.addBranch("if_true", "then", bodyBlock, "else", exitBlock);
+        genCondBranch(testCtx, forStmt->testExpr, bodyBlock, exitBlock);
 
         // Generate the loop body statement
         auto bodyCtx = ctx.subCtx(
@@ -1045,8 +2206,7 @@ void genStmt(CodeGenCtx& ctx, ASTStmt* stmt)
 
         // Generate the increment expression
         auto incrCtx = ctx.subCtx(incrBlock);
-        genExpr(incrCtx, forStmt->incrExpr);
-        incrCtx.addOp("pop");
+        genDiscard(incrCtx, forStmt->incrExpr);
         incrCtx.addBranch("jump", "to", testBlock);
 
         ctx.merge(exitBlock);
@@ -1223,6 +2383,8 @@ void genAssign(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr)
             throw ParseError("cannot assign to exports variable");
         }
 
+        nameFunExpr(rhsExpr, identExpr->name);
+
         if (ctx.fun->hasLocal(identExpr->name))
         {
             auto localIdx = ctx.fun->getLocalIdx(identExpr->name);
@@ -1252,6 +2414,12 @@ void genAssign(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr)
             auto identExpr = dynamic_cast<IdentExpr*>(binOp->rhsExpr);
             assert (identExpr);
 
+            auto baseExpr = dynamic_cast<IdentExpr*>(binOp->lhsExpr);
+            nameFunExpr(
+                rhsExpr,
+                baseExpr? (baseExpr->name + "." + identExpr->name):identExpr->name
+            );
+
             // Evaluate the rhs value
             genExpr(ctx, rhsExpr);
 
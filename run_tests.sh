@@ -16,6 +16,24 @@ set -x
 ./zeta tests/vm/throw_exc2.zim
 ./zeta tests/vm/throw_exc3.zim
 ./zeta tests/vm/closure.zim
+./zeta tests/vm/superinstrs.zim
+./zeta tests/vm/bbv_tags.zim
+./zeta tests/vm/native_ops.zim
+./zeta tests/vm/coroutine.zim
+
+# Check that opcode pair statistics get printed
+./zeta --op-pairs tests/vm/superinstrs.zim 2>&1 | grep -q "if_lt_i32"
+
+# Check that the profiler reports opcode counts and named functions
+./zeta --profile --profile-out=tests/profile.folded benchmarks/fib.pls -- 25 2> tests/profile.txt
+grep -q "opcodes executed" tests/profile.txt
+grep -q "fib" tests/profile.folded
+rm -f tests/profile.txt tests/profile.folded
+
+# Check that the benchmark harness reports timing statistics
+./zeta --bench --bench-iters=3 --bench-out=tests/bench.json benchmarks/fib.pls -- 15 > /dev/null
+grep -q "\"median\"" tests/bench.json
+rm -f tests/bench.json
 
 # Check that loading a non-existent file produces a sensible error
 ./zeta non_existent_file | grep -q "non_existent_file"
@@ -54,6 +72,7 @@ set -x
 ./plush.sh tests/plush/obj_ext.pls
 ./plush.sh tests/plush/throw_exc.pls
 ./plush.sh tests/plush/throw_exc2.pls
+./plush.sh tests/plush/fast_paths.pls
 
 ##############################################################################
 # Plush language package tests (plush/plush_pkg.pls)
@@ -76,6 +95,10 @@ set -x
 ./zeta tests/plush/method_calls.pls
 ./zeta tests/plush/obj_field_names.pls
 ./zeta tests/plush/obj_ext.pls
+./zeta tests/plush/obj_shapes.pls
+./zeta tests/plush/poly_ic.pls
+./zeta tests/plush/stack_overflow.pls
+./zeta --stack-size=256 tests/plush/stack_overflow.pls | grep -q "stack overflow"
 ./zeta tests/plush/import.pls
 ./zeta tests/plush/load.pls
 ./zeta tests/plush/circular3.pls
@@ -83,6 +106,39 @@ set -x
 ./zeta tests/plush/throw_exc2.pls
 ./zeta tests/plush/catch_import_missing.pls
 ./zeta tests/plush/cmdline_args.pls -- foo bar
+./zeta tests/plush/code_heap.pls
+./zeta tests/plush/string_concat.pls
+./zeta tests/plush/buffers.pls
+./zeta tests/plush/native_map.pls
+./zeta tests/plush/coroutines.pls
+./zeta tests/plush/simd.pls
+./zeta tests/plush/host_status.pls | grep -q "variadic 1 2.5"
+./zeta tests/plush/file_io.pls
+./zeta tests/plush/file_io_mode.pls | grep -q "not open for reading"
+./zeta tests/plush/threads.pls
+./zeta tests/plush/parallel.pls
+./zeta --workers=3 tests/plush/parallel.pls
+
+# Binary images of global packages, written on first import, and
+# written again when the cached image is truncated
+rm -f packages/std/string/0/package.zib
+./zeta tests/plush/zib_cache.pls
+test -f packages/std/string/0/package.zib
+./zeta tests/plush/zib_cache.pls
+truncate -s 200 packages/std/string/0/package.zib
+./zeta tests/plush/zib_cache.pls
+./zeta tests/plush/zib_cache.pls
+
+# Prefetch the files of imported packages on worker threads
+./zeta --prefetch tests/plush/zib_cache.pls
+./zeta --prefetch tests/plush/import.pls
+./zeta --prefetch tests/plush/circular3.pls
+./zeta --prefetch tests/plush/catch_import_missing.pls
+
+# Run with a code heap small enough for old code to get evicted
+./zeta --code-heap-max=96 tests/plush/code_heap.pls
+./zeta --code-heap-max=96 tests/plush/throw_exc2.pls
+./zeta --code-heap-max=128 tests/plush/coroutines.pls
 
 # Regression tests
 ./zeta tests/plush/regress_cr_char.pls
@@ -104,6 +160,15 @@ set -x
 
 # Image parsing and serialization tests
 ./zeta tests/plush/serialize.pls
+rm -f tests/plush/serialize_out.zim tests/plush/serialize_out.zib
+rm -f tests/plush/file_io_out.txt
+
+# Garbage collector tests
+./zeta tests/gc/collect.pls
+./zeta tests/gc/objects.pls
+./zeta tests/gc/objext.pls
+./zeta tests/gc/arrays.pls
+./zeta tests/gc/ret.pls
 
 ##############################################################################
 # Packages included with ZetaVM
@@ -139,9 +204,11 @@ python2 espresso/main.py test
 ./zeta benchmarks/saw_wave.pls -- 10
 ./zeta benchmarks/sine_wave.pls -- 10
 ./zeta benchmarks/zsdf.pls -- 16
+./zeta benchmarks/zsdf_par.pls -- 16
+./zeta --workers=2 benchmarks/zsdf_par.pls -- 16
 
 # Example programs
-./zeta examples/line_count.pls -- examples/line_count.pls | grep -q "54"
+./zeta examples/line_count.pls -- examples/line_count.pls | grep -q "48"
 ./zeta examples/csv_parsing.pls -- examples/GOOG.csv | grep -q "rows: 23"
 ./zeta tests/examples/test_harness.pls -- ./examples/audio_render.pls
 ./zeta tests/examples/test_harness.pls -- ./examples/graphics.pls
@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include "bench.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//============================================================================
+// Hardware event counters
+//============================================================================
+
+/// Hardware events reported by the harness
+static const struct
+{
+    const char* name;
+    uint64_t config;
+}
+perfEvents[] =
+{
+#ifdef __linux__
+    { "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+    { "cycles", PERF_COUNT_HW_CPU_CYCLES },
+    { "cache_misses", PERF_COUNT_HW_CACHE_MISSES },
+    { "branch_misses", PERF_COUNT_HW_BRANCH_MISSES },
+#else
+    { nullptr, 0 }
+#endif
+};
+
+static const size_t NUM_PERF_EVENTS = sizeof(perfEvents) / sizeof(perfEvents[0]);
+
+/**
+Set of hardware event counters for the current thread. Counters
+are unavailable when the kernel does not support perf_event, or
+when the user may not read them (see perf_event_paranoid).
+*/
+class PerfCounters
+{
+private:
+
+    int fds[NUM_PERF_EVENTS];
+
+    bool available = false;
+
+public:
+
+    PerfCounters()
+    {
+        std::fill(fds, fds + NUM_PERF_EVENTS, -1);
+
+#ifdef __linux__
+        available = true;
+
+        for (size_t i = 0; i < NUM_PERF_EVENTS; ++i)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = perfEvents[i].config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+            // Report either all of the counters or none of them
+            if (fds[i] < 0)
+            {
+                available = false;
+                break;
+            }
+        }
+#endif
+    }
+
+    ~PerfCounters()
+    {
+#ifdef __linux__
+        for (size_t i = 0; i < NUM_PERF_EVENTS; ++i)
+            if (fds[i] >= 0)
+                close(fds[i]);
+#endif
+    }
+
+    bool isAvailable() const { return available; }
+
+    void start()
+    {
+#ifdef __linux__
+        for (size_t i = 0; available && i < NUM_PERF_EVENTS; ++i)
+        {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    /// Stop counting, and add the counts to the totals
+    void stop(uint64_t* totals)
+    {
+#ifdef __linux__
+        for (size_t i = 0; available && i < NUM_PERF_EVENTS; ++i)
+        {
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            uint64_t count;
+            if (read(fds[i], &count, sizeof(count)) != sizeof(count))
+                available = false;
+            else
+                totals[i] += count;
+        }
+#endif
+    }
+};
+
+//============================================================================
+// Statistics
+//============================================================================
+
+/// Summary statistics over a set of time measurements
+struct TimeStats
+{
+    double min;
+    double max;
+    double mean;
+    double median;
+    double p95;
+    double stddev;
+};
+
+/// Nearest-rank percentile of sorted values
+static double percentile(const std::vector<double>& sorted, double pct)
+{
+    assert (sorted.size() > 0);
+    size_t rank = (size_t)std::ceil(pct / 100 * sorted.size());
+    return sorted[std::max(rank, (size_t)1) - 1];
+}
+
+static TimeStats computeStats(std::vector<double> vals)
+{
+    assert (vals.size() > 0);
+    std::sort(vals.begin(), vals.end());
+
+    TimeStats stats;
+    stats.min = vals.front();
+    stats.max = vals.back();
+
+    size_t n = vals.size();
+    stats.median = (n % 2)? vals[n/2]:((vals[n/2 - 1] + vals[n/2]) / 2);
+    stats.p95 = percentile(vals, 95);
+
+    double sum = 0;
+    for (auto val : vals)
+        sum += val;
+    stats.mean = sum / n;
+
+    // Sample standard deviation
+    double sqSum = 0;
+    for (auto val : vals)
+        sqSum += (val - stats.mean) * (val - stats.mean);
+    stats.stddev = (n > 1)? std::sqrt(sqSum / (n - 1)):0;
+
+    return stats;
+}
+
+//============================================================================
+// JSON output
+//============================================================================
+
+static std::string jsonStr(const std::string& str)
+{
+    std::string out = "\"";
+
+    for (char ch : str)
+    {
+        switch (ch)
+        {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+
+            default:
+            if ((unsigned char)ch < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", ch);
+                out += buf;
+            }
+            else
+            {
+                out += ch;
+            }
+        }
+    }
+
+    return out + "\"";
+}
+
+//============================================================================
+// Harness
+//============================================================================
+
+void runBench(
+    const BenchConfig& config,
+    std::function<void()> iteration,
+    std::ostream& out
+)
+{
+    assert (config.numIters > 0);
+
+    for (size_t i = 0; i < config.numWarmup; ++i)
+        iteration();
+
+    PerfCounters counters;
+    uint64_t totals[NUM_PERF_EVENTS] = {};
+
+    std::vector<double> timesMs;
+
+    for (size_t i = 0; i < config.numIters; ++i)
+    {
+        counters.start();
+        auto startTime = std::chrono::steady_clock::now();
+
+        iteration();
+
+        auto endTime = std::chrono::steady_clock::now();
+        counters.stop(totals);
+
+        timesMs.push_back(
+            std::chrono::duration<double, std::milli>(endTime - startTime).count()
+        );
+    }
+
+    auto stats = computeStats(timesMs);
+
+    out << std::fixed << std::setprecision(3);
+    out << "{" << std::endl;
+    out << "  \"benchmark\": " << jsonStr(config.name) << "," << std::endl;
+
+    out << "  \"args\": [";
+    for (size_t i = 0; i < config.args.size(); ++i)
+        out << (i? ", ":"") << jsonStr(config.args[i]);
+    out << "]," << std::endl;
+
+    out << "  \"warmup\": " << config.numWarmup << "," << std::endl;
+    out << "  \"iterations\": " << config.numIters << "," << std::endl;
+
+    out << "  \"time_ms\": {" << std::endl;
+    out << "    \"min\": " << stats.min << "," << std::endl;
+    out << "    \"median\": " << stats.median << "," << std::endl;
+    out << "    \"p95\": " << stats.p95 << "," << std::endl;
+    out << "    \"mean\": " << stats.mean << "," << std::endl;
+    out << "    \"stddev\": " << stats.stddev << "," << std::endl;
+    out << "    \"max\": " << stats.max << std::endl;
+    out << "  }," << std::endl;
+
+    // Counts are averaged over the timed iterations
+    out << "  \"counters\": ";
+    if (counters.isAvailable())
+    {
+        out << "{" << std::endl;
+        for (size_t i = 0; i < NUM_PERF_EVENTS; ++i)
+        {
+            out << "    " << jsonStr(perfEvents[i].name) << ": ";
+            out << (totals[i] / config.numIters);
+            out << ((i + 1 < NUM_PERF_EVENTS)? ",":"") << std::endl;
+        }
+        out << "  }" << std::endl;
+    }
+    else
+    {
+        out << "null" << std::endl;
+    }
+
+    out << "}" << std::endl;
+}
+
+void testBench()
+{
+    std::cout << "bench tests" << std::endl;
+
+    auto stats = computeStats({ 4, 1, 3, 2 });
+    assert (stats.min == 1 && stats.max == 4);
+    assert (stats.median == 2.5);
+    assert (stats.mean == 2.5);
+    assert (stats.p95 == 4);
+
+    stats = computeStats({ 5 });
+    assert (stats.median == 5 && stats.p95 == 5 && stats.stddev == 0);
+
+    std::vector<double> vals;
+    for (size_t i = 1; i <= 100; ++i)
+        vals.push_back(i);
+    assert (percentile(vals, 95) == 95);
+    assert (percentile(vals, 50) == 50);
+
+    assert (jsonStr("a\"b\\c\n") == "\"a\\\"b\\\\c\\n\"");
+}
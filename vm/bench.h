@@ -0,0 +1,34 @@
+#pragma once
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+In-process benchmark harness. The benchmark runs a number of untimed
+warmup iterations, so that code gets compiled and caches are filled,
+followed by timed iterations. Hardware event counters are read where
+the platform supports them (perf_event on Linux).
+*/
+struct BenchConfig
+{
+    /// Benchmark name, usually the package path
+    std::string name;
+
+    /// Arguments the benchmark was run with
+    std::vector<std::string> args;
+
+    size_t numWarmup = 2;
+    size_t numIters = 10;
+};
+
+/// Run a benchmark, and write statistics about the timed
+/// iterations to the output stream as a JSON object
+void runBench(
+    const BenchConfig& config,
+    std::function<void()> iteration,
+    std::ostream& out
+);
+
+void testBench();
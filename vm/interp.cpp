@@ -1,11 +1,21 @@
 #include <cassert>
+#include <cstdio>
+#include <algorithm>
 #include <iostream>
 #include <unordered_map>
 #include "runtime.h"
 #include "parser.h"
 #include "interp.h"
 #include "packages.h"
+#include "jit.h"
 #include <math.h>
+#include <csignal>
+#include <fstream>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
 
 /// Opcode enumeration
 enum Opcode : uint16_t
@@ -13,6 +23,7 @@ enum Opcode : uint16_t
     // Local variable access
     GET_LOCAL,
     SET_LOCAL,
+    GET_LOCAL2,
 
     // Stack manipulation
     PUSH,
@@ -40,6 +51,18 @@ enum Opcode : uint16_t
     EQ_I32,
     INC_I32,
     DEC_I32,
+    ADD_LOCAL_IMM_I32,
+
+    // 32-bit integer operations on operands known to be int32,
+    // without tag checks
+    ADD_I32_NC,
+    SUB_I32_NC,
+    MUL_I32_NC,
+    LT_I32_NC,
+    LE_I32_NC,
+    GT_I32_NC,
+    GE_I32_NC,
+    EQ_I32_NC,
 
     // Floating-point operations
     ADD_F32,
@@ -84,6 +107,7 @@ enum Opcode : uint16_t
     SET_FIELD,
     GET_FIELD,
     GET_FIELD_IMM,
+    SET_FIELD_IMM,
     GET_FIELD_LIST,
     EQ_OBJ,
 
@@ -100,149 +124,1621 @@ enum Opcode : uint16_t
     JUMP,
     JUMP_STUB,
     IF_TRUE,
+    IF_LOCAL_HAS_TAG,
+    IF_LT_I32,
+    IF_LE_I32,
+    IF_GT_I32,
+    IF_GE_I32,
+    IF_EQ_I32,
     CALL,
     RET,
-    THROW
+    THROW,
+
+    // Coroutine switches
+    RESUME,
+    YIELD,
+
+    // Execution statistics
+    COUNT_BLOCK,
+
+    // Call into native code
+    JIT_RUN,
+
+    // Number of opcodes (not an instruction)
+    NUM_OPCODES
+};
+
+/// Opcode names, in opcode order
+const char* const opNames[] = {
+    "get_local",
+    "set_local",
+    "get_local2",
+    "push",
+    "pop",
+    "dup",
+    "swap",
+    "add_i32",
+    "sub_i32",
+    "mul_i32",
+    "div_i32",
+    "mod_i32",
+    "shl_i32",
+    "shr_i32",
+    "ushr_i32",
+    "and_i32",
+    "or_i32",
+    "xor_i32",
+    "not_i32",
+    "lt_i32",
+    "le_i32",
+    "gt_i32",
+    "ge_i32",
+    "eq_i32",
+    "inc_i32",
+    "dec_i32",
+    "add_local_imm_i32",
+    "add_i32_nc",
+    "sub_i32_nc",
+    "mul_i32_nc",
+    "lt_i32_nc",
+    "le_i32_nc",
+    "gt_i32_nc",
+    "ge_i32_nc",
+    "eq_i32_nc",
+    "add_f32",
+    "sub_f32",
+    "mul_f32",
+    "div_f32",
+    "lt_f32",
+    "le_f32",
+    "gt_f32",
+    "ge_f32",
+    "eq_f32",
+    "sin_f32",
+    "cos_f32",
+    "sqrt_f32",
+    "log_f32",
+    "exp_f32",
+    "i32_to_f32",
+    "i32_to_str",
+    "f32_to_i32",
+    "f32_to_str",
+    "str_to_f32",
+    "eq_bool",
+    "has_tag",
+    "get_tag",
+    "local_has_tag",
+    "str_len",
+    "get_char",
+    "get_char_code",
+    "char_to_str",
+    "str_cat",
+    "eq_str",
+    "new_object",
+    "has_field",
+    "set_field",
+    "get_field",
+    "get_field_imm",
+    "set_field_imm",
+    "get_field_list",
+    "eq_obj",
+    "new_array",
+    "array_len",
+    "array_push",
+    "array_pop",
+    "get_elem",
+    "set_elem",
+    "eq_array",
+    "jump",
+    "jump_stub",
+    "if_true",
+    "if_local_has_tag",
+    "if_lt_i32",
+    "if_le_i32",
+    "if_gt_i32",
+    "if_ge_i32",
+    "if_eq_i32",
+    "call",
+    "ret",
+    "throw",
+    "resume",
+    "yield",
+    "count_block",
+    "jit_run"
+};
+static_assert (
+    sizeof(opNames) / sizeof(opNames[0]) == NUM_OPCODES,
+    "missing opcode names"
+);
+
+/// Dispatch instructions by jumping directly to the address of their
+/// handler, stored in the code heap (computed goto, GCC/Clang extension).
+/// Otherwise, instructions are dispatched through a switch statement.
+#if defined(__GNUC__) && !defined(ZETA_SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+#ifdef THREADED_DISPATCH
+/// Opcodes in the code heap are handler addresses
+typedef void* OpWord;
+
+/// Handler addresses indexed by opcode, exported by execCode()
+thread_local void* const* opHandlers = nullptr;
+
+Value execCode();
+#else
+/// Opcodes in the code heap are opcode numbers, dispatched with a switch
+typedef Opcode OpWord;
+#endif
+
+/// Encode an opcode for the code heap
+OpWord encodeOp(Opcode op)
+{
+#ifdef THREADED_DISPATCH
+    assert (opHandlers);
+    return opHandlers[op];
+#else
+    return op;
+#endif
+}
+
+class CodeFragment
+{
+public:
+
+    /// Start index in the executable heap
+    uint8_t* startPtr = nullptr;
+
+    /// End index in the executable heap
+    uint8_t* endPtr = nullptr;
+
+    /// Get the length of the code fragment
+    size_t length()
+    {
+        assert (startPtr);
+        assert (endPtr);
+        return endPtr - startPtr;
+    }
+};
+
+/// Tag of values whose type isn't known at compilation time
+const Tag TAG_UNKNOWN = 0xFF;
+
+/// Code generation context, tracks the tags known at a given point
+/// in a block version. Versions are specialized based on the context
+/// at their entry.
+class CodeGenCtx
+{
+public:
+
+    /// Known tags of local variables, indexed by local index,
+    /// missing entries are unknown
+    std::vector<Tag> localTags;
+
+    /// Known tags of the temporaries, from the bottom of the temp stack
+    std::vector<Tag> tmpTags;
+
+    /// Create a context where nothing is known about the temporaries
+    explicit CodeGenCtx(uint16_t numTmps = 0)
+    : tmpTags(numTmps, TAG_UNKNOWN)
+    {
+    }
+
+    uint16_t numTmps() const
+    {
+        return tmpTags.size();
+    }
+
+    Tag getLocal(uint16_t idx) const
+    {
+        return (idx < localTags.size())? localTags[idx]:TAG_UNKNOWN;
+    }
+
+    void setLocal(uint16_t idx, Tag tag)
+    {
+        if (idx >= localTags.size())
+            localTags.resize(idx + 1, TAG_UNKNOWN);
+        localTags[idx] = tag;
+    }
+
+    /// Get the tag of a temporary, indexed from the top of the stack
+    Tag getTmp(uint16_t idx) const
+    {
+        if (idx >= tmpTags.size())
+            return TAG_UNKNOWN;
+        return tmpTags[tmpTags.size() - 1 - idx];
+    }
+
+    /// Check if the topmost temporaries are known to have a given tag
+    bool tmpsHaveTag(uint16_t numVals, Tag tag) const
+    {
+        for (uint16_t i = 0; i < numVals; ++i)
+            if (getTmp(i) != tag)
+                return false;
+
+        return true;
+    }
+
+    void push(Tag tag)
+    {
+        tmpTags.push_back(tag);
+    }
+
+    Tag pop()
+    {
+        auto tag = getTmp(0);
+        pop(1);
+        return tag;
+    }
+
+    void pop(uint16_t numVals)
+    {
+        if (numVals > tmpTags.size())
+        {
+            throw RunError(
+                "not enough values on the temporary stack"
+            );
+        }
+
+        tmpTags.resize(tmpTags.size() - numVals);
+    }
+
+    void swap()
+    {
+        if (tmpTags.size() >= 2)
+            std::swap(tmpTags[tmpTags.size() - 1], tmpTags[tmpTags.size() - 2]);
+    }
+
+    /// Check if the tags of all values are unknown
+    bool isGeneric() const
+    {
+        for (auto tag : localTags)
+            if (tag != TAG_UNKNOWN)
+                return false;
+
+        for (auto tag : tmpTags)
+            if (tag != TAG_UNKNOWN)
+                return false;
+
+        return true;
+    }
+
+    bool operator == (const CodeGenCtx& that) const
+    {
+        if (tmpTags != that.tmpTags)
+            return false;
+
+        auto numLocals = std::max(localTags.size(), that.localTags.size());
+        for (size_t i = 0; i < numLocals; ++i)
+            if (getLocal(i) != that.getLocal(i))
+                return false;
+
+        return true;
+    }
+};
+
+/// Branch or jump target slot in the code heap, patched to point
+/// to the code of a block version
+struct PatchedSlot
+{
+    uint8_t** slot;
+
+    /// Eviction epoch of the code heap chunk holding the slot,
+    /// when it was patched
+    uint32_t epoch;
+
+    /// The slot belongs to a jump stub patched into a jump
+    bool isJump;
+};
+
+class BlockVersion;
+
+/// Get the number of locals of a function, which determines
+/// where the frame state is saved in its stack frames
+uint16_t getNumLocals(Object fun)
+{
+    static thread_local ICache numLocalsIC("num_locals");
+    auto numLocals = numLocalsIC.getInt32(fun);
+    assert (numLocals >= 0 && numLocals <= UINT16_MAX);
+    return numLocals;
+}
+
+/// Struct to associate information with a return address
+struct RetEntry
+{
+    /// Associated call instruction
+    refptr callInstr = nullptr;
+
+    /// Block version containing the call instruction
+    BlockVersion* callVer = nullptr;
+
+    /// Exception/catch block version (may be null)
+    BlockVersion* excVer = nullptr;
+
+    /// Temporary stack size before the call instruction
+    uint16_t numTmps = 0;
+};
+
+class BlockVersion : public CodeFragment
+{
+public:
+
+    /// Associated function
+    Object fun;
+
+    /// Associated block
+    Object block;
+
+    /// Size of the temp stack at the beginning of this version
+    uint16_t numTmps;
+
+    /// Number of locals of the function, so that exceptions can
+    /// unwind its frames without looking up the function object
+    uint16_t numLocals;
+
+    /// Code generation context at block entry
+    CodeGenCtx ctx;
+
+    /// Code heap slots patched to point to this version's code
+    std::vector<PatchedSlot> patchedSlots;
+
+    /// The code was written over the jump stub ending the
+    /// version before it, which falls through into this one
+    bool fallThrough = false;
+
+    /// Return address info, if this version is a call continuation
+    /// Note: this is kept outside of the code heap, because frames
+    /// may still return here after the code of the call is evicted
+    RetEntry retEntry;
+
+    BlockVersion(Object fun, Object block, const CodeGenCtx& ctx)
+    : fun(fun),
+      block(block),
+      numTmps(ctx.numTmps()),
+      numLocals(getNumLocals(fun)),
+      ctx(ctx)
+    {
+    }
+};
+
+/// Cached callee of a call site
+struct CallEntry
+{
+    // Cached function
+    refptr fn = nullptr;
+
+    // Entry version for the cached function
+    BlockVersion* entryVer = nullptr;
+
+    // Number of locals for the cached function
+    uint16_t numLocals = 0;
+
+    // Number of parameters of the cached function
+    uint16_t numParams = 0;
+};
+
+/// Information stored by call instructions
+struct CallInfo
+{
+    // Maximum number of functions cached, including the inline one
+    static const size_t NUM_ENTRIES = 4;
+
+    // Block version to return to after the call
+    BlockVersion* retVer;
+
+    // Block version containing the call instruction
+    BlockVersion* callVer;
+
+    // Last seen (cached) function
+    refptr lastFn = nullptr;
+
+    // Entry version for the cached function
+    BlockVersion* entryVer = nullptr;
+
+    // Entries for the other functions called by polymorphic
+    // call sites, allocated on the first miss
+    CallEntry* more = nullptr;
+
+    // Number of locals for the cached function
+    uint16_t numLocals = 0;
+
+    // Number of call site arguments
+    uint16_t numArgs;
+
+    // Number of functions cached
+    uint8_t numEntries = 0;
+
+    // Set once the site has called more functions than there are
+    // entries, after which misses go through the megamorphic cache
+    bool megamorphic = false;
+};
+
+/// Global cache of callees for megamorphic call sites, indexed by
+/// function address. Functions move during garbage collection, so
+/// the cache gets cleared by the GC.
+thread_local CallEntry megaCallCache[1024];
+
+/// Execution count and opcode sequence of a compiled block version,
+/// used to gather opcode pair statistics and profiles
+struct BlockStats
+{
+    /// Block version the code was compiled for
+    BlockVersion* version;
+
+    /// Number of times the block version was entered
+    uint64_t count = 0;
+
+    /// Opcodes compiled into the block version
+    std::vector<Opcode> ops;
+};
+
+typedef std::vector<BlockVersion*> VersionList;
+
+/// Maximum number of specialized versions per block and function,
+/// after which a generic version is used, to bound code growth
+const size_t MAX_BLOCK_VERSIONS = 8;
+
+/// Maximum size of the chunks the code heap is committed and
+/// evicted in. Small heaps use smaller chunks, down to a memory page.
+const size_t MAX_CODE_CHUNK_SIZE = 64 << 10;
+
+/// Upper bound on the code size of one block instruction, including
+/// the native code run header which may precede it
+const size_t MAX_INSTR_CODE_SIZE = 128;
+
+/// Stack space kept in reserve below the stack limit, in words. Calls
+/// check that the callee frame fits above the limit, and instructions
+/// push temporaries into the reserve without bounds checks.
+const size_t STACK_RESERVE_SIZE = 1 << 12;
+
+/// Maximum stack size in bytes
+size_t stackMaxSize = 64 << 20;
+
+/// Maximum coroutine stack size in bytes
+size_t coStackMaxSize = 256 << 10;
+
+/// Number of stack segments of finished coroutines kept for reuse
+const size_t MAX_FREE_CO_STACKS = 1024;
+
+/// Minimum number of coroutine stack segments in use
+/// before a collection is requested
+const size_t MIN_CO_STACK_THRESHOLD = 1024;
+
+/// Maximum code heap size in bytes
+size_t codeHeapMaxSize = 256 << 20;
+
+/// Address range reserved for the code heap, into which code gets
+/// compiled. Memory is committed one chunk at a time as the heap grows.
+thread_local uint8_t* codeHeap = nullptr;
+
+/// Limit pointer for the code heap
+thread_local uint8_t* codeHeapLimit = nullptr;
+
+/// Current allocation pointer in the code heap
+thread_local uint8_t* codeHeapAlloc = nullptr;
+
+/// End of the free space following the allocation pointer. Once the
+/// heap is full, allocation wraps around to the start of the heap, and
+/// the code of the chunks ahead gets evicted before being overwritten.
+thread_local uint8_t* codeFreeLimit = nullptr;
+
+/// End of the space reserved for the block version being compiled
+thread_local uint8_t* codeReserveLimit = nullptr;
+
+/// Chunk of the code heap
+struct CodeChunk
+{
+    /// Versions overlapping the chunk, with their start address
+    /// when compiled. Entries are stale once the version is
+    /// evicted or compiled again.
+    std::vector<std::pair<BlockVersion*, uint8_t*>> versions;
+
+    /// Incremented each time the code of the chunk is evicted
+    uint32_t epoch = 0;
+
+    bool committed = false;
+};
+
+/// Size of the code heap chunks in bytes
+thread_local size_t codeChunkSize = MAX_CODE_CHUNK_SIZE;
+
+/// Chunks of the code heap, in address order
+thread_local std::vector<CodeChunk> codeChunks;
+
+/// Total size of the code of the compiled block versions
+thread_local size_t codeBytesLive = 0;
+
+/// Instruction pointers of the interpreter loops suspended
+/// by calls from host functions into user code
+thread_local std::vector<uint8_t*> savedInstrPtrs;
+
+/// Version lists of the blocks, indexed by the auxiliary word of
+/// the block object headers. Index 0 means the block has no versions.
+thread_local std::vector<VersionList> blockVersions(1);
+
+/// Lower stack limit, checked by calls (the stack pointer must be
+/// greater than this). The stack reserve and a guard page lie below.
+thread_local Value* stackLimit = nullptr;
+
+/// Memory mapping of a stack, with the stack reserve and a guard
+/// page below its limit. Pages get committed as they are used.
+struct StackMap
+{
+    uint8_t* mem = nullptr;
+    size_t size = 0;
+
+    /// Stack base (end of the mapping) and lower stack limit
+    Value* base = nullptr;
+    Value* limit = nullptr;
+};
+
+/// Mapping of the stack of the isolate
+thread_local StackMap mainStack;
+
+/// Stack base, initial stack pointer value (end of the stack memory
+/// array). This is the base of the coroutine stack segment, while a
+/// coroutine is running.
+thread_local Value* stackBase = nullptr;
+
+/// Stack frame base pointer
+thread_local Value* framePtr = nullptr;
+
+/// Current temp stack top pointer
+thread_local Value* stackPtr = nullptr;
+
+// Current instruction pointer
+thread_local uint8_t* instrPtr = nullptr;
+
+/// Execution status of a coroutine
+enum CoStatus
+{
+    CO_NEW,
+    CO_SUSPENDED,
+    CO_RUNNING,
+    CO_DONE
+};
+
+/**
+Coroutine, running a function on its own stack segment. The interpreter
+switches stacks when a coroutine is resumed, and back to the stack of
+its resumer when the coroutine yields or returns. A suspended coroutine
+keeps the block version it continues at, rather than a code pointer,
+so that its code can be evicted in the meantime.
+*/
+struct Coroutine
+{
+    /// Coroutine object. This is a weak reference: the stack of a
+    /// suspended coroutine is only visited while its object is live.
+    refptr obj = nullptr;
+
+    /// Function to run, until the coroutine is first resumed
+    Value fun;
+    uint16_t numParams = 0;
+
+    CoStatus status = CO_NEW;
+
+    /// Stack segment, allocated when the coroutine is first resumed
+    StackMap stack;
+
+    /// Stack and frame pointers and continuation, while suspended
+    Value* stackPtr = nullptr;
+    Value* framePtr = nullptr;
+    BlockVersion* resumeVer = nullptr;
+
+    /// State of the resumer, while running. The continuation is
+    /// null if the coroutine was resumed by host code.
+    Value* callerStackPtr = nullptr;
+    Value* callerFramePtr = nullptr;
+    Value* callerStackBase = nullptr;
+    Value* callerStackLimit = nullptr;
+    BlockVersion* callerRetVer = nullptr;
+    Coroutine* caller = nullptr;
+
+    /// Number of interpreter loops suspended by host calls when the
+    /// coroutine was resumed. It may only yield from the same loop.
+    size_t hostDepth = 0;
+
+    /// Set when the coroutine object is found live by a collection
+    bool marked = false;
+};
+
+/// Coroutines indexed by id, null for unused ids
+thread_local std::vector<Coroutine*> coroutines;
+
+/// Ids of dead coroutines, to be reused
+thread_local std::vector<int32_t> freeCoIds;
+
+/// Coroutine currently running, null on the stack of the isolate
+thread_local Coroutine* curCo = nullptr;
+
+/// Stack segments of finished coroutines, kept for reuse
+thread_local std::vector<StackMap> freeCoStacks;
+
+/// Number of stack segments used by coroutines. Past the threshold,
+/// a collection is requested, to free those of unreachable coroutines.
+thread_local size_t numCoStacks = 0;
+thread_local size_t coStackThreshold = MIN_CO_STACK_THRESHOLD;
+
+/// Cache of all possible one-character string values
+thread_local Value charStrings[256];
+
+/// Locations of heap references embedded in the code heap
+/// Note: these get updated by the garbage collector
+thread_local std::vector<refptr*> codeRefs;
+
+/// Locations of call site inline caches in the code heap
+thread_local std::vector<CallInfo*> callInfos;
+
+/// Gather opcode pair execution counts
+thread_local bool opPairStats = false;
+
+/// Gather execution statistics and samples for the profiler
+thread_local bool profiling = false;
+
+/// Statistics for all compiled block versions, in compilation order
+thread_local std::vector<BlockStats*> blockStats;
+
+/// Statistics of the block version last entered, when counting
+thread_local BlockStats* curBlockStats = nullptr;
+
+/// Set by the profiling timer signal, so that the interpreter takes
+/// a sample of the call stack at the next safe point
+volatile sig_atomic_t sampleDue = 0;
+
+/// Check if block versions are compiled with execution counters
+bool countBlocks()
+{
+    return opPairStats || profiling;
+}
+
+/// Write a value to the code heap
+template <typename T> void writeCode(T val)
+{
+    assert (codeHeapAlloc < codeHeapLimit);
+    T* heapPtr = (T*)codeHeapAlloc;
+    *heapPtr = val;
+    codeHeapAlloc += sizeof(T);
+    assert (codeHeapAlloc <= codeReserveLimit);
+}
+
+#ifdef JIT_BACKEND
+/// Native code for a run of instructions. It returns the address of
+/// the next instruction to interpret, which is the instruction where
+/// native execution stopped.
+typedef uint8_t* (*NativeFn)(Value* framePtr, Value** stackPtrRef);
+
+/// Size of the executable heap for native code in bytes
+const size_t EXEC_HEAP_SIZE = 16 << 20;
+
+/// Executable heap into which native code gets compiled
+thread_local ExecHeap* execHeap = nullptr;
+
+/// Run of consecutive instructions to be compiled to native code
+struct JitRun
+{
+    /// Native function pointer slot of the JIT_RUN instruction
+    NativeFn* fnSlot;
+
+    /// Opcodes and addresses of the instructions in the run
+    std::vector<std::pair<Opcode, uint8_t*>> instrs;
+
+    /// Address of the instruction following the run,
+    /// null if the run ends with a branch
+    uint8_t* endPtr = nullptr;
 };
 
-class CodeFragment
+/// Runs of the block version being compiled
+thread_local std::vector<JitRun> jitRuns;
+
+/// Check if an instruction is part of the current run
+thread_local bool jitInRun = false;
+
+/// Check if an instruction can be compiled to native code
+bool jitSupported(Opcode op)
+{
+    switch (op)
+    {
+        case GET_LOCAL:
+        case SET_LOCAL:
+        case GET_LOCAL2:
+        case PUSH:
+        case POP:
+        case DUP:
+        case SWAP:
+        case ADD_I32:
+        case SUB_I32:
+        case MUL_I32:
+        case SHL_I32:
+        case SHR_I32:
+        case USHR_I32:
+        case AND_I32:
+        case OR_I32:
+        case XOR_I32:
+        case NOT_I32:
+        case LT_I32:
+        case LE_I32:
+        case GT_I32:
+        case GE_I32:
+        case EQ_I32:
+        case INC_I32:
+        case DEC_I32:
+        case ADD_LOCAL_IMM_I32:
+        case ADD_I32_NC:
+        case SUB_I32_NC:
+        case MUL_I32_NC:
+        case LT_I32_NC:
+        case LE_I32_NC:
+        case GT_I32_NC:
+        case GE_I32_NC:
+        case EQ_I32_NC:
+        case ADD_F32:
+        case SUB_F32:
+        case MUL_F32:
+        case DIV_F32:
+        case LT_F32:
+        case LE_F32:
+        case GT_F32:
+        case GE_F32:
+        case EQ_F32:
+        case SQRT_F32:
+        case I32_TO_F32:
+        case F32_TO_I32:
+        case EQ_BOOL:
+        case HAS_TAG:
+        case LOCAL_HAS_TAG:
+        case JUMP_STUB:
+        case IF_TRUE:
+        case IF_LOCAL_HAS_TAG:
+        case IF_LT_I32:
+        case IF_LE_I32:
+        case IF_GT_I32:
+        case IF_GE_I32:
+        case IF_EQ_I32:
+        return true;
+
+        default:
+        return false;
+    }
+}
+
+/// Note an instruction about to be written in the code heap, and
+/// start a new run of native code before it if needed
+void jitNoteOp(Opcode op)
+{
+    if (!jitSupported(op))
+    {
+        if (jitInRun)
+            jitRuns.back().endPtr = codeHeapAlloc;
+        jitInRun = false;
+        return;
+    }
+
+    if (!jitInRun)
+    {
+        writeCode<OpWord>(encodeOp(JIT_RUN));
+        jitRuns.push_back(JitRun());
+        jitRuns.back().fnSlot = (NativeFn*)codeHeapAlloc;
+        writeCode<NativeFn>(nullptr);
+        jitInRun = true;
+    }
+
+    jitRuns.back().instrs.push_back({ op, codeHeapAlloc });
+
+    // Branches end the run, execution doesn't fall through them
+    if (op == JUMP_STUB || op == IF_TRUE || op == IF_LOCAL_HAS_TAG ||
+        op == IF_LT_I32 || op == IF_LE_I32 || op == IF_GT_I32 ||
+        op == IF_GE_I32 || op == IF_EQ_I32)
+        jitInRun = false;
+}
+
+/// Get the bit representation of a value
+uint64_t valBits(Value val)
+{
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    return bits;
+}
+
+/// Get the bit representation of a tag, without payload
+uint64_t tagBits(Tag tag)
+{
+    return valBits(Value(Word(int64_t(0)), tag));
+}
+
+/// Compile a run of instructions to native code.
+/// Register usage:
+///   rdi: frame pointer
+///   rsi: address of the interpreter stack pointer
+///   r8: stack pointer
+///   r9, r10, r11: int32, float32 and bool tag bits
+///   rax, rcx, rdx, xmm0, xmm1: temporaries
+/// The executable heap must be writable, the allocation pointer
+/// gets advanced past the code written.
+void jitCompileRun(JitRun& run, uint8_t*& allocPtr)
+{
+    assert (run.instrs.size() > 0);
+    auto firstAddr = run.instrs[0].second;
+
+    auto startPtr = allocPtr;
+    X86Asm a(startPtr, execHeap->getLimit());
+
+    // Jumps to the exits which resume interpretation at
+    // a given instruction, with the stack pointer saved
+    std::vector<std::pair<uint8_t*, uint8_t*>> bails;
+    auto bailIf = [&](X86Cond cond, uint8_t* instrAddr)
+    {
+        bails.push_back({ a.jcc(cond), instrAddr });
+    };
+
+    // Exit to the address in rax
+    auto exitRax = [&]()
+    {
+        a.mov(RSI, 0, R8);
+        a.ret();
+    };
+
+    auto exitTo = [&](uint8_t* instrAddr)
+    {
+        a.movImm(RAX, (uint64_t)instrAddr);
+        exitRax();
+    };
+
+    // Displacement of a stack slot, and of a local variable
+    auto tmp = [](size_t idx) { return (int32_t)(idx * sizeof(Value)); };
+    auto local = [](uint16_t idx) { return -(int32_t)(idx * sizeof(Value)); };
+
+    // Exit unless the value at [base + disp] has a given tag
+    auto checkTag = [&](X86Reg base, int32_t disp, Tag tag, uint8_t* addr)
+    {
+        a.mov(RDX, base, disp);
+        a.shrImm(RDX, 48);
+        a.cmpImm32(RDX, tag);
+        bailIf(CC_NE, addr);
+    };
+
+    // Pop one value and replace the new stack top by rax
+    auto popPut = [&]()
+    {
+        a.addImm(R8, tmp(1));
+        a.mov(R8, 0, RAX);
+    };
+
+    auto push = [&](X86Reg src)
+    {
+        a.addImm(R8, -tmp(1));
+        a.mov(R8, 0, src);
+    };
+
+    // Jump to a branch target once the branch has been patched,
+    // otherwise let the interpreter execute the branch
+    // Note: patched targets may get restored into stubs when the
+    // code they point to is evicted, so they are always checked
+    auto branchExit = [&](uint8_t* slotPtr, uint8_t* addr, size_t numPops)
+    {
+        a.movImm(RCX, (uint64_t)slotPtr);
+        a.mov(RAX, RCX, 0);
+        a.movImm(RCX, (uint64_t)codeHeap);
+        a.cmpReg(RAX, RCX);
+        bailIf(CC_B, addr);
+        a.movImm(RCX, (uint64_t)codeHeapLimit);
+        a.cmpReg(RAX, RCX);
+        bailIf(CC_AE, addr);
+
+        if (numPops > 0)
+            a.addImm(R8, tmp(numPops));
+        exitRax();
+    };
+
+    // Go to the then or else target of a branch, for a condition
+    // computed in the flags
+    auto branch = [&](X86Cond elseCond, uint8_t* thenSlot, uint8_t* addr, size_t numPops)
+    {
+        auto toElse = a.jcc(elseCond);
+        branchExit(thenSlot, addr, numPops);
+        if (!a.isFull())
+            X86Asm::patchJump(toElse, a.getPtr());
+        branchExit(thenSlot + sizeof(uint8_t*), addr, numPops);
+    };
+
+    a.mov(R8, RSI, 0);
+    a.movImm(R9, tagBits(TAG_INT32));
+    a.movImm(R10, tagBits(TAG_FLOAT32));
+    a.movImm(R11, tagBits(TAG_BOOL));
+
+    // Bound how much the stack can grow in this run, pops are ignored
+    int32_t maxDepth = 0;
+    for (auto& instr : run.instrs)
+    {
+        switch (instr.first)
+        {
+            case GET_LOCAL:
+            case PUSH:
+            case DUP:
+            case LOCAL_HAS_TAG:
+            maxDepth += 1;
+            break;
+
+            case GET_LOCAL2:
+            maxDepth += 2;
+            break;
+
+            default:
+            break;
+        }
+    }
+
+    // Let the interpreter report stack overflows
+    if (maxDepth > 0)
+    {
+        a.movImm(RCX, (uint64_t)&stackLimit);
+        a.mov(RCX, RCX, 0);
+        a.addImm(RCX, tmp(maxDepth));
+        a.cmpReg(R8, RCX);
+        bailIf(CC_B, firstAddr);
+    }
+
+    bool terminated = false;
+
+    for (auto& instr : run.instrs)
+    {
+        auto op = instr.first;
+        auto addr = instr.second;
+
+        // Read the instruction operands from the code heap
+        auto operands = addr + sizeof(OpWord);
+        auto uint16At = [](uint8_t* p) { return *(uint16_t*)p; };
+
+        switch (op)
+        {
+            case GET_LOCAL:
+            a.mov(RAX, RDI, local(uint16At(operands)));
+            push(RAX);
+            break;
+
+            case GET_LOCAL2:
+            a.mov(RAX, RDI, local(uint16At(operands)));
+            push(RAX);
+            a.mov(RAX, RDI, local(uint16At(operands + 2)));
+            push(RAX);
+            break;
+
+            case SET_LOCAL:
+            a.mov(RAX, R8, 0);
+            a.addImm(R8, tmp(1));
+            a.mov(RDI, local(uint16At(operands)), RAX);
+            break;
+
+            case PUSH:
+            {
+                auto word = *(Word*)operands;
+                auto tag = *(Tag*)(operands + sizeof(Word));
+                Value val(word, tag);
+
+                // Heap references get updated by the GC,
+                // so they get read from the code heap
+                if (val.isPointer())
+                {
+                    a.movImm(RCX, (uint64_t)operands);
+                    a.mov(RAX, RCX, 0);
+                    a.movImm(RCX, tagBits(tag));
+                    a.orReg(RAX, RCX);
+                }
+                else
+                {
+                    a.movImm(RAX, valBits(val));
+                }
+
+                push(RAX);
+            }
+            break;
+
+            case POP:
+            a.addImm(R8, tmp(1));
+            break;
+
+            case DUP:
+            a.mov(RAX, R8, tmp(uint16At(operands)));
+            push(RAX);
+            break;
+
+            case SWAP:
+            a.mov(RAX, R8, 0);
+            a.mov(RCX, R8, tmp(1));
+            a.mov(R8, 0, RCX);
+            a.mov(R8, tmp(1), RAX);
+            break;
+
+            case ADD_I32:
+            case SUB_I32:
+            case MUL_I32:
+            case AND_I32:
+            case OR_I32:
+            case XOR_I32:
+            case ADD_I32_NC:
+            case SUB_I32_NC:
+            case MUL_I32_NC:
+            {
+                if (op != ADD_I32_NC && op != SUB_I32_NC && op != MUL_I32_NC)
+                {
+                    checkTag(R8, tmp(0), TAG_INT32, addr);
+                    checkTag(R8, tmp(1), TAG_INT32, addr);
+                }
+
+                a.mov32(RAX, R8, tmp(1));
+
+                if (op == ADD_I32 || op == ADD_I32_NC)
+                    a.add32(RAX, R8, tmp(0));
+                else if (op == SUB_I32 || op == SUB_I32_NC)
+                    a.sub32(RAX, R8, tmp(0));
+                else if (op == MUL_I32 || op == MUL_I32_NC)
+                    a.imul32(RAX, R8, tmp(0));
+                else if (op == AND_I32)
+                    a.and32(RAX, R8, tmp(0));
+                else if (op == OR_I32)
+                    a.or32(RAX, R8, tmp(0));
+                else
+                    a.xor32(RAX, R8, tmp(0));
+
+                a.orReg(RAX, R9);
+                popPut();
+            }
+            break;
+
+            case SHL_I32:
+            case SHR_I32:
+            case USHR_I32:
+            checkTag(R8, tmp(0), TAG_INT32, addr);
+            checkTag(R8, tmp(1), TAG_INT32, addr);
+            a.mov32(RAX, R8, tmp(1));
+            a.mov32(RCX, R8, tmp(0));
+            if (op == SHL_I32)
+                a.shl32Cl(RAX);
+            else if (op == SHR_I32)
+                a.sar32Cl(RAX);
+            else
+                a.shr32Cl(RAX);
+            a.orReg(RAX, R9);
+            popPut();
+            break;
+
+            case NOT_I32:
+            case INC_I32:
+            case DEC_I32:
+            checkTag(R8, tmp(0), TAG_INT32, addr);
+            a.mov32(RAX, R8, tmp(0));
+            if (op == NOT_I32)
+                a.not32(RAX);
+            else
+                a.addImm32(RAX, (op == INC_I32)? 1:-1);
+            a.orReg(RAX, R9);
+            a.mov(R8, tmp(0), RAX);
+            break;
+
+            case ADD_LOCAL_IMM_I32:
+            {
+                auto srcIdx = uint16At(operands);
+                auto imm = *(int32_t*)(operands + 2);
+                auto dstIdx = uint16At(operands + 6);
+                checkTag(RDI, local(srcIdx), TAG_INT32, addr);
+                a.mov32(RAX, RDI, local(srcIdx));
+                a.addImm32(RAX, imm);
+                a.orReg(RAX, R9);
+                a.mov(RDI, local(dstIdx), RAX);
+            }
+            break;
+
+            case LT_I32:
+            case LE_I32:
+            case GT_I32:
+            case GE_I32:
+            case EQ_I32:
+            case LT_I32_NC:
+            case LE_I32_NC:
+            case GT_I32_NC:
+            case GE_I32_NC:
+            case EQ_I32_NC:
+            {
+                if (op >= LT_I32 && op <= EQ_I32)
+                {
+                    checkTag(R8, tmp(0), TAG_INT32, addr);
+                    checkTag(R8, tmp(1), TAG_INT32, addr);
+                }
+
+                X86Cond cond;
+                if (op == LT_I32 || op == LT_I32_NC) cond = CC_L;
+                else if (op == LE_I32 || op == LE_I32_NC) cond = CC_LE;
+                else if (op == GT_I32 || op == GT_I32_NC) cond = CC_G;
+                else if (op == GE_I32 || op == GE_I32_NC) cond = CC_GE;
+                else cond = CC_E;
+
+                a.mov32(RAX, R8, tmp(1));
+                a.cmp32(RAX, R8, tmp(0));
+                a.setcc(cond, RAX);
+                a.movzx8(RAX, RAX);
+                a.orReg(RAX, R11);
+                popPut();
+            }
+            break;
+
+            case ADD_F32:
+            case SUB_F32:
+            case MUL_F32:
+            case DIV_F32:
+            checkTag(R8, tmp(0), TAG_FLOAT32, addr);
+            checkTag(R8, tmp(1), TAG_FLOAT32, addr);
+            a.movss(XMM0, R8, tmp(1));
+            if (op == ADD_F32)
+                a.addss(XMM0, R8, tmp(0));
+            else if (op == SUB_F32)
+                a.subss(XMM0, R8, tmp(0));
+            else if (op == MUL_F32)
+                a.mulss(XMM0, R8, tmp(0));
+            else
+                a.divss(XMM0, R8, tmp(0));
+            a.movd(RAX, XMM0);
+            a.orReg(RAX, R10);
+            popPut();
+            break;
+
+            // Comparisons involving NaN are false, as in C++,
+            // the unordered result sets CF, ZF and PF
+            case LT_F32:
+            case LE_F32:
+            case GT_F32:
+            case GE_F32:
+            case EQ_F32:
+            checkTag(R8, tmp(0), TAG_FLOAT32, addr);
+            checkTag(R8, tmp(1), TAG_FLOAT32, addr);
+            a.movss(XMM0, R8, tmp(1));
+            a.movss(XMM1, R8, tmp(0));
+            if (op == LT_F32 || op == LE_F32)
+                a.ucomiss(XMM1, XMM0);
+            else
+                a.ucomiss(XMM0, XMM1);
+            if (op == EQ_F32)
+            {
+                a.setcc(CC_E, RAX);
+                a.setcc(CC_NP, RCX);
+                a.and8(RAX, RCX);
+            }
+            else
+            {
+                a.setcc((op == LT_F32 || op == GT_F32)? CC_A:CC_AE, RAX);
+            }
+            a.movzx8(RAX, RAX);
+            a.orReg(RAX, R11);
+            popPut();
+            break;
+
+            case SQRT_F32:
+            checkTag(R8, tmp(0), TAG_FLOAT32, addr);
+            a.sqrtss(XMM0, R8, tmp(0));
+            a.movd(RAX, XMM0);
+            a.orReg(RAX, R10);
+            a.mov(R8, tmp(0), RAX);
+            break;
+
+            case I32_TO_F32:
+            checkTag(R8, tmp(0), TAG_INT32, addr);
+            a.cvtsi2ss(XMM0, R8, tmp(0));
+            a.movd(RAX, XMM0);
+            a.orReg(RAX, R10);
+            a.mov(R8, tmp(0), RAX);
+            break;
+
+            case F32_TO_I32:
+            checkTag(R8, tmp(0), TAG_FLOAT32, addr);
+            a.cvttss2si(RAX, R8, tmp(0));
+            a.orReg(RAX, R9);
+            a.mov(R8, tmp(0), RAX);
+            break;
+
+            case EQ_BOOL:
+            checkTag(R8, tmp(0), TAG_BOOL, addr);
+            checkTag(R8, tmp(1), TAG_BOOL, addr);
+            a.mov(RAX, R8, tmp(1));
+            a.cmpMem(RAX, R8, tmp(0));
+            a.setcc(CC_E, RAX);
+            a.movzx8(RAX, RAX);
+            a.orReg(RAX, R11);
+            popPut();
+            break;
+
+            case HAS_TAG:
+            a.mov(RAX, R8, tmp(0));
+            a.shrImm(RAX, 48);
+            a.cmpImm32(RAX, *(Tag*)operands);
+            a.setcc(CC_E, RAX);
+            a.movzx8(RAX, RAX);
+            a.orReg(RAX, R11);
+            a.mov(R8, tmp(0), RAX);
+            break;
+
+            case LOCAL_HAS_TAG:
+            a.mov(RAX, RDI, local(uint16At(operands)));
+            a.shrImm(RAX, 48);
+            a.cmpImm32(RAX, *(Tag*)(operands + 2));
+            a.setcc(CC_E, RAX);
+            a.movzx8(RAX, RAX);
+            a.orReg(RAX, R11);
+            push(RAX);
+            break;
+
+            // Follow the jump once patched, the jump stub may also
+            // get overwritten by the block it jumps to
+            case JUMP_STUB:
+            a.movImm(RCX, (uint64_t)addr);
+            if (sizeof(OpWord) == sizeof(uint64_t))
+            {
+                a.mov(RAX, RCX, 0);
+                a.movImm(RDX, (uint64_t)encodeOp(JUMP));
+                a.cmpReg(RAX, RDX);
+            }
+            else
+            {
+                a.movzx16(RAX, RCX, 0);
+                a.cmpImm32(RAX, (int32_t)(uint64_t)encodeOp(JUMP));
+            }
+            bailIf(CC_NE, addr);
+            a.mov(RAX, RCX, sizeof(OpWord));
+            exitRax();
+            terminated = true;
+            break;
+
+            case IF_TRUE:
+            a.mov(RAX, R8, tmp(0));
+            a.movImm(RCX, valBits(Value::TRUE));
+            a.cmpReg(RAX, RCX);
+            branch(CC_NE, operands, addr, 1);
+            terminated = true;
+            break;
+
+            case IF_LOCAL_HAS_TAG:
+            a.mov(RAX, RDI, local(uint16At(operands)));
+            a.shrImm(RAX, 48);
+            a.cmpImm32(RAX, *(Tag*)(operands + 2));
+            branch(CC_NE, operands + 3, addr, 0);
+            terminated = true;
+            break;
+
+            case IF_LT_I32:
+            case IF_LE_I32:
+            case IF_GT_I32:
+            case IF_GE_I32:
+            case IF_EQ_I32:
+            {
+                checkTag(R8, tmp(0), TAG_INT32, addr);
+                checkTag(R8, tmp(1), TAG_INT32, addr);
+
+                X86Cond elseCond;
+                if (op == IF_LT_I32) elseCond = CC_GE;
+                else if (op == IF_LE_I32) elseCond = CC_G;
+                else if (op == IF_GT_I32) elseCond = CC_LE;
+                else if (op == IF_GE_I32) elseCond = CC_L;
+                else elseCond = CC_NE;
+
+                a.mov32(RAX, R8, tmp(1));
+                a.cmp32(RAX, R8, tmp(0));
+                branch(elseCond, operands, addr, 2);
+                terminated = true;
+            }
+            break;
+
+            default:
+            assert (false && "unsupported instruction in native code run");
+        }
+    }
+
+    // Resume interpretation after the run
+    if (!terminated)
+    {
+        assert (run.endPtr);
+        exitTo(run.endPtr);
+    }
+
+    // Generate the exits back to the interpreter
+    std::unordered_map<uint8_t*, uint8_t*> exits;
+    for (auto& bail : bails)
+    {
+        if (exits.find(bail.second) == exits.end())
+        {
+            exits[bail.second] = a.getPtr();
+            exitTo(bail.second);
+        }
+    }
+
+    // If the executable heap is full, interpret the instructions
+    if (a.isFull())
+    {
+        *(OpWord*)((uint8_t*)run.fnSlot - sizeof(OpWord)) = encodeOp(JUMP);
+        *(uint8_t**)run.fnSlot = firstAddr;
+        return;
+    }
+
+    for (auto& bail : bails)
+        X86Asm::patchJump(bail.first, exits[bail.second]);
+
+    allocPtr = a.getPtr();
+    *run.fnSlot = (NativeFn)startPtr;
+}
+
+/// Compile the runs of instructions of a block version to native code
+void jitCompileRuns()
+{
+    if (jitInRun)
+        jitRuns.back().endPtr = codeHeapAlloc;
+    jitInRun = false;
+
+    if (jitRuns.empty())
+        return;
+
+    execHeap->beginWrite();
+    auto allocPtr = execHeap->getAlloc();
+
+    for (auto& run : jitRuns)
+        jitCompileRun(run, allocPtr);
+
+    execHeap->endWrite(allocPtr);
+    jitRuns.clear();
+}
+#endif
+
+/// Write an opcode to the code heap
+void writeCode(Opcode op)
+{
+    // Jump stubs get patched into jumps once their target is compiled
+    if (countBlocks() && !blockStats.empty())
+        blockStats.back()->ops.push_back((op == JUMP_STUB)? JUMP:op);
+
+#ifdef JIT_BACKEND
+    jitNoteOp(op);
+#endif
+
+    writeCode<OpWord>(encodeOp(op));
+}
+
+/// Deny writing Value objects in the code heap,
+/// because they are managed by the garbage collector
+void writeCode(Value val)
+{
+    assert (false && "don't write Value objects into the code heap");
+}
+
+/// Write a heap reference into the code heap, and remember
+/// its location so the garbage collector can update it
+void writeCodeRef(refptr ptr)
+{
+    codeRefs.push_back((refptr*)codeHeapAlloc);
+    writeCode(ptr);
+}
+
+/// Write a constant value (word and tag) into the code heap
+void writeCodeVal(Value val)
 {
-public:
+    if (val.isPointer())
+        codeRefs.push_back((refptr*)codeHeapAlloc);
 
-    /// Start index in the executable heap
-    uint8_t* startPtr = nullptr;
+    writeCode(val.getWord());
+    writeCode(val.getTag());
+}
 
-    /// End index in the executable heap
-    uint8_t* endPtr = nullptr;
+/// Get the chunk containing a code heap address
+CodeChunk& getChunk(uint8_t* ptr)
+{
+    assert (ptr >= codeHeap && ptr < codeHeapLimit);
+    return codeChunks[(ptr - codeHeap) / codeChunkSize];
+}
 
-    /// Get the length of the code fragment
-    size_t length()
-    {
-        assert (startPtr);
-        assert (endPtr);
-        return endPtr - startPtr;
-    }
-};
+/// Record that a code heap slot was patched to point to a version
+void addPatchedSlot(BlockVersion* version, uint8_t** slot, bool isJump)
+{
+    auto epoch = getChunk((uint8_t*)slot).epoch;
+    version->patchedSlots.push_back({ slot, epoch, isJump });
+}
 
-class BlockVersion : public CodeFragment
+/// Check if a version's code is being executed, either by the
+/// interpreter loop or by one suspended in a host call
+bool isVersionRunning(BlockVersion* version)
 {
-public:
+    auto inVersion = [version](uint8_t* ptr)
+    {
+        return ptr >= version->startPtr && ptr <= version->endPtr;
+    };
 
-    /// Associated function
-    Object fun;
+    if (inVersion(instrPtr))
+        return true;
 
-    /// Associated block
-    Object block;
+    for (auto ptr : savedInstrPtrs)
+        if (inVersion(ptr))
+            return true;
 
-    /// Size of the temp stack at the beginning of this version
-    uint16_t numTmps;
+    return false;
+}
 
-    /// Code generation context at block entry
-    //CodeGenCtx ctx;
+/// Try to evict the code of a chunk. The chunk is kept if one of
+/// its versions is running, or can be entered from a chunk before it.
+bool evictChunk(size_t chunkIdx)
+{
+    auto& chunk = codeChunks[chunkIdx];
+    auto chunkStart = codeHeap + chunkIdx * codeChunkSize;
+    auto chunkEnd = chunkStart + codeChunkSize;
+
+    // Drop the stale entries
+    auto& versions = chunk.versions;
+    versions.erase(
+        std::remove_if(
+            versions.begin(),
+            versions.end(),
+            [](std::pair<BlockVersion*, uint8_t*>& entry)
+            {
+                return entry.first->startPtr != entry.second;
+            }
+        ),
+        versions.end()
+    );
 
-    BlockVersion(Object fun, Object block, uint16_t numTmps)
-    : fun(fun),
-      block(block),
-      numTmps(numTmps)
+    for (auto& entry : versions)
     {
-    }
-};
-
-/// Struct to associate information with a return address
-struct RetEntry
-{
-    /// Associated call instruction
-    refptr callInstr;
+        auto version = entry.first;
 
-    /// Return block version
-    BlockVersion* retVer;
+        if (isVersionRunning(version))
+            return false;
 
-    /// Exception/catch block version (may be null)
-    BlockVersion* excVer = nullptr;
+        // Versions overlapping a kept chunk before this one get evicted
+        // with that chunk, and so do versions falling through into them
+        if (version->startPtr < chunkStart)
+            return false;
+        if (version->startPtr == chunkStart && version->fallThrough)
+            return false;
+    }
 
-    /// Temporary stack size before the call instruction
-    uint16_t numTmps;
-};
+    // Slots in this chunk are no longer valid
+    chunk.epoch++;
 
-/// Information stored by call instructions
-struct CallInfo
-{
-    // Block version to return to after the call
-    BlockVersion* retVer;
+    for (auto& entry : versions)
+    {
+        auto version = entry.first;
+        auto startPtr = version->startPtr;
 
-    // Last seen (cached) function
-    refptr lastFn = nullptr;
+        // Restore the slots still pointing to the version's code into
+        // stubs which will compile it again when executed
+        for (auto& patched : version->patchedSlots)
+        {
+            if (getChunk((uint8_t*)patched.slot).epoch != patched.epoch)
+                continue;
+            if (*patched.slot != startPtr)
+                continue;
 
-    // Entry version for the cached function
-    BlockVersion* entryVer = nullptr;
+            *patched.slot = (uint8_t*)version;
 
-    // Number of locals for the cached function
-    uint16_t numLocals = 0;
+            if (patched.isJump)
+                *(OpWord*)((uint8_t*)patched.slot - sizeof(OpWord)) = encodeOp(JUMP_STUB);
+        }
 
-    // Number of call site arguments
-    uint16_t numArgs;
-};
+        codeBytesLive -= version->length();
+        version->patchedSlots.clear();
+        version->fallThrough = false;
+        version->startPtr = nullptr;
+        version->endPtr = nullptr;
+    }
 
-typedef std::vector<BlockVersion*> VersionList;
+    versions.clear();
 
-/// Initial code heap size in bytes
-const size_t CODE_HEAP_INIT_SIZE = 1 << 20;
+    // Forget about the heap references and call sites in the chunk
+    auto inChunk = [chunkStart, chunkEnd](void* ptr)
+    {
+        return (uint8_t*)ptr >= chunkStart && (uint8_t*)ptr < chunkEnd;
+    };
+    codeRefs.erase(
+        std::remove_if(codeRefs.begin(), codeRefs.end(), inChunk),
+        codeRefs.end()
+    );
+    for (auto callInfo : callInfos)
+    {
+        if (inChunk(callInfo))
+        {
+            delete [] callInfo->more;
+            callInfo->more = nullptr;
+        }
+    }
+    callInfos.erase(
+        std::remove_if(callInfos.begin(), callInfos.end(), inChunk),
+        callInfos.end()
+    );
 
-/// Initial stack size in words
-const size_t STACK_INIT_SIZE = 1 << 16;
+    // Free the polymorphic inline cache entries of the chunk
+    for (auto ic : polyFieldICs)
+    {
+        if (inChunk(ic))
+        {
+            delete [] ic->more;
+            ic->more = nullptr;
+        }
+    }
+    polyFieldICs.erase(
+        std::remove_if(polyFieldICs.begin(), polyFieldICs.end(), inChunk),
+        polyFieldICs.end()
+    );
 
-/// Flat array of bytes into which code gets compiled
-uint8_t* codeHeap = nullptr;
+    return true;
+}
 
-/// Limit pointer for the code heap
-uint8_t* codeHeapLimit = nullptr;
+/// Commit the memory of the chunks overlapping an address range
+void commitChunks(uint8_t* startPtr, uint8_t* endPtr)
+{
+    auto firstIdx = (startPtr - codeHeap) / codeChunkSize;
+    auto lastIdx = (endPtr - 1 - codeHeap) / codeChunkSize;
 
-/// Current allocation pointer in the code heap
-uint8_t* codeHeapAlloc = nullptr;
+    for (auto idx = firstIdx; idx <= lastIdx; ++idx)
+    {
+        auto& chunk = codeChunks[idx];
+        if (chunk.committed)
+            continue;
 
-/// Map of block objects to lists of versions
-std::unordered_map<refptr, VersionList> versionMap;
+#ifndef _WIN32
+        auto r = mprotect(
+            codeHeap + idx * codeChunkSize,
+            codeChunkSize,
+            PROT_READ | PROT_WRITE
+        );
 
-/// Map of instructions to block versions
-/// Note: this isn't defined for all instructions
-std::unordered_map<uint8_t*, BlockVersion*> instrMap;
+        if (r != 0)
+            throw RunError("failed to commit code heap memory");
+#endif
 
-/// Map of return addresses to associated info
-std::unordered_map<BlockVersion*, RetEntry> retAddrMap;
+        chunk.committed = true;
+    }
+}
 
-/// Lower stack limit (stack pointer must be greater than this)
-Value* stackLimit = nullptr;
+/// Make sure the code heap has room for a block version of up
+/// to a given size, evicting old code if the heap is full
+void reserveCode(size_t numBytes)
+{
+    size_t numWraps = 0;
 
-/// Stack base, initial stack pointer value (end of the stack memory array)
-Value* stackBase = nullptr;
+    while (codeHeapAlloc + numBytes > codeFreeLimit)
+    {
+        // If there is code left ahead, try to evict the next chunk
+        if (codeFreeLimit < codeHeapLimit)
+        {
+            auto chunkIdx = (codeFreeLimit - codeHeap) / codeChunkSize;
 
-/// Stack frame base pointer
-Value* framePtr = nullptr;
+            if (evictChunk(chunkIdx))
+            {
+                codeFreeLimit += codeChunkSize;
+            }
+            else
+            {
+                // Skip over the chunk being kept
+                codeFreeLimit += codeChunkSize;
+                codeHeapAlloc = codeFreeLimit;
+            }
 
-/// Current temp stack top pointer
-Value* stackPtr = nullptr;
+            continue;
+        }
 
-// Current instruction pointer
-uint8_t* instrPtr = nullptr;
+        if (numWraps++ > 0)
+            throw RunError("code heap full, no code could be evicted");
 
-/// Cache of all possible one-character string values
-Value charStrings[256];
+        // Wrap around to the start of the heap
+        codeHeapAlloc = codeHeap;
+        codeFreeLimit = codeHeap;
+    }
 
-/// Write a value to the code heap
-template <typename T> void writeCode(T val)
-{
-    assert (codeHeapAlloc < codeHeapLimit);
-    T* heapPtr = (T*)codeHeapAlloc;
-    *heapPtr = val;
-    codeHeapAlloc += sizeof(T);
-    assert (codeHeapAlloc <= codeHeapLimit);
+    commitChunks(codeHeapAlloc, codeHeapAlloc + numBytes);
+    codeReserveLimit = codeHeapAlloc + numBytes;
 }
 
-/// Deny writing Value objects in the code heap,
-/// because they are managed by the garbage collector
-void writeCode(Value val)
+/// Register a freshly compiled version in the chunks its code overlaps
+void addChunkVersion(BlockVersion* version)
 {
-    assert (false && "don't write Value objects into the code heap");
+    auto firstIdx = (version->startPtr - codeHeap) / codeChunkSize;
+    auto lastIdx = (version->endPtr - 1 - codeHeap) / codeChunkSize;
+
+    for (auto idx = firstIdx; idx <= lastIdx; ++idx)
+        codeChunks[idx].versions.push_back({ version, version->startPtr });
+
+    codeBytesLive += version->length();
 }
 
 /// Return a pointer to a value to read from the code stream
@@ -255,9 +1751,9 @@ template <typename T> __attribute__((always_inline)) inline T& readCode()
 }
 
 /// Push a value on the stack
+/// Note: pushes past the stack reserve hit the guard page
 __attribute__((always_inline)) inline void pushVal(Value val)
 {
-    assert (stackPtr > stackLimit && "stack overflow");
     stackPtr--;
     stackPtr[0] = val;
 }
@@ -318,7 +1814,7 @@ __attribute__((always_inline)) inline Object popObj()
 
 size_t codeHeapSize()
 {
-    return codeHeapAlloc - codeHeap;
+    return codeBytesLive;
 }
 
 /// Compute the stack size (number of slots allocated)
@@ -333,18 +1829,304 @@ __attribute__((always_inline)) inline size_t frameSize()
     return framePtr - stackPtr + 1;
 }
 
+/// Perform a garbage collection if one was requested
+/// Note: this must only be called at points where all
+///       live values are on the interpreter stack
+void takeSample();
+
+__attribute__((always_inline)) inline void gcSafePoint()
+{
+    if (__builtin_expect(sampleDue, 0) && profiling)
+        takeSample();
+
+    if (VM::gcRequested)
+        vm.collect();
+}
+
+/// Reserve the memory of a stack holding up to maxSize bytes of frames
+StackMap mapStack(size_t maxSize)
+{
+#ifdef _WIN32
+    size_t pageSize = 4096;
+#else
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+#endif
+
+    auto stackWords = std::max(maxSize / sizeof(Value), size_t(1));
+    auto stackBytes = (stackWords + STACK_RESERVE_SIZE) * sizeof(Value);
+    stackBytes = (stackBytes + pageSize - 1) / pageSize * pageSize;
+
+    StackMap map;
+#ifdef _WIN32
+    // Note: there is no guard page on Windows
+    map.mem = (uint8_t*)(new Value[stackBytes / sizeof(Value)]);
+    map.size = stackBytes;
+    auto stackStart = map.mem;
+#else
+    map.mem = (uint8_t*)mmap(
+        nullptr,
+        stackBytes + pageSize,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+    if (map.mem == MAP_FAILED)
+        throw RunError("failed to reserve the stack");
+    if (mprotect(map.mem, pageSize, PROT_NONE) != 0)
+        throw RunError("failed to protect the stack guard page");
+    map.size = stackBytes + pageSize;
+    auto stackStart = map.mem + pageSize;
+#endif
+    map.base = (Value*)(stackStart + stackBytes);
+    map.limit = (Value*)stackStart + STACK_RESERVE_SIZE;
+
+    return map;
+}
+
+/// Free the memory of a stack
+void unmapStack(StackMap& map)
+{
+#ifdef _WIN32
+    delete [] (Value*)map.mem;
+#else
+    munmap(map.mem, map.size);
+#endif
+    map = StackMap();
+}
+
+/// Visit the garbage collection roots held by the interpreter
+void visitInterpRoots(VM& vm)
+{
+    // Values on the interpreter stack
+    for (auto valPtr = stackPtr; valPtr < stackBase; ++valPtr)
+        vm.visit(*valPtr);
+
+    // Running coroutines, and the stacks of their resumers
+    for (auto co = curCo; co; co = co->caller)
+    {
+        auto callerBase = co->callerStackBase;
+        for (auto valPtr = co->callerStackPtr; valPtr < callerBase; ++valPtr)
+            vm.visit(*valPtr);
+
+        vm.visitPtr(co->obj);
+        co->marked = true;
+    }
+
+    for (auto& charStr : charStrings)
+        vm.visit(charStr);
+
+    // References embedded in compiled code
+    for (auto refPtr : codeRefs)
+        vm.visitPtr(*refPtr);
+
+    for (auto callInfo : callInfos)
+    {
+        if (callInfo->lastFn)
+            vm.visitPtr(callInfo->lastFn);
+        for (size_t i = 0; i + 1 < callInfo->numEntries; ++i)
+            vm.visitPtr(callInfo->more[i].fn);
+    }
+
+    for (auto& entry : megaCallCache)
+        entry = CallEntry();
+
+    // Version list indices are copied along with the block objects
+    for (auto& versions : blockVersions)
+    {
+        for (auto version : versions)
+        {
+            vm.visit(version->fun);
+            vm.visit(version->block);
+            vm.visitPtr(version->retEntry.callInstr);
+        }
+    }
+
+    // Values held by the package system
+    visitPkgRoots(vm);
+}
+
+/// Visit the functions and stacks of the coroutines found live
+bool traceCoroutines(VM& vm)
+{
+    bool visited = false;
+
+    for (auto co : coroutines)
+    {
+        if (!co || co->marked)
+            continue;
+
+        auto objPtr = vm.weakRef(co->obj);
+        if (!objPtr)
+            continue;
+
+        co->obj = objPtr;
+        co->marked = true;
+        visited = true;
+
+        vm.visit(co->fun);
+
+        if (co->status == CO_SUSPENDED)
+        {
+            for (auto valPtr = co->stackPtr; valPtr < co->stack.base; ++valPtr)
+                vm.visit(*valPtr);
+        }
+    }
+
+    return visited;
+}
+
+/// Release the stack segments of finished coroutines, and keep them
+/// for reuse, up to a limit
+void releaseCoStack(Coroutine* co)
+{
+    if (!co->stack.mem)
+        return;
+
+    if (freeCoStacks.size() < MAX_FREE_CO_STACKS)
+        freeCoStacks.push_back(co->stack);
+    else
+        unmapStack(co->stack);
+
+    co->stack = StackMap();
+    co->stackPtr = co->framePtr = nullptr;
+    numCoStacks--;
+}
+
+/// Free the coroutines whose object is no longer reachable
+void sweepCoroutines(VM& vm)
+{
+    for (size_t id = 0; id < coroutines.size(); ++id)
+    {
+        auto co = coroutines[id];
+        if (!co)
+            continue;
+
+        if (co->marked)
+        {
+            co->marked = false;
+            continue;
+        }
+
+        releaseCoStack(co);
+        delete co;
+        coroutines[id] = nullptr;
+        freeCoIds.push_back((int32_t)id);
+    }
+
+    coStackThreshold = std::max(MIN_CO_STACK_THRESHOLD, 2 * numCoStacks);
+}
+
 /// Initialize the interpreter
 void initInterp()
 {
-    // Allocate the code heap
-    codeHeap = new uint8_t[CODE_HEAP_INIT_SIZE];
-    codeHeapLimit = codeHeap + CODE_HEAP_INIT_SIZE;
+    // Split the code heap in at least 16 chunks of whole pages
+#ifdef _WIN32
+    size_t pageSize = 4096;
+#else
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+#endif
+    codeChunkSize = std::min(codeHeapMaxSize / 16, MAX_CODE_CHUNK_SIZE);
+    codeChunkSize = std::max(codeChunkSize / pageSize * pageSize, pageSize);
+
+    // Reserve the code heap address range, rounded up to whole chunks
+    auto numChunks = std::max(
+        (codeHeapMaxSize + codeChunkSize - 1) / codeChunkSize,
+        size_t(1)
+    );
+    auto heapSize = numChunks * codeChunkSize;
+#ifdef _WIN32
+    // Note: the whole heap is allocated upfront
+    codeHeap = new uint8_t[heapSize];
+#else
+    auto mem = mmap(
+        nullptr,
+        heapSize,
+        PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+    if (mem == MAP_FAILED)
+        throw RunError("failed to reserve the code heap");
+    codeHeap = (uint8_t*)mem;
+#endif
+    codeHeapLimit = codeHeap + heapSize;
     codeHeapAlloc = codeHeap;
+    codeFreeLimit = codeHeapLimit;
+    codeChunks.resize(numChunks);
 
-    // Allocate the stack
-    stackLimit = new Value[STACK_INIT_SIZE];
-    stackBase = stackLimit + STACK_INIT_SIZE;
+    mainStack = mapStack(stackMaxSize);
+    stackBase = mainStack.base;
+    stackLimit = mainStack.limit;
     stackPtr = stackBase;
+
+    vm.addRootFn(visitInterpRoots);
+    vm.addTraceFn(traceCoroutines);
+    vm.addSweepFn(sweepCoroutines);
+
+#ifdef JIT_BACKEND
+    // Allocate the executable heap for native code
+    execHeap = new ExecHeap(EXEC_HEAP_SIZE);
+#endif
+
+#ifdef THREADED_DISPATCH
+    // Get the instruction handler addresses
+    execCode();
+#endif
+}
+
+/// Free the memory of the interpreter and of the heap of this isolate.
+/// Note: no code may run on this thread afterwards
+void shutdownInterp()
+{
+    for (auto callInfo : callInfos)
+        delete [] callInfo->more;
+    callInfos.clear();
+
+    for (auto ic : polyFieldICs)
+        delete [] ic->more;
+    polyFieldICs.clear();
+
+    for (auto& versions : blockVersions)
+        for (auto version : versions)
+            delete version;
+    blockVersions.clear();
+
+    for (auto stats : blockStats)
+        delete stats;
+    blockStats.clear();
+    curBlockStats = nullptr;
+
+    codeRefs.clear();
+    savedInstrPtrs.clear();
+
+    for (auto co : coroutines)
+    {
+        if (co && co->stack.mem)
+            unmapStack(co->stack);
+        delete co;
+    }
+    coroutines.clear();
+    freeCoIds.clear();
+    curCo = nullptr;
+
+    for (auto& stack : freeCoStacks)
+        unmapStack(stack);
+    freeCoStacks.clear();
+    numCoStacks = 0;
+    coStackThreshold = MIN_CO_STACK_THRESHOLD;
+
+#ifdef _WIN32
+    delete [] codeHeap;
+#else
+    munmap(codeHeap, codeHeapLimit - codeHeap);
+#endif
+    unmapStack(mainStack);
+    codeHeap = codeHeapLimit = codeHeapAlloc = nullptr;
+    stackBase = stackLimit = stackPtr = framePtr = nullptr;
+
+    vm.shutdown();
 }
 
 /// Get a version of a block. This version will be a stub
@@ -352,22 +2134,27 @@ void initInterp()
 BlockVersion* getBlockVersion(
     Object fun,
     Object block,
-    uint16_t numTmps,
+    const CodeGenCtx& ctx,
     bool forceNew = false
 )
 {
-    auto blockPtr = (refptr)block;
-    auto versionItr = versionMap.find((refptr)block);
-
-    // If there are no existing versions of this block
-    if (versionItr == versionMap.end())
+    // Find the version list of this block, or create it
+    auto listIdx = block.getAux();
+    if (listIdx == 0)
     {
-        versionMap[blockPtr] = VersionList();
+        listIdx = blockVersions.size();
+        blockVersions.emplace_back();
+        block.setAux(listIdx);
     }
-    else if (!forceNew)
+    auto& versions = blockVersions[listIdx];
+
+    // Context used for new versions
+    auto verCtx = ctx;
+
+    if (!forceNew)
     {
-        auto versions = versionItr->second;
-        assert (versions.size() > 0);
+        size_t numVersions = 0;
+        BlockVersion* genericVer = nullptr;
 
         // For each version of this block
         for (auto version : versions)
@@ -377,7 +2164,7 @@ BlockVersion* getBlockVersion(
                 continue;
             }
 
-            if (version->numTmps != numTmps)
+            if (version->numTmps != ctx.numTmps())
             {
                 throw RunError(
                     "a basic block must always receive the same number of "
@@ -385,68 +2172,180 @@ BlockVersion* getBlockVersion(
                 );
             }
 
-            return version;
+            if (version->ctx == ctx)
+            {
+                return version;
+            }
+
+            if (version->ctx.isGeneric())
+            {
+                genericVer = version;
+            }
+
+            numVersions++;
+        }
+
+        // If the version limit is reached, use a version that
+        // makes no assumptions about the tags of values
+        if (numVersions >= MAX_BLOCK_VERSIONS)
+        {
+            if (genericVer)
+                return genericVer;
+
+            verCtx = CodeGenCtx(ctx.numTmps());
         }
     }
 
     // Create a new version and add it to the list
-    auto& versionList = versionMap[blockPtr];
-    auto newVersion = new BlockVersion(fun, block, numTmps);
-    versionList.push_back(newVersion);
+    auto newVersion = new BlockVersion(fun, block, verCtx);
+    versions.push_back(newVersion);
 
     return newVersion;
 }
 
-void genCall(
+/**
+Get the continuation version of an instruction which transfers control
+to other code and back (call, resume, yield), and may raise an exception.
+The operands are popped off the stack, and a result value is pushed.
+*/
+BlockVersion* genRetVersion(
     BlockVersion* version,
     Object callInstr,
-    size_t numArgs,
-    uint16_t& numTmps
+    size_t numOperands,
+    CodeGenCtx& ctx
 )
 {
-    // Store a mapping of this instruction to the block version
-    instrMap[codeHeapAlloc] = version;
-
-    // Arguments and the function object are popped off the stack,
-    // a return value or exception is pushed on the stack
-    numTmps -= numArgs;
+    ctx.pop(numOperands);
+    ctx.push(TAG_UNKNOWN);
 
-    // Create a return address entry unique to this call instruction
+    // Create a return address entry unique to this instruction
     // and this block version
     RetEntry retEntry;
     retEntry.callInstr = (refptr)callInstr;
+    retEntry.callVer = version;
 
-    // Store the number of temporaries when the call is performed
-    // Note: this excludes the arguments and the function object
-    assert (numTmps >= 1);
-    retEntry.numTmps = numTmps - 1;
+    // Store the number of temporaries when the instruction is executed
+    // Note: this excludes the operands
+    retEntry.numTmps = ctx.numTmps() - 1;
 
     // Get a version for the call continuation block
     // Note: we force the creation of a new version unique to this call site
-    static ICache retToCache("ret_to");
+    static thread_local ICache retToCache("ret_to");
     auto retToBB = retToCache.getObj(callInstr);
-    auto retVer = getBlockVersion(version->fun, retToBB, numTmps, true);
-    retEntry.retVer = retVer;
+    auto retVer = getBlockVersion(version->fun, retToBB, ctx, true);
 
     if (callInstr.hasField("throw_to"))
     {
-        // Get a version for the exception catch block
-        // Note: the catch block expects only one temporary as input
-        static ICache throwIC("throw_to");
-        auto throwBB = throwIC.getObj(callInstr);
-        auto throwVer = getBlockVersion(version->fun, throwBB, 1);
-        retEntry.excVer = throwVer;
+        // Get a version for the exception catch block
+        // Note: the catch block expects only one temporary as input,
+        // the locals of the calling function are unchanged
+        static thread_local ICache throwIC("throw_to");
+        auto throwBB = throwIC.getObj(callInstr);
+        CodeGenCtx throwCtx(1);
+        throwCtx.localTags = ctx.localTags;
+        auto throwVer = getBlockVersion(version->fun, throwBB, throwCtx);
+        retEntry.excVer = throwVer;
+    }
+
+    // Store the return address info in the continuation version
+    retVer->retEntry = retEntry;
+
+    return retVer;
+}
+
+void genCall(
+    BlockVersion* version,
+    Object callInstr,
+    size_t numArgs,
+    CodeGenCtx& ctx
+)
+{
+    // Arguments and the function object are popped off the stack,
+    // a return value or exception is pushed on the stack
+    auto retVer = genRetVersion(version, callInstr, numArgs + 1, ctx);
+
+    writeCode(CALL);
+
+    // Remember the call info location, so the GC can update it
+    callInfos.push_back((CallInfo*)codeHeapAlloc);
+
+    CallInfo callInfo;
+    callInfo.numArgs = numArgs;
+    callInfo.retVer = retVer;
+    callInfo.callVer = version;
+    writeCode(callInfo);
+}
+
+/// Write the then and else targets of an if_true instruction
+void genBranchTargets(
+    BlockVersion* version,
+    Object ifInstr,
+    const CodeGenCtx& thenCtx,
+    const CodeGenCtx& elseCtx
+)
+{
+    static thread_local ICache thenIC("then");
+    static thread_local ICache elseIC("else");
+    auto thenBB = thenIC.getObj(ifInstr);
+    auto elseBB = elseIC.getObj(ifInstr);
+    auto thenVer = getBlockVersion(version->fun, thenBB, thenCtx);
+    auto elseVer = getBlockVersion(version->fun, elseBB, elseCtx);
+
+    writeCode(thenVer);
+    writeCode(elseVer);
+}
+
+/// Jump to the then or else target of an if_true instruction,
+/// for a test outcome known at compilation time
+void genKnownBranch(
+    BlockVersion* version,
+    Object ifInstr,
+    bool outcome,
+    const CodeGenCtx& ctx
+)
+{
+    static thread_local ICache thenIC("then");
+    static thread_local ICache elseIC("else");
+    auto dstBB = outcome? thenIC.getObj(ifInstr):elseIC.getObj(ifInstr);
+    auto dstVer = getBlockVersion(version->fun, dstBB, ctx);
+
+    writeCode(JUMP_STUB);
+    writeCode(dstVer);
+}
+
+/// Compile an instruction pushing a single value, which is preceded by
+/// a field name to be removed from the stack. Returns false, writing
+/// nothing, if the instruction can't be compiled this way.
+bool genFieldValue(Object instr)
+{
+    static thread_local ICache opIC("op");
+    static thread_local ICache idxIC("idx");
+    static thread_local ICache valIC("val");
+    auto op = (std::string)opIC.getStr(instr);
+
+    if (op == "push")
+    {
+        writeCode(PUSH);
+        writeCodeVal(valIC.getField(instr));
+        return true;
     }
 
-    // Create an entry for the return address
-    retAddrMap[retVer] = retEntry;
+    if (op == "get_local")
+    {
+        writeCode(GET_LOCAL);
+        writeCode((uint16_t)idxIC.getInt32(instr));
+        return true;
+    }
 
-    writeCode(CALL);
+    // Stack indices are shifted since the field name isn't pushed
+    if (op == "dup" && idxIC.getInt32(instr) > 0)
+    {
+        writeCode(DUP);
+        writeCode((uint16_t)(idxIC.getInt32(instr) - 1));
+        return true;
+    }
 
-    CallInfo callInfo;
-    callInfo.numArgs = numArgs;
-    callInfo.retVer = retVer;
-    writeCode(callInfo);
+    return false;
 }
 
 std::string getOp(Array& instrs, size_t i)
@@ -457,7 +2356,7 @@ std::string getOp(Array& instrs, size_t i)
         return "nop";
     }
     auto instr = (Object)instrs.getElem(i);
-    static ICache opIC("op");
+    static thread_local ICache opIC("op");
     return (std::string)opIC.getStr(instr);
 };
 
@@ -468,7 +2367,7 @@ void compile(BlockVersion* version)
     auto block = version->block;
 
     // Get the instructions array
-    static ICache instrsIC("instrs");
+    static thread_local ICache instrsIC("instrs");
     Array instrs = instrsIC.getArr(block);
 
     if (instrs.length() == 0)
@@ -476,11 +2375,32 @@ void compile(BlockVersion* version)
         throw RunError("empty basic block");
     }
 
+    // Make room for the code of the version
+    reserveCode(
+        MAX_INSTR_CODE_SIZE * (instrs.length() + 1)
+    );
+
+#ifdef JIT_BACKEND
+    jitRuns.clear();
+    jitInRun = false;
+#endif
+
     // Mark the block start
     version->startPtr = codeHeapAlloc;
 
+    // Count the executions of this version
+    if (countBlocks())
+    {
+        auto stats = new BlockStats();
+        stats->version = version;
+        writeCode<OpWord>(encodeOp(COUNT_BLOCK));
+        writeCode(stats);
+        blockStats.push_back(stats);
+    }
+
     // Get the size of the temp stack at the beginning of this version
-    uint16_t numTmps = version->numTmps;
+    // Get the tags known at the beginning of this version
+    auto ctx = version->ctx;
 
     // For each instruction
     for (size_t i = 0; i < instrs.length(); ++i)
@@ -489,21 +2409,23 @@ void compile(BlockVersion* version)
         assert (instrVal.isObject());
         auto instr = (Object)instrVal;
 
-        static ICache opIC("op");
+        static thread_local ICache opIC("op");
         auto op = (std::string)opIC.getStr(instr);
 
         //std::cout << "op: " << op << std::endl;
-        //std::cout << "  numTmps=" << numTmps << std::endl;
+        //std::cout << "  numTmps=" << ctx.numTmps() << std::endl;
 
         if (op == "push")
         {
-            static ICache valIC("val");
+            static thread_local ICache valIC("val");
             auto val = valIC.getField(instr);
             std::string nextOp = getOp(instrs, i + 1);
 
             if (nextOp == "add_i32" && val == Value::ONE)
             {
                 i += 1;
+                ctx.pop(1);
+                ctx.push(TAG_INT32);
                 writeCode(INC_I32);
                 continue;
             }
@@ -511,38 +2433,56 @@ void compile(BlockVersion* version)
             if (nextOp == "sub_i32" && val == Value::ONE)
             {
                 i += 1;
+                ctx.pop(1);
+                ctx.push(TAG_INT32);
                 writeCode(DEC_I32);
                 continue;
             }
 
-            if (nextOp == "get_field")
+            // Field names in the code are interned, so that the inline
+            // caches can be filled by pointer comparisons
+            if (val.isString() && nextOp == "get_field")
             {
                 i += 1;
+                ctx.pop(1);
+                ctx.push(TAG_UNKNOWN);
                 writeCode(GET_FIELD_IMM);
-                writeCode((refptr)val);
-                writeCode(size_t(0));
+                writeCodeRef((refptr)String(val).intern());
+                writeCode(FieldIC());
+                continue;
+            }
+
+            // Fuse a field name and set_field around a single value
+            if (val.isString() &&
+                getOp(instrs, i + 2) == "set_field" &&
+                genFieldValue((Object)instrs.getElem(i + 1)))
+            {
+                i += 2;
+                ctx.pop(1);
+                writeCode(SET_FIELD_IMM);
+                writeCodeRef((refptr)String(val).intern());
+                writeCode(FieldIC());
                 continue;
             }
 
-            numTmps += 1;
+            ctx.push(val.getTag());
             writeCode(PUSH);
-            writeCode(val.getWord());
-            writeCode(val.getTag());
+            writeCodeVal(val);
             continue;
         }
 
         if (op == "pop")
         {
-            numTmps -= 1;
+            ctx.pop(1);
             writeCode(POP);
             continue;
         }
 
         if (op == "dup")
         {
-            numTmps += 1;
-            static ICache idxIC("idx");
+            static thread_local ICache idxIC("idx");
             auto idx = (uint16_t)idxIC.getInt32(instr);
+            ctx.push(ctx.getTmp(idx));
             writeCode(DUP);
             writeCode(idx);
             continue;
@@ -550,29 +2490,109 @@ void compile(BlockVersion* version)
 
         if (op == "swap")
         {
+            ctx.swap();
             writeCode(SWAP);
             continue;
         }
 
         if (op == "get_local")
         {
-            static ICache idxIC("idx");
+            static thread_local ICache idxIC("idx");
             auto idx = (uint16_t)idxIC.getInt32(instr);
+
+            // Add a constant to a local and store the result in a local
+            if (getOp(instrs, i + 1) == "push" &&
+                (getOp(instrs, i + 2) == "add_i32" ||
+                 getOp(instrs, i + 2) == "sub_i32") &&
+                getOp(instrs, i + 3) == "set_local")
+            {
+                auto pushInstr = (Object)instrs.getElem(i + 1);
+                static thread_local ICache valIC("val");
+                auto val = valIC.getField(pushInstr);
+
+                if (val.isInt32())
+                {
+                    // Subtraction wraps around, as in SUB_I32
+                    auto imm = (uint32_t)(int32_t)val;
+                    if (getOp(instrs, i + 2) == "sub_i32")
+                        imm = 0 - imm;
+
+                    auto setInstr = (Object)instrs.getElem(i + 3);
+                    auto dstIdx = (uint16_t)idxIC.getInt32(setInstr);
+                    ctx.setLocal(dstIdx, TAG_INT32);
+
+                    writeCode(ADD_LOCAL_IMM_I32);
+                    writeCode(idx);
+                    writeCode((int32_t)imm);
+                    writeCode(dstIdx);
+                    i += 3;
+                    continue;
+                }
+            }
+
             if (getOp(instrs, i + 1) == "has_tag")
             {
-                numTmps += 1;
-                auto nextInstr = (Object) instrs.getElem(i + 1);
-                static ICache tagIC("tag");
-                auto tagStr = (std::string)tagIC.getStr(nextInstr);
-                auto tag = strToTag(tagStr);
+                auto tagInstr = (Object)instrs.getElem(i + 1);
+                static thread_local ICache tagIC("tag");
+                auto tag = strToTag((std::string)tagIC.getStr(tagInstr));
+                auto localTag = ctx.getLocal(idx);
+
+                // Test the tag of a local and branch on the result
+                if (getOp(instrs, i + 2) == "if_true")
+                {
+                    auto ifInstr = (Object)instrs.getElem(i + 2);
+                    i += 2;
+
+                    // If the tag of the local is known, the test outcome is
+                    if (localTag != TAG_UNKNOWN)
+                    {
+                        genKnownBranch(version, ifInstr, localTag == tag, ctx);
+                        continue;
+                    }
+
+                    // The local has the tested tag in the then branch
+                    auto thenCtx = ctx;
+                    thenCtx.setLocal(idx, tag);
+
+                    writeCode(IF_LOCAL_HAS_TAG);
+                    writeCode(idx);
+                    writeCode(tag);
+                    genBranchTargets(version, ifInstr, thenCtx, ctx);
+                    continue;
+                }
+
+                i += 1;
+                ctx.push(TAG_BOOL);
+
+                if (localTag != TAG_UNKNOWN)
+                {
+                    writeCode(PUSH);
+                    writeCodeVal((localTag == tag)? Value::TRUE:Value::FALSE);
+                    continue;
+                }
+
                 writeCode(LOCAL_HAS_TAG);
                 writeCode(idx);
                 writeCode(tag);
+                continue;
+            }
+
+            // Push two locals, unless the second one has its tag tested
+            if (getOp(instrs, i + 1) == "get_local" &&
+                getOp(instrs, i + 2) != "has_tag")
+            {
+                auto nextInstr = (Object)instrs.getElem(i + 1);
+                auto idx2 = (uint16_t)idxIC.getInt32(nextInstr);
+                ctx.push(ctx.getLocal(idx));
+                ctx.push(ctx.getLocal(idx2));
+                writeCode(GET_LOCAL2);
+                writeCode(idx);
+                writeCode(idx2);
                 i += 1;
                 continue;
             }
 
-            numTmps += 1;
+            ctx.push(ctx.getLocal(idx));
             writeCode(GET_LOCAL);
             writeCode(idx);
             continue;
@@ -580,133 +2600,182 @@ void compile(BlockVersion* version)
 
         if (op == "set_local")
         {
-            numTmps -= 1;
-            static ICache idxIC("idx");
+            static thread_local ICache idxIC("idx");
             auto idx = (uint16_t)idxIC.getInt32(instr);
+            ctx.setLocal(idx, ctx.pop());
             writeCode(SET_LOCAL);
             writeCode(idx);
             continue;
         }
 
+        // Fuse integer comparisons with a following conditional branch
+        if (getOp(instrs, i + 1) == "if_true")
+        {
+            static const std::unordered_map<std::string, Opcode> ifCmpOps = {
+                { "lt_i32", IF_LT_I32 },
+                { "le_i32", IF_LE_I32 },
+                { "gt_i32", IF_GT_I32 },
+                { "ge_i32", IF_GE_I32 },
+                { "eq_i32", IF_EQ_I32 },
+            };
+
+            auto itr = ifCmpOps.find(op);
+            if (itr != ifCmpOps.end())
+            {
+                ctx.pop(2);
+                auto ifInstr = (Object)instrs.getElem(i + 1);
+                writeCode(itr->second);
+                genBranchTargets(version, ifInstr, ctx, ctx);
+                i += 1;
+                continue;
+            }
+        }
+
         //
         // Integer operations
         //
 
         if (op == "add_i32")
         {
-            numTmps -= 1;
-            writeCode(ADD_I32);
+            auto knownInts = ctx.tmpsHaveTag(2, TAG_INT32);
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(knownInts? ADD_I32_NC:ADD_I32);
             continue;
         }
 
         if (op == "sub_i32")
         {
-            numTmps -= 1;
-            writeCode(SUB_I32);
+            auto knownInts = ctx.tmpsHaveTag(2, TAG_INT32);
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(knownInts? SUB_I32_NC:SUB_I32);
             continue;
         }
 
         if (op == "mul_i32")
         {
-            numTmps -= 1;
-            writeCode(MUL_I32);
+            auto knownInts = ctx.tmpsHaveTag(2, TAG_INT32);
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(knownInts? MUL_I32_NC:MUL_I32);
             continue;
         }
 
         if (op == "div_i32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
             writeCode(DIV_I32);
             continue;
         }
 
         if (op == "mod_i32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
             writeCode(MOD_I32);
             continue;
         }
 
         if (op == "shl_i32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
             writeCode(SHL_I32);
             continue;
         }
 
         if (op == "shr_i32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
             writeCode(SHR_I32);
             continue;
         }
 
         if (op == "ushr_i32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
             writeCode(USHR_I32);
             continue;
         }
 
         if (op == "and_i32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
             writeCode(AND_I32);
             continue;
         }
 
         if (op == "or_i32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
             writeCode(OR_I32);
             continue;
         }
 
         if (op == "xor_i32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
             writeCode(XOR_I32);
             continue;
         }
 
         if (op == "not_i32")
         {
+            ctx.pop(1);
+            ctx.push(TAG_INT32);
             writeCode(NOT_I32);
             continue;
         }
 
         if (op == "lt_i32")
         {
-            numTmps -= 1;
-            writeCode(LT_I32);
+            auto knownInts = ctx.tmpsHaveTag(2, TAG_INT32);
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(knownInts? LT_I32_NC:LT_I32);
             continue;
         }
 
         if (op == "le_i32")
         {
-            numTmps -= 1;
-            writeCode(LE_I32);
+            auto knownInts = ctx.tmpsHaveTag(2, TAG_INT32);
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(knownInts? LE_I32_NC:LE_I32);
             continue;
         }
 
         if (op == "gt_i32")
         {
-            numTmps -= 1;
-            writeCode(GT_I32);
+            auto knownInts = ctx.tmpsHaveTag(2, TAG_INT32);
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(knownInts? GT_I32_NC:GT_I32);
             continue;
         }
 
         if (op == "ge_i32")
         {
-            numTmps -= 1;
-            writeCode(GE_I32);
+            auto knownInts = ctx.tmpsHaveTag(2, TAG_INT32);
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(knownInts? GE_I32_NC:GE_I32);
             continue;
         }
 
         if (op == "eq_i32")
         {
-            numTmps -= 1;
-            writeCode(EQ_I32);
+            auto knownInts = ctx.tmpsHaveTag(2, TAG_INT32);
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(knownInts? EQ_I32_NC:EQ_I32);
             continue;
         }
 
@@ -716,98 +2785,112 @@ void compile(BlockVersion* version)
 
         if (op == "add_f32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_FLOAT32);
             writeCode(ADD_F32);
             continue;
         }
 
         if (op == "sub_f32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_FLOAT32);
             writeCode(SUB_F32);
             continue;
         }
 
         if (op == "mul_f32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_FLOAT32);
             writeCode(MUL_F32);
             continue;
         }
 
         if (op == "div_f32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_FLOAT32);
             writeCode(DIV_F32);
             continue;
         }
 
         if (op == "lt_f32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
             writeCode(LT_F32);
             continue;
         }
 
         if (op == "le_f32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
             writeCode(LE_F32);
             continue;
         }
 
         if (op == "gt_f32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
             writeCode(GT_F32);
             continue;
         }
 
         if (op == "ge_f32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
             writeCode(GE_F32);
             continue;
         }
 
         if (op == "eq_f32")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
             writeCode(EQ_F32);
             continue;
         }
 
         if (op == "sin_f32")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_FLOAT32);
             writeCode(SIN_F32);
             continue;
         }
 
         if (op == "cos_f32")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_FLOAT32);
             writeCode(COS_F32);
             continue;
         }
 
         if (op == "sqrt_f32")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_FLOAT32);
             writeCode(SQRT_F32);
             continue;
         }
 
         if (op == "log_f32")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_FLOAT32);
             writeCode(LOG_F32);
             continue;
         }
 
         if (op == "exp_f32")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_FLOAT32);
             writeCode(EXP_F32);
             continue;
         }
@@ -818,30 +2901,40 @@ void compile(BlockVersion* version)
 
         if (op == "i32_to_f32")
         {
+            ctx.pop(1);
+            ctx.push(TAG_FLOAT32);
             writeCode(I32_TO_F32);
             continue;
         }
 
         if (op == "i32_to_str")
         {
+            ctx.pop(1);
+            ctx.push(TAG_STRING);
             writeCode(I32_TO_STR);
             continue;
         }
 
         if (op == "f32_to_i32")
         {
+            ctx.pop(1);
+            ctx.push(TAG_INT32);
             writeCode(F32_TO_I32);
             continue;
         }
 
         if (op == "f32_to_str")
         {
+            ctx.pop(1);
+            ctx.push(TAG_STRING);
             writeCode(F32_TO_STR);
             continue;
         }
 
         if (op == "str_to_f32")
         {
+            ctx.pop(1);
+            ctx.push(TAG_FLOAT32);
             writeCode(STR_TO_F32);
             continue;
         }
@@ -852,18 +2945,39 @@ void compile(BlockVersion* version)
 
         if (op == "eq_bool")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
             writeCode(EQ_BOOL);
             continue;
         }
 
         if (op == "has_tag")
         {
-            numTmps += 0;
-            static ICache tagIC("tag");
+            static thread_local ICache tagIC("tag");
             auto tagStr = (std::string)tagIC.getStr(instr);
             auto tag = strToTag(tagStr);
+            auto valTag = ctx.pop();
+
+            // If the tag of the value is known, the test outcome is
+            if (valTag != TAG_UNKNOWN)
+            {
+                writeCode(POP);
 
+                if (getOp(instrs, i + 1) == "if_true")
+                {
+                    auto ifInstr = (Object)instrs.getElem(i + 1);
+                    genKnownBranch(version, ifInstr, valTag == tag, ctx);
+                    i += 1;
+                    continue;
+                }
+
+                ctx.push(TAG_BOOL);
+                writeCode(PUSH);
+                writeCodeVal((valTag == tag)? Value::TRUE:Value::FALSE);
+                continue;
+            }
+
+            ctx.push(TAG_BOOL);
             writeCode(HAS_TAG);
             writeCode(tag);
             continue;
@@ -871,7 +2985,8 @@ void compile(BlockVersion* version)
 
         if (op == "get_tag")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_STRING);
             writeCode(GET_TAG);
             continue;
         }
@@ -882,42 +2997,48 @@ void compile(BlockVersion* version)
 
         if (op == "str_len")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_INT32);
             writeCode(STR_LEN);
             continue;
         }
 
         if (op == "get_char")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_STRING);
             writeCode(GET_CHAR);
             continue;
         }
 
         if (op == "get_char_code")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
             writeCode(GET_CHAR_CODE);
             continue;
         }
 
         if (op == "char_to_str")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_STRING);
             writeCode(CHAR_TO_STR);
             continue;
         }
 
         if (op == "str_cat")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_STRING);
             writeCode(STR_CAT);
             continue;
         }
 
         if (op == "eq_str")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
             writeCode(EQ_STR);
             continue;
         }
@@ -928,48 +3049,57 @@ void compile(BlockVersion* version)
 
         if (op == "new_object")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_OBJECT);
             writeCode(NEW_OBJECT);
             continue;
         }
 
         if (op == "has_field")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
             writeCode(HAS_FIELD);
             continue;
         }
 
         if (op == "set_field")
         {
-            numTmps -= 3;
+            ctx.pop(3);
             writeCode(SET_FIELD);
+
+            // Cached field name and inline cache
+            writeCodeRef(nullptr);
+            writeCode(FieldIC());
+
             continue;
         }
 
         if (op == "get_field")
         {
-            numTmps -= 1;
-
+            ctx.pop(2);
+            ctx.push(TAG_UNKNOWN);
             writeCode(GET_FIELD);
 
-            // Cached property slot index
-            writeCode(size_t(0));
+            // Cached field name and inline cache
+            writeCodeRef(nullptr);
+            writeCode(FieldIC());
 
             continue;
         }
 
         if (op == "get_field_list")
         {
-            numTmps += 0;
-
+            ctx.pop(1);
+            ctx.push(TAG_ARRAY);
             writeCode(GET_FIELD_LIST);
             continue;
         }
 
         if (op == "eq_obj")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
             writeCode(EQ_OBJ);
             continue;
         }
@@ -980,49 +3110,54 @@ void compile(BlockVersion* version)
 
         if (op == "new_array")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_ARRAY);
             writeCode(NEW_ARRAY);
             continue;
         }
 
         if (op == "array_len")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_INT32);
             writeCode(ARRAY_LEN);
             continue;
         }
 
         if (op == "array_push")
         {
-            numTmps -= 2;
+            ctx.pop(2);
             writeCode(ARRAY_PUSH);
             continue;
         }
 
         if (op == "array_pop")
         {
-            numTmps += 0;
+            ctx.pop(1);
+            ctx.push(TAG_UNKNOWN);
             writeCode(ARRAY_POP);
             continue;
         }
 
         if (op == "set_elem")
         {
-            numTmps -= 3;
+            ctx.pop(3);
             writeCode(SET_ELEM);
             continue;
         }
 
         if (op == "get_elem")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_UNKNOWN);
             writeCode(GET_ELEM);
             continue;
         }
 
         if (op == "eq_array")
         {
-            numTmps -= 1;
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
             writeCode(EQ_ARRAY);
             continue;
         }
@@ -1033,11 +3168,9 @@ void compile(BlockVersion* version)
 
         if (op == "jump")
         {
-            numTmps += 0;
-
-            static ICache toIC("to");
+            static thread_local ICache toIC("to");
             auto dstBB = toIC.getObj(instr);
-            auto dstVer = getBlockVersion(version->fun, dstBB, numTmps);
+            auto dstVer = getBlockVersion(version->fun, dstBB, ctx);
 
             writeCode(JUMP_STUB);
             writeCode(dstVer);
@@ -1046,32 +3179,22 @@ void compile(BlockVersion* version)
 
         if (op == "if_true")
         {
-            numTmps -= 1;
-
-            static ICache thenIC("then");
-            static ICache elseIC("else");
-            auto thenBB = thenIC.getObj(instr);
-            auto elseBB = elseIC.getObj(instr);
-            auto thenVer = getBlockVersion(version->fun, thenBB, numTmps);
-            auto elseVer = getBlockVersion(version->fun, elseBB, numTmps);
-
+            ctx.pop(1);
             writeCode(IF_TRUE);
-            writeCode(thenVer);
-            writeCode(elseVer);
-
+            genBranchTargets(version, instr, ctx, ctx);
             continue;
         }
 
         if (op == "call")
         {
-            static ICache numArgsCache("num_args");
+            static thread_local ICache numArgsCache("num_args");
             auto numArgs = (int16_t)numArgsCache.getInt32(instr);
 
             genCall(
                 version,
                 instr,
                 numArgs,
-                numTmps
+                ctx
             );
 
             continue;
@@ -1079,11 +3202,11 @@ void compile(BlockVersion* version)
 
         if (op == "ret")
         {
-            numTmps -= 1;
+            ctx.pop(1);
 
             // TODO: should report source position (src_pos)
             // of function if this check fails
-            if (numTmps != 0)
+            if (ctx.numTmps() != 0)
             {
                 throw RunError(
                     "there must be no values left on the temporary stack "
@@ -1097,20 +3220,37 @@ void compile(BlockVersion* version)
 
         if (op == "throw")
         {
-            numTmps -= 1;
+            ctx.pop(1);
 
-            // Store a mapping of this instruction to the block version
+            // Store the block version after the instruction
             // Needed to retrieve the identity of the current function
-            instrMap[codeHeapAlloc] = version;
-
             writeCode(THROW);
+            writeCode(version);
+            continue;
+        }
+
+        // Switch to a coroutine, passing it a value
+        if (op == "resume")
+        {
+            auto retVer = genRetVersion(version, instr, 2, ctx);
+            writeCode(RESUME);
+            writeCode(retVer);
+            continue;
+        }
+
+        // Suspend the running coroutine, passing a value to its resumer
+        if (op == "yield")
+        {
+            auto retVer = genRetVersion(version, instr, 1, ctx);
+            writeCode(YIELD);
+            writeCode(retVer);
             continue;
         }
 
         if (op == "import")
         {
             // Push the import function on the stack
-            numTmps += 1;
+            ctx.push(TAG_HOSTFN);
             writeCode(PUSH);
             writeCode((Word)(refptr)&importFn);
             writeCode((Tag)TAG_HOSTFN);
@@ -1120,7 +3260,7 @@ void compile(BlockVersion* version)
                 version,
                 instr,
                 1,
-                numTmps
+                ctx
             );
 
             continue;
@@ -1129,26 +3269,44 @@ void compile(BlockVersion* version)
         throw RunError("unhandled opcode in basic block \"" + op + "\"");
     }
 
+#ifdef JIT_BACKEND
+    // Compile the supported instruction runs to native code
+    jitCompileRuns();
+#endif
+
     // Mark the block end
     version->endPtr = codeHeapAlloc;
+    addChunkVersion(version);
 
     //std::cout << "done compiling version" << std::endl;
     //std::cout << codeHeapSize() << std::endl;
 }
 
-/// Get the source position for a given instruction, if available
-Value getSrcPos(uint8_t* instrPtr)
+/// Get the code address of a branch target, compiling the target
+/// version and patching the branch on first use
+__attribute__((always_inline)) inline uint8_t* branchTarget(uint8_t*& dstAddr)
 {
-    auto itr = instrMap.find(instrPtr);
-    if (itr == instrMap.end())
+    if (dstAddr < codeHeap || dstAddr >= codeHeapLimit)
     {
-        std::cout << "no instr to block mapping" << std::endl;
-        return Value::UNDEF;
+        auto dstVer = (BlockVersion*)dstAddr;
+        if (!dstVer->startPtr)
+            compile(dstVer);
+
+        // Patch the branch
+        dstAddr = dstVer->startPtr;
+        addPatchedSlot(dstVer, &dstAddr, false);
     }
 
-    auto block = itr->second->block;
+    return dstAddr;
+}
+
+/// Get the source position for an instruction of a block version,
+/// if available
+Value getSrcPos(BlockVersion* version)
+{
+    auto block = version->block;
 
-    static ICache instrsIC("instrs");
+    static thread_local ICache instrsIC("instrs");
     Array instrs = instrsIC.getArr(block);
     assert (instrs.length() > 0);
 
@@ -1166,18 +3324,265 @@ Value getSrcPos(uint8_t* instrPtr)
     return Value::UNDEF;
 }
 
+/// Create a coroutine object which runs a function when first resumed
+Object newCoroutine(Object fun)
+{
+    static thread_local ICache paramsIC("params");
+    auto numParams = size_t(paramsIC.getArr(fun).length());
+    auto numLocals = size_t(getNumLocals(fun));
+
+    if (numParams > 1)
+        throw RunError("coroutine functions take at most one parameter");
+
+    if (numLocals < numParams + 1)
+    {
+        throw RunError(
+            "not enough locals to store function parameters in coroutine"
+        );
+    }
+
+    // The frame of the function must fit in a coroutine stack
+    if (numLocals + 3 > coStackMaxSize / sizeof(Value))
+        throw RunError("stack overflow");
+
+    int32_t id;
+    if (freeCoIds.empty())
+    {
+        id = (int32_t)coroutines.size();
+        coroutines.push_back(nullptr);
+    }
+    else
+    {
+        id = freeCoIds.back();
+        freeCoIds.pop_back();
+    }
+
+    static thread_local ICache idIC("_co");
+    auto obj = Object::newObject(2);
+    idIC.setField(obj, Value::int32(id));
+
+    auto co = new Coroutine();
+    co->obj = (refptr)obj;
+    co->fun = fun;
+    co->numParams = numParams;
+    coroutines[id] = co;
+
+    return obj;
+}
+
+/// Get the coroutine of a coroutine object, or null
+Coroutine* getCoroutine(Value val)
+{
+    if (!val.isObject())
+        return nullptr;
+
+    static thread_local ICache idIC("_co");
+    auto obj = Object(val);
+    Value idVal;
+    try
+    {
+        idVal = idIC.getField(obj);
+    }
+    catch (RunError&)
+    {
+        return nullptr;
+    }
+
+    if (!idVal.isInt32())
+        return nullptr;
+
+    // The id must belong to a coroutine created for this object
+    auto id = (int32_t)idVal;
+    if (id < 0 || size_t(id) >= coroutines.size())
+        return nullptr;
+    auto co = coroutines[id];
+    if (!co || co->obj != (refptr)obj)
+        return nullptr;
+
+    return co;
+}
+
+/// Get the coroutine of an object, if it can be resumed,
+/// or describe why it can't be
+Coroutine* getResumable(Value val, std::string& errMsg)
+{
+    auto co = getCoroutine(val);
+
+    if (!co)
+        errMsg = "resumed value is not a coroutine";
+    else if (co->status == CO_RUNNING)
+        errMsg = "coroutine is already running";
+    else if (co->status == CO_DONE)
+        errMsg = "coroutine has finished";
+    else
+        return co;
+
+    return nullptr;
+}
+
+/// Get the execution status of a coroutine object
+std::string coroutineStatus(Value val)
+{
+    auto co = getCoroutine(val);
+    if (!co)
+        throw RunError("value is not a coroutine");
+
+    switch (co->status)
+    {
+        case CO_NEW: return "new";
+        case CO_SUSPENDED: return "suspended";
+        case CO_RUNNING: return "running";
+        default: return "done";
+    }
+}
+
+/// Continue execution at a block version, with a value pushed
+__attribute__((always_inline)) inline void continueAt(
+    BlockVersion* version,
+    Value val
+)
+{
+    pushVal(val);
+
+    if (!version->startPtr)
+        compile(version);
+
+    instrPtr = version->startPtr;
+}
+
+/**
+Switch to the stack of a coroutine and continue its execution, passing
+it a value. This is the argument of the coroutine function when first
+resumed, and the result of the yield it is suspended at afterwards.
+The continuation of the resumer is null when resumed from host code.
+*/
+void enterCoroutine(
+    Coroutine* co,
+    Value val,
+    BlockVersion* callerRetVer
+)
+{
+    co->callerStackPtr = stackPtr;
+    co->callerFramePtr = framePtr;
+    co->callerStackBase = stackBase;
+    co->callerStackLimit = stackLimit;
+    co->callerRetVer = callerRetVer;
+    co->caller = curCo;
+    co->hostDepth = savedInstrPtrs.size();
+
+    auto prevStatus = co->status;
+    co->status = CO_RUNNING;
+    curCo = co;
+
+    if (prevStatus == CO_SUSPENDED)
+    {
+        stackBase = co->stack.base;
+        stackLimit = co->stack.limit;
+        stackPtr = co->stackPtr;
+        framePtr = co->framePtr;
+        continueAt(co->resumeVer, val);
+        return;
+    }
+
+    // Get a stack segment, reusing that of a finished coroutine
+    if (freeCoStacks.empty())
+    {
+        co->stack = mapStack(coStackMaxSize);
+    }
+    else
+    {
+        co->stack = freeCoStacks.back();
+        freeCoStacks.pop_back();
+    }
+
+    // Stack segments are not part of the heap, but get freed
+    // along with the coroutine objects by collections
+    if (++numCoStacks > coStackThreshold)
+        VM::gcRequested = true;
+
+    stackBase = co->stack.base;
+    stackLimit = co->stack.limit;
+    stackPtr = stackBase;
+
+    auto fun = Object(co->fun);
+    co->fun = Value::UNDEF;
+    auto numParams = size_t(co->numParams);
+    auto numLocals = size_t(getNumLocals(fun));
+
+    // Push the frame of the coroutine function. The saved stack
+    // pointer is the stack base, which marks the bottom frame.
+    framePtr = stackPtr - 1;
+    stackPtr -= numLocals;
+    for (size_t i = 0; i < numLocals; ++i)
+        framePtr[-i] = Value::UNDEF;
+    pushVal(Value((refptr)stackBase, TAG_RAWPTR));
+    pushVal(Value(nullptr, TAG_RAWPTR));
+    pushVal(Value(nullptr, TAG_RAWPTR));
+
+    if (numParams == 1)
+        framePtr[0] = val;
+    framePtr[-numParams] = fun;
+
+    static thread_local ICache entryIC("entry");
+    auto entryBlock = entryIC.getObj(fun);
+    auto entryVer = getBlockVersion(fun, entryBlock, CodeGenCtx());
+    if (!entryVer->startPtr)
+        compile(entryVer);
+
+    instrPtr = entryVer->startPtr;
+}
+
+/// Switch back to the stack of the resumer of the running coroutine,
+/// returning the continuation of the resumer
+BlockVersion* leaveCoroutine(Coroutine* co)
+{
+    assert (co == curCo);
+
+    stackPtr = co->callerStackPtr;
+    framePtr = co->callerFramePtr;
+    stackBase = co->callerStackBase;
+    stackLimit = co->callerStackLimit;
+    curCo = co->caller;
+
+    co->caller = nullptr;
+
+    return co->callerRetVer;
+}
+
+/// Finish the running coroutine, once its bottom frame returned
+/// or was unwound, returning the continuation of its resumer
+BlockVersion* finishCoroutine(Coroutine* co)
+{
+    auto retVer = leaveCoroutine(co);
+    co->status = CO_DONE;
+    releaseCoStack(co);
+    return retVer;
+}
+
+/// Check if the bottom frame of the running coroutine was just popped
+__attribute__((always_inline)) inline bool coroutineFinished()
+{
+    return curCo && stackPtr == curCo->stack.base;
+}
+
+/// Finish the coroutines left running by an error escaping the
+/// interpreter loop, back to the one running before
+void unwindCoroutines(Coroutine* prevCo)
+{
+    while (curCo && curCo != prevCo)
+        finishCoroutine(curCo);
+}
+
 /// Implementation of the throw instruction
 void throwExc(
-    uint8_t* throwInstr,
+    BlockVersion* throwVer,
     Value excVal
 )
 {
     //std::cout << "Entering throwExc" << std::endl;
 
-    // Get the current function
-    auto itr = instrMap.find(throwInstr);
-    assert (itr != instrMap.end());
-    auto curFun = itr->second->fun;
+    // Version of the function whose frame is being unwound
+    auto curVer = throwVer;
 
     // Until we are done unwinding the stack
     for (;;)
@@ -1185,8 +3590,7 @@ void throwExc(
         //std::cout << "Unwinding frame" << std::endl;
 
         // Get the number of locals in the function
-        static ICache numLocalsIC("num_locals");
-        auto numLocals = numLocalsIC.getInt32(curFun);
+        size_t numLocals = curVer->numLocals;
 
         //std::cout << "numLocals=" << numLocals << std::endl;
 
@@ -1202,6 +3606,10 @@ void throwExc(
         stackPtr = (Value*)prevStackPtr.getWord().ptr;
         framePtr = (Value*)prevFramePtr.getWord().ptr;
 
+        // Exceptions escaping a coroutine are thrown to its resumer
+        if (retVer == nullptr && coroutineFinished())
+            retVer = finishCoroutine(curCo);
+
         // If we are at the top level
         if (retVer == nullptr)
         {
@@ -1238,11 +3646,11 @@ void throwExc(
         }
 
         // Find the info associated with the return address
-        assert (retAddrMap.find(retVer) != retAddrMap.end());
-        auto retEntry = retAddrMap[retVer];
+        auto& retEntry = retVer->retEntry;
+        assert (retEntry.callInstr);
 
-        // Get the function associated with the return address
-        curFun = retEntry.retVer->fun;
+        // Unwind the frame of the function returned into next
+        curVer = retVer;
 
         // If there is an exception handler
         if (retEntry.excVer)
@@ -1269,87 +3677,277 @@ void throwExc(
     }
 }
 
+/// Throw an error for a call with the wrong argument count
+__attribute__((noinline)) void argCountError(
+    BlockVersion* callVer,
+    size_t numArgs,
+    std::string expected
+)
+{
+    Value srcPos = getSrcPos(callVer);
+
+    std::string srcPosStr = (
+        srcPos.isObject()?
+        (posToString(srcPos) + " - "):
+        std::string("")
+    );
+
+    throw RunError(
+        srcPosStr +
+        "incorrect argument count in call, received " +
+        std::to_string(numArgs) +
+        ", expected " +
+        expected
+    );
+}
+
 void checkArgCount(
-    uint8_t* instrPtr,
+    BlockVersion* callVer,
     size_t numParams,
     size_t numArgs
 )
 {
     if (numArgs != numParams)
+        argCountError(callVer, numArgs, std::to_string(numParams));
+}
+
+/// Check the argument count of a call to a variadic function
+void checkArgRange(
+    BlockVersion* callVer,
+    size_t minParams,
+    size_t maxParams,
+    size_t numArgs
+)
+{
+    if (numArgs < minParams)
+        argCountError(callVer, numArgs, "at least " + std::to_string(minParams));
+    if (numArgs > maxParams)
+        argCountError(callVer, numArgs, "at most " + std::to_string(maxParams));
+}
+
+/**
+Raise an error as an exception thrown by an instruction with a
+continuation version, once its operands are popped, transferring
+control to the exception handler of the instruction, or unwinding
+the stack
+*/
+__attribute__((noinline)) void raiseError(
+    BlockVersion* retVer,
+    Value errMsg
+)
+{
+    // Create an exception object
+    static thread_local ICache msgIC("msg");
+    auto excVal = Object::newObject();
+    msgIC.setField(excVal, errMsg);
+
+    auto& retEntry = retVer->retEntry;
+
+    // If there is an exception handler (throw_to field)
+    if (retEntry.excVer)
     {
-        Value srcPos = getSrcPos(instrPtr);
+        // Clear the temporary stack
+        stackPtr += retEntry.numTmps;
 
-        std::string srcPosStr = (
-            srcPos.isObject()?
-            (posToString(srcPos) + " - "):
-            std::string("")
-        );
+        // Push the exception value on the stack
+        pushVal(excVal);
+
+        // Compile exception handler if needed
+        if (!retEntry.excVer->startPtr)
+            compile(retEntry.excVer);
+
+        instrPtr = retEntry.excVer->startPtr;
+    }
+    else
+    {
+        // Unwind the interpreter stack
+        throwExc(retEntry.callVer, excVal);
+    }
+}
+
+/**
+Raise an error as an exception thrown by a call instruction, such
+as the error reported by a host function
+*/
+__attribute__((noinline)) void callError(
+    CallInfo& callInfo,
+    Value errMsg
+)
+{
+    // Pop the arguments from the stack
+    stackPtr += callInfo.numArgs;
+
+    raiseError(callInfo.retVer, errMsg);
+}
+
+/// Look up the entry version and frame layout of a called function
+void lookupCallee(
+    Object fun,
+    CallInfo& callInfo,
+    CallEntry& entry
+)
+{
+    // Get a version for the function entry block
+    static thread_local ICache entryIC("entry");
+    auto entryBB = entryIC.getObj(fun);
+    auto entryVer = getBlockVersion(fun, entryBB, CodeGenCtx());
+
+    auto numLocals = size_t(entryVer->numLocals);
 
+    static thread_local ICache paramsIC("params");
+    auto params = paramsIC.getArr(fun);
+    auto numParams = size_t(params.length());
+
+    // Check that the argument count matches
+    checkArgCount(callInfo.callVer, numParams, callInfo.numArgs);
+
+    // Note: the hidden function/closure parameter is always present
+    if (numLocals < numParams + 1)
+    {
         throw RunError(
-            srcPosStr +
-            "incorrect argument count in call, received " +
-            std::to_string(numArgs) +
-            ", expected " +
-            std::to_string(numParams)
+            "not enough locals to store function parameters"
         );
     }
+
+    entry.fn = (refptr)fun;
+    entry.entryVer = entryVer;
+    entry.numLocals = numLocals;
+    entry.numParams = numParams;
+}
+
+/**
+Inline cache miss path of user function calls. Checks the other
+functions cached by a polymorphic call site, and then the global
+megamorphic cache, before looking up the function. Returns the
+cache entry for the function, or null if the function was cached
+inline.
+*/
+__attribute__((noinline)) CallEntry* userCallMiss(
+    Object fun,
+    CallInfo& callInfo
+)
+{
+    for (size_t i = 0; i + 1 < callInfo.numEntries; ++i)
+    {
+        if (callInfo.more[i].fn == (refptr)fun)
+            return &callInfo.more[i];
+    }
+
+    ++icStats.callMisses;
+
+    auto megaIdx = ((uintptr_t)(refptr)fun >> 4) % (sizeof(megaCallCache) / sizeof(CallEntry));
+    auto& megaEntry = megaCallCache[megaIdx];
+
+    if (callInfo.megamorphic)
+    {
+        ++icStats.callMegaLookups;
+
+        // The call site may pass a different argument count than
+        // the site which filled the entry
+        if (megaEntry.fn == (refptr)fun)
+        {
+            checkArgCount(callInfo.callVer, megaEntry.numParams, callInfo.numArgs);
+            return &megaEntry;
+        }
+
+        ++icStats.callMegaMisses;
+    }
+
+    CallEntry entry;
+    lookupCallee(fun, callInfo, entry);
+
+    if (callInfo.numEntries == 0)
+    {
+        callInfo.lastFn = entry.fn;
+        callInfo.entryVer = entry.entryVer;
+        callInfo.numLocals = entry.numLocals;
+        callInfo.numEntries = 1;
+        return nullptr;
+    }
+
+    if (!callInfo.megamorphic && callInfo.numEntries < CallInfo::NUM_ENTRIES)
+    {
+        if (!callInfo.more)
+        {
+            callInfo.more = new CallEntry[CallInfo::NUM_ENTRIES - 1];
+            ++icStats.callPolySites;
+        }
+
+        auto& newEntry = callInfo.more[callInfo.numEntries - 1];
+        callInfo.numEntries++;
+        newEntry = entry;
+        return &newEntry;
+    }
+
+    if (!callInfo.megamorphic)
+    {
+        callInfo.megamorphic = true;
+        ++icStats.callMegaSites;
+    }
+
+    megaEntry = entry;
+    return &megaEntry;
+}
+
+/// Reset the inline cache of a get_field/set_field instruction
+/// after the field name accessed changed
+__attribute__((noinline)) void resetFieldIC(
+    refptr& cacheName,
+    refptr fieldName,
+    FieldIC& ic
+)
+{
+    // The cached entries are only valid for the previous field name
+    bool megamorphic = ic.megamorphic || cacheName != nullptr;
+    if (megamorphic && !ic.megamorphic)
+        ++icStats.fieldMegaSites;
+
+    cacheName = fieldName;
+    ic.clear();
+    ic.megamorphic = megamorphic;
 }
 
 /**
 Perform a user function call (call to user-implemented Zeta function)
 */
 __attribute__((always_inline)) inline void userCall(
-    uint8_t* callInstr,
     Object fun,
     CallInfo& callInfo
 )
 {
     size_t numArgs = callInfo.numArgs;
 
-    // If the function does not match the inline cache
+    size_t numLocals = callInfo.numLocals;
+    BlockVersion* entryVer = callInfo.entryVer;
+
+    // The first cached function is checked inline
     if (callInfo.lastFn != (refptr)fun)
     {
-        // Get a version for the function entry block
-        static ICache entryIC("entry");
-        auto entryBB = entryIC.getObj(fun);
-        auto entryVer = getBlockVersion(fun, entryBB, 0);
-
-        if (!entryVer->startPtr)
+        if (auto entry = userCallMiss(fun, callInfo))
         {
-            //std::cout << "compiling function entry block" << std::endl;
-            compile(entryVer);
+            numLocals = entry->numLocals;
+            entryVer = entry->entryVer;
         }
-
-        static ICache localsIC("num_locals");
-        auto nlocals = localsIC.getInt32(fun);
-        assert(nlocals >= 0);
-        auto numLocals = size_t(nlocals);
-
-        static ICache paramsIC("params");
-        auto params = paramsIC.getArr(fun);
-        auto numParams = size_t(params.length());
-
-        // Check that the argument count matches
-        checkArgCount(callInstr, numParams, numArgs);
-
-        // Note: the hidden function/closure parameter is always present
-        if (numLocals < numParams + 1)
+        else
         {
-            throw RunError(
-                "not enough locals to store function parameters"
-            );
+            numLocals = callInfo.numLocals;
+            entryVer = callInfo.entryVer;
         }
-
-        // Update the inline cache
-        callInfo.lastFn = (refptr)fun;
-        callInfo.numLocals = numLocals;
-        callInfo.entryVer = entryVer;
     }
 
-    size_t numLocals = callInfo.numLocals;
-    BlockVersion* entryVer = callInfo.entryVer;
     BlockVersion* retVer = callInfo.retVer;
 
+    // Check that the callee locals and the saved frame state fit
+    if (stackPtr - (numLocals - numArgs + 3) <= stackLimit)
+    {
+        callError(callInfo, String("stack overflow"));
+        return;
+    }
+
+    // Compile the entry block, or compile it again if it was evicted
+    if (!entryVer->startPtr)
+        compile(entryVer);
+
     // Compute the stack pointer to restore after the call
     auto prevStackPtr = stackPtr + numArgs;
 
@@ -1357,7 +3955,6 @@ __attribute__((always_inline)) inline void userCall(
     auto prevFramePtr = framePtr;
 
     // Point the frame pointer to the first argument
-    assert (stackPtr > stackLimit);
     framePtr = stackPtr + numArgs - 1;
 
     // Store the function/pointer argument
@@ -1366,6 +3963,11 @@ __attribute__((always_inline)) inline void userCall(
     // Pop the arguments, push the callee locals
     stackPtr -= numLocals - numArgs;
 
+    // Initialize the remaining locals, so that stale values
+    // left on the stack are not seen by the garbage collector
+    for (size_t i = numArgs + 1; i < numLocals; ++i)
+        framePtr[-i] = Value::UNDEF;
+
     pushVal(Value((refptr)prevStackPtr, TAG_RAWPTR));
     pushVal(Value((refptr)prevFramePtr, TAG_RAWPTR));
     pushVal(Value((refptr)retVer, TAG_RAWPTR));
@@ -1374,85 +3976,98 @@ __attribute__((always_inline)) inline void userCall(
     instrPtr = entryVer->startPtr;
 }
 
+/**
+Call a host function with arguments read from the stack
+*/
+__attribute__((always_inline)) inline HostStatus callHostFn(
+    HostFn* hostFn,
+    Value* args,
+    size_t numArgs,
+    Value& retVal
+)
+{
+    if (hostFn->isVariadic())
+        return hostFn->callV(HostArgs(args, numArgs), retVal);
+
+    switch (numArgs)
+    {
+        case 0:
+        retVal = hostFn->call0();
+        break;
+
+        case 1:
+        retVal = hostFn->call1(args[0]);
+        break;
+
+        case 2:
+        retVal = hostFn->call2(args[0], args[-1]);
+        break;
+
+        case 3:
+        retVal = hostFn->call3(args[0], args[-1], args[-2]);
+        break;
+
+        default:
+        assert (false);
+    }
+
+    return HOST_OK;
+}
+
 /**
 Perform a host function call (call to internal Zeta function)
 */
 __attribute__((always_inline)) inline void hostCall(
-    uint8_t* callInstr,
     Value fun,
-    size_t numArgs,
-    BlockVersion* retVer
+    CallInfo& callInfo
 )
 {
     auto hostFn = (HostFn*)fun.getWord().ptr;
+    size_t numArgs = callInfo.numArgs;
+    BlockVersion* retVer = callInfo.retVer;
 
     // Check that the argument count matches
-    checkArgCount(callInstr, hostFn->getNumParams(), numArgs);
+    if (hostFn->isVariadic())
+    {
+        checkArgRange(
+            callInfo.callVer,
+            hostFn->getNumParams(),
+            hostFn->getMaxParams(),
+            numArgs
+        );
+    }
+    else
+    {
+        checkArgCount(callInfo.callVer, hostFn->getNumParams(), numArgs);
+    }
 
     // Pointer to the first argument
     auto args = stackPtr + numArgs - 1;
 
     Value retVal;
+    HostStatus status;
 
-    try
+    // Functions which can't throw are called without an exception handler
+    if (hostFn->noThrow())
     {
-        // Call the host function
-        switch (numArgs)
-        {
-            case 0:
-            retVal = hostFn->call0();
-            break;
-
-            case 1:
-            retVal = hostFn->call1(args[0]);
-            break;
-
-            case 2:
-            retVal = hostFn->call2(args[0], args[-1]);
-            break;
-
-            case 3:
-            retVal = hostFn->call3(args[0], args[-1], args[-2]);
-            break;
-
-            default:
-            assert (false);
-        }
+        status = callHostFn(hostFn, args, numArgs, retVal);
     }
-
-    catch (RunError err)
+    else
     {
-        // Pop the arguments from the stack
-        stackPtr += numArgs;
-
-        // Create an exception object
-        auto excVal = Object::newObject();
-        auto errStr = String(err.toString());
-        excVal.setField("msg", errStr);
-
-        auto retEntry = retAddrMap[retVer];
-
-        // If there is an exception handler (throw_to field)
-        if (retEntry.excVer)
+        try
         {
-            // Clear the temporary stack
-            stackPtr += retEntry.numTmps;
-
-            // Push the exception value on the stack
-            pushVal(excVal);
-
-            // Compile exception handler if needed
-            if (!retEntry.excVer->startPtr)
-                compile(retEntry.excVer);
-
-            instrPtr = retEntry.excVer->startPtr;
+            status = callHostFn(hostFn, args, numArgs, retVal);
         }
-        else
+        catch (RunError& err)
         {
-            // Unwind the interpreter stack
-            throwExc(callInstr, excVal);
+            retVal = String(err.toString());
+            status = HOST_ERROR;
         }
+    }
 
+    if (status != HOST_OK)
+    {
+        callError(callInfo, retVal);
         return;
     }
 
@@ -1471,337 +4086,592 @@ __attribute__((always_inline)) inline void hostCall(
 /// Start/continue execution beginning at a current instruction
 Value execCode()
 {
+#ifdef THREADED_DISPATCH
+    // Instruction handler addresses, in opcode order
+    static void* const handlers[] = {
+        &&op_GET_LOCAL,
+        &&op_SET_LOCAL,
+        &&op_GET_LOCAL2,
+        &&op_PUSH,
+        &&op_POP,
+        &&op_DUP,
+        &&op_SWAP,
+        &&op_ADD_I32,
+        &&op_SUB_I32,
+        &&op_MUL_I32,
+        &&op_DIV_I32,
+        &&op_MOD_I32,
+        &&op_SHL_I32,
+        &&op_SHR_I32,
+        &&op_USHR_I32,
+        &&op_AND_I32,
+        &&op_OR_I32,
+        &&op_XOR_I32,
+        &&op_NOT_I32,
+        &&op_LT_I32,
+        &&op_LE_I32,
+        &&op_GT_I32,
+        &&op_GE_I32,
+        &&op_EQ_I32,
+        &&op_INC_I32,
+        &&op_DEC_I32,
+        &&op_ADD_LOCAL_IMM_I32,
+        &&op_ADD_I32_NC,
+        &&op_SUB_I32_NC,
+        &&op_MUL_I32_NC,
+        &&op_LT_I32_NC,
+        &&op_LE_I32_NC,
+        &&op_GT_I32_NC,
+        &&op_GE_I32_NC,
+        &&op_EQ_I32_NC,
+        &&op_ADD_F32,
+        &&op_SUB_F32,
+        &&op_MUL_F32,
+        &&op_DIV_F32,
+        &&op_LT_F32,
+        &&op_LE_F32,
+        &&op_GT_F32,
+        &&op_GE_F32,
+        &&op_EQ_F32,
+        &&op_SIN_F32,
+        &&op_COS_F32,
+        &&op_SQRT_F32,
+        &&op_LOG_F32,
+        &&op_EXP_F32,
+        &&op_I32_TO_F32,
+        &&op_I32_TO_STR,
+        &&op_F32_TO_I32,
+        &&op_F32_TO_STR,
+        &&op_STR_TO_F32,
+        &&op_EQ_BOOL,
+        &&op_HAS_TAG,
+        &&op_GET_TAG,
+        &&op_LOCAL_HAS_TAG,
+        &&op_STR_LEN,
+        &&op_GET_CHAR,
+        &&op_GET_CHAR_CODE,
+        &&op_CHAR_TO_STR,
+        &&op_STR_CAT,
+        &&op_EQ_STR,
+        &&op_NEW_OBJECT,
+        &&op_HAS_FIELD,
+        &&op_SET_FIELD,
+        &&op_GET_FIELD,
+        &&op_GET_FIELD_IMM,
+        &&op_SET_FIELD_IMM,
+        &&op_GET_FIELD_LIST,
+        &&op_EQ_OBJ,
+        &&op_NEW_ARRAY,
+        &&op_ARRAY_LEN,
+        &&op_ARRAY_PUSH,
+        &&op_ARRAY_POP,
+        &&op_GET_ELEM,
+        &&op_SET_ELEM,
+        &&op_EQ_ARRAY,
+        &&op_JUMP,
+        &&op_JUMP_STUB,
+        &&op_IF_TRUE,
+        &&op_IF_LOCAL_HAS_TAG,
+        &&op_IF_LT_I32,
+        &&op_IF_LE_I32,
+        &&op_IF_GT_I32,
+        &&op_IF_GE_I32,
+        &&op_IF_EQ_I32,
+        &&op_CALL,
+        &&op_RET,
+        &&op_THROW,
+        &&op_RESUME,
+        &&op_YIELD,
+        &&op_COUNT_BLOCK,
+        &&op_JIT_RUN
+    };
+    static_assert (
+        sizeof(handlers) / sizeof(handlers[0]) == NUM_OPCODES,
+        "missing instruction handlers"
+    );
+
+    // The first call only exports the handler addresses
+    if (!opHandlers)
+    {
+        opHandlers = handlers;
+        return Value::UNDEF;
+    }
+#endif
+
     assert (instrPtr >= codeHeap);
     assert (instrPtr < codeHeapLimit);
 
+    // Instruction being executed
+    OpWord* op;
+
+#ifdef THREADED_DISPATCH
+    // Note: the opcode reads are unchecked, so that the dispatch code
+    // is a single basic block, which the compiler can replicate at the
+    // end of each instruction handler
+    #define CASE(opcode) op_##opcode:
+    #define DISPATCH() { \
+        op = (OpWord*)instrPtr; instrPtr += sizeof(OpWord); goto **op; }
+
+    // Fetch the next handler address before executing an instruction
+    // body. This is only valid for instructions of fixed length which
+    // fall through to the next instruction.
+    #define FETCH_NEXT() \
+        auto nextOp = (OpWord*)instrPtr; instrPtr += sizeof(OpWord); \
+        auto nextHandler = *nextOp;
+    #define DISPATCH_NEXT() { op = nextOp; goto *nextHandler; }
+#else
+    #define CASE(opcode) case opcode:
+    #define DISPATCH() break
+    #define FETCH_NEXT()
+    #define DISPATCH_NEXT() break
+#endif
+
     // For each instruction to execute
     for (;;)
     {
-        auto& op = readCode<Opcode>();
+        op = &readCode<OpWord>();
 
         //std::cout << "instr" << std::endl;
-        //std::cout << "op=" << (int)op << std::endl;
+        //std::cout << "op=" << (int)*op << std::endl;
         //std::cout << "  stack space: " << (stackBase - stackPtr) << std::endl;
 
-        switch (op)
+#ifdef THREADED_DISPATCH
+        goto **op;
         {
-            case PUSH:
+#else
+        switch (*op)
+        {
+#endif
+            CASE(PUSH)
             {
                 auto word = readCode<Word>();
                 auto tag = readCode<Tag>();
+                FETCH_NEXT();
                 pushVal(Value(word, tag));
+                DISPATCH_NEXT();
             }
-            break;
 
-            case POP:
+            CASE(POP)
             {
+                FETCH_NEXT();
                 popVal();
+                DISPATCH_NEXT();
             }
-            break;
 
-            case DUP:
+            CASE(DUP)
             {
                 // Read the index of the value to duplicate
                 auto idx = readCode<uint16_t>();
+                FETCH_NEXT();
                 auto val = stackPtr[idx];
                 pushVal(val);
+                DISPATCH_NEXT();
             }
-            break;
 
             // Swap the topmost two stack elements
-            case SWAP:
+            CASE(SWAP)
             {
+                FETCH_NEXT();
                 auto v0 = popVal();
                 auto v1 = popVal();
                 pushVal(v0);
                 pushVal(v1);
+                DISPATCH_NEXT();
             }
-            break;
 
             // Set a local variable
-            case SET_LOCAL:
+            CASE(SET_LOCAL)
             {
                 auto localIdx = readCode<uint16_t>();
+                FETCH_NEXT();
                 //std::cout << "set localIdx=" << localIdx << std::endl;
-                assert (stackPtr > stackLimit);
                 framePtr[-localIdx] = popVal();
+                DISPATCH_NEXT();
             }
-            break;
 
-            case GET_LOCAL:
+            CASE(GET_LOCAL)
             {
                 // Read the index of the value to push
                 auto localIdx = readCode<uint16_t>();
+                FETCH_NEXT();
                 //std::cout << "get localIdx=" << localIdx << std::endl;
-                assert (stackPtr > stackLimit);
                 auto val = framePtr[-localIdx];
                 pushVal(val);
+                DISPATCH_NEXT();
             }
-            break;
 
-            case LOCAL_HAS_TAG:
+            CASE(GET_LOCAL2)
+            {
+                auto localIdx0 = readCode<uint16_t>();
+                auto localIdx1 = readCode<uint16_t>();
+                FETCH_NEXT();
+                pushVal(framePtr[-localIdx0]);
+                pushVal(framePtr[-localIdx1]);
+                DISPATCH_NEXT();
+            }
+
+            CASE(LOCAL_HAS_TAG)
             {
                 // Read the index of the local value
                 auto localIdx = readCode<uint16_t>();
                 auto testTag = readCode<Tag>();
+                FETCH_NEXT();
 
-                assert (stackPtr > stackLimit);
                 auto val = framePtr[-localIdx];
 
                 auto valTag = val.getTag();
                 pushBool(valTag == testTag);
+                DISPATCH_NEXT();
             }
-            break;
 
             //
             // Integer operations
             //
-            case INC_I32:
+            CASE(INC_I32)
             {
+                FETCH_NEXT();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 + 1));
+                DISPATCH_NEXT();
             }
-            break;
-            case DEC_I32:
+            CASE(DEC_I32)
             {
+                FETCH_NEXT();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 - 1));
+                DISPATCH_NEXT();
             }
-            break;
 
-            case ADD_I32:
+            // Add a constant to a local, without going through the stack
+            CASE(ADD_LOCAL_IMM_I32)
             {
+                auto srcIdx = readCode<uint16_t>();
+                auto imm = readCode<int32_t>();
+                auto dstIdx = readCode<uint16_t>();
+                FETCH_NEXT();
+                auto arg0 = framePtr[-srcIdx];
+                assert (arg0.isInt32());
+                framePtr[-dstIdx] = Value::int32((int32_t)arg0 + imm);
+                DISPATCH_NEXT();
+            }
+
+            CASE(ADD_I32)
+            {
+                FETCH_NEXT();
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 + arg1));
+                DISPATCH_NEXT();
             }
-            break;
 
-            case SUB_I32:
+            CASE(SUB_I32)
             {
+                FETCH_NEXT();
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 - arg1));
+                DISPATCH_NEXT();
             }
-            break;
 
-            case MUL_I32:
+            CASE(MUL_I32)
             {
+                FETCH_NEXT();
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 * arg1));
+                DISPATCH_NEXT();
             }
-            break;
 
-            case DIV_I32:
+            CASE(DIV_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 / arg1));
             }
-            break;
+            DISPATCH();
 
-            case MOD_I32:
+            CASE(MOD_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 % arg1));
             }
-            break;
+            DISPATCH();
 
-            case SHL_I32:
+            CASE(SHL_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 << arg1));
             }
-            break;
+            DISPATCH();
 
-            case SHR_I32:
+            CASE(SHR_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 >> arg1));
             }
-            break;
+            DISPATCH();
 
-            case USHR_I32:
+            CASE(USHR_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = (uint32_t)popInt32();
                 pushVal(Value::int32((int32_t)(arg0 >> arg1)));
             }
-            break;
+            DISPATCH();
 
-            case AND_I32:
+            CASE(AND_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 & arg1));
             }
-            break;
+            DISPATCH();
 
-            case OR_I32:
+            CASE(OR_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 | arg1));
             }
-            break;
+            DISPATCH();
 
-            case XOR_I32:
+            CASE(XOR_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 ^ arg1));
             }
-            break;
+            DISPATCH();
 
-            case NOT_I32:
+            CASE(NOT_I32)
             {
                 auto arg0 = popInt32();
                 pushVal(Value::int32(~arg0));
             }
-            break;
+            DISPATCH();
 
-            case LT_I32:
+            CASE(LT_I32)
             {
+                FETCH_NEXT();
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 < arg1);
+                DISPATCH_NEXT();
             }
-            break;
 
-            case LE_I32:
+            CASE(LE_I32)
             {
+                FETCH_NEXT();
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 <= arg1);
+                DISPATCH_NEXT();
             }
-            break;
 
-            case GT_I32:
+            CASE(GT_I32)
             {
+                FETCH_NEXT();
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 > arg1);
+                DISPATCH_NEXT();
             }
-            break;
 
-            case GE_I32:
+            CASE(GE_I32)
             {
+                FETCH_NEXT();
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 >= arg1);
+                DISPATCH_NEXT();
             }
-            break;
 
-            case EQ_I32:
+            CASE(EQ_I32)
             {
+                FETCH_NEXT();
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 == arg1);
+                DISPATCH_NEXT();
+            }
+
+            //
+            // Integer operations with operand tags known
+            //
+
+            CASE(ADD_I32_NC)
+            {
+                FETCH_NEXT();
+                auto arg1 = popVal().getWord().int32;
+                auto arg0 = popVal().getWord().int32;
+                pushVal(Value::int32(arg0 + arg1));
+                DISPATCH_NEXT();
+            }
+
+            CASE(SUB_I32_NC)
+            {
+                FETCH_NEXT();
+                auto arg1 = popVal().getWord().int32;
+                auto arg0 = popVal().getWord().int32;
+                pushVal(Value::int32(arg0 - arg1));
+                DISPATCH_NEXT();
+            }
+
+            CASE(MUL_I32_NC)
+            {
+                FETCH_NEXT();
+                auto arg1 = popVal().getWord().int32;
+                auto arg0 = popVal().getWord().int32;
+                pushVal(Value::int32(arg0 * arg1));
+                DISPATCH_NEXT();
+            }
+
+            CASE(LT_I32_NC)
+            {
+                FETCH_NEXT();
+                auto arg1 = popVal().getWord().int32;
+                auto arg0 = popVal().getWord().int32;
+                pushBool(arg0 < arg1);
+                DISPATCH_NEXT();
+            }
+
+            CASE(LE_I32_NC)
+            {
+                FETCH_NEXT();
+                auto arg1 = popVal().getWord().int32;
+                auto arg0 = popVal().getWord().int32;
+                pushBool(arg0 <= arg1);
+                DISPATCH_NEXT();
+            }
+
+            CASE(GT_I32_NC)
+            {
+                FETCH_NEXT();
+                auto arg1 = popVal().getWord().int32;
+                auto arg0 = popVal().getWord().int32;
+                pushBool(arg0 > arg1);
+                DISPATCH_NEXT();
+            }
+
+            CASE(GE_I32_NC)
+            {
+                FETCH_NEXT();
+                auto arg1 = popVal().getWord().int32;
+                auto arg0 = popVal().getWord().int32;
+                pushBool(arg0 >= arg1);
+                DISPATCH_NEXT();
+            }
+
+            CASE(EQ_I32_NC)
+            {
+                FETCH_NEXT();
+                auto arg1 = popVal().getWord().int32;
+                auto arg0 = popVal().getWord().int32;
+                pushBool(arg0 == arg1);
+                DISPATCH_NEXT();
             }
-            break;
 
             //
             // Floating-point operations
             //
 
-            case ADD_F32:
+            CASE(ADD_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 + arg1));
             }
-            break;
+            DISPATCH();
 
-            case SUB_F32:
+            CASE(SUB_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 - arg1));
             }
-            break;
+            DISPATCH();
 
-            case MUL_F32:
+            CASE(MUL_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 * arg1));
             }
-            break;
+            DISPATCH();
 
-            case DIV_F32:
+            CASE(DIV_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 / arg1));
             }
-            break;
+            DISPATCH();
 
-            case LT_F32:
+            CASE(LT_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 < arg1);
             }
-            break;
+            DISPATCH();
 
-            case LE_F32:
+            CASE(LE_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 <= arg1);
             }
-            break;
+            DISPATCH();
 
-            case GT_F32:
+            CASE(GT_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 > arg1);
             }
-            break;
+            DISPATCH();
 
-            case GE_F32:
+            CASE(GE_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 >= arg1);
             }
-            break;
+            DISPATCH();
 
-            case EQ_F32:
+            CASE(EQ_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 == arg1);
             }
-            break;
+            DISPATCH();
 
-            case SIN_F32:
+            CASE(SIN_F32)
             {
                 float arg = popFloat32();
                 pushVal(Value::float32(sin(arg)));
             }
-            break;
+            DISPATCH();
 
-            case COS_F32:
+            CASE(COS_F32)
             {
                 float arg = popFloat32();
                 pushVal(Value::float32(cos(arg)));
             }
-            break;
+            DISPATCH();
 
-            case SQRT_F32:
+            CASE(SQRT_F32)
             {
                 float arg = popFloat32();
                 pushVal(Value::float32(sqrt(arg)));
             }
-            break;
+            DISPATCH();
 
-            case LOG_F32:
+            CASE(LOG_F32)
             {
                 float arg = popFloat32();
 
@@ -1810,51 +4680,51 @@ Value execCode()
 
                 pushVal(Value::float32(log(arg)));
             }
-            break;
+            DISPATCH();
 
-            case EXP_F32:
+            CASE(EXP_F32)
             {
                 float arg = popFloat32();
                 auto r = exp(arg);
                 pushVal(Value::float32(r));
             }
-            break;
+            DISPATCH();
 
             //
             // Conversion operations
             //
 
-            case I32_TO_F32:
+            CASE(I32_TO_F32)
             {
                 auto arg0 = popInt32();
                 pushVal(Value::float32(arg0));
             }
-            break;
+            DISPATCH();
 
-            case I32_TO_STR:
+            CASE(I32_TO_STR)
             {
                 auto arg0 = popInt32();
                 String str = std::to_string(arg0);
                 pushVal(str);
             }
-            break;
+            DISPATCH();
 
-            case F32_TO_I32:
+            CASE(F32_TO_I32)
             {
                 auto arg0 = popFloat32();
                 pushVal(Value::int32(arg0));
             }
-            break;
+            DISPATCH();
 
-            case F32_TO_STR:
+            CASE(F32_TO_STR)
             {
                 auto arg0 = popFloat32();
                 String str = std::to_string(arg0);
                 pushVal(str);
             }
-            break;
+            DISPATCH();
 
-            case STR_TO_F32:
+            CASE(STR_TO_F32)
             {
                 auto arg0 = popStr();
 
@@ -1872,51 +4742,53 @@ Value execCode()
 
                 pushVal(Value::float32(val));
             }
-            break;
+            DISPATCH();
 
             //
             // Misc operations
             //
 
-            case EQ_BOOL:
+            CASE(EQ_BOOL)
             {
                 auto arg1 = popBool();
                 auto arg0 = popBool();
                 pushBool(arg0 == arg1);
             }
-            break;
+            DISPATCH();
 
             // Test if a value has a given tag
-            case HAS_TAG:
+            CASE(HAS_TAG)
             {
                 auto testTag = readCode<Tag>();
                 auto valTag = popVal().getTag();
                 pushBool(valTag == testTag);
             }
-            break;
+            DISPATCH();
 
             // Get the type tag associated with a value.
             // Note: this produces a string
-            case GET_TAG:
+            CASE(GET_TAG)
             {
                 auto valTag = popVal().getTag();
                 auto tagStr = tagToStr(valTag);
                 pushVal(String(tagStr));
             }
-            break;
+            DISPATCH();
 
             //
             // String operations
             //
 
-            case STR_LEN:
+            CASE(STR_LEN)
             {
-                auto str = popStr();
-                pushVal(Value::int32(str.length()));
+                // Note: the length of ropes is known without flattening them
+                auto str = popVal();
+                assert (str.isString());
+                pushVal(Value::int32(String::length(str)));
             }
-            break;
+            DISPATCH();
 
-            case GET_CHAR:
+            CASE(GET_CHAR)
             {
                 auto idx = (size_t)popInt32();
                 auto str = popStr();
@@ -1938,9 +4810,9 @@ Value execCode()
 
                 pushVal(charStrings[ch]);
             }
-            break;
+            DISPATCH();
 
-            case GET_CHAR_CODE:
+            CASE(GET_CHAR_CODE)
             {
                 auto idx = (size_t)popInt32();
                 auto str = popStr();
@@ -1955,77 +4827,92 @@ Value execCode()
                 unsigned char ch = (unsigned char)str[idx];
                 pushVal(Value::int32(ch));
             }
-            break;
+            DISPATCH();
 
-            case CHAR_TO_STR:
+            CASE(CHAR_TO_STR)
             {
                 auto charCode = (char)popInt32();
                 char buf[2] = { (char)charCode, '\0' };
                 pushVal(String(buf));
             }
-            break;
+            DISPATCH();
 
-            case STR_CAT:
+            CASE(STR_CAT)
             {
-                auto a = popStr();
-                auto b = popStr();
-                auto c = String::concat(b, a);
-                pushVal(c);
+                // Note: the operands are not flattened
+                auto a = popVal();
+                auto b = popVal();
+                assert (a.isString() && b.isString());
+                pushVal(String::concat(b, a));
             }
-            break;
+            DISPATCH();
 
-            case EQ_STR:
+            CASE(EQ_STR)
             {
                 auto arg1 = popStr();
                 auto arg0 = popStr();
                 pushBool(arg0 == arg1);
             }
-            break;
+            DISPATCH();
 
             //
             // Object operations
             //
 
-            case NEW_OBJECT:
+            CASE(NEW_OBJECT)
             {
                 auto capacity = popInt32();
                 auto obj = Object::newObject(capacity);
                 pushVal(obj);
             }
-            break;
+            DISPATCH();
 
-            case HAS_FIELD:
+            CASE(HAS_FIELD)
             {
                 auto fieldName = popStr();
                 auto obj = popObj();
                 pushBool(obj.hasField(fieldName));
             }
-            break;
+            DISPATCH();
 
-            case SET_FIELD:
+            CASE(SET_FIELD)
             {
                 auto val = popVal();
-                auto fieldName = popStr();
+                auto fieldName = popStr().intern();
                 auto obj = popObj();
-                obj.setField(fieldName, val);
+
+                // The inline cache is only valid for the cached field name.
+                // Sites accessing more than one field name only use the
+                // megamorphic cache, which is keyed by field name.
+                auto& cacheName = readCode<refptr>();
+                auto& ic = readCode<FieldIC>();
+                if ((refptr)fieldName != cacheName)
+                    resetFieldIC(cacheName, (refptr)fieldName, ic);
+
+                obj.setField(fieldName, val, ic);
             }
-            break;
+            DISPATCH();
 
             // This instruction will abort execution if trying to
             // access a field that is not present on an object.
             // The running program is responsible for testing that
             // fields exist before attempting to read them.
-            case GET_FIELD:
+            CASE(GET_FIELD)
             {
-                auto fieldName = popStr();
+                auto fieldName = popStr().intern();
                 auto obj = popObj();
 
-                // Get the cached slot index
-                auto& slotIdx = readCode<size_t>();
+                // The inline cache is only valid for the cached field name.
+                // Sites accessing more than one field name only use the
+                // megamorphic cache, which is keyed by field name.
+                auto& cacheName = readCode<refptr>();
+                auto& ic = readCode<FieldIC>();
+                if ((refptr)fieldName != cacheName)
+                    resetFieldIC(cacheName, (refptr)fieldName, ic);
 
                 Value val;
 
-                if (!obj.getField(fieldName, val, slotIdx))
+                if (!obj.getField(fieldName, val, ic))
                 {
                     throw RunError(
                         "get_field failed, missing field \"" +
@@ -2035,21 +4922,20 @@ Value execCode()
 
                 pushVal(val);
             }
-            break;
+            DISPATCH();
 
-            case GET_FIELD_IMM:
+            CASE(GET_FIELD_IMM)
             {
                 refptr nameStrPtr = readCode<refptr>();
                 String fieldName = Value(nameStrPtr, TAG_STRING);
 
                 auto obj = popObj();
 
-                // Get the cached slot index
-                auto& slotIdx = readCode<size_t>();
+                auto& ic = readCode<FieldIC>();
 
                 Value val;
 
-                if (!obj.getField(fieldName, val, slotIdx))
+                if (!obj.getField(fieldName, val, ic))
                 {
                     throw RunError(
                         "get_field failed, missing field \"" +
@@ -2059,9 +4945,23 @@ Value execCode()
 
                 pushVal(val);
             }
-            break;
+            DISPATCH();
+
+            CASE(SET_FIELD_IMM)
+            {
+                refptr nameStrPtr = readCode<refptr>();
+                String fieldName = Value(nameStrPtr, TAG_STRING);
+
+                auto val = popVal();
+                auto obj = popObj();
 
-            case GET_FIELD_LIST:
+                auto& ic = readCode<FieldIC>();
+
+                obj.setField(fieldName, val, ic);
+            }
+            DISPATCH();
+
+            CASE(GET_FIELD_LIST)
             {
                 Value arg0 = popVal();
                 Array array = Array(0);
@@ -2072,21 +4972,21 @@ Value execCode()
                 }
                 pushVal(array);
             }
-            break;
+            DISPATCH();
 
-            case EQ_OBJ:
+            CASE(EQ_OBJ)
             {
                 Value arg1 = popVal();
                 Value arg0 = popVal();
                 pushBool(arg0 == arg1);
             }
-            break;
+            DISPATCH();
 
             //
             // Array operations
             //
 
-            case NEW_ARRAY:
+            CASE(NEW_ARRAY)
             {
                 // Note: capacity refers to preallocated slots,
                 // the new array will have length 0
@@ -2094,36 +4994,58 @@ Value execCode()
                 auto array = Array(capacity);
                 pushVal(array);
             }
-            break;
+            DISPATCH();
 
-            case ARRAY_LEN:
+            CASE(ARRAY_LEN)
             {
-                auto arr = Array(popVal());
-                pushVal(Value::int32(arr.length()));
+                auto arrVal = popVal();
+
+                if (arrVal.isBuffer())
+                    pushVal(Value::int32(Buffer(arrVal).length()));
+                else
+                    pushVal(Value::int32(Array(arrVal).length()));
             }
-            break;
+            DISPATCH();
 
-            case ARRAY_PUSH:
+            CASE(ARRAY_PUSH)
             {
                 auto val = popVal();
                 auto arr = Array(popVal());
                 arr.push(val);
             }
-            break;
+            DISPATCH();
 
-            case ARRAY_POP:
+            CASE(ARRAY_POP)
             {
                 auto arr = Array(popVal());
                 auto val = arr.pop();
                 pushVal(val);
             }
-            break;
+            DISPATCH();
 
-            case SET_ELEM:
+            CASE(SET_ELEM)
             {
                 auto val = popVal();
                 auto idx = (size_t)popInt32();
-                auto arr = Array(popVal());
+                auto arrVal = popVal();
+
+                // Typed buffers convert the value into their element type
+                if (arrVal.isBuffer())
+                {
+                    auto buf = Buffer(arrVal);
+
+                    if (idx >= buf.length())
+                    {
+                        throw RunError(
+                            "set_elem, index out of bounds"
+                        );
+                    }
+
+                    buf.setElem(idx, val);
+                    DISPATCH();
+                }
+
+                auto arr = Array(arrVal);
 
                 if (idx >= arr.length())
                 {
@@ -2134,12 +5056,29 @@ Value execCode()
 
                 arr.setElem(idx, val);
             }
-            break;
+            DISPATCH();
 
-            case GET_ELEM:
+            CASE(GET_ELEM)
             {
                 auto idx = (size_t)popInt32();
-                auto arr = Array(popVal());
+                auto arrVal = popVal();
+
+                if (arrVal.isBuffer())
+                {
+                    auto buf = Buffer(arrVal);
+
+                    if (idx >= buf.length())
+                    {
+                        throw RunError(
+                            "get_elem, index out of bounds"
+                        );
+                    }
+
+                    pushVal(buf.getElem(idx));
+                    DISPATCH();
+                }
+
+                auto arr = Array(arrVal);
 
                 if (idx >= arr.length())
                 {
@@ -2150,21 +5089,21 @@ Value execCode()
 
                 pushVal(arr.getElem(idx));
             }
-            break;
+            DISPATCH();
 
-            case EQ_ARRAY:
+            CASE(EQ_ARRAY)
             {
                 Value arg1 = popVal();
                 Value arg0 = popVal();
                 pushBool(arg0 == arg1);
             }
-            break;
+            DISPATCH();
 
             //
             // Branch instructions
             //
 
-            case JUMP_STUB:
+            CASE(JUMP_STUB)
             {
                 auto& dstAddr = readCode<uint8_t*>();
 
@@ -2180,75 +5119,159 @@ Value execCode()
                     {
                         // The jump is redundant, so we will write the
                         // next block over this jump instruction
-                        instrPtr = codeHeapAlloc = (uint8_t*)&op;
+                        instrPtr = codeHeapAlloc = (uint8_t*)op;
+
+                        // The jump was the last opcode compiled
+                        if (countBlocks())
+                            blockStats.back()->ops.pop_back();
                     }
 
                     compile(dstVer);
                 }
+
+                if (dstVer->startPtr == (uint8_t*)op)
+                {
+                    // The block was written over the jump
+                    dstVer->fallThrough = true;
+                }
                 else
                 {
                     // Patch the jump
-                    op = JUMP;
+                    *op = encodeOp(JUMP);
                     dstAddr = dstVer->startPtr;
-
-                    // Jump to the target
-                    instrPtr = dstVer->startPtr;
+                    addPatchedSlot(dstVer, (uint8_t**)&dstAddr, true);
                 }
+
+                // Jump to the target
+                instrPtr = dstVer->startPtr;
             }
-            break;
+            DISPATCH();
 
-            case JUMP:
+            CASE(JUMP)
             {
                 auto& dstAddr = readCode<uint8_t*>();
                 instrPtr = dstAddr;
+                gcSafePoint();
             }
-            break;
+            DISPATCH();
 
-            case IF_TRUE:
+            CASE(IF_TRUE)
             {
+                gcSafePoint();
+
                 auto& thenAddr = readCode<uint8_t*>();
                 auto& elseAddr = readCode<uint8_t*>();
 
                 auto arg0 = popVal();
 
-                if (arg0 == Value::TRUE)
-                {
-                    if (thenAddr < codeHeap || thenAddr >= codeHeapLimit)
-                    {
-                        //std::cout << "Patching then target" << std::endl;
+                instrPtr = branchTarget(
+                    (arg0 == Value::TRUE)? thenAddr:elseAddr
+                );
+            }
+            DISPATCH();
 
-                        auto thenVer = (BlockVersion*)thenAddr;
-                        if (!thenVer->startPtr)
-                           compile(thenVer);
+            CASE(IF_LOCAL_HAS_TAG)
+            {
+                gcSafePoint();
 
-                        // Patch the jump
-                        thenAddr = thenVer->startPtr;
-                    }
+                auto localIdx = readCode<uint16_t>();
+                auto testTag = readCode<Tag>();
+                auto& thenAddr = readCode<uint8_t*>();
+                auto& elseAddr = readCode<uint8_t*>();
 
-                    instrPtr = thenAddr;
-                }
-                else
-                {
-                    if (elseAddr < codeHeap || elseAddr >= codeHeapLimit)
-                    {
-                       //std::cout << "Patching else target" << std::endl;
+                auto valTag = framePtr[-localIdx].getTag();
+
+                instrPtr = branchTarget(
+                    (valTag == testTag)? thenAddr:elseAddr
+                );
+            }
+            DISPATCH();
 
-                       auto elseVer = (BlockVersion*)elseAddr;
-                       if (!elseVer->startPtr)
-                           compile(elseVer);
+            CASE(IF_LT_I32)
+            {
+                gcSafePoint();
 
-                       // Patch the jump
-                       elseAddr = elseVer->startPtr;
-                    }
+                auto& thenAddr = readCode<uint8_t*>();
+                auto& elseAddr = readCode<uint8_t*>();
 
-                    instrPtr = elseAddr;
-                }
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+
+                instrPtr = branchTarget(
+                    (arg0 < arg1)? thenAddr:elseAddr
+                );
             }
-            break;
+            DISPATCH();
+
+            CASE(IF_LE_I32)
+            {
+                gcSafePoint();
+
+                auto& thenAddr = readCode<uint8_t*>();
+                auto& elseAddr = readCode<uint8_t*>();
+
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+
+                instrPtr = branchTarget(
+                    (arg0 <= arg1)? thenAddr:elseAddr
+                );
+            }
+            DISPATCH();
+
+            CASE(IF_GT_I32)
+            {
+                gcSafePoint();
+
+                auto& thenAddr = readCode<uint8_t*>();
+                auto& elseAddr = readCode<uint8_t*>();
+
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+
+                instrPtr = branchTarget(
+                    (arg0 > arg1)? thenAddr:elseAddr
+                );
+            }
+            DISPATCH();
+
+            CASE(IF_GE_I32)
+            {
+                gcSafePoint();
+
+                auto& thenAddr = readCode<uint8_t*>();
+                auto& elseAddr = readCode<uint8_t*>();
+
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+
+                instrPtr = branchTarget(
+                    (arg0 >= arg1)? thenAddr:elseAddr
+                );
+            }
+            DISPATCH();
+
+            CASE(IF_EQ_I32)
+            {
+                gcSafePoint();
+
+                auto& thenAddr = readCode<uint8_t*>();
+                auto& elseAddr = readCode<uint8_t*>();
+
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+
+                instrPtr = branchTarget(
+                    (arg0 == arg1)? thenAddr:elseAddr
+                );
+            }
+            DISPATCH();
 
             // Regular function call
-            case CALL:
+            CASE(CALL)
             {
+                gcSafePoint();
+
                 auto& callInfo = readCode<CallInfo>();
 
                 auto callee = popVal();
@@ -2263,7 +5286,6 @@ Value execCode()
                 if (callee.isObject())
                 {
                     userCall(
-                        (uint8_t*)&op,
                         callee,
                         callInfo
                     );
@@ -2271,10 +5293,8 @@ Value execCode()
                 else if (callee.isHostFn())
                 {
                     hostCall(
-                        (uint8_t*)&op,
                         callee,
-                        callInfo.numArgs,
-                        callInfo.retVer
+                        callInfo
                     );
                 }
                 else
@@ -2282,9 +5302,9 @@ Value execCode()
                   throw RunError("invalid callee at call site");
                 }
             }
-            break;
+            DISPATCH();
 
-            case RET:
+            CASE(RET)
             {
                 // TODO: figure out callee identity from version,
                 // caller identity from return address
@@ -2295,6 +5315,8 @@ Value execCode()
                 // The thing is... The caller can't pop our locals,
                 // because the call continuation doesn't know
 
+                gcSafePoint();
+
                 // Pop the return value
                 auto retVal = popVal();
 
@@ -2313,6 +5335,10 @@ Value execCode()
                 // Restore the stack pointer
                 stackPtr = (Value*)prevStackPtr;
 
+                // Coroutines return to their resumer
+                if (retVer == nullptr && coroutineFinished())
+                    retVer = finishCoroutine(curCo);
+
                 // If this is a top-level return
                 if (retVer == nullptr)
                 {
@@ -2329,23 +5355,107 @@ Value execCode()
                     instrPtr = retVer->startPtr;
                 }
             }
-            break;
+            DISPATCH();
 
             // Throw an exception
-            case THROW:
+            CASE(THROW)
             {
                 // Pop the exception value
+                auto throwVer = readCode<BlockVersion*>();
                 auto excVal = popVal();
-                throwExc((uint8_t*)&op, excVal);
+                throwExc(throwVer, excVal);
+            }
+            DISPATCH();
+
+            // Switch to a coroutine, until it yields or returns
+            CASE(RESUME)
+            {
+                gcSafePoint();
+
+                auto retVer = readCode<BlockVersion*>();
+                auto val = popVal();
+                auto coVal = popVal();
+
+                std::string errMsg;
+                if (auto co = getResumable(coVal, errMsg))
+                    enterCoroutine(co, val, retVer);
+                else
+                    raiseError(retVer, String(errMsg));
+            }
+            DISPATCH();
+
+            // Suspend the running coroutine, and switch back to its resumer
+            CASE(YIELD)
+            {
+                gcSafePoint();
+
+                auto retVer = readCode<BlockVersion*>();
+                auto val = popVal();
+                auto co = curCo;
+
+                if (!co)
+                {
+                    raiseError(retVer, String("yield outside of a coroutine"));
+                }
+                else if (savedInstrPtrs.size() != co->hostDepth)
+                {
+                    raiseError(
+                        retVer,
+                        String("cannot yield across a host function call")
+                    );
+                }
+                else
+                {
+                    co->stackPtr = stackPtr;
+                    co->framePtr = framePtr;
+                    co->resumeVer = retVer;
+                    co->status = CO_SUSPENDED;
+
+                    // If resumed from host code, return to it
+                    auto callerVer = leaveCoroutine(co);
+                    if (!callerVer)
+                        return val;
+
+                    continueAt(callerVer, val);
+                }
+            }
+            DISPATCH();
+
+            // Increment the execution count of a block version
+            CASE(COUNT_BLOCK)
+            {
+                auto stats = readCode<BlockStats*>();
+                FETCH_NEXT();
+                stats->count++;
+                curBlockStats = stats;
+                DISPATCH_NEXT();
             }
-            break;
 
+            // Execute a run of instructions compiled to native code
+            CASE(JIT_RUN)
+            {
+#ifdef JIT_BACKEND
+                auto fn = readCode<NativeFn>();
+                gcSafePoint();
+                instrPtr = fn(framePtr, &stackPtr);
+#else
+                assert (false && "native code backend not enabled");
+#endif
+            }
+            DISPATCH();
+
+#ifndef THREADED_DISPATCH
             default:
             assert (false && "unhandled instruction in interpreter loop");
+#endif
         }
-
     }
 
+    #undef CASE
+    #undef DISPATCH
+    #undef FETCH_NEXT
+    #undef DISPATCH_NEXT
+
     assert (false);
 }
 
@@ -2375,6 +5485,9 @@ Value callFun(Object fun, ValueVec args)
         );
     }
 
+    if (stackPtr - (numLocals + 3) <= stackLimit)
+        throw RunError("stack overflow");
+
     // Store the stack size before the call
     auto preCallSz = stackSize();
 
@@ -2390,7 +5503,9 @@ Value callFun(Object fun, ValueVec args)
 
     // Push space for the local variables
     stackPtr -= numLocals;
-    assert (stackPtr >= stackLimit);
+
+    for (size_t i = 0; i < numLocals; ++i)
+        framePtr[-i] = Value::UNDEF;
 
     // Push the previous stack pointer, previous
     // frame pointer and return address
@@ -2409,17 +5524,34 @@ Value callFun(Object fun, ValueVec args)
     framePtr[-numParams] = fun;
 
     // Get the function entry block
-    static ICache entryIC("entry");
+    static thread_local ICache entryIC("entry");
     auto entryBlock = entryIC.getObj(fun);
-    auto entryVer = getBlockVersion(fun, entryBlock, 0);
+    auto entryVer = getBlockVersion(fun, entryBlock, CodeGenCtx());
 
     // Generate code for the entry block version
-    compile(entryVer);
+    if (!entryVer->startPtr)
+        compile(entryVer);
     assert (entryVer->length() > 0);
 
+    // Keep the code of a calling interpreter loop from being evicted
+    savedInstrPtrs.push_back(prevInstrPtr);
+
     // Begin execution at the entry block
     instrPtr = entryVer->startPtr;
-    auto retVal = execCode();
+    auto prevCo = curCo;
+    Value retVal;
+    try
+    {
+        retVal = execCode();
+    }
+    catch (...)
+    {
+        unwindCoroutines(prevCo);
+        savedInstrPtrs.pop_back();
+        throw;
+    }
+
+    savedInstrPtrs.pop_back();
 
     // Restore the previous instruction pointer
     instrPtr = prevInstrPtr;
@@ -2433,6 +5565,39 @@ Value callFun(Object fun, ValueVec args)
     return retVal;
 }
 
+Value resumeCoroutine(Value co, Value val)
+{
+    std::string errMsg;
+    auto coroutine = getResumable(co, errMsg);
+    if (!coroutine)
+        throw RunError(errMsg);
+
+    auto prevInstrPtr = instrPtr;
+    auto prevCo = curCo;
+
+    // Keep the code of a calling interpreter loop from being evicted
+    savedInstrPtrs.push_back(prevInstrPtr);
+
+    Value retVal;
+    try
+    {
+        enterCoroutine(coroutine, val, nullptr);
+        retVal = execCode();
+    }
+    catch (...)
+    {
+        unwindCoroutines(prevCo);
+        savedInstrPtrs.pop_back();
+        instrPtr = prevInstrPtr;
+        throw;
+    }
+
+    savedInstrPtrs.pop_back();
+    instrPtr = prevInstrPtr;
+
+    return retVal;
+}
+
 /// Call a function exported by a package
 Value callExportFn(
     Object pkg,
@@ -2461,15 +5626,360 @@ Value callExportFn(
     return callFun(funObj, args);
 }
 
+/// Print the most frequently executed opcode pairs.
+/// Only pairs within a block version are counted, since these are
+/// the candidates for fusion into superinstructions.
+void printOpPairStats(size_t maxPairs)
+{
+    std::vector<uint64_t> pairCounts(NUM_OPCODES * NUM_OPCODES, 0);
+    uint64_t totalOps = 0;
+    uint64_t totalPairs = 0;
+
+    for (auto stats : blockStats)
+    {
+        auto& ops = stats->ops;
+        totalOps += stats->count * ops.size();
+
+        for (size_t i = 1; i < ops.size(); ++i)
+        {
+            pairCounts[ops[i-1] * NUM_OPCODES + ops[i]] += stats->count;
+            totalPairs += stats->count;
+        }
+    }
+
+    std::vector<size_t> pairIdxs;
+    for (size_t i = 0; i < pairCounts.size(); ++i)
+        if (pairCounts[i] > 0)
+            pairIdxs.push_back(i);
+
+    std::sort(
+        pairIdxs.begin(),
+        pairIdxs.end(),
+        [&pairCounts](size_t a, size_t b)
+        {
+            return pairCounts[a] > pairCounts[b];
+        }
+    );
+
+    std::cerr << "opcodes executed: " << totalOps << std::endl;
+    std::cerr << "opcode pairs executed: " << totalPairs << std::endl;
+
+    for (size_t i = 0; i < pairIdxs.size() && i < maxPairs; ++i)
+    {
+        auto idx = pairIdxs[i];
+        auto count = pairCounts[idx];
+        char line[128];
+        snprintf(
+            line,
+            sizeof(line),
+            "%12llu %5.1f%%  %s, %s",
+            (unsigned long long)count,
+            100.0 * count / totalPairs,
+            opNames[idx / NUM_OPCODES],
+            opNames[idx % NUM_OPCODES]
+        );
+        std::cerr << line << std::endl;
+    }
+}
+
+/// Interval of the profiling timer, in microseconds
+const int SAMPLE_INTERVAL_US = 1000;
+
+/// Maximum number of frames recorded per sample
+const size_t MAX_SAMPLE_DEPTH = 64;
+
+/// Number of samples per folded call stack, with frames separated
+/// by semicolons from the outermost call to the sampled function
+thread_local std::unordered_map<std::string, uint64_t> stackSamples;
+
+/// Total number of samples taken
+thread_local uint64_t numSamples = 0;
+
+/// Get the name of a function, for profiles
+std::string funName(Object fun)
+{
+    if (fun.hasField("name"))
+    {
+        auto name = fun.getField("name");
+        if (name.isString())
+            return (std::string)name;
+    }
+
+    return "<anonymous>";
+}
+
+/// Describe a function and source line, as a profile frame
+std::string frameName(Object fun, Value srcPos)
+{
+    auto name = funName(fun);
+
+    if (!srcPos.isObject())
+        return name;
+
+    auto srcPosObj = Object(srcPos);
+    auto lineNo = srcPosObj.getField("line_no");
+    auto srcName = srcPosObj.getField("src_name");
+
+    if (!lineNo.isInt32() || !srcName.isString())
+        return name;
+
+    return (
+        name + " (" + (std::string)srcName + "@" +
+        std::to_string((int32_t)lineNo) + ")"
+    );
+}
+
+/**
+Record the call stack at a safe point, attributing the sample to the
+block version last entered and to the call sites of its callers
+Note: frames above the outermost call of the current interpreter
+loop (made by host functions) are not visible
+*/
+__attribute__((noinline)) void takeSample()
+{
+    sampleDue = 0;
+
+    if (!curBlockStats)
+        return;
+
+    auto version = curBlockStats->version;
+    auto fun = version->fun;
+
+    // Frames, from the sampled function to the outermost call
+    std::vector<std::string> frames;
+    frames.push_back(frameName(fun, getSrcPos(version)));
+
+    auto fp = framePtr;
+
+    while (frames.size() < MAX_SAMPLE_DEPTH)
+    {
+        size_t numLocals = version->numLocals;
+
+        auto retAddr = fp[-(numLocals + 2)];
+        if (retAddr.getTag() != TAG_RAWPTR || !retAddr.getWord().ptr)
+            break;
+
+        auto retVer = (BlockVersion*)retAddr.getWord().ptr;
+        fp = (Value*)fp[-(numLocals + 1)].getWord().ptr;
+        version = retVer;
+        fun = retVer->fun;
+
+        auto callInstr = Object(Value(retVer->retEntry.callInstr, TAG_OBJECT));
+        auto callPos = callInstr.hasField("src_pos")? callInstr.getField("src_pos"):Value::UNDEF;
+        frames.push_back(frameName(fun, callPos));
+    }
+
+    std::string stack;
+    for (auto itr = frames.rbegin(); itr != frames.rend(); ++itr)
+    {
+        if (!stack.empty())
+            stack += ";";
+        stack += *itr;
+    }
+
+    stackSamples[stack]++;
+    numSamples++;
+}
+
+#ifndef _WIN32
+/// Handler for the profiling timer signal
+void onProfSignal(int)
+{
+    sampleDue = 1;
+}
+#endif
+
+/// Start gathering execution statistics, and sampling the call stack
+/// from a profiling timer. Must be called before any code is compiled.
+void startProfiler()
+{
+    assert (blockStats.empty());
+    profiling = true;
+
+#ifndef _WIN32
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onProfSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = SAMPLE_INTERVAL_US;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+#endif
+}
+
+/// Format a profile line with a count and a percentage of a total
+std::string countLine(uint64_t count, uint64_t total, std::string desc)
+{
+    char line[64];
+    snprintf(
+        line,
+        sizeof(line),
+        "%12llu %5.1f%%  ",
+        (unsigned long long)count,
+        total? (100.0 * count / total):0.0
+    );
+    return line + desc;
+}
+
+/// Print an inline cache hit rate
+void printICRate(std::string name, uint64_t lookups, uint64_t misses)
+{
+    char line[128];
+    snprintf(
+        line,
+        sizeof(line),
+        "%-18s %12llu lookups %10llu misses  %5.1f%% hits",
+        name.c_str(),
+        (unsigned long long)lookups,
+        (unsigned long long)misses,
+        lookups? (100.0 * (lookups - std::min(misses, lookups)) / lookups):100.0
+    );
+    std::cerr << line << std::endl;
+}
+
+void printProfile(std::string foldedPath, size_t maxLines)
+{
+#ifndef _WIN32
+    // Stop the profiling timer
+    itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
+#endif
+
+    // Samples by sampled function and source line
+    std::unordered_map<std::string, uint64_t> selfSamples;
+    for (auto& pair : stackSamples)
+    {
+        auto& stack = pair.first;
+        auto semi = stack.rfind(';');
+        auto leaf = (semi == std::string::npos)? stack:stack.substr(semi + 1);
+        selfSamples[leaf] += pair.second;
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> flat(
+        selfSamples.begin(),
+        selfSamples.end()
+    );
+    std::sort(
+        flat.begin(),
+        flat.end(),
+        [](const std::pair<std::string, uint64_t>& a, const std::pair<std::string, uint64_t>& b)
+        {
+            return a.second > b.second;
+        }
+    );
+
+    std::cerr << "samples: " << numSamples << " (";
+    std::cerr << SAMPLE_INTERVAL_US << "us of CPU time each)" << std::endl;
+    for (size_t i = 0; i < flat.size() && i < maxLines; ++i)
+        std::cerr << countLine(flat[i].second, numSamples, flat[i].first) << std::endl;
+
+    // Block version and opcode execution counts
+    std::unordered_map<BlockVersion*, uint64_t> verCounts;
+    std::vector<uint64_t> opCounts(NUM_OPCODES, 0);
+    uint64_t totalBlocks = 0;
+    uint64_t totalOps = 0;
+
+    for (auto stats : blockStats)
+    {
+        verCounts[stats->version] += stats->count;
+        totalBlocks += stats->count;
+
+        for (auto op : stats->ops)
+            opCounts[op] += stats->count;
+        totalOps += stats->count * stats->ops.size();
+    }
+
+    std::vector<std::pair<BlockVersion*, uint64_t>> versions(
+        verCounts.begin(),
+        verCounts.end()
+    );
+    std::sort(
+        versions.begin(),
+        versions.end(),
+        [](const std::pair<BlockVersion*, uint64_t>& a, const std::pair<BlockVersion*, uint64_t>& b)
+        {
+            return a.second > b.second;
+        }
+    );
+
+    std::cerr << std::endl;
+    std::cerr << "block versions entered: " << totalBlocks << std::endl;
+    for (size_t i = 0; i < versions.size() && i < maxLines; ++i)
+    {
+        auto version = versions[i].first;
+        auto desc = frameName(version->fun, getSrcPos(version));
+        std::cerr << countLine(versions[i].second, totalBlocks, desc) << std::endl;
+    }
+
+    std::vector<size_t> ops;
+    for (size_t i = 0; i < NUM_OPCODES; ++i)
+        if (opCounts[i] > 0)
+            ops.push_back(i);
+    std::sort(
+        ops.begin(),
+        ops.end(),
+        [&opCounts](size_t a, size_t b)
+        {
+            return opCounts[a] > opCounts[b];
+        }
+    );
+
+    std::cerr << std::endl;
+    std::cerr << "opcodes executed: " << totalOps << std::endl;
+    for (size_t i = 0; i < ops.size() && i < maxLines; ++i)
+        std::cerr << countLine(opCounts[ops[i]], totalOps, opNames[ops[i]]) << std::endl;
+
+    std::cerr << std::endl;
+    printICRate(
+        "get_field",
+        opCounts[GET_FIELD] + opCounts[GET_FIELD_IMM],
+        icStats.getFieldMisses
+    );
+    printICRate(
+        "set_field",
+        opCounts[SET_FIELD] + opCounts[SET_FIELD_IMM],
+        icStats.setFieldMisses
+    );
+    printICRate("call", opCounts[CALL], icStats.callMisses);
+    printICRate("runtime ICache", icStats.iCacheLookups, icStats.iCacheMisses);
+    printICRate("megamorphic field", icStats.fieldMegaLookups, icStats.fieldMegaMisses);
+    printICRate("megamorphic call", icStats.callMegaLookups, icStats.callMegaMisses);
+
+    std::cerr << std::endl;
+    std::cerr << "polymorphic sites: " << icStats.fieldPolySites << " field, ";
+    std::cerr << icStats.callPolySites << " call" << std::endl;
+    std::cerr << "megamorphic sites: " << icStats.fieldMegaSites << " field, ";
+    std::cerr << icStats.callMegaSites << " call" << std::endl;
+
+    // Write the folded stacks, which flamegraph tools take as input
+    if (foldedPath != "")
+    {
+        std::ofstream out(foldedPath);
+        for (auto& pair : stackSamples)
+            out << pair.first << " " << pair.second << "\n";
+
+        if (out)
+            std::cerr << std::endl << "folded stacks written to \"" << foldedPath << "\"" << std::endl;
+        else
+            std::cerr << "failed to write \"" << foldedPath << "\"" << std::endl;
+    }
+}
+
 Value testRunImage(std::string fileName)
 {
     std::cout << "loading image \"" << fileName << "\"" << std::endl;
 
-    auto pkg = parseFile(fileName);
+    GCRoot pkg(parseFile(fileName));
 
-    std::cout << callExportFn(pkg, "main").toString() << "\n";
+    std::cout << callExportFn(Object(pkg), "main").toString() << "\n";
 
-    return callExportFn(pkg, "main");
+    return callExportFn(Object(pkg), "main");
 }
 
 void testInterp()
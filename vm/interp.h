@@ -5,9 +5,57 @@
 
 typedef std::vector<Value> ValueVec;
 
-/// Initialize the interpreter
+/// Gather opcode pair execution counts, in the isolate of this thread
+/// Note: this must be set before any code is compiled
+extern thread_local bool opPairStats;
+
+/// Maximum code heap size in bytes, old code gets evicted past it
+/// Note: this must be set before the interpreter is initialized
+extern size_t codeHeapMaxSize;
+
+/// Maximum interpreter stack size in bytes. The stack is reserved
+/// upfront, and memory gets committed as it is used.
+/// Note: this must be set before the interpreter is initialized
+extern size_t stackMaxSize;
+
+/// Maximum stack size of each coroutine, in bytes
+/// Note: this must be set before any coroutine is created
+extern size_t coStackMaxSize;
+
+/// Get the size of the compiled code in the code heap, in bytes
+size_t codeHeapSize();
+
+/// Initialize the interpreter, for the isolate of this thread
 void initInterp();
 
+/// Free the interpreter state and the heap of the isolate of this thread
+void shutdownInterp();
+
+/// Print the most frequently executed opcode pairs
+void printOpPairStats(size_t maxPairs = 40);
+
+/// Start gathering execution statistics, and sampling the call stack
+/// from a profiling timer. Must be called before any code is compiled.
+void startProfiler();
+
+/// Print a flat profile, with block, opcode and inline cache statistics,
+/// and write the sampled call stacks in folded format to a file
+void printProfile(std::string foldedPath, size_t maxLines = 25);
+
+/// Call a function object from host code
+Value callFun(Object fun, ValueVec args);
+
+/// Create a coroutine object, which runs a function of at most one
+/// parameter on its own stack when first resumed
+Object newCoroutine(Object fun);
+
+/// Resume a coroutine from host code, passing it a value. Returns the
+/// value the coroutine yields, or the value its function returns.
+Value resumeCoroutine(Value co, Value val);
+
+/// Get the status of a coroutine: "new", "suspended", "running" or "done"
+std::string coroutineStatus(Value co);
+
 /// Call a function exported by a package
 Value callExportFn(
     Object pkg,
@@ -0,0 +1,355 @@
+#include <cassert>
+#include <cstring>
+#include "jit.h"
+
+#ifdef JIT_BACKEND
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include "runtime.h"
+
+ExecHeap::ExecHeap(size_t size)
+{
+    auto mem = mmap(
+        nullptr,
+        size,
+        PROT_READ | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+
+    if (mem == MAP_FAILED)
+        throw RunError("failed to allocate executable memory");
+
+    start = (uint8_t*)mem;
+    limit = start + size;
+    alloc = start;
+}
+
+/// Round a pointer down to the start of its memory page
+static uint8_t* pageStart(uint8_t* ptr)
+{
+    static const uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    return (uint8_t*)((uintptr_t)ptr & ~(pageSize - 1));
+}
+
+void ExecHeap::beginWrite()
+{
+    auto base = pageStart(alloc);
+    auto r = mprotect(base, limit - base, PROT_READ | PROT_WRITE);
+    assert (r == 0);
+    (void)r;
+}
+
+void ExecHeap::endWrite(uint8_t* newAlloc)
+{
+    assert (newAlloc >= alloc && newAlloc <= limit);
+
+    auto base = pageStart(alloc);
+    auto r = mprotect(base, limit - base, PROT_READ | PROT_EXEC);
+    assert (r == 0);
+    (void)r;
+
+    __builtin___clear_cache((char*)alloc, (char*)newAlloc);
+    alloc = newAlloc;
+}
+
+void X86Asm::byte(uint8_t val)
+{
+    if (ptr >= limit)
+    {
+        full = true;
+        return;
+    }
+
+    *(ptr++) = val;
+}
+
+void X86Asm::dword(uint32_t val)
+{
+    for (size_t i = 0; i < 4; ++i)
+        byte(val >> (8 * i));
+}
+
+void X86Asm::qword(uint64_t val)
+{
+    for (size_t i = 0; i < 8; ++i)
+        byte(val >> (8 * i));
+}
+
+void X86Asm::opMem(
+    uint8_t prefix,
+    std::initializer_list<uint8_t> opcode,
+    bool rexW,
+    uint8_t reg,
+    X86Reg base,
+    int32_t disp
+)
+{
+    if (prefix)
+        byte(prefix);
+
+    uint8_t rex = 0x40 | (rexW? 8:0) | ((reg & 8)? 4:0) | ((base & 8)? 1:0);
+    if (rex != 0x40)
+        byte(rex);
+
+    for (auto b : opcode)
+        byte(b);
+
+    // Use an 8-bit displacement when possible
+    bool disp8 = (disp >= -128 && disp <= 127);
+    byte(((disp8? 1:2) << 6) | ((reg & 7) << 3) | (base & 7));
+
+    // RSP and R12 require a SIB byte
+    if ((base & 7) == RSP)
+        byte(0x24);
+
+    if (disp8)
+        byte((uint8_t)disp);
+    else
+        dword(disp);
+}
+
+void X86Asm::opReg(
+    uint8_t prefix,
+    std::initializer_list<uint8_t> opcode,
+    bool rexW,
+    uint8_t reg,
+    uint8_t rm
+)
+{
+    if (prefix)
+        byte(prefix);
+
+    uint8_t rex = 0x40 | (rexW? 8:0) | ((reg & 8)? 4:0) | ((rm & 8)? 1:0);
+    if (rex != 0x40)
+        byte(rex);
+
+    for (auto b : opcode)
+        byte(b);
+
+    byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void X86Asm::mov(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(0, { 0x8B }, true, dst, base, disp);
+}
+
+void X86Asm::mov(X86Reg base, int32_t disp, X86Reg src)
+{
+    opMem(0, { 0x89 }, true, src, base, disp);
+}
+
+void X86Asm::movImm(X86Reg dst, uint64_t imm)
+{
+    byte(0x48 | ((dst & 8)? 1:0));
+    byte(0xB8 | (dst & 7));
+    qword(imm);
+}
+
+void X86Asm::mov32(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(0, { 0x8B }, false, dst, base, disp);
+}
+
+void X86Asm::movzx16(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(0, { 0x0F, 0xB7 }, false, dst, base, disp);
+}
+
+void X86Asm::addImm(X86Reg dst, int32_t imm)
+{
+    opReg(0, { 0x81 }, true, 0, dst);
+    dword(imm);
+}
+
+void X86Asm::orReg(X86Reg dst, X86Reg src)
+{
+    opReg(0, { 0x0B }, true, dst, src);
+}
+
+void X86Asm::shrImm(X86Reg dst, uint8_t imm)
+{
+    opReg(0, { 0xC1 }, true, 5, dst);
+    byte(imm);
+}
+
+void X86Asm::cmpReg(X86Reg a, X86Reg b)
+{
+    opReg(0, { 0x3B }, true, a, b);
+}
+
+void X86Asm::cmpMem(X86Reg a, X86Reg base, int32_t disp)
+{
+    opMem(0, { 0x3B }, true, a, base, disp);
+}
+
+void X86Asm::add32(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(0, { 0x03 }, false, dst, base, disp);
+}
+
+void X86Asm::sub32(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(0, { 0x2B }, false, dst, base, disp);
+}
+
+void X86Asm::imul32(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(0, { 0x0F, 0xAF }, false, dst, base, disp);
+}
+
+void X86Asm::and32(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(0, { 0x23 }, false, dst, base, disp);
+}
+
+void X86Asm::or32(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(0, { 0x0B }, false, dst, base, disp);
+}
+
+void X86Asm::xor32(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(0, { 0x33 }, false, dst, base, disp);
+}
+
+void X86Asm::cmp32(X86Reg a, X86Reg base, int32_t disp)
+{
+    opMem(0, { 0x3B }, false, a, base, disp);
+}
+
+void X86Asm::addImm32(X86Reg dst, int32_t imm)
+{
+    opReg(0, { 0x81 }, false, 0, dst);
+    dword(imm);
+}
+
+void X86Asm::cmpImm32(X86Reg a, int32_t imm)
+{
+    opReg(0, { 0x81 }, false, 7, a);
+    dword(imm);
+}
+
+void X86Asm::not32(X86Reg dst)
+{
+    opReg(0, { 0xF7 }, false, 2, dst);
+}
+
+void X86Asm::shl32Cl(X86Reg dst)
+{
+    opReg(0, { 0xD3 }, false, 4, dst);
+}
+
+void X86Asm::sar32Cl(X86Reg dst)
+{
+    opReg(0, { 0xD3 }, false, 7, dst);
+}
+
+void X86Asm::shr32Cl(X86Reg dst)
+{
+    opReg(0, { 0xD3 }, false, 5, dst);
+}
+
+void X86Asm::setcc(X86Cond cond, X86Reg dst)
+{
+    // Only the low byte registers without a REX prefix are supported
+    assert (dst <= RBX);
+    opReg(0, { 0x0F, (uint8_t)(0x90 | cond) }, false, 0, dst);
+}
+
+void X86Asm::and8(X86Reg dst, X86Reg src)
+{
+    assert (dst <= RBX && src <= RBX);
+    opReg(0, { 0x22 }, false, dst, src);
+}
+
+void X86Asm::movzx8(X86Reg dst, X86Reg src)
+{
+    assert (src <= RBX);
+    opReg(0, { 0x0F, 0xB6 }, false, dst, src);
+}
+
+void X86Asm::movss(XmmReg dst, X86Reg base, int32_t disp)
+{
+    opMem(0xF3, { 0x0F, 0x10 }, false, dst, base, disp);
+}
+
+void X86Asm::addss(XmmReg dst, X86Reg base, int32_t disp)
+{
+    opMem(0xF3, { 0x0F, 0x58 }, false, dst, base, disp);
+}
+
+void X86Asm::subss(XmmReg dst, X86Reg base, int32_t disp)
+{
+    opMem(0xF3, { 0x0F, 0x5C }, false, dst, base, disp);
+}
+
+void X86Asm::mulss(XmmReg dst, X86Reg base, int32_t disp)
+{
+    opMem(0xF3, { 0x0F, 0x59 }, false, dst, base, disp);
+}
+
+void X86Asm::divss(XmmReg dst, X86Reg base, int32_t disp)
+{
+    opMem(0xF3, { 0x0F, 0x5E }, false, dst, base, disp);
+}
+
+void X86Asm::sqrtss(XmmReg dst, X86Reg base, int32_t disp)
+{
+    opMem(0xF3, { 0x0F, 0x51 }, false, dst, base, disp);
+}
+
+void X86Asm::ucomiss(XmmReg a, XmmReg b)
+{
+    opReg(0, { 0x0F, 0x2E }, false, a, b);
+}
+
+void X86Asm::cvtsi2ss(XmmReg dst, X86Reg base, int32_t disp)
+{
+    opMem(0xF3, { 0x0F, 0x2A }, false, dst, base, disp);
+}
+
+void X86Asm::cvttss2si(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(0xF3, { 0x0F, 0x2C }, false, dst, base, disp);
+}
+
+void X86Asm::movd(X86Reg dst, XmmReg src)
+{
+    opReg(0x66, { 0x0F, 0x7E }, false, src, dst);
+}
+
+uint8_t* X86Asm::jcc(X86Cond cond)
+{
+    byte(0x0F);
+    byte(0x80 | cond);
+    auto dispPtr = ptr;
+    dword(0);
+    return dispPtr;
+}
+
+uint8_t* X86Asm::jmp()
+{
+    byte(0xE9);
+    auto dispPtr = ptr;
+    dword(0);
+    return dispPtr;
+}
+
+void X86Asm::ret()
+{
+    byte(0xC3);
+}
+
+void X86Asm::patchJump(uint8_t* dispPtr, uint8_t* target)
+{
+    int64_t disp = target - (dispPtr + 4);
+    assert (disp >= INT32_MIN && disp <= INT32_MAX);
+    int32_t disp32 = (int32_t)disp;
+    memcpy(dispPtr, &disp32, sizeof(disp32));
+}
+
+#endif
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <initializer_list>
+
+/// The native code backend is only available on x86-64 with tagged
+/// 8-byte values, otherwise all code is interpreted
+#if defined(ZETA_JIT) && defined(__x86_64__) && \
+    !defined(ZETA_WIDE_VALUES) && !defined(_WIN32)
+#define JIT_BACKEND
+#endif
+
+#ifdef JIT_BACKEND
+
+/**
+Executable memory region into which native code is written.
+The memory is mapped read+execute, and only made writable while
+code is being written into it.
+*/
+class ExecHeap
+{
+private:
+
+    uint8_t* start;
+
+    uint8_t* limit;
+
+    /// Current allocation pointer
+    uint8_t* alloc;
+
+public:
+
+    ExecHeap(size_t size);
+
+    uint8_t* getAlloc() const { return alloc; }
+    uint8_t* getLimit() const { return limit; }
+
+    /// Make the unallocated part of the heap writable
+    void beginWrite();
+
+    /// Make the heap executable again, up to a new allocation pointer
+    void endWrite(uint8_t* newAlloc);
+};
+
+/// x86-64 general-purpose registers
+enum X86Reg : uint8_t
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/// SSE registers
+enum XmmReg : uint8_t
+{
+    XMM0, XMM1
+};
+
+/// x86-64 condition codes
+enum X86Cond : uint8_t
+{
+    CC_B    = 0x2,
+    CC_AE   = 0x3,
+    CC_E    = 0x4,
+    CC_NE   = 0x5,
+    CC_BE   = 0x6,
+    CC_A    = 0x7,
+    CC_P    = 0xA,
+    CC_NP   = 0xB,
+    CC_L    = 0xC,
+    CC_GE   = 0xD,
+    CC_LE   = 0xE,
+    CC_G    = 0xF
+};
+
+/**
+Minimal x86-64 assembler, writing machine code into a memory buffer.
+Only the instruction forms needed by the native code backend are
+supported. Memory operands are of the form [base + disp].
+*/
+class X86Asm
+{
+private:
+
+    uint8_t* ptr;
+
+    uint8_t* limit;
+
+    /// Set if the code didn't fit in the buffer
+    bool full = false;
+
+    /// Encode an instruction with a register and a memory operand
+    void opMem(
+        uint8_t prefix,
+        std::initializer_list<uint8_t> opcode,
+        bool rexW,
+        uint8_t reg,
+        X86Reg base,
+        int32_t disp
+    );
+
+    /// Encode an instruction with two register operands
+    void opReg(
+        uint8_t prefix,
+        std::initializer_list<uint8_t> opcode,
+        bool rexW,
+        uint8_t reg,
+        uint8_t rm
+    );
+
+public:
+
+    X86Asm(uint8_t* start, uint8_t* limit)
+    : ptr(start),
+      limit(limit)
+    {
+    }
+
+    uint8_t* getPtr() const { return ptr; }
+
+    /// Check if the code didn't fit in the buffer
+    bool isFull() const { return full; }
+
+    void byte(uint8_t val);
+    void dword(uint32_t val);
+    void qword(uint64_t val);
+
+    // 64-bit moves
+    void mov(X86Reg dst, X86Reg base, int32_t disp);
+    void mov(X86Reg base, int32_t disp, X86Reg src);
+    void movImm(X86Reg dst, uint64_t imm);
+
+    // 32-bit loads, zero-extended
+    void mov32(X86Reg dst, X86Reg base, int32_t disp);
+    void movzx16(X86Reg dst, X86Reg base, int32_t disp);
+
+    // 64-bit arithmetic
+    void addImm(X86Reg dst, int32_t imm);
+    void orReg(X86Reg dst, X86Reg src);
+    void shrImm(X86Reg dst, uint8_t imm);
+    void cmpReg(X86Reg a, X86Reg b);
+    void cmpMem(X86Reg a, X86Reg base, int32_t disp);
+
+    // 32-bit arithmetic, results are zero-extended
+    void add32(X86Reg dst, X86Reg base, int32_t disp);
+    void sub32(X86Reg dst, X86Reg base, int32_t disp);
+    void imul32(X86Reg dst, X86Reg base, int32_t disp);
+    void and32(X86Reg dst, X86Reg base, int32_t disp);
+    void or32(X86Reg dst, X86Reg base, int32_t disp);
+    void xor32(X86Reg dst, X86Reg base, int32_t disp);
+    void cmp32(X86Reg a, X86Reg base, int32_t disp);
+    void addImm32(X86Reg dst, int32_t imm);
+    void cmpImm32(X86Reg a, int32_t imm);
+    void not32(X86Reg dst);
+    void shl32Cl(X86Reg dst);
+    void sar32Cl(X86Reg dst);
+    void shr32Cl(X86Reg dst);
+
+    // Byte operations
+    void setcc(X86Cond cond, X86Reg dst);
+    void and8(X86Reg dst, X86Reg src);
+    void movzx8(X86Reg dst, X86Reg src);
+
+    // SSE scalar single-precision operations
+    void movss(XmmReg dst, X86Reg base, int32_t disp);
+    void addss(XmmReg dst, X86Reg base, int32_t disp);
+    void subss(XmmReg dst, X86Reg base, int32_t disp);
+    void mulss(XmmReg dst, X86Reg base, int32_t disp);
+    void divss(XmmReg dst, X86Reg base, int32_t disp);
+    void sqrtss(XmmReg dst, X86Reg base, int32_t disp);
+    void ucomiss(XmmReg a, XmmReg b);
+    void cvtsi2ss(XmmReg dst, X86Reg base, int32_t disp);
+    void cvttss2si(X86Reg dst, X86Reg base, int32_t disp);
+    void movd(X86Reg dst, XmmReg src);
+
+    // Control flow
+    // Note: jumps return the location of their 32-bit displacement
+    uint8_t* jcc(X86Cond cond);
+    uint8_t* jmp();
+    void ret();
+
+    /// Set the target of a jump
+    static void patchJump(uint8_t* dispPtr, uint8_t* target);
+};
+
+#endif
@@ -1,10 +1,14 @@
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <exception>
+#include <fstream>
 #include "parser.h"
 #include "interp.h"
 #include "packages.h"
+#include "simd.h"
+#include "bench.h"
 #include "opt_parser.h"
 
 int runPkgMain(
@@ -64,13 +68,184 @@ int runPkgMain(
     return (int32_t)retVal;
 }
 
+/// Load and initialize a local package file
+Object loadPkg(std::string pkgPath)
+{
+    // Note: the package object may move during initialization
+    GCRoot pkg(load(pkgPath));
+
+    if (Object(pkg).hasField("init"))
+        callExportFn(Object(pkg), "init");
+
+    return Object(pkg);
+}
+
+/**
+Benchmark a package. The package is imported once, and each iteration
+calls its main function. Packages without a main function do all of
+their work when initialized, so they get reloaded for each iteration,
+which also times their compilation.
+*/
+void benchPkg(
+    const BenchConfig& config,
+    std::string benchOut
+)
+{
+    auto importPkg = [&config]()
+    {
+        try
+        {
+            return import(config.name);
+        }
+        catch (const ImportError&)
+        {
+            return loadPkg(config.name);
+        }
+    };
+
+    GCRoot pkg(importPkg());
+
+    auto iteration = [&config, &pkg]()
+    {
+        if (!Object(pkg).hasField("main"))
+        {
+            loadPkg(config.name);
+            return;
+        }
+
+        auto ret = runPkgMain(Object(pkg), config.name, config.args);
+        if (ret != 0)
+        {
+            throw RunError(
+                "benchmark main function returned " + std::to_string(ret)
+            );
+        }
+    };
+
+    if (benchOut == "")
+    {
+        runBench(config, iteration, std::cout);
+        return;
+    }
+
+    std::ofstream out(benchOut);
+    if (!out)
+        throw RunError("could not open \"" + benchOut + "\" for writing");
+    runBench(config, iteration, out);
+}
+
+/**
+Statistics printed when main returns, however it returns. This is not
+done from atexit handlers, since the isolate state is thread-local, and
+gets destroyed before those run.
+*/
+struct ExitStats
+{
+    bool opPairs = false;
+
+    bool profile = false;
+    std::string foldedPath;
+
+    ~ExitStats()
+    {
+        if (profile)
+            printProfile(foldedPath);
+
+        if (opPairs)
+            printOpPairStats();
+    }
+};
+
 int main(int argc, char** argv)
 {
     BoolOpt test('t', "test", false, "runs unit tests");
     BoolOpt help('h', "help", false, "prints this help message.");
+    BoolOpt opPairs(
+        "op-pairs",
+        false,
+        "prints the most frequently executed opcode pairs at exit"
+    );
+    BoolOpt prefetchPkgs(
+        "prefetch",
+        false,
+        "reads the packages a program imports ahead of time on worker threads"
+    );
+    BoolOpt profile(
+        "profile",
+        false,
+        "prints a profile of the program at exit, with block, opcode "
+        "and inline cache statistics"
+    );
+    StrOpt profileOut(
+        "profile-out",
+        "zeta-profile.folded",
+        "file the sampled call stacks of --profile are written to, in "
+        "the folded format of flamegraph tools"
+    );
+    BoolOpt bench(
+        "bench",
+        false,
+        "benchmarks the program: runs its main function for a number of "
+        "warmup and timed iterations, and reports timing statistics and "
+        "hardware event counts as JSON"
+    );
+    UintOpt benchWarmup(
+        "bench-warmup",
+        2,
+        "number of untimed warmup iterations of --bench"
+    );
+    UintOpt benchIters(
+        "bench-iters",
+        10,
+        "number of timed iterations of --bench"
+    );
+    StrOpt benchOut(
+        "bench-out",
+        "",
+        "file the --bench results are written to, instead of stdout"
+    );
+    UintOpt codeHeapMax(
+        "code-heap-max",
+        codeHeapMaxSize >> 10,
+        "maximum size of the code heap in KiB"
+    );
+    UintOpt stackMax(
+        "stack-size",
+        stackMaxSize >> 10,
+        "maximum size of the interpreter stack in KiB"
+    );
+    UintOpt coStackMax(
+        "co-stack-size",
+        coStackMaxSize >> 10,
+        "maximum size of the stack of each coroutine in KiB"
+    );
+    UintOpt workers(
+        "workers",
+        0,
+        "number of worker isolates running the parallel loops of "
+        "core/thread/0, one per core beyond the first by default"
+    );
     OptParser parser;
     parser.add(test);
     parser.add(help);
+    parser.add(opPairs);
+    parser.add(prefetchPkgs);
+    parser.add(profile);
+    parser.add(profileOut);
+    parser.add(bench);
+    parser.add(benchWarmup);
+    parser.add(benchIters);
+    parser.add(benchOut);
+    parser.add(codeHeapMax);
+    parser.add(stackMax);
+    parser.add(coStackMax);
+    parser.add(workers);
+
+    // All output goes through the C++ streams, which then don't
+    // need to be synchronized with C stdio on every write
+    std::ios::sync_with_stdio(false);
+
+    ExitStats exitStats;
 
     try
     {
@@ -83,20 +258,58 @@ int main(int argc, char** argv)
             return 0;
         }
 
+        if (opPairs())
+        {
+            opPairStats = true;
+            exitStats.opPairs = true;
+        }
+
+        codeHeapMaxSize = codeHeapMax.get() << 10;
+        stackMaxSize = stackMax.get() << 10;
+        coStackMaxSize = coStackMax.get() << 10;
+        if (workers.isPresent())
+            numWorkers = workers.get();
         initInterp();
 
+        if (profile())
+        {
+            startProfiler();
+            exitStats.profile = true;
+            exitStats.foldedPath = profileOut.get();
+        }
+
         // If we are in test mode
         if (test())
         {
             testRuntime();
             testParser();
             testInterp();
+            testSimd();
+            testBench();
             testOptParser();
             return 0;
         }
 
         auto pkgName = parser.getProgramName();
 
+        if (bench())
+        {
+            if (benchIters.get() == 0)
+                throw RunError("--bench-iters must be at least 1");
+
+            BenchConfig config;
+            config.name = pkgName;
+            config.args = parser.getProgramArgs();
+            config.numWarmup = benchWarmup.get();
+            config.numIters = benchIters.get();
+            benchPkg(config, benchOut.get());
+            return 0;
+        }
+
+        // Start reading the packages the program imports in the background
+        if (prefetchPkgs())
+            prefetch(pkgName);
+
         // Try importing and running the package
         try
         {
@@ -108,12 +321,7 @@ int main(int argc, char** argv)
         catch (ImportError e)
         {
             // Try loading the package as a local file
-            auto pkg = load(pkgName);
-
-            // Initialize the package
-            if (pkg.hasField("init"))
-                callExportFn(pkg, "init");
-
+            auto pkg = loadPkg(pkgName);
             return runPkgMain(pkg, pkgName, parser.getProgramArgs());
         }
     }
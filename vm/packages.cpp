@@ -1,23 +1,61 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <cstring>
 #include <ctime>
+#include <deque>
 #include <iostream>
-#include <regex>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include "util.h"
 #include "packages.h"
 #include "parser.h"
 #include "serialize.h"
 #include "interp.h"
+#include "simd.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
 
 #ifdef HAVE_SDL2
 #include <SDL.h>
 #endif
 
-HostFn::HostFn(std::string name, size_t numParams, void* fptr)
+HostFn::HostFn(std::string name, size_t numParams, void* fptr, uint8_t flags)
 : name(name),
   numParams(numParams),
-  fptr(fptr)
+  maxParams(numParams),
+  fptr(fptr),
+  flags(flags)
+{
+    assert (!isVariadic());
+    assert (numParams <= 3);
+}
+
+HostFn::HostFn(
+    std::string name,
+    size_t minParams,
+    size_t maxParams,
+    HostFnV fptr,
+    uint8_t flags
+)
+: name(name),
+  numParams(minParams),
+  maxParams(maxParams),
+  fptr((void*)fptr),
+  flags(flags | HOST_VARIADIC)
 {
+    assert (minParams <= maxParams);
 }
 
 Value HostFn::call0()
@@ -52,20 +90,38 @@ Value HostFn::call3(Value arg0, Value arg1, Value arg2)
     return f3(arg0, arg1, arg2);
 }
 
+/// Add a host function to a package's exports
+void setHostFn(Object pkgObj, HostFn* fnObj, std::string name)
+{
+    auto fnVal = Value((refptr)fnObj, TAG_HOSTFN);
+
+    assert (!pkgObj.hasField(name));
+
+    pkgObj.setField(name, fnVal);
+}
+
 void setHostFn(
     Object pkgObj,
     std::string name,
     size_t numParams,
-    void* fptr
+    void* fptr,
+    uint8_t flags = 0
 )
 {
-    auto fnObj = new HostFn(name, numParams, fptr);
-
-    auto fnVal = Value((refptr)fnObj, TAG_HOSTFN);
-
-    assert (!pkgObj.hasField(name));
+    setHostFn(pkgObj, new HostFn(name, numParams, fptr, flags), name);
+}
 
-    pkgObj.setField(name, fnVal);
+/// Add a variadic host function to a package's exports
+void setHostFnV(
+    Object pkgObj,
+    std::string name,
+    size_t minParams,
+    size_t maxParams,
+    HostFnV fptr,
+    uint8_t flags = 0
+)
+{
+    setHostFn(pkgObj, new HostFn(name, minParams, maxParams, fptr, flags), name);
 }
 
 //============================================================================
@@ -86,14 +142,24 @@ namespace core_vm_0
     }
 
     /**
-    Load a ZIM file into memory, but do not run any initialization code
+    Load a ZIM or ZIB file into memory, but do not run any
+    initialization code
     */
     Value load(Value pkgName)
     {
         if (!pkgName.isString())
             throw RunError("load expects package name to be a string");
 
-        return parseFile(std::string(pkgName));
+        auto fileName = std::string(pkgName);
+
+        // Binary images written by serialize_bin_to_file
+        // are loaded without parsing
+        Input input(fileName);
+        Value val;
+        if (deserializeBin(input.getInputData(), input.getInputLen(), 0, val))
+            return val;
+
+        return parseFile(fileName);
     }
 
     /**
@@ -118,12 +184,54 @@ namespace core_vm_0
         return String(str);
     }
 
+    /**
+    Serialize data into a ZIM file, streaming the output to the file
+    */
+    Value serialize_to_file(Value val, Value fileName, Value indent)
+    {
+        if (!fileName.isString())
+            throw RunError("serialize_to_file expects a file name string");
+
+        bool indentBool = (indent == Value::TRUE);
+
+        FileSink out((std::string)fileName);
+        out.write("#zeta-image\n\n");
+        ::serialize(val, indentBool, out);
+        out.put('\n');
+        out.close();
+
+        return Value::UNDEF;
+    }
+
+    /**
+    Serialize data into a binary image (ZIB) file, which load reads back
+    */
+    Value serialize_bin_to_file(Value val, Value fileName)
+    {
+        if (!fileName.isString())
+            throw RunError("serialize_bin_to_file expects a file name string");
+
+        FileSink out((std::string)fileName);
+        serializeBin(val, 0, out);
+        out.close();
+
+        return Value::UNDEF;
+    }
+
     /**
     Get the number of garbage collections performed so far.
     */
     Value get_gc_count()
     {
-        assert (false && "implement me");
+        return Value::int32((int32_t)vm.gcCount());
+    }
+
+    /**
+    Get the size of the compiled code in the code heap, in bytes
+    */
+    Value get_code_heap_size()
+    {
+        return Value::int32((int32_t)codeHeapSize());
     }
 
     /**
@@ -131,10 +239,85 @@ namespace core_vm_0
     */
     Value gc_collect()
     {
-        assert (false && "implement me");
+        // Note: host function calls are safe points, all
+        // live values are on the interpreter stack
+        vm.collect();
         return Value::UNDEF;
     }
 
+    /**
+    Create a coroutine, which runs a function of zero or one parameter
+    on its own stack. The first value it is resumed with is passed as
+    the argument of the function.
+    */
+    Value coroutine(Value fun)
+    {
+        if (!fun.isObject())
+            throw RunError("coroutine expects a function");
+
+        return newCoroutine(Object(fun));
+    }
+
+    /**
+    Get the status of a coroutine, one of "new", "suspended",
+    "running" or "done"
+    */
+    Value status(Value co)
+    {
+        return String(coroutineStatus(co));
+    }
+
+    /**
+    The resume and yield functions are user functions wrapping
+    the instructions, rather than host functions, since they
+    switch the interpreter between stacks
+    */
+    const char* const coroutineFns = R"(
+        #zeta-image
+
+        resume_entry = {
+            instrs: [
+                { op: "get_local", idx: 0 },
+                { op: "get_local", idx: 1 },
+                { op: "resume", ret_to: @resume_ret },
+            ]
+        };
+
+        resume_ret = {
+            instrs: [
+                { op: "ret" },
+            ]
+        };
+
+        yield_entry = {
+            instrs: [
+                { op: "get_local", idx: 0 },
+                { op: "yield", ret_to: @yield_ret },
+            ]
+        };
+
+        yield_ret = {
+            instrs: [
+                { op: "ret" },
+            ]
+        };
+
+        {
+            resume: {
+                name: "resume",
+                params: ["co", "val"],
+                num_locals: 3,
+                entry: @resume_entry
+            },
+            yield: {
+                name: "yield",
+                params: ["val"],
+                num_locals: 2,
+                entry: @yield_entry
+            }
+        };
+    )";
+
     Value get_pkg()
     {
         auto exports = Object::newObject(32);
@@ -142,8 +325,18 @@ namespace core_vm_0
         setHostFn(exports, "load"         , 1, (void*)load);
         setHostFn(exports, "parse"        , 1, (void*)parse);
         setHostFn(exports, "serialize"    , 2, (void*)serialize);
-        setHostFn(exports, "get_gc_count" , 0, (void*)get_gc_count);
+        setHostFn(exports, "serialize_to_file", 3, (void*)serialize_to_file);
+        setHostFn(exports, "serialize_bin_to_file", 2, (void*)serialize_bin_to_file);
+        setHostFn(exports, "get_gc_count" , 0, (void*)get_gc_count, HOST_NO_THROW);
+        setHostFn(exports, "get_code_heap_size", 0, (void*)get_code_heap_size, HOST_NO_THROW);
         setHostFn(exports, "gc_collect"   , 0, (void*)gc_collect);
+        setHostFn(exports, "coroutine"    , 1, (void*)coroutine);
+        setHostFn(exports, "status"       , 1, (void*)status);
+
+        auto fns = Object(parseString(coroutineFns, "core/vm/0"));
+        exports.setField("resume", fns.getField("resume"));
+        exports.setField("yield", fns.getField("yield"));
+
         return exports;
     }
 };
@@ -156,436 +349,1721 @@ HostFn importFn("import", 1, (void*)core_vm_0::import);
 
 namespace core_io_0
 {
-    Value print_int32(Value val)
-    {
-        assert (val.isInt32());
-        std::cout << (int32_t)val;
-        return Value::UNDEF;
-    }
+    /// Size of the read and write buffers of file handles
+    const size_t IO_BUF_SIZE = 1 << 20;
 
-    Value print_float32(Value val)
-    {
-        assert (val.isFloat32());
-        std::cout << (float)val;
-        return Value::UNDEF;
-    }
+    /// Serializes the writes of the isolates to standard output
+    std::mutex stdoutMutex;
 
-    Value print_str(Value val)
+    /**
+    Open file with reusable read or write buffers. Reads from regular
+    files are performed ahead of time by a worker thread, which fills
+    a second buffer while the interpreter consumes the current one.
+    */
+    class FileHandle
     {
-        assert (val.isString());
-        std::cout << (std::string)val;
-        return Value::UNDEF;
-    }
+    private:
 
-    Value read_file(Value fileName)
-    {
-        assert (fileName.isString());
-        auto nameStr = (std::string)fileName;
+        int fd;
 
-        FILE* file = fopen(nameStr.c_str(), "r");
+        /// Whether the file descriptor is closed with the handle
+        bool ownsFd;
 
-        if (!file)
+        bool writable;
+
+        /// Buffered data. Reads consume [start, end), writes
+        /// accumulate into [0, end).
+        std::vector<char> buf;
+        size_t start = 0;
+        size_t end = 0;
+
+        /// Number of bytes read or written so far
+        uint64_t pos = 0;
+
+        bool atEof = false;
+
+        /// Read-ahead state, used for regular files only
+        bool readAhead = false;
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<char> backBuf;
+        ssize_t backLen = 0;
+        bool backWanted = false;
+        bool backReady = false;
+        bool stopping = false;
+
+        /// Read as much as possible into a buffer, up to its size
+        static ssize_t readFull(int fd, char* dst, size_t size)
         {
-            throw RunError("failed to open file \"" + nameStr + "\"");
+            size_t total = 0;
+
+            while (total < size)
+            {
+                auto n = ::read(fd, dst + total, size - total);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    return -1;
+                if (n == 0)
+                    break;
+                total += n;
+            }
+
+            return total;
+        }
+
+        void workerLoop()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            while (true)
+            {
+                cv.wait(lock, [this] { return backWanted || stopping; });
+                if (stopping)
+                    break;
+
+                lock.unlock();
+                auto n = readFull(fd, backBuf.data(), backBuf.size());
+                lock.lock();
+
+                backLen = n;
+                backWanted = false;
+                backReady = true;
+                cv.notify_all();
+            }
         }
 
-        // Get the file size in bytes
-        fseek(file, 0, SEEK_END);
-        size_t len = ftell(file);
-        fseek(file, 0, SEEK_SET);
+        /// Refill the read buffer once it has been fully consumed
+        void fill()
+        {
+            assert (start == end);
+            ssize_t n;
+
+            if (readAhead)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return backReady; });
+                n = backLen;
+                std::swap(buf, backBuf);
+                backReady = false;
+
+                // Start reading the next block right away
+                if (n > 0)
+                {
+                    backWanted = true;
+                    cv.notify_all();
+                }
+            }
+            else
+            {
+                // Standard input may be interactive, make sure that
+                // prompts are visible before blocking
+                {
+                    std::lock_guard<std::mutex> lock(stdoutMutex);
+                    std::cout.flush();
+                }
+
+                do
+                    n = ::read(fd, buf.data(), buf.size());
+                while (n < 0 && errno == EINTR);
+            }
+
+            if (n < 0)
+                throw RunError("failed to read file");
 
-        char* buf = (char*)malloc(len+1);
+            start = 0;
+            end = n;
+            atEof = (n == 0);
+        }
 
-        // Read into the allocated buffer
-        size_t read = fread(buf, 1, len, file);
+    public:
 
-        if (read != len)
+        FileHandle(int fd, bool ownsFd, bool writable)
+        : fd(fd),
+          ownsFd(ownsFd),
+          writable(writable),
+          buf(IO_BUF_SIZE)
         {
-            throw RunError("failed to read file \"" + nameStr + "\"");
+            struct stat fileStat;
+            bool regular = fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode);
+
+            if (!writable && regular)
+            {
+#ifdef POSIX_FADV_SEQUENTIAL
+                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+                readAhead = true;
+                backBuf.resize(IO_BUF_SIZE);
+                backWanted = true;
+                worker = std::thread(&FileHandle::workerLoop, this);
+            }
         }
 
-        // Add a null terminator to the string
-        buf[len] = '\0';
+        ~FileHandle()
+        {
+            if (writable)
+            {
+                try { flush(); } catch (RunError&) {}
+            }
 
-        // Close the input file
-        fclose(file);
+            if (readAhead)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                    cv.notify_all();
+                }
 
-        return String(buf);
-    }
+                worker.join();
+            }
 
-    Value write_file(Value fileName, Value data)
-    {
-        assert (fileName.isString());
-        assert (data.isString());
+            if (ownsFd)
+                ::close(fd);
+        }
 
-        auto nameStr = (std::string)fileName;
+        bool isWritable() const { return writable; }
 
-        FILE* file = fopen(nameStr.c_str(), "w");
+        uint64_t getPos() const { return pos; }
 
-        if (!file)
+        /// Read up to maxLen bytes, returning false at the end of the file
+        bool readChunk(size_t maxLen, const char*& data, size_t& len)
         {
-            throw RunError("failed to open file \"" + nameStr + "\"");
+            assert (!writable);
+
+            if (start == end && !atEof)
+                fill();
+
+            if (start == end)
+                return false;
+
+            len = std::min(maxLen, end - start);
+            data = buf.data() + start;
+            start += len;
+            pos += len;
+            return true;
         }
 
-        auto dataStr = String(data);
+        /// Read a line into a string, without its newline character,
+        /// returning false at the end of the file
+        bool readLine(std::string& line)
+        {
+            assert (!writable);
 
-        fwrite(
-            dataStr.getDataPtr(),
-            dataStr.length(),
-            1,
-            file
-        );
+            line.clear();
+            bool found = false;
 
-        fclose(file);
+            while (true)
+            {
+                if (start == end)
+                {
+                    if (!atEof)
+                        fill();
 
-        return Value::TRUE;
-    }
+                    if (start == end)
+                        return found;
+                }
 
-    Value read_line()
-    {
-        char* lineBuf = nullptr;
-        size_t bufSize = 0;
+                found = true;
+                auto data = buf.data() + start;
+                auto nl = (const char*)memchr(data, '\n', end - start);
 
-        auto numRead = getdelim(&lineBuf, &bufSize, '\n', stdin);
+                if (nl)
+                {
+                    size_t len = nl - data;
+                    line.append(data, len);
+                    start += len + 1;
+                    pos += len + 1;
+                    return true;
+                }
 
-        if (numRead <= 0)
-        {
-            free(lineBuf);
-            return Value::UNDEF;
+                // The line continues past the end of the buffer
+                line.append(data, end - start);
+                pos += end - start;
+                start = end;
+            }
         }
 
-        // Clear trailing end of line characters
-        for (ssize_t i = 0; i < numRead; ++i)
+        void write(const char* data, size_t len)
         {
-            size_t idx = numRead - 1 - i;
+            assert (writable);
+
+            if (end + len > buf.size())
+                flush();
 
-            if (lineBuf[idx] == '\n' || lineBuf[idx] == '\r')
+            // Large writes bypass the buffer
+            if (len >= buf.size())
             {
-                lineBuf[idx] = '\0';
+                writeAll(data, len);
             }
             else
             {
-                break;
+                memcpy(buf.data() + end, data, len);
+                end += len;
             }
+
+            pos += len;
         }
 
-        auto str = String(lineBuf);
-        free(lineBuf);
+        void flush()
+        {
+            if (end > 0)
+            {
+                auto len = end;
+                end = 0;
+                writeAll(buf.data(), len);
+            }
+        }
 
-        return str;
-    }
+        void writeAll(const char* data, size_t len)
+        {
+            while (len > 0)
+            {
+                auto n = ::write(fd, data, len);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    throw RunError("failed to write file");
+                data += n;
+                len -= n;
+            }
+        }
+    };
 
-    Value get_pkg()
+    /// Open file handles, indexed by handle number. Handle 0 is
+    /// standard input, which is opened on first use.
+    /// Each isolate has its own handles.
+    thread_local std::vector<std::unique_ptr<FileHandle>> handles;
+
+    FileHandle& getHandle(Value handleVal)
     {
-        auto exports = Object::newObject(32);
-        setHostFn(exports, "print_int32"  , 1, (void*)print_int32);
-        setHostFn(exports, "print_float32", 1, (void*)print_float32);
-        setHostFn(exports, "print_str"    , 1, (void*)print_str);
-        setHostFn(exports, "read_file"    , 1, (void*)read_file);
-        setHostFn(exports, "write_file"   , 2, (void*)write_file);
-        setHostFn(exports, "read_line"    , 0, (void*)read_line);
-        return exports;
-    }
-}
+        if (!handleVal.isInt32())
+            throw RunError("expected a file handle");
 
-//============================================================================
-// core/time/0 package
-//============================================================================
+        auto idx = (int32_t)handleVal;
 
-#ifdef _WIN32
-    #include <windows.h>
-#else
-    #include <sys/time.h>
-#endif
+        if (idx == 0 && (handles.empty() || !handles[0]))
+        {
+            if (handles.empty())
+                handles.resize(1);
+            handles[0].reset(new FileHandle(0, false, false));
+        }
 
-namespace core_time_0
-{
-    // Time when the time package was loaded
-    #ifdef _WIN32
-        LARGE_INTEGER startTime;
-    #else
-        timeval startTime;
-    #endif
+        if (idx < 0 || (size_t)idx >= handles.size() || !handles[idx])
+            throw RunError("invalid or closed file handle");
+
+        return *handles[idx];
+    }
 
     /**
-    Get the time in milliseconds since the time library was loaded
-    The value produced is of int32 type
+    Open a file for reading ("r"), writing ("w") or appending ("a"),
+    returning an int32 file handle
     */
-    Value get_time_millis()
+    Value open_file(Value fileName, Value modeVal)
     {
-        #ifdef _WIN32
-            LARGE_INTEGER frequency;
-            QueryPerformanceFrequency(&frequency);
-            LARGE_INTEGER time;
-            QueryPerformanceCounter(&time);
-            LARGE_INTEGER delta = time.QuadPart - startTime.QuadPart;
-            int64_t millis = (int64_t)(1000 * (delta / frequency.QuadPart));
-            return Value::int32((int32_t)millis);
-        #else
-            timeval time;
-            gettimeofday(&time, NULL);
-            int64_t delta = 0;
-            delta += (time.tv_sec - startTime.tv_sec) * 1000;
-            delta += (time.tv_usec - startTime.tv_usec) / 1000.0;
-            return Value::int32((int32_t)delta);
-        #endif
+        if (!fileName.isString() || !modeVal.isString())
+            throw RunError("open_file expects a file name and a mode string");
+
+        auto nameStr = (std::string)fileName;
+        auto mode = (std::string)modeVal;
+
+        int flags;
+        if (mode == "r")
+            flags = O_RDONLY;
+        else if (mode == "w")
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+        else if (mode == "a")
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+        else
+            throw RunError("file mode must be \"r\", \"w\" or \"a\"");
+
+        int fd = ::open(nameStr.c_str(), flags, 0644);
+
+        if (fd < 0)
+            throw RunError("failed to open file \"" + nameStr + "\"");
+
+        // Handle 0 is reserved for standard input
+        if (handles.empty())
+            handles.resize(1);
+
+        handles.emplace_back(new FileHandle(fd, true, mode != "r"));
+        return Value::int32((int32_t)(handles.size() - 1));
     }
 
     /**
-     * Populates an object with the fields of a <time.h> `tm` struct. A few
-     * fields have been altered to make their values more useful:
-     *
-     * - The year is no longer relative to 1900, we simply add 1900 to the value.
-     *
-     * - Per time.h's specifications, isdst is positive when true, zero when
-     *   false and negative when inconclusive. To model this in plush, we return
-     *   true/false when the answer is known and undefined when it is not.
-     */
-    Value get_local_time()
+    Close a file handle, writing out any buffered data
+    */
+    Value close_file(Value handleVal)
     {
-        time_t rawtime;
-        struct tm* timeinfo;
+        auto& handle = getHandle(handleVal);
 
-        time(&rawtime);
-        timeinfo = localtime(&rawtime);
+        if (handle.isWritable())
+            handle.flush();
 
-        auto obj = Object::newObject();
-        obj.setField("sec", Value::int32(timeinfo->tm_sec));
-        obj.setField("min", Value::int32(timeinfo->tm_min));
-        obj.setField("hour", Value::int32(timeinfo->tm_hour));
-        obj.setField("day", Value::int32(timeinfo->tm_mday));
-        obj.setField("month", Value::int32(timeinfo->tm_mon));
-        obj.setField("year", Value::int32(timeinfo->tm_year + 1900));
-        obj.setField("week_day", Value::int32(timeinfo->tm_wday));
-        obj.setField("year_day", Value::int32(timeinfo->tm_yday));
+        handles[(int32_t)handleVal].reset();
+        return Value::UNDEF;
+    }
 
-        const auto& isdst = timeinfo->tm_isdst;
-        if (isdst > 0)
-          obj.setField("is_dst", Value::TRUE);
-        else if (isdst == 0)
-          obj.setField("is_dst", Value::FALSE);
-        else
-          obj.setField("is_dst", Value::UNDEF);
+    /**
+    Read up to a given number of bytes from a file as a string.
+    Produces undef once the end of the file is reached.
+    */
+    Value read_chunk(Value handleVal, Value maxLen)
+    {
+        auto& handle = getHandle(handleVal);
 
-        return obj;
+        if (handle.isWritable())
+            throw RunError("file handle is not open for reading");
+        if (!maxLen.isInt32() || (int32_t)maxLen <= 0)
+            throw RunError("read_chunk expects a positive int32 length");
+
+        const char* data;
+        size_t len;
+
+        if (!handle.readChunk((int32_t)maxLen, data, len))
+            return Value::UNDEF;
+
+        return String::newString(data, len);
     }
 
-    Value get_pkg()
+    /**
+    Write a string to a file through the handle's buffer
+    */
+    Value write(Value handleVal, Value data)
     {
-        // Store the time value when the time package is loaded
-        #ifdef _WIN32
-            QueryPerformanceCounter(&startTime);
-        #else
-            gettimeofday(&startTime, NULL);
-        #endif
+        auto& handle = getHandle(handleVal);
 
-        auto exports = Object::newObject(32);
-        setHostFn(exports, "get_time_millis", 0, (void*)get_time_millis);
-        setHostFn(exports, "get_local_time", 0, (void*)get_local_time);
-        return exports;
-    }
-}
+        if (!handle.isWritable())
+            throw RunError("file handle is not open for writing");
+        if (!data.isString())
+            throw RunError("write expects a string");
 
-//============================================================================
-// core/window/0 package
-//============================================================================
+        auto str = String(data);
+        handle.write(str.getDataPtr(), str.length());
+        return Value::UNDEF;
+    }
 
-namespace core_window_0
-{
-#ifdef HAVE_SDL2
-    size_t width = 0;
-    size_t height = 0;
+    Value flush(Value handleVal)
+    {
+        auto& handle = getHandle(handleVal);
 
-    std::vector<uint32_t> pixelBuffer;
+        if (handle.isWritable())
+            handle.flush();
 
-    SDL_Window* window = nullptr;
-    SDL_Renderer* renderer = nullptr;
-    SDL_Texture* texture = nullptr;
+        return Value::UNDEF;
+    }
 
     /**
-    Convert an SDL keycode to a key name
-    Note: we intentionally avoid using the SDL function for doing this
-          to hide the underlying implementation
+    Get the number of bytes read from or written to a file so far.
+    Offsets beyond the int32 range are approximated as float32 values.
     */
-    std::string sdlKeyToStr(int keyCode)
+    Value tell(Value handleVal)
     {
-        // Note: platform-specific keys such as mac command
-        // and windows keys are intentionally not listed here,
-        // to encourage portable application development
+        auto pos = getHandle(handleVal).getPos();
 
-        if (keyCode == SDLK_LEFT)
-            return "left";
-        if (keyCode == SDLK_RIGHT)
-            return "right";
-        if (keyCode == SDLK_UP)
-            return "up";
-        if (keyCode == SDLK_DOWN)
-            return "down";
+        if (pos <= INT32_MAX)
+            return Value::int32((int32_t)pos);
 
-        if (keyCode == SDLK_SPACE)
-            return "space";
-        if (keyCode == SDLK_RETURN)
-            return "return";
-        if (keyCode == SDLK_DELETE)
-            return "delete";
-        if (keyCode == SDLK_ESCAPE)
-            return "escape";
+        return Value::float32((float)pos);
+    }
 
-        // Note: not distinguishable on every system, so we
-        // alias left/right control and shift
-        if (keyCode == SDLK_LCTRL || keyCode == SDLK_RCTRL)
-            return "ctrl";
-        if (keyCode == SDLK_LSHIFT || keyCode == SDLK_RSHIFT)
-            return "shift";
+    /// Write the characters of a string value to stdout
+    void writeStr(Value val)
+    {
+        auto str = String(val);
+        std::cout.write(str.getDataPtr(), str.length());
+    }
 
-        if (keyCode >= SDLK_a && keyCode <= SDLK_z)
+    HostStatus print_int32(HostArgs args, Value& ret)
+    {
+        if (!args[0].isInt32())
         {
-            auto idx = keyCode - SDLK_a;
-            std::string keyName;
-            keyName = 'a' + idx;
-            return keyName;
+            ret = String("print_int32 expects an int32 value");
+            return HOST_ERROR;
         }
 
-        if (keyCode >= SDLK_0 && keyCode <= SDLK_9)
+        std::lock_guard<std::mutex> lock(stdoutMutex);
+        std::cout << (int32_t)args[0];
+        ret = Value::UNDEF;
+        return HOST_OK;
+    }
+
+    HostStatus print_float32(HostArgs args, Value& ret)
+    {
+        if (!args[0].isFloat32())
         {
-            auto idx = keyCode - SDLK_0;
-            std::string keyName;
-            keyName = '0' + idx;
-            return keyName;
+            ret = String("print_float32 expects a float32 value");
+            return HOST_ERROR;
         }
 
-        if (keyCode >= SDLK_F1 && keyCode <= SDLK_F12)
+        std::lock_guard<std::mutex> lock(stdoutMutex);
+        std::cout << (float)args[0];
+        ret = Value::UNDEF;
+        return HOST_OK;
+    }
+
+    HostStatus print_str(HostArgs args, Value& ret)
+    {
+        if (!args[0].isString())
         {
-            auto num = keyCode - SDLK_F1 + 1;
-            return "f" + std::to_string(num);
+            ret = String("print_str expects a string value");
+            return HOST_ERROR;
         }
 
-        // Unknown key
-        return "";
+        std::lock_guard<std::mutex> lock(stdoutMutex);
+        writeStr(args[0]);
+        ret = Value::UNDEF;
+        return HOST_OK;
     }
 
-    Value create_window(
-        Value titleVal,
-        Value widthVal,
-        Value heightVal
-    )
+    /**
+    Print any number of int32, float32 and string values,
+    without separators
+    */
+    HostStatus print(HostArgs args, Value& ret)
     {
-        SDL_Init(SDL_INIT_VIDEO);
+        // Check all the arguments before printing anything
+        for (size_t i = 0; i < args.size(); ++i)
+        {
+            auto val = args[i];
 
-        auto title = (std::string)titleVal;
-        width = (size_t)(int32_t)widthVal;
-        height = (size_t)(int32_t)heightVal;
+            if (!val.isString() && !val.isInt32() && !val.isFloat32())
+            {
+                ret = String("print expects int32, float32 or string values");
+                return HOST_ERROR;
+            }
+        }
 
-        window = SDL_CreateWindow(
-            title.c_str(),
-            SDL_WINDOWPOS_UNDEFINED,
-            SDL_WINDOWPOS_UNDEFINED,
-            width,
-            height,
-            0
-        );
+        std::lock_guard<std::mutex> lock(stdoutMutex);
+        for (size_t i = 0; i < args.size(); ++i)
+        {
+            auto val = args[i];
 
-        renderer = SDL_CreateRenderer(window, -1, 0);
+            if (val.isString())
+                writeStr(val);
+            else if (val.isInt32())
+                std::cout << (int32_t)val;
+            else
+                std::cout << (float)val;
+        }
 
-        texture = SDL_CreateTexture(
-            renderer,
-            SDL_PIXELFORMAT_RGBA8888,
-            SDL_TEXTUREACCESS_STATIC,
-            width,
-            height
-        );
+        ret = Value::UNDEF;
+        return HOST_OK;
+    }
 
-        pixelBuffer.resize(width * height, 0);
+    /**
+    Read a whole file as a string. The file is memory-mapped, so that
+    its data is copied only once, directly from the page cache.
+    */
+    Value read_file(Value fileName)
+    {
+        if (!fileName.isString())
+            throw RunError("read_file expects a file name string");
 
-        // Clear the window
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-        SDL_RenderClear(renderer);
-        SDL_RenderPresent(renderer);
+        auto nameStr = (std::string)fileName;
+        std::unique_ptr<Input> input;
 
-        SDL_ShowWindow(window);
+        try
+        {
+            input.reset(new Input(nameStr));
+        }
+        catch (ParseError&)
+        {
+            throw RunError("failed to open file \"" + nameStr + "\"");
+        }
 
-        // Return the window handle, hidden in a raw pointer value
-        return Value((refptr)window, TAG_RAWPTR);
+        if (input->getInputLen() > UINT32_MAX)
+            throw RunError("file \"" + nameStr + "\" is too large to read as a string");
+
+        return String::newString(input->getInputData(), input->getInputLen());
     }
 
-    Value destroy_window(Value handle)
+    Value write_file(Value fileName, Value data)
     {
-        // For now, only one window is supported
-        assert (handle == Value((refptr)window, TAG_RAWPTR));
+        assert (fileName.isString());
+        assert (data.isString());
 
-        SDL_DestroyTexture(texture);
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
-        SDL_Quit();
+        auto nameStr = (std::string)fileName;
 
-        pixelBuffer.clear();
+        FILE* file = fopen(nameStr.c_str(), "w");
 
-        return Value::UNDEF;
+        if (!file)
+        {
+            throw RunError("failed to open file \"" + nameStr + "\"");
+        }
+
+        auto dataStr = String(data);
+
+        fwrite(
+            dataStr.getDataPtr(),
+            dataStr.length(),
+            1,
+            file
+        );
+
+        fclose(file);
+
+        return Value::TRUE;
     }
 
     /**
-    Get the next event to process, if any
+    Read a line from a file handle, or from standard input if no
+    handle is given, without its end of line characters.
+    Produces undef once the end of the file is reached.
     */
-    Value get_next_event(Value handle)
+    HostStatus read_line(HostArgs args, Value& ret)
     {
-        // For now, only one window is supported
-        assert (handle == Value((refptr)window, TAG_RAWPTR));
+        auto& handle = getHandle(args.size()? args[0]:Value::int32(0));
 
-        SDL_Event event;
+        if (handle.isWritable())
+            throw RunError("file handle is not open for reading");
 
-        // While there are events to process
-        while (SDL_PollEvent(&event))
-        {
-            switch (event.type)
-            {
-                case SDL_QUIT:
-                {
-                    auto obj = Object::newObject();
-                    obj.setField("type", String("quit"));
-                    return obj;
-                }
+        // Note: the line string is reused across calls
+        static thread_local std::string line;
 
-                case SDL_KEYDOWN:
-                case SDL_KEYUP:
-                {
-                    auto eventType = String(
-                        event.type == SDL_KEYDOWN?
-                        "key_down":"key_up"
-                    );
+        if (!handle.readLine(line))
+        {
+            ret = Value::UNDEF;
+            return HOST_OK;
+        }
 
-                    std::string keyName = sdlKeyToStr(event.key.keysym.sym);
+        // Clear trailing end of line characters
+        while (!line.empty() && line.back() == '\r')
+            line.pop_back();
 
-                    // Unknown key, ignore this event
-                    if (keyName == "")
-                        continue;
+        ret = String::newString(line.data(), line.length());
+        return HOST_OK;
+    }
 
-                    auto obj = Object::newObject();
-                    obj.setField("type", eventType);
-                    obj.setField("key", String(keyName));
-                    return obj;
-                }
-                break;
+    Value get_pkg()
+    {
+        auto exports = Object::newObject(32);
+        setHostFnV(exports, "print_int32"  , 1, 1, print_int32, HOST_NO_THROW);
+        setHostFnV(exports, "print_float32", 1, 1, print_float32, HOST_NO_THROW);
+        setHostFnV(exports, "print_str"    , 1, 1, print_str, HOST_NO_THROW);
+        setHostFnV(exports, "print"        , 0, SIZE_MAX, print, HOST_NO_THROW);
+        setHostFn(exports, "read_file"    , 1, (void*)read_file);
+        setHostFn(exports, "write_file"   , 2, (void*)write_file);
+        setHostFnV(exports, "read_line"    , 0, 1, read_line);
+        setHostFn(exports, "open_file"    , 2, (void*)open_file);
+        setHostFn(exports, "close_file"   , 1, (void*)close_file);
+        setHostFn(exports, "read_chunk"   , 2, (void*)read_chunk);
+        setHostFn(exports, "write"        , 2, (void*)write);
+        setHostFn(exports, "flush"        , 1, (void*)flush);
+        setHostFn(exports, "tell"         , 1, (void*)tell);
+        return exports;
+    }
+}
 
-                case SDL_MOUSEBUTTONDOWN:
-                case SDL_MOUSEBUTTONUP:
-                {
-                    auto eventType = String(
-                        event.type == SDL_MOUSEBUTTONDOWN?
-                        "mouse_down":"mouse_up"
-                    );
+//============================================================================
+// core/time/0 package
+//============================================================================
 
-                    int32_t buttonIdx;
-                    switch (event.button.button)
-                    {
-                        case SDL_BUTTON_LEFT: buttonIdx = 0; break;
-                        case SDL_BUTTON_MIDDLE: buttonIdx = 1; break;
-                        case SDL_BUTTON_RIGHT: buttonIdx = 2; break;
-                        case SDL_BUTTON_X1: buttonIdx = 3; break;
-                        case SDL_BUTTON_X2: buttonIdx = 4; break;
-                        default: assert (false);
-                    }
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/time.h>
+#endif
 
-                    auto obj = Object::newObject();
+namespace core_time_0
+{
+    // Time when the time package was loaded
+    #ifdef _WIN32
+        LARGE_INTEGER startTime;
+    #else
+        timeval startTime;
+    #endif
+
+    /**
+    Get the time in milliseconds since the time library was loaded
+    The value produced is of int32 type
+    */
+    Value get_time_millis()
+    {
+        #ifdef _WIN32
+            LARGE_INTEGER frequency;
+            QueryPerformanceFrequency(&frequency);
+            LARGE_INTEGER time;
+            QueryPerformanceCounter(&time);
+            LARGE_INTEGER delta = time.QuadPart - startTime.QuadPart;
+            int64_t millis = (int64_t)(1000 * (delta / frequency.QuadPart));
+            return Value::int32((int32_t)millis);
+        #else
+            timeval time;
+            gettimeofday(&time, NULL);
+            int64_t delta = 0;
+            delta += (time.tv_sec - startTime.tv_sec) * 1000;
+            delta += (time.tv_usec - startTime.tv_usec) / 1000.0;
+            return Value::int32((int32_t)delta);
+        #endif
+    }
+
+    /**
+     * Populates an object with the fields of a <time.h> `tm` struct. A few
+     * fields have been altered to make their values more useful:
+     *
+     * - The year is no longer relative to 1900, we simply add 1900 to the value.
+     *
+     * - Per time.h's specifications, isdst is positive when true, zero when
+     *   false and negative when inconclusive. To model this in plush, we return
+     *   true/false when the answer is known and undefined when it is not.
+     */
+    Value get_local_time()
+    {
+        time_t rawtime;
+        struct tm* timeinfo;
+
+        time(&rawtime);
+        timeinfo = localtime(&rawtime);
+
+        auto obj = Object::newObject();
+        obj.setField("sec", Value::int32(timeinfo->tm_sec));
+        obj.setField("min", Value::int32(timeinfo->tm_min));
+        obj.setField("hour", Value::int32(timeinfo->tm_hour));
+        obj.setField("day", Value::int32(timeinfo->tm_mday));
+        obj.setField("month", Value::int32(timeinfo->tm_mon));
+        obj.setField("year", Value::int32(timeinfo->tm_year + 1900));
+        obj.setField("week_day", Value::int32(timeinfo->tm_wday));
+        obj.setField("year_day", Value::int32(timeinfo->tm_yday));
+
+        const auto& isdst = timeinfo->tm_isdst;
+        if (isdst > 0)
+          obj.setField("is_dst", Value::TRUE);
+        else if (isdst == 0)
+          obj.setField("is_dst", Value::FALSE);
+        else
+          obj.setField("is_dst", Value::UNDEF);
+
+        return obj;
+    }
+
+    Value get_pkg()
+    {
+        // Store the time value when the time package is loaded
+        #ifdef _WIN32
+            QueryPerformanceCounter(&startTime);
+        #else
+            gettimeofday(&startTime, NULL);
+        #endif
+
+        auto exports = Object::newObject(32);
+        setHostFn(exports, "get_time_millis", 0, (void*)get_time_millis, HOST_NO_THROW);
+        setHostFn(exports, "get_local_time", 0, (void*)get_local_time);
+        return exports;
+    }
+}
+
+//============================================================================
+// core/buffer/0 package
+//============================================================================
+
+namespace core_buffer_0
+{
+    /// Get the element type named by a string value
+    Buffer::ElemType getElemType(Value typeVal)
+    {
+        Buffer::ElemType type;
+
+        if (!typeVal.isString() || !Buffer::strToType(typeVal, type))
+        {
+            throw RunError(
+                "buffer element type must be \"float32\", \"int32\" or \"uint8\""
+            );
+        }
+
+        return type;
+    }
+
+    /**
+    Allocate a new buffer of a given element type and length,
+    with all elements set to zero
+    */
+    Value alloc(Value typeVal, Value lenVal)
+    {
+        auto type = getElemType(typeVal);
+
+        if (!lenVal.isInt32() || (int32_t)lenVal < 0)
+            throw RunError("buffer length must be a non-negative int32 value");
+
+        return Buffer(type, (int32_t)lenVal);
+    }
+
+    /**
+    Create a buffer holding the elements of an array
+    */
+    Value from_array(Value typeVal, Value arrVal)
+    {
+        auto type = getElemType(typeVal);
+
+        if (!arrVal.isArray())
+            throw RunError("from_array expects an array");
+
+        auto arr = Array(arrVal);
+        auto buf = Buffer(type, arr.length());
+
+        for (size_t i = 0; i < arr.length(); ++i)
+            buf.setElem(i, arr.getElem(i));
+
+        return buf;
+    }
+
+    /**
+    Create an array holding the elements of a buffer
+    */
+    Value to_array(Value bufVal)
+    {
+        if (!bufVal.isBuffer())
+            throw RunError("to_array expects a buffer");
+
+        auto buf = Buffer(bufVal);
+        auto arr = Array(buf.length());
+
+        for (size_t i = 0; i < buf.length(); ++i)
+            arr.push(buf.getElem(i));
+
+        return arr;
+    }
+
+    /**
+    Get the name of the element type of a buffer
+    */
+    Value elem_type(Value bufVal)
+    {
+        if (!bufVal.isBuffer())
+            throw RunError("elem_type expects a buffer");
+
+        return String(Buffer::typeToStr(Buffer(bufVal).getType()));
+    }
+
+    Value get_pkg()
+    {
+        auto exports = Object::newObject(32);
+        setHostFn(exports, "alloc"      , 2, (void*)alloc);
+        setHostFn(exports, "from_array" , 2, (void*)from_array);
+        setHostFn(exports, "to_array"   , 1, (void*)to_array);
+        setHostFn(exports, "elem_type"  , 1, (void*)elem_type);
+        return exports;
+    }
+}
+
+//============================================================================
+// core/map/0 package
+//============================================================================
+
+namespace core_map_0
+{
+    /**
+    Maps are objects holding an array of key/value slot pairs, where
+    empty slots have undefined keys, and an entry count. Keys are strings
+    or int32 values. Slots are found by linear probing from the key hash,
+    using the hash cached in strings, and the capacity is a power of two.
+    */
+    class Map
+    {
+    private:
+
+        Object obj;
+
+        Array slots;
+
+        size_t cap;
+
+        /// Maximum number of entries before the capacity is doubled,
+        /// keeping the load factor below 3/4
+        static size_t maxSize(size_t cap) { return cap - cap / 4; }
+
+    public:
+
+        static const size_t MIN_CAP = 8;
+
+        Map(Value mapVal)
+        : obj(checkMap(mapVal)),
+          slots(getSlots(obj)),
+          cap(slots.length() / 2)
+        {
+        }
+
+        static Object checkMap(Value mapVal)
+        {
+            if (!mapVal.isObject())
+                throw RunError("expected a map object");
+
+            return Object(mapVal);
+        }
+
+        static Array getSlots(Object obj)
+        {
+            static thread_local ICache slotsIC("_slots");
+
+            auto slotsVal = slotsIC.getField(obj);
+            if (!slotsVal.isArray())
+                throw RunError("expected a map object");
+
+            return Array(slotsVal);
+        }
+
+        /// Allocate a map with room for some number of entries
+        static Value alloc(size_t numEntries)
+        {
+            auto obj = Object::newObject(2);
+            obj.setField("_slots", newSlots(capFor(numEntries)));
+            obj.setField("_size", Value::int32(0));
+            return obj;
+        }
+
+        /// Get the smallest capacity holding some number of entries
+        static size_t capFor(size_t numEntries)
+        {
+            size_t cap = MIN_CAP;
+            while (maxSize(cap) < numEntries)
+                cap *= 2;
+            return cap;
+        }
+
+        static Array newSlots(size_t cap)
+        {
+            auto slots = Array(2 * cap);
+            for (size_t i = 0; i < 2 * cap; ++i)
+                slots.push(Value::UNDEF);
+            return slots;
+        }
+
+        /// Check that a value is a valid key. Ropes are flattened,
+        /// so that the string hash is cached.
+        static Value checkKey(Value key)
+        {
+            if (key.isInt32())
+                return key;
+
+            if (key.isString())
+                return String(key);
+
+            throw RunError("map keys must be strings or int32 values");
+        }
+
+        static uint32_t hash(Value key)
+        {
+            if (key.isString())
+                return String(key).getHash();
+
+            // Mix the bits of integers, so that consecutive
+            // keys don't fill consecutive slots
+            auto h = (uint32_t)(int32_t)key * 2654435761u;
+            return h ^ (h >> 16);
+        }
+
+        static bool keysEqual(Value a, Value b)
+        {
+            if (a.isInt32())
+                return b.isInt32() && (int32_t)a == (int32_t)b;
+
+            return b.isString() && String(a) == String(b);
+        }
+
+        size_t size()
+        {
+            static thread_local ICache sizeIC("_size");
+            return (size_t)sizeIC.getInt32(obj);
+        }
+
+        void setSize(size_t size)
+        {
+            static thread_local ICache sizeIC("_size");
+            sizeIC.setField(obj, Value::int32((int32_t)size));
+        }
+
+        size_t capacity() const { return cap; }
+
+        Value keyAt(size_t slot) { return slots.getElem(2 * slot); }
+        Value valAt(size_t slot) { return slots.getElem(2 * slot + 1); }
+
+        /// Find the slot holding a key, or the empty slot where it
+        /// would be inserted. Returns true if the key was found.
+        bool find(Value key, size_t& slot)
+        {
+            auto mask = cap - 1;
+
+            for (slot = hash(key) & mask;; slot = (slot + 1) & mask)
+            {
+                auto slotKey = keyAt(slot);
+
+                if (slotKey == Value::UNDEF)
+                    return false;
+
+                if (keysEqual(slotKey, key))
+                    return true;
+            }
+        }
+
+        void set(Value key, Value val)
+        {
+            size_t slot;
+            if (find(key, slot))
+            {
+                slots.setElem(2 * slot + 1, val);
+                return;
+            }
+
+            auto newSize = size() + 1;
+            if (newSize > maxSize(cap))
+            {
+                resize(capFor(newSize));
+                find(key, slot);
+            }
+
+            slots.setElem(2 * slot, key);
+            slots.setElem(2 * slot + 1, val);
+            setSize(newSize);
+        }
+
+        /// Remove the entry of a key, returns false if there is none.
+        /// The following entries of the probe sequence are shifted back,
+        /// so that no deleted markers are needed.
+        bool remove(Value key)
+        {
+            size_t hole;
+            if (!find(key, hole))
+                return false;
+
+            auto mask = cap - 1;
+
+            for (auto slot = (hole + 1) & mask;; slot = (slot + 1) & mask)
+            {
+                auto slotKey = keyAt(slot);
+                if (slotKey == Value::UNDEF)
+                    break;
+
+                // Move the entry into the hole, unless its home slot
+                // lies cyclically between the hole and its slot
+                auto home = hash(slotKey) & mask;
+                if (((slot - home) & mask) >= ((slot - hole) & mask))
+                {
+                    slots.setElem(2 * hole, slotKey);
+                    slots.setElem(2 * hole + 1, valAt(slot));
+                    hole = slot;
+                }
+            }
+
+            slots.setElem(2 * hole, Value::UNDEF);
+            slots.setElem(2 * hole + 1, Value::UNDEF);
+            setSize(size() - 1);
+            return true;
+        }
+
+        /// Move the entries into new slots of a given capacity
+        void resize(size_t newCap)
+        {
+            static thread_local ICache slotsIC("_slots");
+
+            auto oldSlots = slots;
+            auto oldCap = cap;
+
+            slots = newSlots(newCap);
+            cap = newCap;
+            slotsIC.setField(obj, slots);
+
+            for (size_t i = 0; i < oldCap; ++i)
+            {
+                auto key = oldSlots.getElem(2 * i);
+                if (key == Value::UNDEF)
+                    continue;
+
+                size_t slot;
+                find(key, slot);
+                slots.setElem(2 * slot, key);
+                slots.setElem(2 * slot + 1, oldSlots.getElem(2 * i + 1));
+            }
+        }
+    };
+
+    /**
+    Create a new map, optionally with room for some number of entries
+    */
+    HostStatus new_map(HostArgs args, Value& ret)
+    {
+        size_t numEntries = 0;
+
+        if (args.size() > 0)
+        {
+            if (!args[0].isInt32() || (int32_t)args[0] < 0)
+            {
+                ret = String("map capacity must be a non-negative int32 value");
+                return HOST_ERROR;
+            }
+
+            numEntries = (int32_t)args[0];
+        }
+
+        ret = Map::alloc(numEntries);
+        return HOST_OK;
+    }
+
+    Value size(Value mapVal)
+    {
+        return Value::int32((int32_t)Map(mapVal).size());
+    }
+
+    Value has(Value mapVal, Value key)
+    {
+        size_t slot;
+        return Map(mapVal).find(Map::checkKey(key), slot)? Value::TRUE:Value::FALSE;
+    }
+
+    /**
+    Get the value of a key, or a default value (undefined
+    if not specified) when the key is absent
+    */
+    HostStatus get(HostArgs args, Value& ret)
+    {
+        auto map = Map(args[0]);
+        auto key = Map::checkKey(args[1]);
+
+        size_t slot;
+        if (map.find(key, slot))
+            ret = map.valAt(slot);
+        else
+            ret = (args.size() > 2)? args[2]:Value::UNDEF;
+
+        return HOST_OK;
+    }
+
+    Value set(Value mapVal, Value key, Value val)
+    {
+        Map(mapVal).set(Map::checkKey(key), val);
+        return Value::UNDEF;
+    }
+
+    /**
+    Remove the entry of a key, returns true if there was one
+    */
+    Value remove(Value mapVal, Value key)
+    {
+        return Map(mapVal).remove(Map::checkKey(key))? Value::TRUE:Value::FALSE;
+    }
+
+    /**
+    Make room for some number of entries
+    */
+    Value reserve(Value mapVal, Value numVal)
+    {
+        if (!numVal.isInt32() || (int32_t)numVal < 0)
+            throw RunError("map capacity must be a non-negative int32 value");
+
+        auto map = Map(mapVal);
+        auto newCap = Map::capFor((size_t)(int32_t)numVal);
+        if (newCap > map.capacity())
+            map.resize(newCap);
+
+        return Value::UNDEF;
+    }
+
+    /// Get an array of the keys or the values of a map, in slot order
+    Value getEntries(Value mapVal, size_t part)
+    {
+        auto map = Map(mapVal);
+        auto arr = Array(map.size());
+
+        for (size_t i = 0; i < map.capacity(); ++i)
+        {
+            if (map.keyAt(i) != Value::UNDEF)
+                arr.push(part? map.valAt(i):map.keyAt(i));
+        }
+
+        return arr;
+    }
+
+    Value keys(Value mapVal) { return getEntries(mapVal, 0); }
+    Value values(Value mapVal) { return getEntries(mapVal, 1); }
+
+    /**
+    Get the index of the first slot holding an entry, starting at some
+    slot index, or -1 if there are no more entries. This is used to
+    iterate over maps, along with slot_key and slot_val.
+    */
+    Value next_slot(Value mapVal, Value slotVal)
+    {
+        if (!slotVal.isInt32() || (int32_t)slotVal < 0)
+            throw RunError("slot index must be a non-negative int32 value");
+
+        auto map = Map(mapVal);
+        for (auto i = (size_t)(int32_t)slotVal; i < map.capacity(); ++i)
+        {
+            if (map.keyAt(i) != Value::UNDEF)
+                return Value::int32((int32_t)i);
+        }
+
+        return Value::int32(-1);
+    }
+
+    /// Get the slot of an entry, from an index returned by next_slot
+    size_t getSlot(Map& map, Value slotVal)
+    {
+        if (!slotVal.isInt32() || (int32_t)slotVal < 0 ||
+            (size_t)(int32_t)slotVal >= map.capacity() ||
+            map.keyAt((int32_t)slotVal) == Value::UNDEF)
+        {
+            throw RunError("invalid map slot index");
+        }
+
+        return (size_t)(int32_t)slotVal;
+    }
+
+    Value slot_key(Value mapVal, Value slotVal)
+    {
+        auto map = Map(mapVal);
+        return map.keyAt(getSlot(map, slotVal));
+    }
+
+    Value slot_val(Value mapVal, Value slotVal)
+    {
+        auto map = Map(mapVal);
+        return map.valAt(getSlot(map, slotVal));
+    }
+
+    Value get_pkg()
+    {
+        auto exports = Object::newObject(32);
+        setHostFnV(exports, "new"          , 0, 1, new_map);
+        setHostFn(exports, "size"         , 1, (void*)size);
+        setHostFn(exports, "has"          , 2, (void*)has);
+        setHostFnV(exports, "get"          , 2, 3, get);
+        setHostFn(exports, "set"          , 3, (void*)set);
+        setHostFn(exports, "remove"       , 2, (void*)remove);
+        setHostFn(exports, "reserve"      , 2, (void*)reserve);
+        setHostFn(exports, "keys"         , 1, (void*)keys);
+        setHostFn(exports, "values"       , 1, (void*)values);
+        setHostFn(exports, "next_slot"    , 2, (void*)next_slot);
+        setHostFn(exports, "slot_key"     , 2, (void*)slot_key);
+        setHostFn(exports, "slot_val"     , 2, (void*)slot_val);
+        return exports;
+    }
+}
+
+//============================================================================
+// core/simd/0 package
+//============================================================================
+
+namespace core_simd_0
+{
+    /// Get a buffer argument, checking its element type if one is given
+    Buffer getBuffer(Value val, const char* fnName, int elemType = -1)
+    {
+        if (!val.isBuffer())
+            throw RunError(std::string(fnName) + " expects buffer arguments");
+
+        auto buf = Buffer(val);
+
+        if (elemType != -1 && buf.getType() != (Buffer::ElemType)elemType)
+        {
+            throw RunError(
+                std::string(fnName) + " expects " +
+                Buffer::typeToStr((Buffer::ElemType)elemType) + " buffers"
+            );
+        }
+
+        return buf;
+    }
+
+    /// Check that a buffer matches the type and length of another
+    void checkSame(Buffer a, Buffer b, const char* fnName)
+    {
+        if (a.getType() != b.getType())
+            throw RunError(std::string(fnName) + " expects buffers of the same element type");
+        if (a.length() != b.length())
+            throw RunError(std::string(fnName) + " expects buffers of the same length");
+    }
+
+    /// Get a float32 scalar argument, also accepting int32 values
+    float getFloat(Value val, const char* fnName)
+    {
+        if (val.isFloat32())
+            return (float)val;
+        if (val.isInt32())
+            return (float)(int32_t)val;
+        throw RunError(std::string(fnName) + " expects a numeric value");
+    }
+
+    float* f32Ptr(Buffer buf) { return (float*)buf.getDataPtr(); }
+    int32_t* i32Ptr(Buffer buf) { return (int32_t*)buf.getDataPtr(); }
+
+    /// Get the float32 or int32 buffer an arithmetic function operates on
+    Buffer getNumBuffer(Value val, const char* fnName)
+    {
+        auto buf = getBuffer(val, fnName);
+
+        if (buf.getType() != Buffer::FLOAT32 && buf.getType() != Buffer::INT32)
+            throw RunError(std::string(fnName) + " expects float32 or int32 buffers");
+
+        return buf;
+    }
+
+    /**
+    Set all the elements of a buffer to the same value
+    */
+    Value fill(Value dstVal, Value val)
+    {
+        auto dst = getBuffer(dstVal, "fill");
+        if (dst.length() == 0)
+            return Value::UNDEF;
+
+        // Store the first element with type checking, then replicate it
+        dst.setElem(0, val);
+        auto size = Buffer::elemSize(dst.getType());
+        auto data = dst.getDataPtr();
+        for (size_t i = 1; i < dst.length(); ++i)
+            memcpy(data + i * size, data, size);
+
+        return Value::UNDEF;
+    }
+
+    /**
+    Copy the elements of a buffer into another of the same type
+    */
+    Value copy(Value dstVal, Value srcVal)
+    {
+        auto dst = getBuffer(dstVal, "copy");
+        auto src = getBuffer(srcVal, "copy");
+        checkSame(dst, src, "copy");
+        memmove(dst.getDataPtr(), src.getDataPtr(), dst.length() * Buffer::elemSize(dst.getType()));
+        return Value::UNDEF;
+    }
+
+    /**
+    Element-wise dst = a + b
+    Note: int32 arithmetic wraps around on overflow
+    */
+    Value add(Value dstVal, Value aVal, Value bVal)
+    {
+        auto dst = getNumBuffer(dstVal, "add");
+        auto a = getBuffer(aVal, "add");
+        auto b = getBuffer(bVal, "add");
+        checkSame(dst, a, "add");
+        checkSame(dst, b, "add");
+
+        if (dst.getType() == Buffer::FLOAT32)
+        {
+            simdKernels().addF32(f32Ptr(dst), f32Ptr(a), f32Ptr(b), dst.length());
+        }
+        else
+        {
+            auto d = i32Ptr(dst), x = i32Ptr(a), y = i32Ptr(b);
+            for (size_t i = 0; i < dst.length(); ++i)
+                d[i] = (int32_t)((uint32_t)x[i] + (uint32_t)y[i]);
+        }
+
+        return Value::UNDEF;
+    }
+
+    /**
+    Element-wise dst = a * b
+    */
+    Value mul(Value dstVal, Value aVal, Value bVal)
+    {
+        auto dst = getNumBuffer(dstVal, "mul");
+        auto a = getBuffer(aVal, "mul");
+        auto b = getBuffer(bVal, "mul");
+        checkSame(dst, a, "mul");
+        checkSame(dst, b, "mul");
+
+        if (dst.getType() == Buffer::FLOAT32)
+        {
+            simdKernels().mulF32(f32Ptr(dst), f32Ptr(a), f32Ptr(b), dst.length());
+        }
+        else
+        {
+            auto d = i32Ptr(dst), x = i32Ptr(a), y = i32Ptr(b);
+            for (size_t i = 0; i < dst.length(); ++i)
+                d[i] = (int32_t)((uint32_t)x[i] * (uint32_t)y[i]);
+        }
+
+        return Value::UNDEF;
+    }
+
+    /**
+    Element-wise dst += a * b, on float32 buffers
+    */
+    Value fma(Value dstVal, Value aVal, Value bVal)
+    {
+        auto dst = getBuffer(dstVal, "fma", Buffer::FLOAT32);
+        auto a = getBuffer(aVal, "fma");
+        auto b = getBuffer(bVal, "fma");
+        checkSame(dst, a, "fma");
+        checkSame(dst, b, "fma");
+        simdKernels().fmaF32(f32Ptr(dst), f32Ptr(a), f32Ptr(b), dst.length());
+        return Value::UNDEF;
+    }
+
+    /**
+    Element-wise dst = src * k, on float32 buffers
+    */
+    Value scale(Value dstVal, Value srcVal, Value kVal)
+    {
+        auto dst = getBuffer(dstVal, "scale", Buffer::FLOAT32);
+        auto src = getBuffer(srcVal, "scale");
+        checkSame(dst, src, "scale");
+        auto k = getFloat(kVal, "scale");
+        simdKernels().scaleF32(f32Ptr(dst), f32Ptr(src), k, dst.length());
+        return Value::UNDEF;
+    }
+
+    /**
+    Clamp the elements of a buffer in place to [lo, hi]
+    */
+    Value clamp(Value dstVal, Value loVal, Value hiVal)
+    {
+        auto dst = getNumBuffer(dstVal, "clamp");
+
+        if (dst.getType() == Buffer::FLOAT32)
+        {
+            auto lo = getFloat(loVal, "clamp");
+            auto hi = getFloat(hiVal, "clamp");
+            simdKernels().clampF32(f32Ptr(dst), lo, hi, dst.length());
+        }
+        else
+        {
+            if (!loVal.isInt32() || !hiVal.isInt32())
+                throw RunError("clamp expects int32 bounds for int32 buffers");
+
+            auto lo = (int32_t)loVal, hi = (int32_t)hiVal;
+            auto d = i32Ptr(dst);
+            for (size_t i = 0; i < dst.length(); ++i)
+                d[i] = std::min(std::max(d[i], lo), hi);
+        }
+
+        return Value::UNDEF;
+    }
+
+    /**
+    Element-wise dst = sin(src), on float32 buffers.
+    Uses an interpolated table, accurate to about 1e-6.
+    */
+    Value sin(Value dstVal, Value srcVal)
+    {
+        auto dst = getBuffer(dstVal, "sin", Buffer::FLOAT32);
+        auto src = getBuffer(srcVal, "sin");
+        checkSame(dst, src, "sin");
+        simdKernels().sinF32(f32Ptr(dst), f32Ptr(src), 0, dst.length());
+        return Value::UNDEF;
+    }
+
+    /**
+    Element-wise dst = cos(src), on float32 buffers
+    */
+    Value cos(Value dstVal, Value srcVal)
+    {
+        auto dst = getBuffer(dstVal, "cos", Buffer::FLOAT32);
+        auto src = getBuffer(srcVal, "cos");
+        checkSame(dst, src, "cos");
+        simdKernels().sinF32(f32Ptr(dst), f32Ptr(src), 1.57079632679489662f, dst.length());
+        return Value::UNDEF;
+    }
+
+    /**
+    Sum the elements of a buffer
+    */
+    Value sum(Value srcVal)
+    {
+        auto src = getNumBuffer(srcVal, "sum");
+
+        if (src.getType() == Buffer::FLOAT32)
+            return Value::float32(simdKernels().sumF32(f32Ptr(src), src.length()));
+
+        uint32_t sum = 0;
+        auto s = i32Ptr(src);
+        for (size_t i = 0; i < src.length(); ++i)
+            sum += (uint32_t)s[i];
+        return Value::int32((int32_t)sum);
+    }
+
+    /**
+    Get the smallest element of a non-empty buffer
+    */
+    Value min(Value srcVal)
+    {
+        auto src = getNumBuffer(srcVal, "min");
+        if (src.length() == 0)
+            throw RunError("min of an empty buffer");
+
+        if (src.getType() == Buffer::FLOAT32)
+            return Value::float32(simdKernels().minF32(f32Ptr(src), src.length()));
+
+        auto s = i32Ptr(src);
+        return Value::int32(*std::min_element(s, s + src.length()));
+    }
+
+    /**
+    Get the largest element of a non-empty buffer
+    */
+    Value max(Value srcVal)
+    {
+        auto src = getNumBuffer(srcVal, "max");
+        if (src.length() == 0)
+            throw RunError("max of an empty buffer");
+
+        if (src.getType() == Buffer::FLOAT32)
+            return Value::float32(simdKernels().maxF32(f32Ptr(src), src.length()));
+
+        auto s = i32Ptr(src);
+        return Value::int32(*std::max_element(s, s + src.length()));
+    }
+
+    /**
+    Convert the elements of an int32 buffer into a float32 buffer
+    */
+    Value to_float32(Value dstVal, Value srcVal)
+    {
+        auto dst = getBuffer(dstVal, "to_float32", Buffer::FLOAT32);
+        auto src = getBuffer(srcVal, "to_float32", Buffer::INT32);
+        if (dst.length() != src.length())
+            throw RunError("to_float32 expects buffers of the same length");
+        simdKernels().i32ToF32(f32Ptr(dst), i32Ptr(src), dst.length());
+        return Value::UNDEF;
+    }
+
+    /**
+    Convert the elements of a float32 buffer into an int32 buffer,
+    truncating toward zero
+    */
+    Value to_int32(Value dstVal, Value srcVal)
+    {
+        auto dst = getBuffer(dstVal, "to_int32", Buffer::INT32);
+        auto src = getBuffer(srcVal, "to_int32", Buffer::FLOAT32);
+        if (dst.length() != src.length())
+            throw RunError("to_int32 expects buffers of the same length");
+        simdKernels().f32ToI32(i32Ptr(dst), f32Ptr(src), dst.length());
+        return Value::UNDEF;
+    }
+
+    /**
+    Get the name of the instruction set the kernels use
+    */
+    Value get_isa()
+    {
+        return String(simdKernels().isa);
+    }
+
+    Value get_pkg()
+    {
+        auto exports = Object::newObject(32);
+        setHostFn(exports, "fill"       , 2, (void*)fill);
+        setHostFn(exports, "copy"       , 2, (void*)copy);
+        setHostFn(exports, "add"        , 3, (void*)add);
+        setHostFn(exports, "mul"        , 3, (void*)mul);
+        setHostFn(exports, "fma"        , 3, (void*)fma);
+        setHostFn(exports, "scale"      , 3, (void*)scale);
+        setHostFn(exports, "clamp"      , 3, (void*)clamp);
+        setHostFn(exports, "sin"        , 2, (void*)sin);
+        setHostFn(exports, "cos"        , 2, (void*)cos);
+        setHostFn(exports, "sum"        , 1, (void*)sum);
+        setHostFn(exports, "min"        , 1, (void*)min);
+        setHostFn(exports, "max"        , 1, (void*)max);
+        setHostFn(exports, "to_float32" , 2, (void*)to_float32);
+        setHostFn(exports, "to_int32"   , 2, (void*)to_int32);
+        setHostFn(exports, "get_isa"    , 0, (void*)get_isa, HOST_NO_THROW);
+        return exports;
+    }
+}
+
+//============================================================================
+// core/window/0 package
+//============================================================================
+
+namespace core_window_0
+{
+#ifdef HAVE_SDL2
+    size_t width = 0;
+    size_t height = 0;
+
+    std::vector<uint32_t> pixelBuffer;
+
+    SDL_Window* window = nullptr;
+    SDL_Renderer* renderer = nullptr;
+    SDL_Texture* texture = nullptr;
+
+    /**
+    Convert an SDL keycode to a key name
+    Note: we intentionally avoid using the SDL function for doing this
+          to hide the underlying implementation
+    */
+    std::string sdlKeyToStr(int keyCode)
+    {
+        // Note: platform-specific keys such as mac command
+        // and windows keys are intentionally not listed here,
+        // to encourage portable application development
+
+        if (keyCode == SDLK_LEFT)
+            return "left";
+        if (keyCode == SDLK_RIGHT)
+            return "right";
+        if (keyCode == SDLK_UP)
+            return "up";
+        if (keyCode == SDLK_DOWN)
+            return "down";
+
+        if (keyCode == SDLK_SPACE)
+            return "space";
+        if (keyCode == SDLK_RETURN)
+            return "return";
+        if (keyCode == SDLK_DELETE)
+            return "delete";
+        if (keyCode == SDLK_ESCAPE)
+            return "escape";
+
+        // Note: not distinguishable on every system, so we
+        // alias left/right control and shift
+        if (keyCode == SDLK_LCTRL || keyCode == SDLK_RCTRL)
+            return "ctrl";
+        if (keyCode == SDLK_LSHIFT || keyCode == SDLK_RSHIFT)
+            return "shift";
+
+        if (keyCode >= SDLK_a && keyCode <= SDLK_z)
+        {
+            auto idx = keyCode - SDLK_a;
+            std::string keyName;
+            keyName = 'a' + idx;
+            return keyName;
+        }
+
+        if (keyCode >= SDLK_0 && keyCode <= SDLK_9)
+        {
+            auto idx = keyCode - SDLK_0;
+            std::string keyName;
+            keyName = '0' + idx;
+            return keyName;
+        }
+
+        if (keyCode >= SDLK_F1 && keyCode <= SDLK_F12)
+        {
+            auto num = keyCode - SDLK_F1 + 1;
+            return "f" + std::to_string(num);
+        }
+
+        // Unknown key
+        return "";
+    }
+
+    Value create_window(
+        Value titleVal,
+        Value widthVal,
+        Value heightVal
+    )
+    {
+        SDL_Init(SDL_INIT_VIDEO);
+
+        auto title = (std::string)titleVal;
+        width = (size_t)(int32_t)widthVal;
+        height = (size_t)(int32_t)heightVal;
+
+        window = SDL_CreateWindow(
+            title.c_str(),
+            SDL_WINDOWPOS_UNDEFINED,
+            SDL_WINDOWPOS_UNDEFINED,
+            width,
+            height,
+            0
+        );
+
+        renderer = SDL_CreateRenderer(window, -1, 0);
+
+        texture = SDL_CreateTexture(
+            renderer,
+            SDL_PIXELFORMAT_RGBA8888,
+            SDL_TEXTUREACCESS_STATIC,
+            width,
+            height
+        );
+
+        pixelBuffer.resize(width * height, 0);
+
+        // Clear the window
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        SDL_RenderClear(renderer);
+        SDL_RenderPresent(renderer);
+
+        SDL_ShowWindow(window);
+
+        // Return the window handle, hidden in a raw pointer value
+        return Value((refptr)window, TAG_RAWPTR);
+    }
+
+    Value destroy_window(Value handle)
+    {
+        // For now, only one window is supported
+        assert (handle == Value((refptr)window, TAG_RAWPTR));
+
+        SDL_DestroyTexture(texture);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+
+        pixelBuffer.clear();
+
+        return Value::UNDEF;
+    }
+
+    /**
+    Get the next event to process, if any
+    */
+    Value get_next_event(Value handle)
+    {
+        // For now, only one window is supported
+        assert (handle == Value((refptr)window, TAG_RAWPTR));
+
+        SDL_Event event;
+
+        // While there are events to process
+        while (SDL_PollEvent(&event))
+        {
+            switch (event.type)
+            {
+                case SDL_QUIT:
+                {
+                    auto obj = Object::newObject();
+                    obj.setField("type", String("quit"));
+                    return obj;
+                }
+
+                case SDL_KEYDOWN:
+                case SDL_KEYUP:
+                {
+                    auto eventType = String(
+                        event.type == SDL_KEYDOWN?
+                        "key_down":"key_up"
+                    );
+
+                    std::string keyName = sdlKeyToStr(event.key.keysym.sym);
+
+                    // Unknown key, ignore this event
+                    if (keyName == "")
+                        continue;
+
+                    auto obj = Object::newObject();
+                    obj.setField("type", eventType);
+                    obj.setField("key", String(keyName));
+                    return obj;
+                }
+                break;
+
+                case SDL_MOUSEBUTTONDOWN:
+                case SDL_MOUSEBUTTONUP:
+                {
+                    auto eventType = String(
+                        event.type == SDL_MOUSEBUTTONDOWN?
+                        "mouse_down":"mouse_up"
+                    );
+
+                    int32_t buttonIdx;
+                    switch (event.button.button)
+                    {
+                        case SDL_BUTTON_LEFT: buttonIdx = 0; break;
+                        case SDL_BUTTON_MIDDLE: buttonIdx = 1; break;
+                        case SDL_BUTTON_RIGHT: buttonIdx = 2; break;
+                        case SDL_BUTTON_X1: buttonIdx = 3; break;
+                        case SDL_BUTTON_X2: buttonIdx = 4; break;
+                        default: assert (false);
+                    }
+
+                    auto obj = Object::newObject();
                     obj.setField("type", eventType);
                     obj.setField("x", Value::int32(event.button.x));
                     obj.setField("y", Value::int32(event.button.y));
@@ -593,204 +2071,1806 @@ namespace core_window_0
                     return obj;
                 }
 
-                // Process the next event
-                default:
+                // Process the next event
+                default:
+                continue;
+            }
+        }
+
+        // No event to process
+        return Value::FALSE;
+    }
+
+    /**
+    Display a bitmap (array or int32 buffer of pixels) into the window.
+    Pixels are in ABGR format (alpha least significant),
+    with one int32 value per pixel.
+    */
+    Value draw_bitmap(Value handle, Value pixelsArray)
+    {
+        // For now, only one window is supported
+        assert (handle == Value((refptr)window, TAG_RAWPTR));
+
+        // Buffers are handed to SDL as they are, without copying.
+        // The texture has no blending, so alpha is ignored.
+        if (pixelsArray.isBuffer())
+        {
+            auto pixels = Buffer(pixelsArray);
+
+            if (pixels.getType() != Buffer::INT32 ||
+                pixels.length() != width * height)
+            {
+                throw RunError(
+                    "bitmap buffer must hold one int32 element per pixel"
+                );
+            }
+
+            SDL_UpdateTexture(texture, NULL, pixels.getDataPtr(), width * 4);
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+            SDL_RenderClear(renderer);
+            SDL_RenderCopy(renderer, texture, NULL, NULL);
+            SDL_RenderPresent(renderer);
+            return Value::UNDEF;
+        }
+
+        auto pixels = (Array)pixelsArray;
+        assert (pixels.length() == width * height);
+
+        for (size_t pixIdx = 0; pixIdx < width * height; ++pixIdx)
+        {
+            // Mask out the alpha channel so its content is ignored
+            auto pixVal = (int32_t)pixels.getElem(pixIdx);
+            pixVal = 0xFFFFFF00 & pixVal;
+            pixelBuffer[pixIdx] = pixVal;
+        }
+
+        SDL_UpdateTexture(texture, NULL, &pixelBuffer[0], width * 4);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderClear(renderer);
+        SDL_RenderCopy(renderer, texture, NULL, NULL);
+        SDL_RenderPresent(renderer);
+        return Value::UNDEF;
+    }
+#endif // HAVE_SDL2
+
+    Value get_pkg()
+    {
+#ifdef HAVE_SDL2
+        auto exports = Object::newObject(32);
+        setHostFn(exports, "create_window"  , 3, (void*)create_window);
+        setHostFn(exports, "destroy_window" , 1, (void*)destroy_window);
+        setHostFn(exports, "get_next_event" , 1, (void*)get_next_event);
+        setHostFn(exports, "draw_bitmap"    , 2, (void*)draw_bitmap);
+        return exports;
+#else
+        throw DepMissing("core/window", "libsdl2", "--with-sdl2");
+#endif
+    }
+}
+
+//============================================================================
+// core/audio/0 package
+//============================================================================
+
+namespace core_audio_0
+{
+#ifdef HAVE_SDL2
+    bool paused = true;
+
+    Value open_output_device(
+        Value sample_rate_val,
+        Value num_channels
+    )
+    {
+        assert (sample_rate_val.isInt32());
+        assert (num_channels.isInt32());
+
+        auto sampleRate = (int32_t)sample_rate_val;
+        if (sampleRate != 44100)
+            throw RunError("sample rate is currently fixed to 44100");
+
+        SDL_Init(SDL_INIT_AUDIO);
+        SDL_AudioSpec want, have;
+
+        SDL_zero(want);
+        want.freq = sampleRate;
+        want.format = AUDIO_F32;
+        want.channels = (uint8_t)(int32_t)num_channels;
+        want.samples = 4096;
+        want.callback = NULL;
+
+        auto devId = (int32_t)SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_ANY_CHANGE);
+
+        assert (want.format == have.format);
+        assert (want.freq == have.freq);
+        assert (want.channels = have.channels);
+
+        return Value::int32(devId);
+    }
+
+    Value queue_samples(
+        Value dev,
+        Value samplesArray
+    )
+    {
+        assert(dev.isInt32());
+        auto devID = (int32_t)dev;
+
+        if (paused)
+        {
+            paused = false;
+            SDL_PauseAudioDevice(devID, 0);
+        }
+
+        // Float32 buffers are queued as they are, without copying.
+        // Their samples are expected to be in [-1, 1].
+        if (samplesArray.isBuffer())
+        {
+            auto samples = Buffer(samplesArray);
+
+            if (samples.getType() != Buffer::FLOAT32)
+                throw RunError("audio sample buffers must be float32");
+
+            auto numBytes = samples.length() * sizeof(float);
+            if (SDL_QueueAudio(devID, samples.getDataPtr(), numBytes) != 0)
+                return Value::FALSE;
+
+            return Value::TRUE;
+        }
+
+        if (!samplesArray.isArray())
+            throw RunError("audio samples must be an array or a buffer");
+
+        auto samples = (Array)samplesArray;
+
+        if (samples.length() == 0)
+            return Value::UNDEF;
+
+        float samples_buf[samples.length()];
+
+        for (size_t i = 0; i < samples.length(); i++)
+        {
+            auto elem = samples.getElem(i);
+
+            if (!elem.isFloat32())
+            {
+                throw RunError("audio samples must be float32");
+            }
+
+            float sample = (float)elem > 1.0f ? 1.0f : elem;
+            sample = sample < -1.0f ? -1.0f : sample;
+            samples_buf[i] = sample;
+        }
+
+        if (SDL_QueueAudio(devID, samples_buf, sizeof(samples_buf)) != 0)
+        {
+            return Value::FALSE;
+        }
+
+        return Value::TRUE;
+    }
+
+    Value get_queue_size(
+        Value dev
+    )
+    {
+        assert(dev.isInt32());
+
+        auto devID = (int32_t)dev;
+
+        auto numBytes = SDL_GetQueuedAudioSize(devID);
+        auto numSamples = numBytes / 4;
+
+        return Value::int32((int32_t)numSamples);
+    }
+
+    Value close_output_device(
+        Value dev
+    )
+    {
+        assert(dev.isInt32());
+
+        auto devID = (int32_t)dev;
+        SDL_CloseAudioDevice(devID);
+
+        return Value::UNDEF;
+    }
+
+    /**
+    Output stream, whose samples are generated by a coroutine. The
+    device callback, which runs on an SDL thread, takes the samples from
+    a ring buffer, and wakes the isolate running the streams when there
+    is room for more.
+    */
+    struct Stream
+    {
+        SDL_AudioDeviceID devId;
+
+        /// Coroutine generating the samples
+        GCRoot co;
+
+        /// Samples requested from the coroutine at once
+        size_t blockSize;
+
+        /// Ring buffer of the queued samples
+        std::vector<float> ring;
+        size_t readPos = 0;
+        size_t numQueued = 0;
+
+        /// Set once the coroutine has returned
+        bool done = false;
+
+        Stream(Value co, size_t blockSize)
+        : co(co),
+          blockSize(blockSize),
+          ring(4 * blockSize)
+        {
+        }
+    };
+
+    /// Protects the ring buffers of the streams of all isolates
+    std::mutex streamMutex;
+    std::condition_variable streamCond;
+
+    /// Streams opened by the isolate of this thread
+    thread_local std::vector<Stream*> streams;
+
+    void streamCallback(void* userData, Uint8* out, int numBytes)
+    {
+        auto stream = (Stream*)userData;
+        auto dst = (float*)out;
+        auto numSamples = size_t(numBytes) / sizeof(float);
+
+        std::lock_guard<std::mutex> lock(streamMutex);
+
+        size_t i = 0;
+        for (; i < numSamples && stream->numQueued > 0; ++i)
+        {
+            dst[i] = stream->ring[stream->readPos];
+            stream->readPos = (stream->readPos + 1) % stream->ring.size();
+            stream->numQueued--;
+        }
+
+        // Output silence if the coroutine fell behind
+        for (; i < numSamples; ++i)
+            dst[i] = 0;
+
+        streamCond.notify_all();
+    }
+
+    /**
+    Open an output device whose samples are generated by a coroutine.
+    The coroutine is resumed with the number of samples there is room
+    for, and yields float32 buffers of samples, until it returns.
+    */
+    Value open_stream(
+        Value sample_rate_val,
+        Value num_channels,
+        Value co
+    )
+    {
+        if (!sample_rate_val.isInt32() || !num_channels.isInt32())
+            throw RunError("expected an int32 sample rate and channel count");
+
+        auto sampleRate = (int32_t)sample_rate_val;
+        if (sampleRate != 44100)
+            throw RunError("sample rate is currently fixed to 44100");
+
+        if (coroutineStatus(co) != "new")
+            throw RunError("expected a new coroutine");
+
+        SDL_Init(SDL_INIT_AUDIO);
+        SDL_AudioSpec want, have;
+
+        auto stream = new Stream(co, 0);
+
+        SDL_zero(want);
+        want.freq = sampleRate;
+        want.format = AUDIO_F32;
+        want.channels = (uint8_t)(int32_t)num_channels;
+        want.samples = 1024;
+        want.callback = streamCallback;
+        want.userdata = stream;
+
+        auto devId = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+        if (devId == 0)
+        {
+            delete stream;
+            throw RunError("failed to open the audio device");
+        }
+
+        stream->devId = devId;
+        stream->blockSize = size_t(have.samples) * have.channels;
+        stream->ring.resize(4 * stream->blockSize);
+        streams.push_back(stream);
+
+        SDL_PauseAudioDevice(devId, 0);
+
+        return Value::int32((int32_t)devId);
+    }
+
+    /// Copy samples yielded by a stream coroutine into its ring buffer
+    void queueStream(Stream* stream, Value samplesVal)
+    {
+        if (!samplesVal.isBuffer())
+            throw RunError("stream coroutines must yield sample buffers");
+
+        auto samples = Buffer(samplesVal);
+        if (samples.getType() != Buffer::FLOAT32)
+            throw RunError("audio sample buffers must be float32");
+
+        auto src = (float*)samples.getDataPtr();
+
+        std::lock_guard<std::mutex> lock(streamMutex);
+
+        auto& ring = stream->ring;
+        auto numSamples = std::min(
+            size_t(samples.length()),
+            ring.size() - stream->numQueued
+        );
+
+        auto writePos = (stream->readPos + stream->numQueued) % ring.size();
+        for (size_t i = 0; i < numSamples; ++i)
+        {
+            ring[writePos] = src[i];
+            writePos = (writePos + 1) % ring.size();
+        }
+
+        stream->numQueued += numSamples;
+    }
+
+    /**
+    Run the streams opened by this isolate, until all of their coroutines
+    have returned and their samples have been played. The thread sleeps
+    until a device callback needs samples, then resumes the coroutine of
+    that stream.
+    */
+    Value run_streams()
+    {
+        while (!streams.empty())
+        {
+            Stream* stream = nullptr;
+            size_t numWanted = 0;
+
+            {
+                std::unique_lock<std::mutex> lock(streamMutex);
+                streamCond.wait(lock, [&stream, &numWanted]()
+                {
+                    for (auto s : streams)
+                    {
+                        auto numFree = s->ring.size() - s->numQueued;
+                        if (s->done? (s->numQueued == 0):(numFree >= s->blockSize))
+                        {
+                            stream = s;
+                            numWanted = numFree;
+                            return true;
+                        }
+                    }
+
+                    return false;
+                });
+            }
+
+            // Close the streams which are done playing
+            if (stream->done)
+            {
+                SDL_CloseAudioDevice(stream->devId);
+                streams.erase(std::find(streams.begin(), streams.end(), stream));
+                delete stream;
+                continue;
+            }
+
+            auto samples = resumeCoroutine(
+                stream->co,
+                Value::int32((int32_t)numWanted)
+            );
+
+            if (coroutineStatus(stream->co) == "done")
+            {
+                std::lock_guard<std::mutex> lock(streamMutex);
+                stream->done = true;
+                continue;
+            }
+
+            queueStream(stream, samples);
+        }
+
+        return Value::UNDEF;
+    }
+#endif // HAVE_SDL2
+
+    Value get_pkg()
+    {
+#ifdef HAVE_SDL2
+        auto exports = Object::newObject(32);
+        setHostFn(exports, "open_output_device" , 2, (void*)open_output_device);
+        setHostFn(exports, "close_output_device", 1, (void*)close_output_device);
+        setHostFn(exports, "queue_samples"      , 2, (void*)queue_samples);
+        setHostFn(exports, "get_queue_size"     , 1, (void*)get_queue_size);
+        setHostFn(exports, "open_stream"        , 3, (void*)open_stream);
+        setHostFn(exports, "run_streams"        , 0, (void*)run_streams);
+        return exports;
+#else
+        throw DepMissing("core/audio", "libsdl2", "--with-sdl2");
+#endif
+    }
+}
+
+//============================================================================
+// core/thread/0 package
+//============================================================================
+
+/**
+Binary images of the packages loaded by the isolates, shared between all
+of them, so that each package is parsed only once per process. Images
+are immutable once added, and each isolate loading one deserializes it
+into its own heap. Only packages parsed from ZIM/ZIB images are shared:
+the output of language packages can hold runtime objects of the isolate
+which produced it, which is why it isn't cached as a ZIB image either.
+*/
+class SharedImages
+{
+private:
+
+    std::mutex mutex;
+
+    /// Source hashes and images, indexed by package path
+    std::unordered_map<
+        std::string,
+        std::pair<uint64_t, std::shared_ptr<const std::string>>
+    > images;
+
+public:
+
+    /// Find the image of a package, if one matches its source
+    std::shared_ptr<const std::string> find(
+        const std::string& pkgPath,
+        uint64_t srcHash
+    )
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto itr = images.find(pkgPath);
+        if (itr == images.end() || itr->second.first != srcHash)
+            return nullptr;
+
+        return itr->second.second;
+    }
+
+    /// Add the image of a package. Packages whose exports cannot be
+    /// serialized are not shared.
+    void add(const std::string& pkgPath, uint64_t srcHash, Value exportVal)
+    {
+        std::shared_ptr<const std::string> image;
+
+        try
+        {
+            image = std::make_shared<const std::string>(
+                serializeBin(exportVal, srcHash, true)
+            );
+        }
+        catch (RunError& err)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        images[pkgPath] = std::make_pair(srcHash, image);
+    }
+};
+
+/// Note: this is never destroyed, since isolates may still be running
+/// while the process exits
+static SharedImages& sharedImages = *new SharedImages();
+
+/// Set once a second isolate is spawned. Images are only shared from
+/// then on, since serializing them costs time.
+static std::atomic<bool> shareImages(false);
+
+size_t numWorkers = SIZE_MAX;
+
+namespace core_thread_0
+{
+    /**
+    Isolate, running on its own thread with its own heap and interpreter.
+    Messages are passed between isolates as binary images, which are
+    deep copies of the values sent, buffers included.
+    */
+    struct Isolate
+    {
+        int32_t id;
+
+        /// Id of the isolate which spawned this one, -1 for the main isolate
+        int32_t parentId;
+
+        std::thread thread;
+
+        /// Protects the inbox and the result
+        std::mutex mutex;
+        std::condition_variable inboxCond;
+
+        /// Messages received and not yet taken
+        std::deque<std::string> inbox;
+
+        /// Image of the value returned by thread_main, or error message
+        std::string result;
+        bool failed = false;
+        bool joined = false;
+    };
+
+    /// Isolates, indexed by id. Isolates are never removed, so that ids
+    /// stay unique. The main isolate has id 0.
+    /// Note: this is never destroyed, since isolates may still be
+    /// running while the process exits
+    std::mutex isolatesMutex;
+    std::vector<std::unique_ptr<Isolate>>& isolates =
+        *new std::vector<std::unique_ptr<Isolate>>();
+
+    /// Isolate running on this thread, created on first use
+    /// for the main isolate
+    thread_local Isolate* self = nullptr;
+
+    Isolate& getSelf()
+    {
+        if (!self)
+        {
+            std::lock_guard<std::mutex> lock(isolatesMutex);
+            if (isolates.empty())
+            {
+                isolates.emplace_back(new Isolate());
+                isolates[0]->id = 0;
+                isolates[0]->parentId = -1;
+            }
+            self = isolates[0].get();
+        }
+
+        return *self;
+    }
+
+    Isolate& getIsolate(Value idVal)
+    {
+        getSelf();
+
+        if (!idVal.isInt32())
+            throw RunError("expected an int32 isolate id");
+
+        auto id = (int32_t)idVal;
+
+        std::lock_guard<std::mutex> lock(isolatesMutex);
+        if (id < 0 || (size_t)id >= isolates.size())
+            throw RunError("invalid isolate id " + std::to_string(id));
+
+        return *isolates[id];
+    }
+
+    /// Decode a message, in the heap of the isolate of this thread
+    Value decodeMsg(const std::string& image)
+    {
+        Value val;
+        auto valid = deserializeBin(image.data(), image.size(), 0, val, true, true);
+
+        if (!valid)
+            throw RunError("failed to decode message image");
+
+        return val;
+    }
+
+    /// Run the thread_main function of a package in a new isolate
+    void runIsolate(Isolate* iso, std::string pkgName, std::string msgImage)
+    {
+        self = iso;
+
+        std::string result;
+        bool failed = false;
+
+        try
+        {
+            initInterp();
+
+            try
+            {
+                auto pkg = ::import(pkgName);
+                auto msg = decodeMsg(msgImage);
+                auto ret = callExportFn(pkg, "thread_main", { msg });
+                result = serializeBin(ret, 0, true);
+            }
+            catch (RunError& err)
+            {
+                result = err.toString();
+                failed = true;
+            }
+
+            shutdownInterp();
+        }
+        catch (RunError& err)
+        {
+            result = err.toString();
+            failed = true;
+        }
+
+        std::lock_guard<std::mutex> lock(iso->mutex);
+        iso->result = std::move(result);
+        iso->failed = failed;
+    }
+
+    /**
+    Spawn an isolate running the thread_main function exported by a
+    package, which receives a copy of a message value. Returns the id
+    of the new isolate.
+    */
+    Value spawn(Value pkgName, Value msg)
+    {
+        if (!pkgName.isString())
+            throw RunError("spawn expects a package name string");
+
+        auto parentId = getSelf().id;
+        auto msgImage = serializeBin(msg, 0, true);
+
+        shareImages = true;
+
+        std::lock_guard<std::mutex> lock(isolatesMutex);
+        auto iso = new Isolate();
+        iso->id = (int32_t)isolates.size();
+        iso->parentId = parentId;
+        isolates.emplace_back(iso);
+
+        iso->thread = std::thread(
+            runIsolate,
+            iso,
+            (std::string)pkgName,
+            std::move(msgImage)
+        );
+
+        return Value::int32(iso->id);
+    }
+
+    /**
+    Send a copy of a value to the inbox of an isolate
+    */
+    Value send(Value idVal, Value msg)
+    {
+        auto& iso = getIsolate(idVal);
+        auto msgImage = serializeBin(msg, 0, true);
+
+        std::lock_guard<std::mutex> lock(iso.mutex);
+        iso.inbox.push_back(std::move(msgImage));
+        iso.inboxCond.notify_one();
+
+        return Value::UNDEF;
+    }
+
+    /**
+    Take the next message from the inbox of this isolate,
+    waiting for one if the inbox is empty
+    */
+    Value recv()
+    {
+        auto& iso = getSelf();
+
+        std::unique_lock<std::mutex> lock(iso.mutex);
+        iso.inboxCond.wait(lock, [&iso]() { return !iso.inbox.empty(); });
+        auto msgImage = std::move(iso.inbox.front());
+        iso.inbox.pop_front();
+        lock.unlock();
+
+        return decodeMsg(msgImage);
+    }
+
+    /**
+    Get the number of messages waiting in the inbox of this isolate
+    */
+    Value poll()
+    {
+        auto& iso = getSelf();
+
+        std::lock_guard<std::mutex> lock(iso.mutex);
+        return Value::int32((int32_t)iso.inbox.size());
+    }
+
+    /**
+    Wait for an isolate to finish, and get a copy of the value its
+    thread_main function returned. Errors raised by the isolate are
+    raised again in the joining isolate.
+    */
+    Value join(Value idVal)
+    {
+        auto& iso = getIsolate(idVal);
+
+        if (&iso == &getSelf() || iso.id == 0)
+            throw RunError("cannot join the main or the current isolate");
+
+        {
+            std::lock_guard<std::mutex> lock(iso.mutex);
+            if (iso.joined)
+                throw RunError("isolate " + std::to_string(iso.id) + " already joined");
+            iso.joined = true;
+        }
+
+        iso.thread.join();
+
+        if (iso.failed)
+            throw RunError("isolate " + std::to_string(iso.id) + " failed: " + iso.result);
+
+        return decodeMsg(iso.result);
+    }
+
+    Value self_id()
+    {
+        return Value::int32(getSelf().id);
+    }
+
+    Value parent_id()
+    {
+        return Value::int32(getSelf().parentId);
+    }
+
+    /// Kinds of parallel loops
+    enum LoopKind
+    {
+        LOOP_FOR,
+        LOOP_MAP,
+        LOOP_REDUCE
+    };
+
+    /**
+    Parallel loop over an index range, split into chunks. The calling
+    isolate and each worker have a deque of chunks. They take chunks
+    from the front of their own deque, and steal chunks from the back
+    of the other deques once theirs is empty.
+    */
+    struct Loop
+    {
+        LoopKind kind;
+
+        /// Image of the function, the extra data and the initial value
+        /// of reductions, decoded once by each worker taking part
+        std::string fnImage;
+        bool hasData;
+
+        size_t length;
+        size_t chunkSize;
+        size_t numChunks;
+
+        /// Element type of the buffer written into, for loops over buffers
+        bool bufOut;
+        Buffer::ElemType elemType;
+
+        /// Images of the source elements of each chunk, if the
+        /// loop is over the elements of an array or buffer
+        std::vector<std::string> slices;
+
+        struct ChunkDeque
+        {
+            std::mutex mutex;
+            std::deque<size_t> chunks;
+        };
+
+        /// Chunk deques, indexed by participant. The caller is
+        /// participant 0, and worker i is participant i + 1.
+        std::unique_ptr<ChunkDeque[]> deques;
+        size_t numDeques;
+
+        /// Images of the results of the chunks run by workers. Chunks
+        /// run by the caller store their results directly.
+        std::vector<std::string> results;
+        std::vector<bool> ranByCaller;
+
+        /// Set when an element fails, so that the other chunks are skipped
+        std::atomic<bool> cancelled;
+
+        std::mutex doneMutex;
+        std::condition_variable doneCond;
+        size_t numDone = 0;
+        std::string error;
+
+        Loop(size_t length, size_t numDeques)
+        : length(length),
+          deques(new ChunkDeque[numDeques]),
+          numDeques(numDeques),
+          cancelled(false)
+        {
+            // Aim for a few chunks per participant, so that
+            // stealing can balance uneven chunks
+            chunkSize = std::max((length + 8 * numDeques - 1) / (8 * numDeques), size_t(1));
+            numChunks = (length + chunkSize - 1) / chunkSize;
+            results.resize(numChunks);
+            ranByCaller.resize(numChunks);
+
+            // Each participant starts with a contiguous range of chunks
+            for (size_t i = 0; i < numChunks; ++i)
+                deques[i * numDeques / numChunks].chunks.push_back(i);
+        }
+
+        size_t chunkStart(size_t chunk) const { return chunk * chunkSize; }
+
+        size_t chunkEnd(size_t chunk) const
+        {
+            return std::min((chunk + 1) * chunkSize, length);
+        }
+
+        /// Take a chunk to run, returns false once all chunks are taken
+        bool take(size_t self, size_t& chunk)
+        {
+            {
+                auto& own = deques[self];
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (!own.chunks.empty())
+                {
+                    chunk = own.chunks.front();
+                    own.chunks.pop_front();
+                    return true;
+                }
+            }
+
+            for (size_t i = 1; i < numDeques; ++i)
+            {
+                auto& victim = deques[(self + i) % numDeques];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.chunks.empty())
+                {
+                    chunk = victim.chunks.back();
+                    victim.chunks.pop_back();
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        void chunkDone(const std::string* errMsg = nullptr)
+        {
+            std::lock_guard<std::mutex> lock(doneMutex);
+
+            if (errMsg && !cancelled)
+            {
+                error = *errMsg;
+                cancelled = true;
+            }
+
+            if (++numDone == numChunks)
+                doneCond.notify_all();
+        }
+    };
+
+    /**
+    Pool of worker isolates running the chunks of parallel loops,
+    started on first use
+    */
+    struct WorkerPool
+    {
+        std::mutex mutex;
+        std::condition_variable workCond;
+
+        /// Loops which may still have chunks to take
+        std::deque<std::shared_ptr<Loop>> loops;
+
+        size_t numWorkers = 0;
+        bool started = false;
+
+        void remove(const std::shared_ptr<Loop>& loop)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto itr = std::find(loops.begin(), loops.end(), loop);
+            if (itr != loops.end())
+                loops.erase(itr);
+        }
+    };
+
+    /// Note: this is never destroyed, since workers run until
+    /// the process exits
+    WorkerPool& pool = *new WorkerPool();
+
+    /// Get an element of the source of a loop, which is an array, a
+    /// buffer, or undefined for index ranges
+    Value getSrcElem(Value src, size_t idx, size_t srcIdx)
+    {
+        if (src.isArray())
+            return Array(src).getElem(srcIdx);
+        if (src.isBuffer())
+            return Buffer(src).getElem(srcIdx);
+        return Value::int32((int32_t)idx);
+    }
+
+    /**
+    Run the elements of a chunk. The fnArgs array holds the function,
+    the extra data and the initial value of reductions. Results are
+    stored into an output array or buffer, at indices relative to an
+    output offset, and elements are read from the source at indices
+    relative to a source offset. Reductions return the value
+    accumulated over the chunk instead.
+    */
+    Value runChunk(
+        Loop& loop,
+        size_t chunk,
+        const GCRoot& fnArgs,
+        const GCRoot& src,
+        size_t srcOfs,
+        const GCRoot& out,
+        size_t outOfs
+    )
+    {
+        auto start = loop.chunkStart(chunk);
+        auto end = loop.chunkEnd(chunk);
+
+        auto acc = Array(fnArgs).getElem(2);
+        ValueVec args;
+
+        // Note: values are read from the roots again on each
+        // iteration, since calls may trigger collections
+        for (size_t i = start; i < end && !loop.cancelled; ++i)
+        {
+            args.clear();
+            if (loop.kind == LOOP_REDUCE)
+                args.push_back(acc);
+            args.push_back(getSrcElem(src, i, i - start + srcOfs));
+            if (loop.hasData)
+                args.push_back(Array(fnArgs).getElem(1));
+
+            auto fn = Object(Array(fnArgs).getElem(0));
+            auto ret = callFun(fn, args);
+
+            if (loop.kind == LOOP_REDUCE)
+                acc = ret;
+            else if (loop.bufOut)
+                Buffer(out).setElem(i - start + outOfs, ret);
+            else
+                Array(out).setElem(i - start + outOfs, ret);
+        }
+
+        return acc;
+    }
+
+    /// Allocate an array of undefined values
+    Value newUndefArray(size_t len)
+    {
+        auto arr = Array(len);
+        for (size_t i = 0; i < len; ++i)
+            arr.push(Value::UNDEF);
+        return arr;
+    }
+
+    /// Run the chunks of a loop on a worker, until none are left to take
+    void workOn(Loop& loop, size_t self)
+    {
+        size_t chunk;
+        if (!loop.take(self, chunk))
+            return;
+
+        GCRoot fnArgs(decodeMsg(loop.fnImage));
+
+        do
+        {
+            if (loop.cancelled)
+            {
+                loop.chunkDone();
+                continue;
+            }
+
+            try
+            {
+                auto len = loop.chunkEnd(chunk) - loop.chunkStart(chunk);
+                GCRoot slice(
+                    loop.slices.empty()? Value::UNDEF:decodeMsg(loop.slices[chunk])
+                );
+
+                Value outVal = Value::UNDEF;
+                if (loop.kind != LOOP_REDUCE)
+                {
+                    if (loop.bufOut)
+                        outVal = Buffer(loop.elemType, len);
+                    else
+                        outVal = newUndefArray(len);
+                }
+                GCRoot out(outVal);
+
+                auto acc = runChunk(loop, chunk, fnArgs, slice, 0, out, 0);
+
+                // The elements of buffers are sent as raw data
+                if (loop.kind == LOOP_REDUCE)
+                {
+                    loop.results[chunk] = serializeBin(acc, 0, true);
+                }
+                else if (loop.bufOut)
+                {
+                    auto buf = Buffer(out);
+                    loop.results[chunk].assign(
+                        (const char*)buf.getDataPtr(),
+                        len * Buffer::elemSize(loop.elemType)
+                    );
+                }
+                else
+                {
+                    loop.results[chunk] = serializeBin(out, 0, true);
+                }
+
+                loop.chunkDone();
+            }
+            catch (RunError& err)
+            {
+                auto errMsg = err.toString();
+                loop.chunkDone(&errMsg);
+            }
+        }
+        while (loop.take(self, chunk));
+    }
+
+    /// Wait for parallel loops, and run their chunks
+    void runWorker(Isolate* iso, size_t workerIdx)
+    {
+        self = iso;
+        initInterp();
+
+        for (;;)
+        {
+            std::shared_ptr<Loop> loop;
+            {
+                std::unique_lock<std::mutex> lock(pool.mutex);
+                pool.workCond.wait(lock, []() { return !pool.loops.empty(); });
+                loop = pool.loops.front();
+            }
+
+            workOn(*loop, workerIdx + 1);
+
+            // No chunks are left to take in this loop
+            pool.remove(loop);
+        }
+    }
+
+    /// Start the worker pool, if not already started
+    size_t startPool()
+    {
+        auto parentId = getSelf().id;
+
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        if (pool.started)
+            return pool.numWorkers;
+
+        pool.started = true;
+        pool.numWorkers = numWorkers;
+        if (numWorkers == SIZE_MAX)
+        {
+            auto numCores = std::thread::hardware_concurrency();
+            pool.numWorkers = (numCores > 1)? (numCores - 1):0;
+        }
+        lock.unlock();
+
+        if (pool.numWorkers > 0)
+            shareImages = true;
+
+        for (size_t i = 0; i < pool.numWorkers; ++i)
+        {
+            // Workers cannot be joined
+            std::lock_guard<std::mutex> lock(isolatesMutex);
+            auto iso = new Isolate();
+            iso->id = (int32_t)isolates.size();
+            iso->parentId = parentId;
+            iso->joined = true;
+            isolates.emplace_back(iso);
+
+            std::thread(runWorker, iso, i).detach();
+        }
+
+        return pool.numWorkers;
+    }
+
+    /**
+    Run a parallel loop over the elements of a source, which is an
+    array, a buffer, or undefined for the index range of the output.
+    Loops which are not reductions store their results into the output,
+    an array or buffer with one element per element of the source.
+    */
+    Value runLoop(
+        LoopKind kind,
+        Value srcVal,
+        Value outVal,
+        size_t length,
+        Value fnVal,
+        Value initVal,
+        HostArgs args,
+        size_t dataIdx
+    )
+    {
+        if (!fnVal.isObject())
+            throw RunError("expected a function to run in parallel");
+
+        auto hasData = args.size() > dataIdx;
+        auto fnArgsVal = Array(3);
+        fnArgsVal.push(fnVal);
+        fnArgsVal.push(hasData? args[dataIdx]:Value::UNDEF);
+        fnArgsVal.push(initVal);
+        GCRoot fnArgs(fnArgsVal);
+        GCRoot src(srcVal);
+        GCRoot out(outVal);
+
+        auto numWorkers = startPool();
+        auto loop = std::make_shared<Loop>(length, numWorkers + 1);
+        loop->kind = kind;
+        loop->hasData = hasData;
+        loop->bufOut = outVal.isBuffer();
+        if (loop->bufOut)
+            loop->elemType = Buffer(outVal).getType();
+
+        // Copies of the function and of the source elements
+        // of each chunk are sent to the workers
+        if (numWorkers > 0)
+        {
+            loop->fnImage = serializeBin(fnArgs, 0, true);
+
+            if (srcVal.isArray() || srcVal.isBuffer())
+            {
+                loop->slices.resize(loop->numChunks);
+
+                for (size_t i = 0; i < loop->numChunks; ++i)
+                {
+                    auto start = loop->chunkStart(i);
+                    auto len = loop->chunkEnd(i) - start;
+
+                    if (srcVal.isArray())
+                    {
+                        auto arr = Array(srcVal);
+                        auto slice = Array(len);
+                        for (size_t j = 0; j < len; ++j)
+                            slice.push(arr.getElem(start + j));
+                        loop->slices[i] = serializeBin(slice, 0, true);
+                    }
+                    else
+                    {
+                        auto buf = Buffer(srcVal);
+                        auto slice = Buffer(buf.getType(), len);
+                        auto elemSize = Buffer::elemSize(buf.getType());
+                        memcpy(
+                            slice.getDataPtr(),
+                            buf.getDataPtr() + start * elemSize,
+                            len * elemSize
+                        );
+                        loop->slices[i] = serializeBin(slice, 0);
+                    }
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            pool.loops.push_back(loop);
+            pool.workCond.notify_all();
+        }
+
+        // The calling isolate runs chunks too, without copies
+        GCRoot accs(newUndefArray(loop->numChunks));
+        size_t chunk;
+        while (loop->take(0, chunk))
+        {
+            if (loop->cancelled)
+            {
+                loop->chunkDone();
+                continue;
+            }
+
+            try
+            {
+                auto start = loop->chunkStart(chunk);
+                auto acc = runChunk(*loop, chunk, fnArgs, src, start, out, start);
+                Array(accs).setElem(chunk, acc);
+                loop->ranByCaller[chunk] = true;
+                loop->chunkDone();
+            }
+            catch (RunError& err)
+            {
+                auto errMsg = err.toString();
+                loop->chunkDone(&errMsg);
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(loop->doneMutex);
+            loop->doneCond.wait(
+                lock,
+                [&loop]() { return loop->numDone == loop->numChunks; }
+            );
+        }
+
+        if (numWorkers > 0)
+            pool.remove(loop);
+
+        if (loop->cancelled)
+            throw RunError(loop->error);
+
+        // Gather the results of the chunks run by workers
+        for (size_t i = 0; i < loop->numChunks; ++i)
+        {
+            if (loop->ranByCaller[i])
                 continue;
+
+            auto& result = loop->results[i];
+            auto start = loop->chunkStart(i);
+
+            if (kind == LOOP_REDUCE)
+            {
+                Array(accs).setElem(i, decodeMsg(result));
+            }
+            else if (loop->bufOut)
+            {
+                auto buf = Buffer(out);
+                auto elemSize = Buffer::elemSize(loop->elemType);
+                memcpy(buf.getDataPtr() + start * elemSize, result.data(), result.size());
+            }
+            else
+            {
+                auto arr = Array(out);
+                auto chunkArr = Array(decodeMsg(result));
+                for (size_t j = 0; j < chunkArr.length(); ++j)
+                    arr.setElem(start + j, chunkArr.getElem(j));
             }
         }
 
-        // No event to process
-        return Value::FALSE;
+        if (kind != LOOP_REDUCE)
+            return out;
+
+        // Combine the values accumulated over each chunk, in order
+        if (loop->numChunks == 0)
+            return initVal;
+
+        auto acc = Array(accs).getElem(0);
+        for (size_t i = 1; i < loop->numChunks; ++i)
+        {
+            auto fn = Object(Array(fnArgs).getElem(0));
+            ValueVec callArgs = { acc, Array(accs).getElem(i) };
+            if (hasData)
+                callArgs.push_back(Array(fnArgs).getElem(1));
+            acc = callFun(fn, callArgs);
+        }
+
+        return acc;
+    }
+
+    /// Get the length of the source of a parallel loop, which is an
+    /// array, a buffer, or a non-negative int32 index range
+    size_t srcLength(Value src)
+    {
+        if (src.isArray())
+            return Array(src).length();
+        if (src.isBuffer())
+            return Buffer(src).length();
+        if (src.isInt32() && (int32_t)src >= 0)
+            return (size_t)(int32_t)src;
+
+        throw RunError(
+            "parallel loops expect an array, a buffer or an int32 length"
+        );
     }
 
     /**
-    Display a bitmap (array of pixels) into the window.
-    Pixels are in ABGR format (alpha least significant),
-    with one int32 value per pixel.
+    Store fn(i) into each element of an array or buffer, in parallel.
+    An extra data argument, if given, is passed as the last argument
+    of each call.
     */
-    Value draw_bitmap(Value handle, Value pixelsArray)
+    HostStatus parallel_for(HostArgs args, Value& ret)
     {
-        // For now, only one window is supported
-        assert (handle == Value((refptr)window, TAG_RAWPTR));
-
-        auto pixels = (Array)pixelsArray;
-        assert (pixels.length() == width * height);
-
-        for (size_t pixIdx = 0; pixIdx < width * height; ++pixIdx)
+        auto dst = args[0];
+        if (!dst.isArray() && !dst.isBuffer())
         {
-            // Mask out the alpha channel so its content is ignored
-            auto pixVal = (int32_t)pixels.getElem(pixIdx);
-            pixVal = 0xFFFFFF00 & pixVal;
-            pixelBuffer[pixIdx] = pixVal;
+            ret = String("parallel_for expects an array or a buffer");
+            return HOST_ERROR;
         }
 
-        SDL_UpdateTexture(texture, NULL, &pixelBuffer[0], width * 4);
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-        SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, texture, NULL, NULL);
-        SDL_RenderPresent(renderer);
-        return Value::UNDEF;
+        auto len = srcLength(dst);
+        runLoop(LOOP_FOR, Value::UNDEF, dst, len, args[1], Value::UNDEF, args, 2);
+        ret = Value::UNDEF;
+        return HOST_OK;
+    }
+
+    /**
+    Map a function over the elements of an array, a buffer, or the
+    indices of an int32 range, in parallel. Buffers produce a buffer
+    with the same element type, and other sources produce an array.
+    */
+    HostStatus parallel_map(HostArgs args, Value& ret)
+    {
+        auto src = args[0];
+        auto len = srcLength(src);
+
+        auto out = src.isBuffer()?
+            Value(Buffer(Buffer(src).getType(), len)):newUndefArray(len);
+
+        ret = runLoop(
+            LOOP_MAP,
+            src.isInt32()? Value::UNDEF:src,
+            out,
+            len,
+            args[1],
+            Value::UNDEF,
+            args,
+            2
+        );
+        return HOST_OK;
+    }
+
+    /**
+    Reduce the elements of an array, a buffer, or the indices of an
+    int32 range with fn(acc, elem), in parallel. Each chunk of elements
+    is reduced starting from the initial value, and the results of the
+    chunks are then combined in order, so the function must be
+    associative and the initial value must be its identity.
+    */
+    HostStatus parallel_reduce(HostArgs args, Value& ret)
+    {
+        auto src = args[0];
+        auto len = srcLength(src);
+
+        ret = runLoop(
+            LOOP_REDUCE,
+            src.isInt32()? Value::UNDEF:src,
+            Value::UNDEF,
+            len,
+            args[1],
+            args[2],
+            args,
+            3
+        );
+        return HOST_OK;
+    }
+
+    /**
+    Get the number of worker isolates running parallel loops,
+    starting them if needed
+    */
+    Value num_workers()
+    {
+        return Value::int32((int32_t)startPool());
     }
-#endif // HAVE_SDL2
 
     Value get_pkg()
     {
-#ifdef HAVE_SDL2
         auto exports = Object::newObject(32);
-        setHostFn(exports, "create_window"  , 3, (void*)create_window);
-        setHostFn(exports, "destroy_window" , 1, (void*)destroy_window);
-        setHostFn(exports, "get_next_event" , 1, (void*)get_next_event);
-        setHostFn(exports, "draw_bitmap"    , 2, (void*)draw_bitmap);
+        setHostFn(exports, "spawn"        , 2, (void*)spawn);
+        setHostFn(exports, "send"         , 2, (void*)send);
+        setHostFn(exports, "recv"         , 0, (void*)recv);
+        setHostFn(exports, "poll"         , 0, (void*)poll, HOST_NO_THROW);
+        setHostFn(exports, "join"         , 1, (void*)join);
+        setHostFn(exports, "self_id"      , 0, (void*)self_id, HOST_NO_THROW);
+        setHostFn(exports, "parent_id"    , 0, (void*)parent_id, HOST_NO_THROW);
+        setHostFnV(exports, "parallel_for" , 2, 3, parallel_for);
+        setHostFnV(exports, "parallel_map" , 2, 3, parallel_map);
+        setHostFnV(exports, "parallel_reduce", 3, 4, parallel_reduce);
+        setHostFn(exports, "num_workers"  , 0, (void*)num_workers);
         return exports;
-#else
-        throw DepMissing("core/window", "libsdl2", "--with-sdl2");
-#endif
     }
 }
 
-//============================================================================
-// core/audio/0 package
 //============================================================================
 
-namespace core_audio_0
+// Cache of the packages loaded by the isolate of this thread
+thread_local std::unordered_map<std::string, Value> pkgCache;
+
+/// Visit the garbage collection roots held by the package system
+void visitPkgRoots(VM& vm)
 {
-#ifdef HAVE_SDL2
-    bool paused = true;
+    for (auto& pair : pkgCache)
+        vm.visit(pair.second);
+}
 
-    Value open_output_device(
-        Value sample_rate_val,
-        Value num_channels
-    )
+/// Test if a string is a valid global package name,
+/// of the form ([a-z0-9]+/)*[0-9]+
+static bool isGlobalPkgName(const std::string& pkgName)
+{
+    auto lastSlash = pkgName.rfind('/');
+    auto verStart = (lastSlash == std::string::npos)? 0:lastSlash + 1;
+
+    // The version number ends the name
+    if (verStart == pkgName.size())
+        return false;
+    for (size_t i = verStart; i < pkgName.size(); ++i)
     {
-        assert (sample_rate_val.isInt32());
-        assert (num_channels.isInt32());
+        if (pkgName[i] < '0' || pkgName[i] > '9')
+            return false;
+    }
 
-        auto sampleRate = (int32_t)sample_rate_val;
-        if (sampleRate != 44100)
-            throw RunError("sample rate is currently fixed to 44100");
+    size_t partLen = 0;
+    for (size_t i = 0; i < verStart; ++i)
+    {
+        auto ch = pkgName[i];
 
-        SDL_Init(SDL_INIT_AUDIO);
-        SDL_AudioSpec want, have;
+        if (ch == '/')
+        {
+            if (partLen == 0)
+                return false;
+            partLen = 0;
+        }
+        else if ((ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9'))
+        {
+            ++partLen;
+        }
+        else
+        {
+            return false;
+        }
+    }
 
-        SDL_zero(want);
-        want.freq = sampleRate;
-        want.format = AUDIO_F32;
-        want.channels = (uint8_t)(int32_t)num_channels;
-        want.samples = 4096;
-        want.callback = NULL;
+    return true;
+}
 
-        auto devId = (int32_t)SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_ANY_CHANGE);
+/// Get the path of the package file for a global package name
+static std::string globalPkgPath(const std::string& pkgName)
+{
+    return PKGS_DIR + pkgName + "/package";
+}
 
-        assert (want.format == have.format);
-        assert (want.freq == have.freq);
-        assert (want.channels = have.channels);
+/**
+Files backing a package, mapped into memory before the package
+is loaded. Reading them does not touch the heap, so this can
+be done on a worker thread.
+*/
+struct PkgFiles
+{
+    /// Package source file
+    std::unique_ptr<Input> input;
 
-        return Value::int32(devId);
+    /// Hash of the package source
+    uint64_t srcHash;
+
+    /// Cached binary image, if one matches the source
+    std::unique_ptr<Input> zib;
+};
+
+/// Map the files backing a package. The binary image cached next to
+/// the package file is only kept if it matches the package source.
+static void readPkgFiles(
+    std::string pkgPath,
+    bool cacheImage,
+    PkgFiles& files
+)
+{
+    files.input.reset(new Input(pkgPath));
+
+    files.srcHash = (uint64_t)murmurHash2(
+        files.input->getInputData(),
+        files.input->getInputLen(),
+        1337
+    );
+
+    auto zibPath = pkgPath + ".zib";
+    if (!cacheImage || !fileExists(zibPath))
+        return;
+
+    try
+    {
+        files.zib.reset(new Input(zibPath));
+    }
+    catch (ParseError& err)
+    {
+        return;
     }
 
-    Value queue_samples(
-        Value dev,
-        Value samplesArray
-    )
+    auto valid = checkBinImage(
+        files.zib->getInputData(),
+        files.zib->getInputLen(),
+        files.srcHash
+    );
+
+    if (!valid)
+        files.zib.reset();
+}
+
+/// Find the names of the packages which a package source may import.
+/// This is a textual scan for string literals which look like package
+/// names, so it can run on a worker thread. Names which are never
+/// actually imported only cost a wasted prefetch.
+static std::vector<std::string> scanImports(const char* data, size_t len)
+{
+    std::vector<std::string> names;
+
+    for (size_t i = 0; i < len; ++i)
     {
-        assert(dev.isInt32());
-        assert(samplesArray.isArray());
-        auto devID = (int32_t)dev;
+        auto quote = data[i];
+        if (quote != '"' && quote != '\'')
+            continue;
 
-        if (paused)
+        // Find the end of the string literal on the same line
+        auto end = i + 1;
+        while (end < len && data[end] != quote && data[end] != '\n')
+            ++end;
+
+        if (end >= len || data[end] != quote)
         {
-            paused = false;
-            SDL_PauseAudioDevice(devID, 0);
+            i = end;
+            continue;
         }
 
-        auto samples = (Array)samplesArray;
+        // Filter out most strings before matching the name formats
+        auto strLen = end - (i + 1);
+        auto str = data + i + 1;
+        if (strLen > 2 && strLen < 256 && memchr(str, '/', strLen))
+        {
+            std::string name(str, strLen);
 
-        if (samples.length() == 0)
-            return Value::UNDEF;
+            if (name.substr(0, 2) == "./" || isGlobalPkgName(name))
+                names.push_back(name);
+        }
 
-        float samples_buf[samples.length()];
+        i = end;
+    }
 
-        for (size_t i = 0; i < samples.length(); i++)
+    return names;
+}
+
+/**
+Pool of worker threads which map and validate the files of the packages
+a program imports, ahead of time. The import list of each prefetched
+package is scanned so that its own dependencies are prefetched as well.
+The packages are still loaded and initialized on the main thread, in
+the order in which they get imported, since the heap is not thread-safe.
+*/
+class Prefetcher
+{
+private:
+
+    std::mutex mutex;
+
+    /// Signaled when work is queued, or when the workers must stop
+    std::condition_variable workCond;
+
+    /// Signaled when a package is done being prefetched
+    std::condition_variable doneCond;
+
+    /// Package paths waiting to be prefetched, and whether their cached
+    /// binary images should be read
+    std::deque<std::pair<std::string, bool>> queue;
+
+    /// Every path ever queued, so that each is only prefetched once
+    std::unordered_set<std::string> queued;
+
+    /// Paths being prefetched by a worker
+    std::unordered_set<std::string> running;
+
+    /// Prefetched files, waiting to be loaded
+    std::unordered_map<std::string, std::unique_ptr<PkgFiles>> done;
+
+    std::vector<std::thread> workers;
+
+    bool stopping = false;
+
+    /// Queue a package by name. Must be called with the mutex held.
+    void enqueue(const std::string& pkgName)
+    {
+        auto isLocal = !isGlobalPkgName(pkgName);
+        auto pkgPath = isLocal? pkgName:globalPkgPath(pkgName);
+
+        if (!queued.insert(pkgPath).second)
+            return;
+
+        queue.push_back({ pkgPath, !isLocal });
+        workCond.notify_one();
+    }
+
+    void workerLoop()
+    {
+        std::unique_lock<std::mutex> guard(mutex);
+
+        while (true)
         {
-            auto elem = samples.getElem(i);
+            workCond.wait(guard, [this] { return stopping || !queue.empty(); });
 
-            if (!elem.isFloat32())
+            if (stopping)
+                return;
+
+            auto pkgPath = queue.front().first;
+            auto cacheImage = queue.front().second;
+            queue.pop_front();
+            running.insert(pkgPath);
+
+            guard.unlock();
+
+            // Missing or unreadable files are left to the main
+            // thread, which reports the error when importing
+            std::unique_ptr<PkgFiles> files(new PkgFiles());
+            std::vector<std::string> deps;
+            try
+            {
+                if (fileExists(pkgPath))
+                {
+                    readPkgFiles(pkgPath, cacheImage, *files);
+                    deps = scanImports(
+                        files->input->getInputData(),
+                        files->input->getInputLen()
+                    );
+                }
+            }
+            catch (ParseError& err)
             {
-                throw RunError("audio samples must be float32");
             }
 
-            float sample = (float)elem > 1.0f ? 1.0f : elem;
-            sample = sample < -1.0f ? -1.0f : sample;
-            samples_buf[i] = sample;
+            guard.lock();
+
+            running.erase(pkgPath);
+            if (files->input)
+                done[pkgPath] = std::move(files);
+            for (auto& dep : deps)
+                enqueue(dep);
+
+            doneCond.notify_all();
         }
+    }
 
-        if (SDL_QueueAudio(devID, samples_buf, sizeof(samples_buf)) != 0)
+public:
+
+    ~Prefetcher()
+    {
         {
-            return Value::FALSE;
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+            workCond.notify_all();
         }
 
-        return Value::TRUE;
+        for (auto& worker : workers)
+            worker.join();
     }
 
-    Value get_queue_size(
-        Value dev
-    )
+    /// Start prefetching a package and its dependencies
+    void prefetch(const std::string& pkgName)
     {
-        assert(dev.isInt32());
+        std::lock_guard<std::mutex> guard(mutex);
 
-        auto devID = (int32_t)dev;
+        if (workers.empty())
+        {
+            auto numWorkers = std::thread::hardware_concurrency();
+            numWorkers = std::max(1u, std::min(numWorkers, 4u));
 
-        auto numBytes = SDL_GetQueuedAudioSize(devID);
-        auto numSamples = numBytes / 4;
+            for (size_t i = 0; i < numWorkers; ++i)
+                workers.emplace_back(&Prefetcher::workerLoop, this);
+        }
 
-        return Value::int32((int32_t)numSamples);
+        enqueue(pkgName);
     }
 
-    Value close_output_device(
-        Value dev
-    )
+    /// Take the prefetched files of a package, waiting for a worker if
+    /// one is reading them. Queued packages no worker has started on yet
+    /// are read by the caller, and their dependencies still get queued.
+    bool take(const std::string& pkgPath, PkgFiles& files)
     {
-        assert(dev.isInt32());
+        std::unique_lock<std::mutex> guard(mutex);
 
-        auto devID = (int32_t)dev;
-        SDL_CloseAudioDevice(devID);
+        doneCond.wait(guard, [&] { return !running.count(pkgPath); });
 
-        return Value::UNDEF;
+        auto itr = done.find(pkgPath);
+        if (itr != done.end())
+        {
+            files = std::move(*itr->second);
+            done.erase(itr);
+            return true;
+        }
+
+        auto qItr = std::find_if(
+            queue.begin(),
+            queue.end(),
+            [&](const std::pair<std::string, bool>& entry)
+            {
+                return entry.first == pkgPath;
+            }
+        );
+
+        if (qItr == queue.end())
+            return false;
+
+        auto cacheImage = qItr->second;
+        queue.erase(qItr);
+
+        guard.unlock();
+        readPkgFiles(pkgPath, cacheImage, files);
+        auto deps = scanImports(
+            files.input->getInputData(),
+            files.input->getInputLen()
+        );
+        guard.lock();
+
+        for (auto& dep : deps)
+            enqueue(dep);
+
+        return true;
     }
-#endif // HAVE_SDL2
+};
 
-    Value get_pkg()
+/// Package prefetcher, created on the first prefetch request
+static thread_local std::unique_ptr<Prefetcher> prefetcher;
+
+void prefetch(std::string pkgName)
+{
+    if (!prefetcher)
+        prefetcher.reset(new Prefetcher());
+
+    prefetcher->prefetch(pkgName);
+}
+
+/// Load the cached binary image of a package
+bool loadCachedImage(PkgFiles& files, Value& exportVal)
+{
+    if (!files.zib)
+        return false;
+
+    return deserializeBin(
+        files.zib->getInputData(),
+        files.zib->getInputLen(),
+        files.srcHash,
+        exportVal,
+        true
+    );
+}
+
+/// Write the binary image of a package next to the package file.
+/// Failures are ignored, since the cached image is only an optimization.
+void writeCachedImage(std::string zibPath, uint64_t srcHash, Value exportVal)
+{
+    std::string image;
+
+    try
     {
-#ifdef HAVE_SDL2
-        auto exports = Object::newObject(32);
-        setHostFn(exports, "open_output_device" , 2, (void*)open_output_device);
-        setHostFn(exports, "close_output_device", 1, (void*)close_output_device);
-        setHostFn(exports, "queue_samples"      , 2, (void*)queue_samples);
-        setHostFn(exports, "get_queue_size"     , 1, (void*)get_queue_size);
-        return exports;
+        image = serializeBin(exportVal, srcHash);
+    }
+    catch (RunError& err)
+    {
+        return;
+    }
+
+    // Write a temporary file first, so that a partially written
+    // image is never seen by another process
+#ifndef _WIN32
+    auto tmpPath = zibPath + "." + std::to_string(getpid()) + ".tmp";
 #else
-        throw DepMissing("core/audio", "libsdl2", "--with-sdl2");
+    auto tmpPath = zibPath + ".tmp";
 #endif
-    }
-}
+    auto file = fopen(tmpPath.c_str(), "wb");
 
-//============================================================================
+    if (!file)
+        return;
+
+    auto written = fwrite(image.data(), 1, image.size(), file);
 
-// Cache of loaded packages
-std::unordered_map<std::string, Value> pkgCache;
+    if (fclose(file) != 0 || written != image.size() ||
+        rename(tmpPath.c_str(), zibPath.c_str()) != 0)
+    {
+        remove(tmpPath.c_str());
+    }
+}
 
 /// Load a package based on its path
-Object load(std::string pkgPath)
+Object load(std::string pkgPath, bool cacheImage)
 {
-    Input input(pkgPath);
+    // Use the package files if they were prefetched
+    PkgFiles files;
+    if (!prefetcher || !prefetcher->take(pkgPath, files))
+        readPkgFiles(pkgPath, cacheImage, files);
+
+    auto& input = *files.input;
 
     Value exportVal;
 
     // Parse the language directive
     auto langPkgName = parseLang(input);
 
+    // Packages already loaded by another isolate are not parsed again
+    std::shared_ptr<const std::string> sharedImage;
+    if (shareImages && langPkgName == "")
+        sharedImage = sharedImages.find(pkgPath, files.srcHash);
+
+    if (sharedImage)
+    {
+        auto valid = deserializeBin(
+            sharedImage->data(),
+            sharedImage->size(),
+            files.srcHash,
+            exportVal,
+            true,
+            true
+        );
+
+        if (!valid)
+        {
+            throw ImportError(
+                "failed to load the shared image of package \"" +
+                pkgPath + "\""
+            );
+        }
+    }
+
     // If a language package is specified
-    if (langPkgName != "")
+    else if (langPkgName != "")
     {
         //std::cout << "Loading language package" << std::endl;
 
@@ -806,7 +3886,11 @@ Object load(std::string pkgPath)
         // Create an object to pass the input data
         auto inputObj = Object::newObject();
         inputObj.setField("src_name", String(input.getSrcName()));
-        inputObj.setField("src_string", String(input.getInputStr()));
+        auto srcString = String::newString(
+            input.getInputData(),
+            input.getInputLen()
+        );
+        inputObj.setField("src_string", srcString);
         inputObj.setField("str_idx", Value::int32(input.getInputIdx()));
         inputObj.setField("line_no", Value::int32(input.getLineNo()));
         inputObj.setField("col_no", Value::int32(input.getColNo()));
@@ -820,12 +3904,21 @@ Object load(std::string pkgPath)
 
         //std::cout << "Returned from parse_input" << std::endl;
     }
-    else
+
+    // Binary images are cached next to the package file, and
+    // tagged with the hash of the package source
+    else if (!cacheImage || !loadCachedImage(files, exportVal))
     {
         // Parse the package file contents
         exportVal = parseInput(input);
+
+        if (cacheImage)
+            writeCachedImage(pkgPath + ".zib", files.srcHash, exportVal);
     }
 
+    if (shareImages && langPkgName == "" && !sharedImage)
+        sharedImages.add(pkgPath, files.srcHash, exportVal);
+
     if (!exportVal.isObject())
     {
         throw RunError("exports value is not an object");
@@ -845,10 +3938,18 @@ Value getCorePkg(std::string pkgName)
         return core_io_0::get_pkg();
     if (pkgName == "core/time/0")
         return core_time_0::get_pkg();
+    if (pkgName == "core/buffer/0")
+        return core_buffer_0::get_pkg();
+    if (pkgName == "core/map/0")
+        return core_map_0::get_pkg();
+    if (pkgName == "core/simd/0")
+        return core_simd_0::get_pkg();
     if (pkgName == "core/window/0")
         return core_window_0::get_pkg();
     if (pkgName == "core/audio/0")
         return core_audio_0::get_pkg();
+    if (pkgName == "core/thread/0")
+        return core_thread_0::get_pkg();
 
     return Value::UNDEF;
 }
@@ -879,13 +3980,13 @@ Object import(std::string pkgName)
     // Otherwise, this is a global import
     else
     {
-        if (!regex_match(pkgName, std::regex("([a-z0-9]+/)*[0-9]+")))
+        if (!isGlobalPkgName(pkgName))
         {
             throw ImportError("invalid global package name \"" + pkgName + "\"");
         }
 
         // Look in the package directory
-        auto pkgDirPath = PKGS_DIR + pkgName + "/package";
+        auto pkgDirPath = globalPkgPath(pkgName);
 
         if (fileExists(pkgDirPath))
         {
@@ -896,8 +3997,8 @@ Object import(std::string pkgName)
     // If a package file was found for the given package name
     if (pkgPath != "")
     {
-        // Load the package file
-        auto pkg = load(pkgPath);
+        // Load the package file, caching the images of global packages
+        auto pkg = load(pkgPath, pkgName.substr(0, 2) != "./");
 
         // Cache the package
         pkgCache[pkgName] = pkg;
@@ -908,7 +4009,8 @@ Object import(std::string pkgName)
             callExportFn(pkg, "init");
         }
 
-        return pkg;
+        // Note: the package object may have moved during initialization
+        return Object(pkgCache[pkgName]);
     }
 
     // If we can find a core package for this name
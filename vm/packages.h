@@ -2,6 +2,61 @@
 
 #include "runtime.h"
 
+/**
+Arguments of a variadic host function, read in place from the
+interpreter stack. The stack grows downward, so successive
+arguments are found at decreasing addresses.
+*/
+class HostArgs
+{
+private:
+
+    Value* first;
+
+    size_t num;
+
+public:
+
+    HostArgs(Value* first, size_t num)
+    : first(first),
+      num(num)
+    {
+    }
+
+    size_t size() const { return num; }
+
+    Value operator [] (size_t idx) const
+    {
+        assert (idx < num);
+        return first[-(ptrdiff_t)idx];
+    }
+};
+
+/// Completion status of a variadic host function
+enum HostStatus : uint8_t
+{
+    HOST_OK,
+    HOST_ERROR
+};
+
+/**
+Variadic host function. On success, the function writes its return
+value into ret. On failure, it writes an error message string into
+ret and returns HOST_ERROR, instead of throwing a RunError.
+*/
+typedef HostStatus (*HostFnV)(HostArgs args, Value& ret);
+
+/// Host function flags
+enum HostFlags : uint8_t
+{
+    /// The function never throws C++ exceptions, so that calls
+    /// can skip setting up an exception handler
+    HOST_NO_THROW   = 1 << 0,
+
+    /// The function uses the variadic calling convention (HostFnV)
+    HOST_VARIADIC   = 1 << 1,
+};
+
 /**
 Host function wrapper
 */
@@ -13,14 +68,29 @@ private:
 
     size_t numParams;
 
+    /// Maximum argument count of variadic functions
+    size_t maxParams;
+
     void* fptr;
 
+    uint8_t flags;
+
 public:
 
     HostFn(
         std::string name,
         size_t numParams,
-        void* fptr
+        void* fptr,
+        uint8_t flags = 0
+    );
+
+    /// Create a variadic host function
+    HostFn(
+        std::string name,
+        size_t minParams,
+        size_t maxParams,
+        HostFnV fptr,
+        uint8_t flags = 0
     );
 
     Value call0();
@@ -28,7 +98,20 @@ public:
     Value call2(Value arg0, Value arg1);
     Value call3(Value arg0, Value arg1, Value arg2);
 
+    HostStatus callV(HostArgs args, Value& ret)
+    {
+        assert (isVariadic());
+        assert (args.size() >= numParams && args.size() <= maxParams);
+        return ((HostFnV)fptr)(args, ret);
+    }
+
+    bool isVariadic() const { return flags & HOST_VARIADIC; }
+    bool noThrow() const { return flags & HOST_NO_THROW; }
+
+    /// Get the parameter count, or the minimum argument
+    /// count of a variadic function
     size_t getNumParams() const { return numParams; }
+    size_t getMaxParams() const { return maxParams; }
 };
 
 class ImportError : public RunError
@@ -71,8 +154,22 @@ public:
 /// User-facing import function, used to implement the import instruction
 extern HostFn importFn;
 
-/// Load a package based on its path
-Object load(std::string pkgPath);
+/// Load a package based on its path. Packages in the ZIM format can
+/// be loaded from a binary image cached next to the package file.
+Object load(std::string pkgPath, bool cacheImage = false);
+
+/// Start reading the files of a package, and of the packages it may
+/// import, on worker threads. The name may also be the path of a
+/// local package file.
+void prefetch(std::string pkgName);
+
+/// Number of worker isolates running the parallel loops of the
+/// core/thread/0 package, SIZE_MAX to use one per extra core
+/// Note: this must be set before the first parallel loop runs
+extern size_t numWorkers;
 
 /// Import a package based on its name, and perform caching
 Object import(std::string pkgName);
+
+/// Visit the garbage collection roots held by the package system
+void visitPkgRoots(VM& vm);
@@ -9,10 +9,62 @@
 #include <functional>
 #include "runtime.h"
 #include "parser.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
-/// Read an entire file at once
-std::string readFile(std::string fileName)
+Input::Input(std::string fileName)
+: srcName(fileName),
+  strIdx(0),
+  lineNo(1),
+  colNo(1)
 {
+#ifndef _WIN32
+    // Map the file, so that it is parsed directly from the page cache
+    // without being copied into memory
+    int fd = open(fileName.c_str(), O_RDONLY);
+
+    if (fd < 0)
+    {
+        throw ParseError(
+            "failed to open file \"" + fileName + "\""
+        );
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0)
+    {
+        close(fd);
+        throw ParseError(
+            "failed to read file \"" + fileName + "\""
+        );
+    }
+
+    inLen = fileStat.st_size;
+
+    // Note: empty files can't be mapped
+    if (inLen > 0)
+    {
+        mapping = mmap(nullptr, inLen, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mapping == MAP_FAILED)
+        {
+            mapping = nullptr;
+            close(fd);
+            throw ParseError(
+                "failed to map file \"" + fileName + "\""
+            );
+        }
+
+        madvise(mapping, inLen, MADV_SEQUENTIAL);
+        inData = (const char*)mapping;
+    }
+
+    close(fd);
+#else
     FILE* file = fopen(fileName.c_str(), "rb");
 
     if (!file)
@@ -27,40 +79,29 @@ std::string readFile(std::string fileName)
     size_t len = ftell(file);
     fseek(file, 0, SEEK_SET);
 
-    //printf("%ld bytes\n", len);
-
-    char* buf = (char*)malloc(len+1);
-
-    // Read into the allocated buffer
-    size_t read = fread(buf, 1, len, file);
+    // Read directly into the input string
+    inStr.resize(len);
+    size_t read = fread(&inStr[0], 1, len, file);
+    fclose(file);
 
     if (read != len)
     {
-        printf("failed to read file");
-        assert (false);
+        throw ParseError(
+            "failed to read file \"" + fileName + "\""
+        );
     }
 
-    // Add a null terminator to the string
-    buf[len] = '\0';
-
-    // Close the input file
-    fclose(file);
-
-    return std::string(buf);
-}
-
-Input::Input(std::string fileName)
-: Input(readFile(fileName), fileName)
-{
-    // Note: if we ever need/want to implement parallel
-    // parsing, we could mmap the file instead of
-    // reading it into memory all at once
+    inData = inStr.data();
+    inLen = inStr.length();
+#endif
 }
 
 Input::Input(std::string str, std::string srcName)
 {
     this->srcName = srcName;
-    this->inStr = str;
+    this->inStr = std::move(str);
+    this->inData = inStr.data();
+    this->inLen = inStr.length();
     this->strIdx = 0;
     this->lineNo = 1;
     this->colNo = 1;
@@ -68,6 +109,10 @@ Input::Input(std::string str, std::string srcName)
 
 Input::~Input()
 {
+#ifndef _WIN32
+    if (mapping)
+        munmap(mapping, inLen);
+#endif
 }
 
 /// Read a character from the input
@@ -111,10 +156,10 @@ bool Input::eof()
 /// Peek at a character from the input
 char Input::peek()
 {
-    if (strIdx >= inStr.length())
+    if (strIdx >= inLen)
         return '\0';
 
-    return inStr[strIdx];
+    return inData[strIdx];
 }
 
 /// Peek to see if a specific character is next in the input
@@ -130,10 +175,10 @@ bool Input::peek(const std::string& str)
 
     for (; idx < str.length(); idx++)
     {
-        if (this->strIdx + idx >= this->inStr.length())
+        if (this->strIdx + idx >= this->inLen)
             return false;
 
-        if (str[idx] != this->inStr[this->strIdx + idx])
+        if (str[idx] != this->inData[this->strIdx + idx])
             return false;
     }
 
@@ -284,13 +329,18 @@ Value parseFloatingPart(Input& input, bool neg, char literal[64])
 }
 
 /**
-Parse a string literal
+Parse a string literal. Literals without escape sequences are
+sliced directly from the input data.
 */
-std::string parseStringLit(Input& input, char endCh)
+String parseStringLit(Input& input, char endCh)
 {
     //std::cout << "parseStringLit" << std::endl;
 
+    auto startIdx = input.getInputIdx();
+
+    // Decoded characters, once an escape sequence is found
     std::string str;
+    bool escaped = false;
 
     for (;;)
     {
@@ -324,6 +374,14 @@ std::string parseStringLit(Input& input, char endCh)
         // If this is an escape sequence
         if (ch == '\\')
         {
+            // Copy the characters preceding the first escape sequence
+            if (!escaped)
+            {
+                auto len = input.getInputIdx() - 1 - startIdx;
+                str.assign(input.getInputData() + startIdx, len);
+                escaped = true;
+            }
+
             char esc = input.readCh();
 
             switch (esc)
@@ -373,18 +431,23 @@ std::string parseStringLit(Input& input, char endCh)
             }
         }
 
-        str += ch;
+        if (escaped)
+            str += ch;
     }
 
-    return str;
+    if (escaped)
+        return String(str);
+
+    auto len = input.getInputIdx() - 1 - startIdx;
+    return String(String::newString(input.getInputData() + startIdx, len));
 }
 
 /**
 Parse an identifier string
 */
-std::string parseIdentStr(Input& input)
+String parseIdentStr(Input& input)
 {
-    std::string ident;
+    auto startIdx = input.getInputIdx();
 
     char firstCh = input.peek();
 
@@ -400,16 +463,19 @@ std::string parseIdentStr(Input& input)
             break;
 
         // Consume this character
-        ident += input.readCh();
+        input.readCh();
     }
 
-    if (ident.size() == 0)
+    auto identStr = input.getInputData() + startIdx;
+    auto len = input.getInputIdx() - startIdx;
+
+    if (len == 0)
         throw ParseError(input, "invalid identifier");
 
     // Sanity check on the parsed identifier string
-    assert (isValidIdent(ident));
+    assert (isValidIdent(std::string(identStr, len)));
 
-    return ident;
+    return String(String::newString(identStr, len));
 }
 
 /**
@@ -491,22 +557,11 @@ Value parseObject(Input& input)
         }
 
         // Parse the field name
-        std::string fieldName;
-
-        if (input.peek('"'))
-        {
-            input.readCh();
-            fieldName = parseStringLit(input, '"');
-        }
-        else if (input.peek('\''))
-        {
-            input.readCh();
-            fieldName = parseStringLit(input, '\'');
-        }
-        else
-        {
-            fieldName = parseIdentStr(input);
-        }
+        auto fieldName = (
+            input.match('"')? parseStringLit(input, '"'):
+            input.match('\'')? parseStringLit(input, '\''):
+            parseIdentStr(input)
+        );
 
         input.eatWS();
         input.expect(":");
@@ -561,11 +616,11 @@ Value parseExpr(Input& input)
     // String literal
     if (input.match('\''))
     {
-        return String(parseStringLit(input, '\''));
+        return parseStringLit(input, '\'');
     }
     if (input.match('\"'))
     {
-        return String(parseStringLit(input, '\"'));
+        return parseStringLit(input, '\"');
     }
 
     // Array expression
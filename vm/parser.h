@@ -15,7 +15,17 @@ private:
     /// Input source name
     std::string srcName;
 
-    /// Input string to be parsed
+    /// Input data to be parsed. Files are memory-mapped, so the
+    /// data may not be null-terminated.
+    const char* inData = nullptr;
+
+    /// Length of the input data in bytes
+    size_t inLen = 0;
+
+    /// Memory mapping of the input file, if mapped
+    void* mapping = nullptr;
+
+    /// Input string, when parsing from a string or an unmapped file
     std::string inStr;
 
     /// Current index in the input string
@@ -35,6 +45,9 @@ public:
 
     ~Input();
 
+    Input(const Input& that) = delete;
+    Input& operator = (const Input& that) = delete;
+
     /// Read/consume a character from the input
     char readCh();
 
@@ -64,8 +77,9 @@ public:
     /// Consume whitespace and comments
     void eatWS();
 
-    /// Get the entire input as a string
-    std::string getInputStr() const { return inStr; }
+    /// Get the raw input data, and its length
+    const char* getInputData() const { return inData; }
+    size_t getInputLen() const { return inLen; }
 
     /// Get the current index in the input
     size_t getInputIdx() const { return strIdx; }
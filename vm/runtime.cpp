@@ -2,8 +2,13 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <algorithm>
 #include "runtime.h"
 
+#ifndef ZETA_WIDE_VALUES
+static_assert (sizeof(Value) == 8, "values should fit in a single word");
+#endif
+
 /// Undefined value constant
 /// Note: zeroed memory is automatically undefined
 const Value Value::UNDEF(Word(int64_t(0)), TAG_UNDEF);
@@ -17,16 +22,16 @@ const Value Value::ZERO(Word(int64_t(0)), TAG_INT32);
 const Value Value::ONE(Word(int64_t(1)), TAG_INT32);
 const Value Value::TWO(Word(int64_t(2)), TAG_INT32);
 
-// Global virtual machine instance
-VM vm;
+// Virtual machine instance of the isolate
+thread_local VM vm;
 
-// Global string pool
-StringPool stringPool;
+// String pool of the isolate
+thread_local StringPool stringPool;
 
 /// Produce a string representation of a value
 std::string Value::toString() const
 {
-    switch (tag)
+    switch (getTag())
     {
         case TAG_UNDEF:
         return "$undef";
@@ -35,10 +40,10 @@ std::string Value::toString() const
         return (*this == Value::TRUE)? "$true":"$false";
 
         case TAG_INT32:
-        return std::to_string(word.int32);
+        return std::to_string(getWord().int32);
 
         case TAG_FLOAT32:
-        return std::to_string(word.float32);
+        return std::to_string(getWord().float32);
 
         case TAG_STRING:
         return (std::string)*this;
@@ -57,12 +62,13 @@ std::string Value::toString() const
 /// Determine if this value is of a pointer type
 bool Value::isPointer() const
 {
-    switch (tag)
+    switch (getTag())
     {
         case TAG_STRING:
         case TAG_ARRAY:
         case TAG_OBJECT:
         case TAG_IMGREF:
+        case TAG_BUFFER:
         return true;
 
         default:
@@ -76,18 +82,76 @@ Value::operator std::string () const
     return String(*this);
 }
 
+__thread bool VM::gcRequested = false;
+
+const size_t VM::HEAP_MIN_SIZE;
+const size_t VM::CHUNK_SIZE;
+
 VM::VM()
+: gcThreshold(HEAP_MIN_SIZE)
 {
 }
 
+/// Round an allocation size up so that objects stay pointer-aligned
+/// and have room for a forwarding pointer
+static size_t allocSize(size_t size)
+{
+    size = (size + sizeof(refptr) - 1) & ~(sizeof(refptr) - 1);
+    return (size < OBJ_OF_FWD + sizeof(refptr))? (OBJ_OF_FWD + sizeof(refptr)):size;
+}
+
+/// Compute the allocated size of a heap object
+static size_t objSize(refptr ptr)
+{
+    switch (*(Tag*)ptr)
+    {
+        case TAG_STRING:
+        return allocSize(String::memSize(*(uint32_t*)(ptr + String::OF_LEN)));
+
+        case TAG_ROPE:
+        return allocSize(String::ROPE_SIZE);
+
+        case TAG_ARRAY:
+        return allocSize(Array::SIZE);
+
+        case TAG_OBJECT:
+        return allocSize(Object::SIZE);
+
+        case TAG_STORE:
+        return allocSize(ValStore::memSize(ValStore::getCap(ptr)));
+
+        case TAG_IMGREF:
+        return allocSize(ImgRef::SIZE);
+
+        case TAG_BUFFER:
+        {
+            auto type = *(Buffer::ElemType*)(ptr + Buffer::OF_TYPE);
+            auto len = *(uint32_t*)(ptr + Buffer::OF_LEN);
+            return allocSize(Buffer::memSize(type, len));
+        }
+
+        default:
+        assert (false && "unknown object kind in heap");
+        return 0;
+    }
+}
+
 /**
 Allocates a block of memory
 Note that this function guarantees that the memory is zeroed out
 */
 Value VM::alloc(uint32_t size, Tag tag)
 {
-    // FIXME: use an alloc pool of some kind
-    auto ptr = (refptr)calloc(1, size);
+    auto numBytes = allocSize(size);
+
+    // If the current chunk is full, or we've reached the point
+    // where a collection should be requested
+    if (allocPtr + numBytes > allocLimit)
+        newChunk(numBytes);
+
+    // Bump-allocate the object
+    auto ptr = allocPtr;
+    allocPtr += numBytes;
 
     // Set the tag in the object header
     *(Tag*)ptr = tag;
@@ -96,48 +160,375 @@ Value VM::alloc(uint32_t size, Tag tag)
     return Value(ptr, tag);
 }
 
-void Wrapper::setNextPtr(refptr obj, refptr nextPtr)
+void VM::newChunk(size_t minSize)
+{
+    // If we've stopped at the collection trigger point,
+    // request a collection and continue in the current chunk
+    if (chunks.size() > 0 && allocLimit < chunks.back().limit)
+    {
+        gcRequested = true;
+        allocLimit = chunks.back().limit;
+
+        if (allocPtr + minSize <= allocLimit)
+            return;
+    }
+
+    // Close the current chunk
+    if (chunks.size() > 0)
+    {
+        auto& chunk = chunks.back();
+        chunk.alloc = allocPtr;
+        prevChunksUsed += chunk.alloc - chunk.start;
+    }
+
+    // Note: calloc gives us zeroed memory,
+    // which evaluates to $undef in objects and arrays
+    auto chunkSize = std::max(CHUNK_SIZE, minSize);
+    auto start = (uint8_t*)calloc(1, chunkSize);
+
+    if (!start)
+    {
+        std::cerr << "failed to allocate heap memory" << std::endl;
+        abort();
+    }
+
+    chunks.push_back({ start, start, start + chunkSize });
+    allocPtr = start;
+    allocLimit = start + chunkSize;
+
+    // Stop allocating at the collection trigger point, if it falls
+    // inside this chunk, so that we can request a collection there
+    if (!gcRequested)
+    {
+        if (prevChunksUsed + minSize >= gcThreshold)
+            gcRequested = true;
+        else if (gcThreshold - prevChunksUsed < chunkSize)
+            allocLimit = start + (gcThreshold - prevChunksUsed);
+    }
+}
+
+size_t VM::allocated() const
+{
+    if (chunks.size() == 0)
+        return 0;
+
+    return prevChunksUsed + (allocPtr - chunks.back().start);
+}
+
+void VM::addRoot(Value* valPtr)
+{
+    roots.push_back(valPtr);
+}
+
+void VM::removeRoot(Value* valPtr)
 {
-    // Get the object header
-    auto header = *(obj_header*)obj;
+    // Roots are usually removed in reverse order of registration
+    for (size_t i = roots.size(); i > 0; --i)
+    {
+        if (roots[i-1] == valPtr)
+        {
+            roots.erase(roots.begin() + (i-1));
+            return;
+        }
+    }
 
-    // Set the next pointer
-    *(refptr*)(obj + OBJ_OF_NEXT) = nextPtr;
+    assert (false && "root not found");
+}
 
-    // Set the next pointer flag bit in the object header
-    *(obj_header*)(obj) = header | HEADER_MSK_NEXT;
+void VM::addRoot(Wrapper& wrapper)
+{
+    addRoot(&wrapper.val);
 }
 
-refptr Wrapper::getNextPtr(refptr obj, refptr notFound)
+void VM::removeRoot(Wrapper& wrapper)
 {
-    auto header = *(obj_header*)obj;
-    bool hasNextPtr = header & HEADER_MSK_NEXT;
+    removeRoot(&wrapper.val);
+}
 
-    if (!hasNextPtr)
-        return notFound;
+void VM::addRootFn(RootFn fn)
+{
+    rootFns.push_back(fn);
+}
 
-    auto nextPtr = *(refptr*)(obj + OBJ_OF_NEXT);
-    assert (nextPtr != nullptr);
+void VM::addTraceFn(TraceFn fn)
+{
+    traceFns.push_back(fn);
+}
 
-    return nextPtr;
+void VM::addSweepFn(RootFn fn)
+{
+    sweepFns.push_back(fn);
 }
 
-refptr Wrapper::getObjPtr()
+refptr VM::forward(refptr ptr)
 {
-    auto objPtr = (refptr)val;
-    assert (objPtr != nullptr);
-    return getNextPtr(objPtr, objPtr);
+    assert (ptr != nullptr);
+
+    // If this object is already in to-space
+    if (ptr >= toStart && ptr < toLimit)
+        return ptr;
+
+    auto header = *(obj_header*)ptr;
+
+    // If this object was already copied
+    if (header & HEADER_MSK_FWD)
+        return *(refptr*)(ptr + OBJ_OF_FWD);
+
+    // Flattened ropes get replaced by their flat string
+    if (*(Tag*)ptr == TAG_ROPE && *(refptr*)(ptr + String::OF_FLAT))
+        return forward(*(refptr*)(ptr + String::OF_FLAT));
+
+    auto size = objSize(ptr);
+    auto newPtr = toAlloc;
+    toAlloc += size;
+    assert (toAlloc <= toLimit);
+
+    memcpy(newPtr, ptr, size);
+
+    // Leave a forwarding pointer in the old copy
+    *(obj_header*)ptr = header | HEADER_MSK_FWD;
+    *(refptr*)(ptr + OBJ_OF_FWD) = newPtr;
+
+    // Copy value stores right after their owner, to keep them adjacent
+    auto tag = *(Tag*)newPtr;
+    if (tag == TAG_ARRAY)
+        visitPtr(*(refptr*)(newPtr + Array::OF_STORE));
+    else if (tag == TAG_OBJECT)
+        visitPtr(*(refptr*)(newPtr + Object::OF_STORE));
+
+    return newPtr;
+}
+
+void VM::visit(Value& val)
+{
+    if (val.isPointer())
+        val = Value(forward(val.getWord().ptr), val.getTag());
+}
+
+void VM::visit(Wrapper& wrapper)
+{
+    visit(wrapper.val);
+}
+
+void VM::visitPtr(refptr& ptr)
+{
+    if (ptr)
+        ptr = forward(ptr);
+}
+
+refptr VM::weakRef(refptr ptr)
+{
+    if (ptr >= toStart && ptr < toLimit)
+        return ptr;
+
+    auto header = *(obj_header*)ptr;
+
+    if (header & HEADER_MSK_FWD)
+        return *(refptr*)(ptr + OBJ_OF_FWD);
+
+    return nullptr;
+}
+
+void VM::scanObj(refptr ptr)
+{
+    switch (*(Tag*)ptr)
+    {
+        case TAG_STRING:
+        break;
+
+        case TAG_ROPE:
+        visitPtr(*(refptr*)(ptr + String::OF_LEFT));
+        visitPtr(*(refptr*)(ptr + String::OF_RIGHT));
+        visitPtr(*(refptr*)(ptr + String::OF_FLAT));
+        break;
+
+        // Value stores get copied along with their owner
+        case TAG_ARRAY:
+        case TAG_OBJECT:
+        break;
+
+        case TAG_STORE:
+        {
+            auto cap = ValStore::getCap(ptr);
+
+            for (size_t i = 0; i < cap; ++i)
+            {
+                auto val = ValStore::get(ptr, i);
+                if (val.isPointer())
+                    ValStore::set(ptr, i, Value(forward(val.getWord().ptr), val.getTag()));
+            }
+        }
+        break;
+
+        case TAG_IMGREF:
+        visitPtr(*(refptr*)(ptr + ImgRef::OF_SYM));
+        break;
+
+        // Buffers hold no references
+        case TAG_BUFFER:
+        break;
+
+        default:
+        assert (false && "unknown object kind in heap");
+    }
+}
+
+void VM::collect()
+{
+    //std::cout << "gc, allocated=" << allocated() << std::endl;
+
+    // All live objects fit in a to-space as large as the from-space.
+    // The extra chunk leaves room to keep allocating afterwards.
+    auto toSize = allocated() + CHUNK_SIZE;
+    toStart = (uint8_t*)calloc(1, toSize);
+    toAlloc = toStart;
+    toLimit = toStart + toSize;
+
+    if (!toStart)
+    {
+        std::cerr << "failed to allocate heap memory" << std::endl;
+        abort();
+    }
+
+    // Copy the objects directly reachable from the roots
+    for (auto valPtr : roots)
+        visit(*valPtr);
+    for (auto rootFn : rootFns)
+        rootFn(*this);
+    visitShapes();
+
+    // Scan the copied objects, until everything reachable is copied.
+    // The trace functions may find more values to visit each time.
+    auto scanPtr = toStart;
+    for (;;)
+    {
+        for (; scanPtr < toAlloc; scanPtr += objSize(scanPtr))
+            scanObj(scanPtr);
+
+        bool visited = false;
+        for (auto traceFn : traceFns)
+            visited |= traceFn(*this);
+        if (!visited)
+            break;
+    }
+
+    // Interned strings are weakly referenced by the string pool
+    stringPool.sweep(*this);
+    for (auto sweepFn : sweepFns)
+        sweepFn(*this);
+
+    // Free the from-space
+    for (auto& chunk : chunks)
+        free(chunk.start);
+    chunks.clear();
+
+    // The to-space becomes the allocation chunk
+    chunks.push_back({ toStart, toAlloc, toLimit });
+    allocPtr = toAlloc;
+    allocLimit = toLimit;
+    prevChunksUsed = 0;
+
+    // Let the heap grow to twice the live data size before collecting again
+    size_t liveBytes = toAlloc - toStart;
+    gcThreshold = std::max(HEAP_MIN_SIZE, 2 * liveBytes);
+    if (liveBytes + (size_t)(allocLimit - allocPtr) > gcThreshold)
+        allocLimit = toStart + gcThreshold;
+
+    toStart = toAlloc = toLimit = nullptr;
+    gcRequested = false;
+    numCollections++;
+
+    //std::cout << "gc done, live=" << liveBytes << std::endl;
 }
 
 String::String(std::string str)
 {
-    this->val = stringPool.getString(str);
+    this->val = newString(str.data(), str.length());
+}
+
+uint32_t String::hash(const char* data, size_t len)
+{
+    return (uint32_t)murmurHash2(data, len, 1337);
+}
+
+/// Allocate a string object of a given length, with its data uninitialized
+static refptr allocString(size_t len)
+{
+    auto ptr = vm.alloc(String::memSize(len), TAG_STRING).getWord().ptr;
+    *(uint32_t*)(ptr + String::OF_LEN) = len;
+    return ptr;
+}
+
+Value String::newString(const char* data, size_t len)
+{
+    if (len <= MAX_INTERN_LEN)
+        return stringPool.getString(data, len);
+
+    auto ptr = allocString(len);
+    memcpy(ptr + OF_DATA, data, len);
+    *(uint32_t*)(ptr + OF_HASH) = hash(data, len);
+    return Value(ptr, TAG_STRING);
 }
 
 String::String(Value value)
 {
     assert (value.isString());
-    this->val = value;
+
+    auto ptr = (refptr)value;
+    if (*(Tag*)ptr == TAG_ROPE)
+        ptr = flatten(ptr);
+
+    this->val = Value(ptr, TAG_STRING);
+}
+
+refptr String::flatten(refptr rope)
+{
+    auto& flat = *(refptr*)(rope + OF_FLAT);
+    if (flat)
+        return flat;
+
+    auto len = *(uint32_t*)(rope + OF_LEN);
+    auto str = allocString(len);
+    auto buf = (char*)(str + OF_DATA);
+
+    // Copy the pieces from right to left, using an explicit stack
+    // since ropes built by appending in a loop can be very deep
+    std::vector<refptr> stack = { rope };
+    size_t pos = len;
+    while (stack.size() > 0)
+    {
+        auto node = stack.back();
+        stack.pop_back();
+
+        if (*(Tag*)node == TAG_ROPE && *(refptr*)(node + OF_FLAT))
+            node = *(refptr*)(node + OF_FLAT);
+
+        if (*(Tag*)node == TAG_ROPE)
+        {
+            stack.push_back(*(refptr*)(node + OF_LEFT));
+            stack.push_back(*(refptr*)(node + OF_RIGHT));
+            continue;
+        }
+
+        auto nodeLen = *(uint32_t*)(node + OF_LEN);
+        assert (nodeLen <= pos);
+        pos -= nodeLen;
+        memcpy(&buf[pos], node + OF_DATA, nodeLen);
+    }
+    assert (pos == 0);
+
+    // Note: allocation never triggers a collection, so the
+    // rope pointer stays valid
+    *(uint32_t*)(str + OF_HASH) = hash(buf, len);
+    flat = str;
+    if (len <= MAX_INTERN_LEN)
+        flat = (refptr)stringPool.intern(Value(str, TAG_STRING));
+
+    // Release the pieces, which are no longer needed
+    *(refptr*)(rope + OF_LEFT) = nullptr;
+    *(refptr*)(rope + OF_RIGHT) = nullptr;
+
+    return flat;
 }
 
 uint32_t String::length() const
@@ -170,6 +561,21 @@ bool String::operator == (const char* that) const
     return strcmp(getDataPtr(), that) == 0;
 }
 
+bool String::equalsSlow(String that) const
+{
+    auto len = length();
+
+    if (len != that.length() || getHash() != that.getHash())
+        return false;
+
+    return memcmp(getDataPtr(), that.getDataPtr(), len) == 0;
+}
+
+String String::internSlow() const
+{
+    return String(stringPool.intern(val));
+}
+
 /// Get the ith character code
 char String::operator [] (size_t i)
 {
@@ -179,36 +585,76 @@ char String::operator [] (size_t i)
     return strdata[i];
 }
 
-String String::concat(String a, String b)
+Value String::concat(Value a, Value b)
 {
-    auto lenA = a.length();
-    auto lenB = b.length();
+    auto lenA = length(a);
+    auto lenB = length(b);
 
-    std::string c;
-    c.resize(lenA + lenB);
+    if (lenA == 0)
+        return b;
+    if (lenB == 0)
+        return a;
 
-    for (size_t i = 0; i < lenA; ++i)
-        c[i] = a[i];
+    auto len = (size_t)lenA + lenB;
 
-    for (size_t i = 0; i < lenB; ++i)
-        c[lenA + i] = b[i];
+    if (len > UINT32_MAX)
+        throw RunError("string concatenation result is too long");
 
-    return String(c);
+    // Short strings are built directly, since they are cheap to copy
+    if (len < ROPE_MIN_LEN)
+    {
+        char buf[ROPE_MIN_LEN];
+        memcpy(buf, String(a).getDataPtr(), lenA);
+        memcpy(buf + lenA, String(b).getDataPtr(), lenB);
+        return newString(buf, len);
+    }
+
+    auto rope = vm.alloc(ROPE_SIZE, TAG_ROPE).getWord().ptr;
+    *(uint32_t*)(rope + OF_LEN) = len;
+    *(refptr*)(rope + OF_LEFT) = (refptr)a;
+    *(refptr*)(rope + OF_RIGHT) = (refptr)b;
+    *(refptr*)(rope + OF_FLAT) = nullptr;
+
+    return Value(rope, TAG_STRING);
+}
+
+refptr ValStore::alloc(size_t cap)
+{
+    auto store = vm.alloc(memSize(cap), TAG_STORE).getWord().ptr;
+    init(store, cap);
+    return store;
+}
+
+refptr ValStore::grow(refptr store, size_t newCap)
+{
+    auto cap = getCap(store);
+    assert (newCap >= cap);
+
+    auto newStore = alloc(newCap);
+#ifdef ZETA_WIDE_VALUES
+    memcpy(getWords(newStore), getWords(store), cap * sizeof(Word));
+    memcpy(getTags(newStore), getTags(store), cap * sizeof(Tag));
+#else
+    std::copy(getValues(store), getValues(store) + cap, getValues(newStore));
+#endif
+
+    return newStore;
 }
 
 /// Allocate a new array of a given length
 Array::Array(size_t minCap)
 {
-    // Compute the object size
-    auto numBytes = memSize(minCap);
-
-    // Allocate memory
-    val = vm.alloc(numBytes, TAG_ARRAY);
+    // Allocate the array and its store together,
+    // so that they are adjacent in memory
+    auto arrSize = allocSize(SIZE);
+    val = vm.alloc(arrSize + ValStore::memSize(minCap), TAG_ARRAY);
     auto ptr = (refptr)val;
+    auto store = ptr + arrSize;
+    ValStore::init(store, minCap);
 
-    // Set the array capacity and length
-    *(uint32_t*)(ptr + OF_CAP) = minCap;
+    // Set the array length and store
     *(uint32_t*)(ptr + OF_LEN) = 0;
+    *(refptr*)(ptr + OF_STORE) = store;
 
     // No initialization necessary because vm.alloc
     // provides zeroed out memory, initialized to all zeroes,
@@ -223,107 +669,264 @@ Array::Array(Value value)
 
 size_t Array::getCap()
 {
-    auto ptr = getObjPtr();
-    auto cap = *(uint32_t*)(ptr + OF_CAP);
-    return cap;
+    return ValStore::getCap(getStore());
 }
 
-uint32_t Array::length()
+void Array::push(Value val)
 {
     auto ptr = getObjPtr();
-    auto len = *(uint32_t*)(ptr + OF_LEN);
-    return len;
+    auto store = getStore();
+    auto cap = ValStore::getCap(store);
+    auto len = length();
+    assert (len <= cap);
+
+    // If the array is at capacity, replace its store
+    // with one of twice the capacity
+    if (len == cap)
+    {
+        //std::cerr << "extending array capacity from " << cap << " to " << newCap << std::endl;
+        store = ValStore::grow(store, 2 * cap + 1);
+        *(refptr*)(ptr + OF_STORE) = store;
+    }
+
+    ValStore::set(store, len, val);
+
+    // Increment the length
+    *(uint32_t*)(ptr + OF_LEN) = len + 1;
 }
 
-/// Set the value of the ith element
-void Array::setElem(size_t i, Value v)
+Value Array::pop()
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
+    auto store = getStore();
+    auto len = length();
+    assert (len > 0);
 
-    auto words = (Word*)(ptr + OF_DATA);
-    auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
+    auto val = ValStore::get(store, len-1);
 
-    assert (length() <= getCap());
-    assert (i < length());
-    words[i] = v.getWord();
-    tags[i] = v.getTag();
+    // Clear the slot so the garbage collector doesn't retain its value
+    ValStore::set(store, len-1, Value::UNDEF);
+
+    // Decrement the length
+    *(uint32_t*)(ptr + OF_LEN) = len - 1;
+
+    return val;
 }
 
-/// Get the value of the ith element
-Value Array::getElem(size_t i)
+bool Buffer::strToType(std::string str, ElemType& type)
 {
-    auto ptr = getObjPtr();
-    auto cap = getCap();
+    if (str == "float32")
+        type = FLOAT32;
+    else if (str == "int32")
+        type = INT32;
+    else if (str == "uint8")
+        type = UINT8;
+    else
+        return false;
+
+    return true;
+}
+
+std::string Buffer::typeToStr(ElemType type)
+{
+    switch (type)
+    {
+        case FLOAT32: return "float32";
+        case INT32: return "int32";
+        case UINT8: return "uint8";
+        default:
+        assert (false);
+        return "";
+    }
+}
 
-    auto words = (Word*)(ptr + OF_DATA);
-    auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
+Buffer::Buffer(ElemType type, size_t len)
+{
+    auto size = memSize(type, len);
 
-    assert (length() <= getCap());
+    if (size > UINT32_MAX)
+        throw RunError("buffer length is too large");
+
+    // Note: vm.alloc provides zeroed memory, so the elements
+    // are initialized to zero
+    val = vm.alloc(size, TAG_BUFFER);
+    auto ptr = (refptr)val;
+    *(uint32_t*)(ptr + OF_LEN) = len;
+    *(ElemType*)(ptr + OF_TYPE) = type;
+}
+
+Buffer::Buffer(Value value)
+{
+    assert (value.isBuffer());
+    this->val = value;
+}
+
+Value Buffer::getElem(size_t i)
+{
     assert (i < length());
-    auto word = words[i];
-    auto tag = tags[i];
+    auto data = getDataPtr();
 
-    return Value(word, tag);
+    switch (getType())
+    {
+        case FLOAT32:
+        return Value::float32(((float*)data)[i]);
+
+        case INT32:
+        return Value::int32(((int32_t*)data)[i]);
+
+        default:
+        return Value::int32(data[i]);
+    }
 }
 
-void Array::push(Value val)
+void Buffer::setElem(size_t i, Value val)
 {
-    auto ptr = getObjPtr();
-    auto cap = getCap();
-    auto len = length();
-    assert (len <= cap);
+    assert (i < length());
+    auto data = getDataPtr();
+    auto type = getType();
 
-    // If the array is at capacity
-    if (len == cap)
+    if (type == FLOAT32)
     {
-        // Create a new array with twice the capacity
-        auto newCap = 2 * cap + 1;
-        //std::cerr << "extending array capacity from " << cap << " to " << newCap << std::endl;
-        auto newArr = Array(newCap);
+        if (!val.isFloat32())
+            throw RunError("float32 buffer elements must be float32 values");
 
-        // Copy elements to the new array
-        for (size_t i = 0; i < len; ++i)
-            newArr.push(getElem(i));
+        ((float*)data)[i] = (float)val;
+        return;
+    }
 
-        // Set the next pointer on this object
-        auto rootObjPtr = (refptr)this->val;
-        setNextPtr(rootObjPtr, newArr.getObjPtr());
-        assert (getObjPtr() != ptr);
+    if (!val.isInt32())
+    {
+        throw RunError(
+            typeToStr(type) + " buffer elements must be int32 values"
+        );
+    }
 
-        ptr = getObjPtr();
-        cap = newCap;
+    if (type == INT32)
+        ((int32_t*)data)[i] = (int32_t)val;
+    else
+        data[i] = (uint8_t)(int32_t)val;
+}
+
+/// All shapes ever created in the isolate
+static thread_local std::vector<Shape*> allShapes;
 
-        //std::cout << "done extending array" << std::endl;
+Shape::Shape(Shape* parent, refptr name)
+: parent(parent),
+  name(name),
+  numFields(parent? (parent->numFields + 1):0)
+{
+    allShapes.push_back(this);
+}
+
+Shape* Shape::empty()
+{
+    static thread_local Shape* emptyShape = nullptr;
+    if (!emptyShape)
+        emptyShape = new Shape(nullptr, nullptr);
+    return emptyShape;
+}
+
+Shape* Shape::addField(refptr name)
+{
+    if (childTable)
+    {
+        auto itr = childTable->find(name);
+        if (itr != childTable->end())
+            return itr->second;
+    }
+    else
+    {
+        for (auto child : children)
+            if (child->name == name)
+                return child;
     }
 
-    auto words = (Word*)(ptr + OF_DATA);
-    auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
+    auto child = new Shape(this, name);
+    children.push_back(child);
 
-    words[len] = val.getWord();
-    tags[len] = val.getTag();
+    if (childTable)
+        (*childTable)[name] = child;
+    else if (children.size() >= TABLE_MIN_SIZE)
+    {
+        childTable = new std::unordered_map<refptr, Shape*>();
+        for (auto child : children)
+            (*childTable)[child->name] = child;
+    }
 
-    // Increment the length
-    *(uint32_t*)(ptr + OF_LEN) = len + 1;
+    return child;
 }
 
-Value Array::pop()
+bool Shape::getSlotIdx(refptr name, uint32_t& slotIdx)
 {
-    auto ptr = getObjPtr();
-    auto cap = getCap();
-    auto len = length();
-    assert (len > 0);
+    // For small shapes, search up the parent chain
+    if (numFields < TABLE_MIN_SIZE)
+    {
+        for (auto shape = this; shape->parent; shape = shape->parent)
+        {
+            if (shape->name == name)
+            {
+                slotIdx = shape->numFields - 1;
+                return true;
+            }
+        }
 
-    auto words = (Word*)(ptr + OF_DATA);
-    auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
+        return false;
+    }
 
-    auto word = words[len-1];
-    auto tag = tags[len-1];
+    if (!slotTable)
+    {
+        slotTable = new std::unordered_map<refptr, uint32_t>();
+        for (auto shape = this; shape->parent; shape = shape->parent)
+            (*slotTable)[shape->name] = shape->numFields - 1;
+    }
 
-    // Increment the length
-    *(uint32_t*)(ptr + OF_LEN) = len - 1;
+    auto itr = slotTable->find(name);
+    if (itr == slotTable->end())
+        return false;
+
+    slotIdx = itr->second;
+    return true;
+}
 
-    return Value(word, tag);
+void Shape::getFieldShapes(std::vector<Shape*>& shapes)
+{
+    shapes.resize(numFields);
+    for (auto shape = this; shape->parent; shape = shape->parent)
+        shapes[shape->numFields - 1] = shape;
+}
+
+void VM::visitShapes()
+{
+    // Field names are strongly referenced by the shapes
+    for (auto shape : allShapes)
+    {
+        visitPtr(shape->name);
+
+        // The lookup tables are keyed by string address, rebuild them lazily
+        delete shape->slotTable;
+        delete shape->childTable;
+        shape->slotTable = nullptr;
+        shape->childTable = nullptr;
+    }
+
+    // The megamorphic field cache is also keyed by string address
+    megaFieldCache.clear();
+}
+
+void VM::shutdown()
+{
+    for (auto& chunk : chunks)
+        free(chunk.start);
+    chunks.clear();
+    allocPtr = allocLimit = nullptr;
+
+    for (auto shape : allShapes)
+    {
+        delete shape->slotTable;
+        delete shape->childTable;
+        delete shape;
+    }
+    allShapes.clear();
 }
 
 /// Allocate a new empty object
@@ -332,17 +935,17 @@ Object Object::newObject(size_t cap)
     if (cap < MIN_CAP)
         cap = MIN_CAP;
 
-    // Compute the object size
-    auto numBytes = memSize(cap);
-
-    // Allocate memory
-    auto val = vm.alloc(numBytes, TAG_OBJECT);
+    // Allocate the object and its store together,
+    // so that they are adjacent in memory
+    auto objBytes = allocSize(SIZE);
+    auto val = vm.alloc(objBytes + ValStore::memSize(cap), TAG_OBJECT);
     auto ptr = (refptr)val;
+    auto store = ptr + objBytes;
+    ValStore::init(store, cap);
 
-    // Set the object capacity
-    *(uint32_t*)(ptr + OF_CAP) = cap;
-
-    // TODO: init object shape, when shapes actually implemented!
+    // New objects start out with no fields
+    *(Shape**)(ptr + OF_SHAPE) = Shape::empty();
+    *(refptr*)(ptr + OF_STORE) = store;
 
     // No field initialization necessary
 
@@ -356,148 +959,230 @@ Object::Object(Value value)
     val = value;
 }
 
-size_t Object::getCap()
+bool Object::hasField(String name)
 {
-    auto ptr = getObjPtr();
-    auto cap = *(uint32_t*)(ptr + OF_CAP);
-    assert (cap > 0);
-    return cap;
+    // Shapes compare field names by pointer, so names must be interned
+    uint32_t slotIdx;
+    return getShape(getObjPtr())->getSlotIdx((refptr)name.intern(), slotIdx);
 }
 
-size_t Object::getSlotIdx(
-    refptr ptr,
-    size_t cap,
-    String fieldName,
-    bool newField
-)
+void Object::setField(String name, Value value)
+{
+    FieldICEntry entry;
+    setFieldSlow(name, value, entry);
+}
+
+Value Object::getField(String name)
 {
-    auto values = (Value*)(ptr + OF_FIELDS);
+    Value value;
+    FieldICEntry entry;
+    bool found = getFieldSlow(name, value, entry);
+    assert (found);
+    (void)found;
+    return value;
+}
 
-    // FIXME: for now, we use a dumb key-pair linear search strategy
-    size_t idx = 0;
-    for (; idx < cap; idx += 2)
+bool Object::getFieldMiss(String name, Value& value, FieldIC& ic, uint64_t& numMisses)
+{
+    auto ptr = getObjPtr();
+    auto shape = getShape(ptr);
+
+    // Check the other shapes seen by a polymorphic site
+    for (size_t i = 0; i + 1 < ic.numEntries; ++i)
     {
-        // Empty slot, property name not found
-        if (values[idx] == Value::UNDEF)
-            return newField? idx:cap;
+        if (ic.more[i].shape == shape)
+        {
+            value = ValStore::get(getStore(ptr), ic.more[i].slotIdx);
+            return true;
+        }
+    }
 
-        assert (values[idx].isString());
+    ++numMisses;
 
-        // Slot found
-        if ((String)values[idx] == fieldName)
-            return idx;
+    name = name.intern();
+
+    if (ic.megamorphic)
+    {
+        ++icStats.fieldMegaLookups;
+        if (auto cached = megaFieldCache.find(shape, (refptr)name))
+        {
+            value = ValStore::get(getStore(ptr), cached->slotIdx);
+            return true;
+        }
+        ++icStats.fieldMegaMisses;
     }
 
-    return cap;
+    FieldICEntry entry;
+    if (!getFieldSlow(name, value, entry))
+        return false;
+
+    if (!ic.megamorphic)
+        ic.add(entry.shape, entry.newShape, entry.slotIdx);
+    if (ic.megamorphic)
+        megaFieldCache.add(shape, (refptr)name, shape, entry.slotIdx);
+
+    return true;
 }
 
-bool Object::hasField(String fieldName)
+void Object::setFieldMiss(String name, Value value, FieldIC& ic)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
+    auto shape = getShape(ptr);
+    auto store = getStore(ptr);
+    auto cap = ValStore::getCap(store);
+
+    // Check the other shapes seen by a polymorphic site. The first
+    // shape may also be cached for a field addition which needs the
+    // object store to grow first.
+    bool inCache = (ic.shape == shape);
+    for (size_t i = 0; !inCache && i + 1 < ic.numEntries; ++i)
+    {
+        auto& entry = ic.more[i];
+        if (entry.shape != shape)
+            continue;
 
-    auto slotIdx = getSlotIdx(ptr, cap, fieldName, false);
+        if (entry.newShape == shape || entry.slotIdx < cap)
+        {
+            ValStore::set(store, entry.slotIdx, value);
+            *(Shape**)(ptr + OF_SHAPE) = entry.newShape;
+            return;
+        }
 
-    return (slotIdx < cap);
-}
+        inCache = true;
+    }
 
-void Object::setField(String name, Value value)
-{
-    auto ptr = getObjPtr();
-    auto cap = getCap();
+    ++icStats.setFieldMisses;
 
-    auto slotIdx = getSlotIdx(ptr, cap, name, true);
+    name = name.intern();
 
-    // If we've exceeded the object capacity
-    if (slotIdx + 1 >= cap)
+    if (ic.megamorphic && !inCache)
     {
-        // Create a new object with twice the capacity
-        assert (cap > 0);
-        auto newCap = 2 * cap;
-        //std::cout << "extending object capacity from " << cap << " to " << newCap << std::endl;
-        auto newObj = Object::newObject(newCap);
-
-        // Copy properties to the new object
-        for (auto itr = ObjFieldItr(*this); itr.valid(); itr.next())
+        ++icStats.fieldMegaLookups;
+        auto cached = megaFieldCache.find(shape, (refptr)name);
+        if (cached && (cached->newShape == shape || cached->slotIdx < cap))
         {
-            auto fieldName = itr.get();
-            auto fieldVal = getField(fieldName);
-            newObj.setField(fieldName, fieldVal);
+            ValStore::set(store, cached->slotIdx, value);
+            *(Shape**)(ptr + OF_SHAPE) = cached->newShape;
+            return;
         }
+        ++icStats.fieldMegaMisses;
+    }
 
-        // Set the next pointer on this object
-        auto newObjPtr = newObj.getObjPtr();
-        auto rootObjPtr = (refptr)val;
-        setNextPtr(rootObjPtr, newObjPtr);
-        assert (getObjPtr() != ptr);
+    FieldICEntry entry;
+    setFieldSlow(name, value, entry);
 
-        ptr = getObjPtr();
-        cap = getCap();
-    }
+    if (inCache)
+        return;
 
-    // Write the new property
-    assert (slotIdx + 1 < cap);
-    auto values = (Value*)(ptr + OF_FIELDS);
-    values[slotIdx + 0] = name;
-    values[slotIdx + 1] = value;
+    if (!ic.megamorphic)
+        ic.add(entry.shape, entry.newShape, entry.slotIdx);
+    if (ic.megamorphic)
+        megaFieldCache.add(entry.shape, (refptr)name, entry.newShape, entry.slotIdx);
 }
 
-Value Object::getField(String name)
+bool Object::getFieldSlow(String name, Value& value, FieldICEntry& entry)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
-    auto values = (Value*)(ptr + OF_FIELDS);
+    auto shape = getShape(ptr);
 
-    size_t slotIdx = getSlotIdx(ptr, cap, name, false);
+    uint32_t slotIdx;
+    if (!shape->getSlotIdx((refptr)name.intern(), slotIdx))
+        return false;
+
+    entry.shape = shape;
+    entry.newShape = shape;
+    entry.slotIdx = slotIdx;
 
-    assert (slotIdx < cap);
-    return values[slotIdx + 1];
+    value = ValStore::get(getStore(ptr), slotIdx);
+    return true;
 }
 
-bool Object::getField(const String& fieldName, Value& value, size_t& idxCache)
+void Object::setFieldSlow(String name, Value value, FieldICEntry& entry)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
-    auto values = (Value*)(ptr + OF_FIELDS);
+    auto shape = getShape(ptr);
 
-    //std::cout << "Lookup" << std::endl;
-    //std::cout << "  name=" << name << std::endl;
-    //std::cout << "  idxCache=" << idxCache << std::endl;
+    auto store = getStore(ptr);
 
-    if (idxCache < cap)
+    name = name.intern();
+
+    // If the field already exists, update it in place
+    uint32_t slotIdx;
+    if (shape->getSlotIdx((refptr)name, slotIdx))
     {
-        auto nameSlot = values[idxCache];
-        if (nameSlot.isString())
-        {
-            auto nameSlotStr = String(nameSlot);
-            if (nameSlotStr == fieldName)
-            {
-                //std::cout << "  cache hit" << std::endl;
-                value = values[idxCache + 1];
-                return true;
-            }
-        }
+        ValStore::set(store, slotIdx, value);
+        entry.shape = shape;
+        entry.newShape = shape;
+        entry.slotIdx = slotIdx;
+        return;
     }
 
-    //std::cout << "cache miss" << std::endl;
-    //std::cout << "  name=" << name << std::endl;
-
-    size_t slotIdx = getSlotIdx(ptr, cap, fieldName, false);
+    auto newShape = shape->addField((refptr)name);
+    slotIdx = newShape->numFields - 1;
 
+    // If we've exceeded the object capacity, replace the
+    // object's store with one of twice the capacity
+    auto cap = ValStore::getCap(store);
     if (slotIdx >= cap)
     {
-        return false;
+        //std::cout << "extending object capacity from " << cap << " to " << newCap << std::endl;
+        store = ValStore::grow(store, 2 * cap);
+        *(refptr*)(ptr + OF_STORE) = store;
     }
 
-    idxCache = slotIdx;
+    // Write the new field
+    ValStore::set(store, slotIdx, value);
+    *(Shape**)(ptr + OF_SHAPE) = newShape;
 
-    //std::cout << "  cache miss" << std::endl;
-    //std::cout << "  slotIdx=" << slotIdx << std::endl;
+    entry.shape = shape;
+    entry.newShape = newShape;
+    entry.slotIdx = slotIdx;
+}
 
-    value = values[slotIdx + 1];
-    return true;
+thread_local std::vector<FieldIC*> polyFieldICs;
+
+void FieldIC::add(Shape* shape, Shape* newShape, uint32_t slotIdx)
+{
+    if (numEntries == 0)
+    {
+        this->shape = shape;
+        this->newShape = newShape;
+        this->slotIdx = slotIdx;
+        numEntries = 1;
+        return;
+    }
+
+    if (numEntries == NUM_ENTRIES)
+    {
+        megamorphic = true;
+        ++icStats.fieldMegaSites;
+        return;
+    }
+
+    if (!more)
+    {
+        more = new FieldICEntry[NUM_ENTRIES - 1];
+        polyFieldICs.push_back(this);
+        ++icStats.fieldPolySites;
+    }
+
+    more[numEntries - 1] = { shape, newShape, slotIdx };
+    numEntries++;
+}
+
+void FieldIC::clear()
+{
+    delete [] more;
+    *this = FieldIC();
+}
+
+void MegaFieldCache::clear()
+{
+    memset(entries, 0, sizeof(entries));
 }
 
+thread_local MegaFieldCache megaFieldCache;
+
 int32_t Object::getFieldInt32(std::string name)
 {
     if (!hasField(name))
@@ -537,48 +1222,38 @@ Array Object::getFieldArr(std::string name)
     return Array(val);
 }
 
-ObjFieldItr::ObjFieldItr(Object obj)
-: obj(obj)
+__thread ICStats icStats;
+
+ICache::ICache(std::string fieldName)
+: fieldName(fieldName)
 {
+    vm.addRoot(this->fieldName);
 }
 
-bool ObjFieldItr::valid()
+ICache::~ICache()
 {
-    //std::cout << "valid" << std::endl;
+    vm.removeRoot(fieldName);
+}
 
-    auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
+ObjFieldItr::ObjFieldItr(Object obj)
+{
+    obj.getShape(obj.getObjPtr())->getFieldShapes(shapes);
+}
 
-    return slotIdx < cap && values[slotIdx].isString();
+bool ObjFieldItr::valid()
+{
+    return idx < shapes.size();
 }
 
 std::string ObjFieldItr::get()
 {
-    auto ptr = obj.getObjPtr();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    //std::cout << "cap=" << cap << std::endl;
-    //std::cout << "tag=" << (int)values[slotIdx].getTag() << std::endl;
-
-    assert (values[slotIdx].isString());
-
-    return values[slotIdx];
+    assert (idx < shapes.size());
+    return String(Value(shapes[idx]->name, TAG_STRING));
 }
 
 void ObjFieldItr::next()
 {
-    auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    slotIdx += 2;
-
-    if (slotIdx >= cap)
-        return;
-
-    if (values[slotIdx] == Value::UNDEF)
-        slotIdx = cap;
+    idx++;
 }
 
 ImgRef::ImgRef(String symbol)
@@ -653,36 +1328,104 @@ int64_t murmurHash2(const void* key, size_t len, uint64_t seed)
 }
 
 StringPool::StringPool()
+: table(1024, nullptr)
 {
 }
 
-Value StringPool::getString(std::string str)
+size_t StringPool::findSlot(const char* data, size_t len, uint32_t hash)
 {
-    auto iter = pool.find(str);
-    if (iter == pool.end())
+    auto mask = table.size() - 1;
+
+    for (auto idx = hash & mask;; idx = (idx + 1) & mask)
     {
-        return newString(str);
+        auto str = table[idx];
+
+        if (str == nullptr)
+            return idx;
+
+        if (*(uint32_t*)(str + String::OF_HASH) == hash &&
+            *(uint32_t*)(str + String::OF_LEN) == len &&
+            memcmp(str + String::OF_DATA, data, len) == 0)
+            return idx;
     }
-    return iter->second;
 }
 
-Value StringPool::newString(std::string str)
+void StringPool::insert(refptr str)
 {
-    auto len = str.length();
-    // Compute the string object size
-    auto numBytes = String::memSize(len);
+    // Keep the table at most half full
+    if (2 * (numStrings + 1) > table.size())
+    {
+        std::vector<refptr> oldTable(table.size() * 2, nullptr);
+        std::swap(table, oldTable);
+        numStrings = 0;
 
-    // Allocate memory
-    auto val = vm.alloc(numBytes, TAG_STRING);
-    auto ptr = (refptr)val;
+        for (auto oldStr : oldTable)
+            if (oldStr)
+                insert(oldStr);
+    }
 
-    // Set the string length
-    *(uint32_t*)(ptr + String::OF_LEN) = len;
+    auto mask = table.size() - 1;
+    auto idx = *(uint32_t*)(str + String::OF_HASH) & mask;
+    while (table[idx] != nullptr)
+        idx = (idx + 1) & mask;
 
-    // Copy the string data
-    strcpy((char*)(ptr + String::OF_DATA), str.c_str());
-    pool.insert({str, val});
-    return val;
+    *(obj_header*)str |= HEADER_MSK_INTERNED;
+    table[idx] = str;
+    numStrings++;
+}
+
+void StringPool::sweep(VM& vm)
+{
+    // Strings move, so the table is rebuilt from the surviving strings
+    std::vector<refptr> oldTable(table.size(), nullptr);
+    std::swap(table, oldTable);
+    numStrings = 0;
+
+    for (auto str : oldTable)
+    {
+        if (str == nullptr)
+            continue;
+
+        // If the string is no longer referenced, drop it from the pool
+        auto newPtr = vm.weakRef(str);
+        if (newPtr)
+            insert(newPtr);
+    }
+}
+
+Value StringPool::getString(const char* data, size_t len)
+{
+    auto hash = String::hash(data, len);
+    auto idx = findSlot(data, len, hash);
+
+    if (table[idx])
+        return Value(table[idx], TAG_STRING);
+
+    auto ptr = allocString(len);
+    memcpy(ptr + String::OF_DATA, data, len);
+    *(uint32_t*)(ptr + String::OF_HASH) = hash;
+    insert(ptr);
+
+    return Value(ptr, TAG_STRING);
+}
+
+Value StringPool::intern(Value str)
+{
+    auto ptr = (refptr)str;
+    assert (*(Tag*)ptr == TAG_STRING);
+
+    if (*(obj_header*)ptr & HEADER_MSK_INTERNED)
+        return str;
+
+    auto len = *(uint32_t*)(ptr + String::OF_LEN);
+    auto hash = *(uint32_t*)(ptr + String::OF_HASH);
+    auto idx = findSlot((char*)(ptr + String::OF_DATA), len, hash);
+
+    if (table[idx])
+        return Value(table[idx], TAG_STRING);
+
+    insert(ptr);
+    return str;
 }
 
 bool isValidIdent(std::string identStr)
@@ -719,6 +1462,7 @@ Tag strToTag(std::string str)
     if (str == "object")    return TAG_OBJECT;
     if (str == "array")     return TAG_ARRAY;
     if (str == "hostfn")    return TAG_HOSTFN;
+    if (str == "buffer")    return TAG_BUFFER;
     assert (false);
 }
 
@@ -737,6 +1481,7 @@ std::string tagToStr(Tag tag)
         case TAG_ARRAY:     return "array";
         case TAG_HOSTFN:    return "hostfn";
         case TAG_RAWPTR:    return "rawptr";
+        case TAG_BUFFER:    return "buffer";
         default:
         assert (false);
     }
@@ -774,6 +1519,24 @@ void testRuntime()
     assert (str == str2);
     assert ((std::string)str == (std::string)str2);
 
+    // Interned and non-interned strings
+    assert (str.isInterned());
+    assert ((refptr)str == (refptr)str2);
+    assert (str.getHash() == String::hash("foobar", 6));
+    auto longStr = std::string(String::MAX_INTERN_LEN + 1, 'x');
+    auto long1 = String(longStr);
+    auto long2 = String(longStr);
+    assert (!long1.isInterned() && !long2.isInterned());
+    assert ((refptr)long1 != (refptr)long2);
+    assert (long1 == long2);
+    assert (!(long1 == String(longStr + "y")));
+    assert ((refptr)long1.intern() == (refptr)long2.intern());
+
+    // Ropes
+    auto rope = String::concat(long1, String("abc"));
+    assert (String::length(rope) == longStr.length() + 3);
+    assert ((std::string)String(rope) == longStr + "abc");
+
     // Arrays
     auto arr = Array(2);
     assert (arr.length() == 0);
@@ -5,6 +5,7 @@
 #include <string>
 #include <cstring>
 #include <unordered_map>
+#include <vector>
 
 /// Type tag, 8 bits
 typedef uint8_t Tag;
@@ -29,15 +30,34 @@ const Tag TAG_HOSTFN    = 9;
 const Tag TAG_RAWPTR    = 10;
 const Tag TAG_IMGREF    = 11;
 
+/// Heap-only tag for the out-of-line value storage of arrays and objects
+/// Note: values never have this tag
+const Tag TAG_STORE     = 12;
+
+/// Heap-only tag for lazy string concatenations (ropes)
+/// Note: ropes are referenced by values tagged as strings
+const Tag TAG_ROPE      = 13;
+
+/// Packed buffers of numeric elements
+const Tag TAG_BUFFER    = 14;
+
 /// Object header size
 const size_t HEADER_SIZE = sizeof(obj_header);
 
-/// Bit flag indicating the next pointer is set
-const size_t HEADER_IDX_NEXT = 15;
-const size_t HEADER_MSK_NEXT = 1 << HEADER_IDX_NEXT;
+/// Bit flag indicating the object was moved by the garbage collector
+const size_t HEADER_IDX_FWD = 14;
+const size_t HEADER_MSK_FWD = 1 << HEADER_IDX_FWD;
 
-/// Offset of the next pointer
-const size_t OBJ_OF_NEXT = HEADER_SIZE;
+/// Offset of the forwarding pointer
+const size_t OBJ_OF_FWD = HEADER_SIZE;
+
+/// Bit flag indicating a string is interned in the string pool
+const size_t HEADER_IDX_INTERNED = 15;
+const size_t HEADER_MSK_INTERNED = 1 << HEADER_IDX_INTERNED;
+
+/// The upper half of object headers is free for the interpreter to
+/// associate objects with its own metadata, without a side table
+const size_t HEADER_IDX_AUX = 32;
 
 /**
 64-bit word union
@@ -46,7 +66,7 @@ union Word
 {
     Word(refptr p) { int64 = 0; ptr = p; }
     Word(int64_t v) { int64 = v; }
-    Word(float v) { float32 = v; }
+    Word(float v) { int64 = 0; float32 = v; }
     Word() {}
 
     float float32;
@@ -57,14 +77,32 @@ union Word
 };
 
 /**
-Tagged value pair type (64-bit word + tag)
+Tagged value type
+
+By default, values are packed into a single 64-bit word, with the
+type tag in the top 16 bits and the payload in the low 48 bits.
+User-space pointers on x86-64 and AArch64 fit in 48 bits. Building
+with ZETA_WIDE_VALUES defined instead stores a full word and a
+separate tag byte, which pads values to 16 bytes.
 */
 class Value
 {
 private:
 
+#ifdef ZETA_WIDE_VALUES
     Word word;
     Tag tag;
+#else
+    static const size_t TAG_SHIFT = 48;
+    static const uint64_t PAYLOAD_MASK = (uint64_t(1) << TAG_SHIFT) - 1;
+
+    uint64_t bits;
+
+    static constexpr uint64_t pack(uint64_t payload, Tag t)
+    {
+        return (uint64_t(t) << TAG_SHIFT) | (payload & PAYLOAD_MASK);
+    }
+#endif
 
 public:
 
@@ -76,6 +114,7 @@ public:
     static const Value TRUE;
     static const Value FALSE;
 
+#ifdef ZETA_WIDE_VALUES
     Value() : Value(UNDEF.word, UNDEF.tag) {}
     Value(refptr p, Tag t) : Value(Word(p), t) {}
     Value(Word w, Tag t) : word(w), tag(t) {};
@@ -85,16 +124,41 @@ public:
     static Value int32(int32_t v) { return Value(Word((int64_t)v), TAG_INT32); }
     static Value float32(float v) { return Value(Word(v), TAG_FLOAT32); }
 
-    bool isBool() const { return tag == TAG_BOOL; }
-    bool isInt32() const { return tag == TAG_INT32; }
-    bool isFloat32() const { return tag == TAG_FLOAT32; }
-    bool isString() const { return tag == TAG_STRING; }
-    bool isObject() const { return tag == TAG_OBJECT; }
-    bool isArray() const { return tag == TAG_ARRAY; }
-    bool isHostFn() const { return tag == TAG_HOSTFN; }
-
     Word getWord() const { return word; }
     Tag getTag() const { return tag; }
+#else
+    Value() : bits(0) {}
+    Value(refptr p, Tag t) : bits(pack(uint64_t(p), t))
+    {
+        assert ((uint64_t(p) & ~PAYLOAD_MASK) == 0);
+    }
+    Value(Word w, Tag t) : bits(pack(w.int64, t)) {};
+    ~Value() {}
+
+    // Static constructors. These are needed because of type ambiguity.
+    static Value int32(int32_t v)
+    {
+        Value val;
+        val.bits = pack(uint32_t(v), TAG_INT32);
+        return val;
+    }
+    static Value float32(float v)
+    {
+        return Value(Word(v), TAG_FLOAT32);
+    }
+
+    Word getWord() const { return Word(int64_t(bits & PAYLOAD_MASK)); }
+    Tag getTag() const { return Tag(bits >> TAG_SHIFT); }
+#endif
+
+    bool isBool() const { return getTag() == TAG_BOOL; }
+    bool isInt32() const { return getTag() == TAG_INT32; }
+    bool isFloat32() const { return getTag() == TAG_FLOAT32; }
+    bool isString() const { return getTag() == TAG_STRING; }
+    bool isObject() const { return getTag() == TAG_OBJECT; }
+    bool isArray() const { return getTag() == TAG_ARRAY; }
+    bool isHostFn() const { return getTag() == TAG_HOSTFN; }
+    bool isBuffer() const { return getTag() == TAG_BUFFER; }
 
     bool isPointer() const;
 
@@ -102,34 +166,41 @@ public:
 
     inline operator bool () const
     {
-        assert (tag == TAG_BOOL);
-        return word.int64? 1:0;
+        assert (isBool());
+        return getWord().int64? 1:0;
     }
 
     inline operator int32_t () const
     {
-        assert (tag == TAG_INT32);
-        return word.int32;
+        assert (isInt32());
+        return getWord().int32;
     }
 
     inline operator float () const
     {
-        assert (tag == TAG_FLOAT32);
-        return word.float32;
+        assert (isFloat32());
+        return getWord().float32;
     }
 
     inline operator refptr () const
     {
         assert (isPointer());
-        return word.ptr;
+        return getWord().ptr;
     }
 
     operator std::string () const;
 
+#ifdef ZETA_WIDE_VALUES
     bool operator == (const Value& that) const
     {
         return this->word.int64 == that.word.int64 && this->tag == that.tag;
     }
+#else
+    bool operator == (const Value& that) const
+    {
+        return this->bits == that.bits;
+    }
+#endif
 
     bool operator != (const Value& that) const
     {
@@ -137,29 +208,148 @@ public:
     }
 };
 
+// Forward declarations
+class VM;
+class Wrapper;
+
+/// Callback invoked by the garbage collector to visit external roots
+typedef void (*RootFn)(VM& vm);
+
+/// Callback visiting the values reachable only through objects found
+/// to be live so far. It returns true if it visited any value, and gets
+/// invoked again after the newly copied objects are scanned.
+typedef bool (*TraceFn)(VM& vm);
+
 /**
-Virtual Machine object (singleton)
+Virtual Machine object (one per isolate)
+
+The heap is managed by a copying (Cheney-style) garbage collector.
+Memory is bump-allocated into chunks, and collections copy all live
+objects into a single contiguous to-space.
+
+Collections only happen at safe points (interpreter branches, calls
+and returns, or explicit gc_collect calls). Allocation itself never
+triggers a collection, it only requests one. C++ code holding values
+across calls back into the interpreter must keep them in a GCRoot.
 */
 class VM
 {
 private:
 
-    // TODO: total memory size allocated
+    /// Allocation chunk (contiguous block of heap memory)
+    struct Chunk
+    {
+        uint8_t* start;
+        uint8_t* alloc;
+        uint8_t* limit;
+    };
+
+    /// Chunks making up the current heap (from-space)
+    std::vector<Chunk> chunks;
+
+    /// Current allocation pointer and limit
+    uint8_t* allocPtr = nullptr;
+    uint8_t* allocLimit = nullptr;
+
+    /// Bytes allocated in chunks other than the current one
+    size_t prevChunksUsed = 0;
+
+    /// Heap size which, when exceeded, triggers a collection request
+    size_t gcThreshold;
+
+    /// Number of collections performed so far
+    size_t numCollections = 0;
+
+    /// To-space bounds, only valid during a collection
+    uint8_t* toStart = nullptr;
+    uint8_t* toAlloc = nullptr;
+    uint8_t* toLimit = nullptr;
+
+    /// Individual value slots registered as roots
+    std::vector<Value*> roots;
 
-    // TODO: dynamically grow pools?
+    /// Functions visiting externally-held roots
+    std::vector<RootFn> rootFns;
 
-    // TODO: pools for sizes up to 32 (words)
+    /// Functions visiting values held on behalf of live objects
+    std::vector<TraceFn> traceFns;
 
-    // TODO: number of elements allocated in each pool
+    /// Functions dropping the weak references to dead objects
+    std::vector<RootFn> sweepFns;
+
+    /// Allocate a new chunk to bump-allocate from
+    void newChunk(size_t minSize);
+
+    /// Copy an object into to-space, if not already copied
+    refptr forward(refptr ptr);
+
+    /// Visit the outgoing references of an object in to-space
+    void scanObj(refptr ptr);
+
+    /// Visit the field names held by object shapes
+    void visitShapes();
 
 public:
 
+    /// Minimum heap size before a collection is requested
+    static const size_t HEAP_MIN_SIZE = 32 << 20;
+
+    /// Default allocation chunk size
+    static const size_t CHUNK_SIZE = 4 << 20;
+
+    /// Flag set when a collection should happen at the next safe point.
+    /// This is a thread-local static member, rather than a field of the
+    /// isolate's VM instance, so that safe points can test it directly.
+    /// It is declared __thread rather than thread_local: an extern
+    /// thread_local is read through a call to the TLS init function of
+    /// runtime.cpp, which made every safe point, and every entry into
+    /// native code, pay for a function call.
+    static __thread bool gcRequested;
+
     VM();
 
     /// Allocate a block of memory on the heap
     Value alloc(uint32_t size, Tag tag);
 
+    /// Total number of bytes currently allocated in the heap
     size_t allocated() const;
+
+    /// Number of collections performed so far
+    size_t gcCount() const { return numCollections; }
+
+    /// Perform a garbage collection
+    void collect();
+
+    /// Free the heap and the object shapes, when the isolate
+    /// exits. No values may be used afterwards.
+    void shutdown();
+
+    /// Register/unregister an individual root slot
+    void addRoot(Value* valPtr);
+    void removeRoot(Value* valPtr);
+    void addRoot(Wrapper& wrapper);
+    void removeRoot(Wrapper& wrapper);
+
+    /// Register a function visiting externally-held roots
+    void addRootFn(RootFn fn);
+
+    /// Register a function visiting values kept alive by live objects,
+    /// such as the stacks of suspended coroutines
+    void addTraceFn(TraceFn fn);
+
+    /// Register a function called once all live objects are copied,
+    /// which can release the resources of the unreachable ones
+    void addSweepFn(RootFn fn);
+
+    /// Update a reference during a collection
+    /// Note: these must only be called from root functions
+    void visit(Value& val);
+    void visit(Wrapper& wrapper);
+    void visitPtr(refptr& ptr);
+
+    /// Get the new location of a weakly-referenced object during a
+    /// collection, or null if the object is no longer reachable
+    refptr weakRef(refptr ptr);
 };
 
 /**
@@ -202,6 +392,8 @@ Heap object value wrapper base class
 */
 class Wrapper
 {
+    friend class VM;
+
 protected:
 
     /// Internal value holding a heap pointer to the string
@@ -209,16 +401,13 @@ protected:
 
     Wrapper() {}
 
-    /// Set the next pointer for an object
-    void setNextPtr(refptr obj, refptr nextPtr);
-
-    /// Get the next pointer for an object
-    refptr getNextPtr(refptr obj, refptr notFound);
-
-    /// Get a pointer to the object, or its next pointer if set
-    /// Note: this method is necessary because objects may be
-    ///       extended through indirection.
-    refptr getObjPtr();
+    /// Get a pointer to the object
+    refptr getObjPtr()
+    {
+        auto objPtr = (refptr)val;
+        assert (objPtr != nullptr);
+        return objPtr;
+    }
 
 public:
 
@@ -243,10 +432,12 @@ class String : public Wrapper
 {
 public:
 
-    /// Offset and size of the length and data fields
+    /// Offset and size of the length, hash and data fields
     static const size_t OF_LEN = HEADER_SIZE;
     static const size_t SZ_LEN = sizeof(uint32_t);
-    static const size_t OF_DATA = OF_LEN + SZ_LEN;
+    static const size_t OF_HASH = OF_LEN + SZ_LEN;
+    static const size_t SZ_HASH = sizeof(uint32_t);
+    static const size_t OF_DATA = OF_HASH + SZ_HASH;
 
     /// Compute the size of an object of this type
     static constexpr size_t memSize(size_t len)
@@ -254,6 +445,33 @@ public:
         return OF_DATA + (len + 1) * sizeof(char);
     }
 
+    /// Offsets of the fields of ropes, which share the length field
+    /// with flat strings. The flat field points to the flattened
+    /// string once the rope has been flattened.
+    static const size_t OF_LEFT = OF_LEN + sizeof(refptr);
+    static const size_t OF_RIGHT = OF_LEFT + sizeof(refptr);
+    static const size_t OF_FLAT = OF_RIGHT + sizeof(refptr);
+    static const size_t ROPE_SIZE = OF_FLAT + sizeof(refptr);
+
+    /// Concatenations shorter than this produce flat strings
+    static const size_t ROPE_MIN_LEN = 32;
+
+    /// Strings up to this length are interned when created. Longer ones
+    /// are only interned when used as field names.
+    static const size_t MAX_INTERN_LEN = 64;
+
+    /// Compute the hash of some string data
+    static uint32_t hash(const char* data, size_t len);
+
+    /// Allocate a flat string, interned if it is short enough
+    static Value newString(const char* data, size_t len);
+
+    /// Flatten a rope into a flat string
+    static refptr flatten(refptr rope);
+
+    /// Create a wrapper for a string value
+    /// Note: ropes get flattened, so that wrappers always refer to
+    /// flat strings
     String(std::string str);
     String(Value value);
 
@@ -270,21 +488,148 @@ public:
     /// Comparison with a string literal
     bool operator == (const char* that) const;
 
-    // FIXME: temporary until string interning is implemented
-    bool operator == (String that) {
-        return val == that.val;
+    /// Comparison of strings, which can only be equal if both are the
+    /// same object when both are interned
+    bool operator == (String that) const
+    {
+        if (val == that.val)
+            return true;
+
+        if (isInterned() && that.isInterned())
+            return false;
+
+        return equalsSlow(that);
+    }
+
+    /// Get the cached hash of the string data
+    uint32_t getHash() const
+    {
+        return *(uint32_t*)((refptr)val + OF_HASH);
+    }
+
+    bool isInterned() const
+    {
+        return *(obj_header*)(refptr)val & HEADER_MSK_INTERNED;
+    }
+
+    /// Get the interned string equal to this one
+    String intern() const
+    {
+        return isInterned()? *this:internSlow();
     }
 
     /// Get the ith character code
     char operator [] (size_t i);
 
-    /// Concatenate two strings
-    static String concat(String a, String b);
+    /// Get the length of a string value, without flattening it
+    static uint32_t length(Value str)
+    {
+        assert (str.isString());
+        return *(uint32_t*)((refptr)str + OF_LEN);
+    }
+
+    /// Concatenate two string values. Long results are ropes
+    /// referencing both operands, flattened when first accessed.
+    static Value concat(Value a, Value b);
+
+private:
+
+    /// Compare the hashes and then the data of two strings
+    bool equalsSlow(String that) const;
+
+    String internSlow() const;
+};
+
+/**
+Out-of-line value storage for arrays and objects
+Arrays and objects hold a pointer to a store containing their
+elements or field values. They grow by replacing their store with a
+larger copy, so that the array or object itself never moves.
+*/
+class ValStore
+{
+public:
+
+    /// Offset and size of the fields
+    /// Note: the capacity is padded so the data is 16-byte aligned
+    static const size_t OF_CAP = HEADER_SIZE;
+    static const size_t SZ_CAP = sizeof(uint32_t);
+    static const size_t OF_DATA = OF_CAP + sizeof(refptr);
+
+    /// Compute the size of a store of a given capacity
+    static constexpr size_t memSize(size_t cap)
+    {
+#ifdef ZETA_WIDE_VALUES
+        // Words and tags are stored in separate arrays to avoid padding
+        return OF_DATA + cap * sizeof(Word) + cap * sizeof(Tag);
+#else
+        return OF_DATA + cap * sizeof(Value);
+#endif
+    }
+
+    /// Allocate a new store, zero-initialized
+    static refptr alloc(size_t cap);
+
+    /// Initialize a store in zeroed memory
+    static void init(refptr store, size_t cap)
+    {
+        *(Tag*)store = TAG_STORE;
+        *(uint32_t*)(store + OF_CAP) = cap;
+    }
+
+    static uint32_t getCap(refptr store)
+    {
+        return *(uint32_t*)(store + OF_CAP);
+    }
+
+#ifdef ZETA_WIDE_VALUES
+    static Word* getWords(refptr store)
+    {
+        return (Word*)(store + OF_DATA);
+    }
+
+    static Tag* getTags(refptr store)
+    {
+        return (Tag*)(store + OF_DATA + getCap(store) * sizeof(Word));
+    }
+
+    static Value get(refptr store, size_t i)
+    {
+        assert (i < getCap(store));
+        return Value(getWords(store)[i], getTags(store)[i]);
+    }
+
+    static void set(refptr store, size_t i, Value v)
+    {
+        assert (i < getCap(store));
+        getWords(store)[i] = v.getWord();
+        getTags(store)[i] = v.getTag();
+    }
+#else
+    static Value* getValues(refptr store)
+    {
+        return (Value*)(store + OF_DATA);
+    }
+
+    static Value get(refptr store, size_t i)
+    {
+        assert (i < getCap(store));
+        return getValues(store)[i];
+    }
+
+    static void set(refptr store, size_t i, Value v)
+    {
+        assert (i < getCap(store));
+        getValues(store)[i] = v;
+    }
+#endif
+
+    /// Allocate a larger copy of a store
+    static refptr grow(refptr store, size_t newCap);
 };
 
 /**
 Array value wrapper
-Note: arrays have a fixed length set at allocation time
 */
 class Array : public Wrapper
 {
@@ -294,20 +639,21 @@ private:
     /// Note: we want to avoid publicly exposing the array capacity
     size_t getCap();
 
+    refptr getStore()
+    {
+        return *(refptr*)(getObjPtr() + OF_STORE);
+    }
+
 public:
 
     /// Offset and size of the fields
-    static const size_t OF_CAP = HEADER_SIZE;
-    static const size_t SZ_CAP = sizeof(uint32_t);
-    static const size_t OF_LEN = OF_CAP + SZ_CAP;
+    static const size_t OF_LEN = HEADER_SIZE;
     static const size_t SZ_LEN = sizeof(uint32_t);
-    static const size_t OF_DATA = OF_LEN + SZ_LEN;
+    static const size_t OF_STORE = OF_LEN + sizeof(refptr);
+    static const size_t SZ_STORE = sizeof(refptr);
 
-    /// Compute the size of an object of this type
-    static constexpr size_t memSize(size_t cap)
-    {
-        return OF_DATA + cap * sizeof(Word) + cap * sizeof(Tag);
-    }
+    /// Size of an array, excluding its store
+    static const size_t SIZE = OF_STORE + SZ_STORE;
 
     /// Allocate a new array of a given length
     Array(size_t minCap);
@@ -316,13 +662,24 @@ public:
     Array(Value value);
 
     /// Get the length of the array
-    uint32_t length();
+    uint32_t length()
+    {
+        return *(uint32_t*)(getObjPtr() + OF_LEN);
+    }
 
     /// Set the value of the ith element
-    void setElem(size_t i, Value v);
+    void setElem(size_t i, Value v)
+    {
+        assert (i < length());
+        ValStore::set(getStore(), i, v);
+    }
 
     /// Get the value of the ith element
-    Value getElem(size_t i);
+    Value getElem(size_t i)
+    {
+        assert (i < length());
+        return ValStore::get(getStore(), i);
+    }
 
     /// Append a value to the array
     void push(Value val);
@@ -331,6 +688,270 @@ public:
     Value pop();
 };
 
+/**
+Typed buffer value wrapper
+Buffers hold a fixed number of elements of a single numeric type,
+packed inline without type tags, so that host code can use their
+data directly.
+*/
+class Buffer : public Wrapper
+{
+public:
+
+    /// Element types
+    enum ElemType : uint32_t
+    {
+        FLOAT32,
+        INT32,
+        UINT8
+    };
+
+    /// Offset and size of the fields
+    static const size_t OF_LEN = HEADER_SIZE;
+    static const size_t SZ_LEN = sizeof(uint32_t);
+    static const size_t OF_TYPE = OF_LEN + SZ_LEN;
+    static const size_t SZ_TYPE = sizeof(uint32_t);
+    static const size_t OF_DATA = OF_TYPE + SZ_TYPE;
+
+    /// Get the size of the elements of a given type, in bytes
+    static size_t elemSize(ElemType type)
+    {
+        return (type == UINT8)? 1:4;
+    }
+
+    /// Compute the size of a buffer object
+    static size_t memSize(ElemType type, size_t len)
+    {
+        return OF_DATA + len * elemSize(type);
+    }
+
+    /// Parse the name of an element type (eg: "float32")
+    static bool strToType(std::string str, ElemType& type);
+    static std::string typeToStr(ElemType type);
+
+    /// Allocate a new zero-initialized buffer
+    Buffer(ElemType type, size_t len);
+
+    /// Create a buffer wrapper from a tagged value
+    Buffer(Value value);
+
+    uint32_t length()
+    {
+        return *(uint32_t*)(getObjPtr() + OF_LEN);
+    }
+
+    ElemType getType()
+    {
+        return *(ElemType*)(getObjPtr() + OF_TYPE);
+    }
+
+    /// Get a pointer to the raw element data
+    /// Warning: this data can get garbage-collected
+    uint8_t* getDataPtr()
+    {
+        return getObjPtr() + OF_DATA;
+    }
+
+    /// Get the ith element, as an int32 or float32 value
+    Value getElem(size_t i);
+
+    /// Set the ith element. Values must be float32 for float32
+    /// buffers, and int32 otherwise. Values stored into uint8
+    /// buffers are truncated to their low 8 bits.
+    void setElem(size_t i, Value val);
+};
+
+/**
+Object shape (hidden class)
+
+Shapes form a transition tree rooted at the empty shape. Each shape
+adds one field to its parent, so that objects which had the same
+fields added in the same order share the same shape. Objects only
+store field values, the field names and slot indices come from the
+shape. Shapes are never freed.
+*/
+class Shape
+{
+    friend class VM;
+
+private:
+
+    /// Child shapes, each adding one field to this shape
+    std::vector<Shape*> children;
+
+    /// Slot index table for shapes with many fields, built lazily
+    /// Note: this is keyed by string pointer, and cleared by the GC
+    std::unordered_map<refptr, uint32_t>* slotTable = nullptr;
+
+    /// Shape lookup table for shapes with many children, built lazily
+    std::unordered_map<refptr, Shape*>* childTable = nullptr;
+
+    Shape(Shape* parent, refptr name);
+
+public:
+
+    /// Minimum field count or child count for which lookup tables are built
+    static const size_t TABLE_MIN_SIZE = 8;
+
+    /// Parent shape, null for the empty shape
+    Shape* const parent;
+
+    /// Name of the field added by this shape (interned string)
+    /// Note: null for the empty shape
+    refptr name;
+
+    /// Number of fields of objects with this shape
+    /// Note: the field added by this shape has slot index numFields-1
+    const uint32_t numFields;
+
+    /// Shape of objects with no fields
+    static Shape* empty();
+
+    /// Get the shape obtained by adding a field to this shape
+    Shape* addField(refptr name);
+
+    /// Find the slot index for a given field name
+    bool getSlotIdx(refptr name, uint32_t& slotIdx);
+
+    /// Get the shapes adding each field, in the order fields were added
+    void getFieldShapes(std::vector<Shape*>& shapes);
+};
+
+/// Cached field slot for one object shape
+struct FieldICEntry
+{
+    Shape* shape;
+    Shape* newShape;
+    uint32_t slotIdx;
+};
+
+/**
+Polymorphic inline cache state for field accesses. The first shape
+seen is cached inline, so that monomorphic sites stay compact. The
+other shapes seen by polymorphic sites are cached in entries allocated
+on the first miss. Once a site has seen more shapes than there are
+entries, it becomes megamorphic, and its misses go through a global
+cache keyed by shape and field name.
+*/
+struct FieldIC
+{
+    /// Maximum number of shapes cached, including the inline one
+    static const size_t NUM_ENTRIES = 4;
+
+    /// Cached object shape
+    Shape* shape = nullptr;
+
+    /// Shape after the access
+    /// Note: this differs from shape when a field gets added
+    Shape* newShape = nullptr;
+
+    /// Slot index of the field
+    uint32_t slotIdx = 0;
+
+    /// Number of shapes cached
+    uint8_t numEntries = 0;
+
+    /// Set once the site has seen more shapes than there are entries
+    bool megamorphic = false;
+
+    /// Entries for the shapes after the first, null until needed
+    FieldICEntry* more = nullptr;
+
+    /// Add an entry for a shape, or mark the site megamorphic if full
+    void add(Shape* shape, Shape* newShape, uint32_t slotIdx);
+
+    /// Free the polymorphic entries, and empty the cache
+    void clear();
+};
+
+/// Inline caches which allocated polymorphic entries. The interpreter
+/// frees the entries of caches in code heap chunks it evicts.
+extern thread_local std::vector<FieldIC*> polyFieldICs;
+
+/**
+Global field cache used by megamorphic field access sites, mapping
+shapes and field names to slot indices. Entries are overwritten on
+collisions. Field names move during garbage collection, so the cache
+gets cleared by the GC. The cache starts out zeroed.
+*/
+class MegaFieldCache
+{
+private:
+
+    struct Entry
+    {
+        Shape* shape;
+        refptr name;
+        Shape* newShape;
+        uint32_t slotIdx;
+    };
+
+    static const size_t NUM_ENTRIES = 4096;
+
+    Entry entries[NUM_ENTRIES];
+
+    static size_t index(Shape* shape, refptr name)
+    {
+        auto hash = ((uintptr_t)shape >> 3) * 31 + ((uintptr_t)name >> 3);
+        return (hash ^ (hash >> 12)) & (NUM_ENTRIES - 1);
+    }
+
+public:
+
+    void clear();
+
+    /// Look up a cached field access, the entry is null on a miss
+    const Entry* find(Shape* shape, refptr name)
+    {
+        auto& entry = entries[index(shape, name)];
+        return (entry.shape == shape && entry.name == name)? &entry:nullptr;
+    }
+
+    void add(Shape* shape, refptr name, Shape* newShape, uint32_t slotIdx)
+    {
+        entries[index(shape, name)] = { shape, name, newShape, slotIdx };
+    }
+};
+
+extern thread_local MegaFieldCache megaFieldCache;
+
+/**
+Inline cache statistics, reported by the profiler. Only misses are
+counted for the caches of instructions, since their hit counts can
+be derived from the instruction execution counts. The counters have no
+initializers, since thread-local storage is zeroed, and the instance
+is declared __thread so that other translation units access it
+directly, without calling the TLS init function of runtime.cpp.
+*/
+struct ICStats
+{
+    /// Misses of the field caches of get_field/set_field instructions
+    uint64_t getFieldMisses;
+    uint64_t setFieldMisses;
+
+    /// Misses of the cached callee of call instructions
+    uint64_t callMisses;
+
+    /// Lookups and misses of the ICache objects used by the runtime
+    uint64_t iCacheLookups;
+    uint64_t iCacheMisses;
+
+    /// Number of field and call sites which became polymorphic
+    /// (more than one entry), and which became megamorphic
+    uint64_t fieldPolySites;
+    uint64_t fieldMegaSites;
+    uint64_t callPolySites;
+    uint64_t callMegaSites;
+
+    /// Lookups and misses of the global megamorphic caches
+    uint64_t fieldMegaLookups;
+    uint64_t fieldMegaMisses;
+    uint64_t callMegaLookups;
+    uint64_t callMegaMisses;
+};
+
+extern __thread ICStats icStats;
+
 /**
 Object value wrapper
 */
@@ -338,37 +959,38 @@ class Object : public Wrapper
 {
     friend class ObjFieldItr;
 
-    /// Get the object's capacity
-    size_t getCap();
+    /// Get the object's shape
+    Shape* getShape(refptr ptr)
+    {
+        return *(Shape**)(ptr + OF_SHAPE);
+    }
+
+    refptr getStore(refptr ptr)
+    {
+        return *(refptr*)(ptr + OF_STORE);
+    }
+
+    /// Cache miss path of the cached field accesses
+    bool getFieldMiss(String name, Value& value, FieldIC& ic, uint64_t& numMisses);
+    void setFieldMiss(String name, Value value, FieldIC& ic);
 
-    /// Find the slot index at which a field is stored
-    size_t getSlotIdx(
-        refptr ptr,
-        size_t cap,
-        String fieldName,
-        bool newField
-    );
+    /// Uncached field accesses, which fill the given cache entry
+    bool getFieldSlow(String name, Value& value, FieldICEntry& entry);
+    void setFieldSlow(String name, Value value, FieldICEntry& entry);
 
 public:
 
-    /// Minimum guaranteed object capacity
-    static const size_t MIN_CAP = 16;
+    /// Minimum guaranteed object capacity, in fields
+    static const size_t MIN_CAP = 8;
 
     /// Offset and size of the fields
-    static const size_t OF_CAP = HEADER_SIZE;
-    static const size_t SZ_CAP = sizeof(uint32_t);
-    static const size_t OF_SHAPE = OF_CAP + SZ_CAP;
+    static const size_t OF_SHAPE = HEADER_SIZE;
     static const size_t SZ_SHAPE = sizeof(refptr);
-    static const size_t OF_FIELDS = OF_SHAPE + SZ_SHAPE;
+    static const size_t OF_STORE = OF_SHAPE + SZ_SHAPE;
+    static const size_t SZ_STORE = sizeof(refptr);
 
-    /// Compute the size of an object of this type
-    static constexpr size_t memSize(size_t cap)
-    {
-        // FIXME: for now, we store tagged values, this will change
-        // once we have proper shapes implemented
-        //return OF_FIELDS + cap * sizeof(Word);
-        return OF_FIELDS + cap * sizeof(Value);
-    }
+    /// Size of an object, excluding the store for its field values
+    static const size_t SIZE = OF_STORE + SZ_STORE;
 
     /// Allocate a new empty object
     static Object newObject(size_t cap = 0);
@@ -379,8 +1001,60 @@ public:
     void setField(String name, Value val);
     Value getField(String name);
 
-    /// Property lookup with a slot index cache
-    bool getField(const String& name, Value& value, size_t& idxCache);
+    /// Get the auxiliary word stored in the object header
+    uint32_t getAux()
+    {
+        return *(obj_header*)getObjPtr() >> HEADER_IDX_AUX;
+    }
+
+    void setAux(uint32_t aux)
+    {
+        auto& header = *(obj_header*)getObjPtr();
+        header = (header & 0xFFFFFFFF) | ((obj_header)aux << HEADER_IDX_AUX);
+    }
+
+    /// Field lookup with an inline cache, counting the cache misses
+    /// Note: the cache must always be used with the same field name
+    bool getField(String name, Value& value, FieldIC& ic, uint64_t& numMisses)
+    {
+        auto ptr = getObjPtr();
+
+        // The first shape is checked inline, the shapes of
+        // polymorphic sites are checked on the miss path
+        if (getShape(ptr) == ic.shape)
+        {
+            value = ValStore::get(getStore(ptr), ic.slotIdx);
+            return true;
+        }
+
+        return getFieldMiss(name, value, ic, numMisses);
+    }
+
+    /// Field lookup with the inline cache of a get_field instruction
+    bool getField(String name, Value& value, FieldIC& ic)
+    {
+        return getField(name, value, ic, icStats.getFieldMisses);
+    }
+
+    /// Field update with an inline cache
+    /// Note: the cache must always be used with the same field name
+    void setField(String name, Value value, FieldIC& ic)
+    {
+        auto ptr = getObjPtr();
+        auto store = getStore(ptr);
+
+        // If this is an update of an existing field, or if a field
+        // is being added and there is enough capacity for it
+        if (getShape(ptr) == ic.shape &&
+            (ic.newShape == ic.shape || ic.slotIdx < ValStore::getCap(store)))
+        {
+            ValStore::set(store, ic.slotIdx, value);
+            *(Shape**)(ptr + OF_SHAPE) = ic.newShape;
+            return;
+        }
+
+        setFieldMiss(name, value, ic);
+    }
 
     bool hasField(std::string name) { return hasField(String(name)); }
     void setField(std::string name, Value val) { return setField(String(name), val); }
@@ -399,24 +1073,26 @@ class ICache
 {
 private:
 
-    // Cached slot index
-    size_t slotIdx = 0;
+    // Cached shapes and slot indices
+    FieldIC ic;
 
     // Field name to look up
     String fieldName;
 
 public:
 
-    ICache(std::string fieldName)
-    : fieldName(fieldName)
-    {
-    }
+    ICache(std::string fieldName);
+    ~ICache();
+
+    /// Inline caches register themselves as GC roots, so they can't be copied
+    ICache(const ICache& that) = delete;
 
     Value getField(Object obj)
     {
         Value val;
 
-        if (!obj.getField(fieldName, val, slotIdx))
+        ++icStats.iCacheLookups;
+        if (!obj.getField(fieldName, val, ic, icStats.iCacheMisses))
         {
             throw RunError("missing field \"" + (std::string)fieldName + "\"");
         }
@@ -424,6 +1100,11 @@ public:
         return val;
     }
 
+    void setField(Object obj, Value val)
+    {
+        obj.setField(fieldName, val, ic);
+    }
+
     int32_t getInt32(Object obj)
     {
         auto val = getField(obj);
@@ -455,14 +1136,16 @@ public:
 
 /**
 Object field iterator
+Note: fields are iterated in the order they were added
 */
 class ObjFieldItr
 {
 private:
 
-    Object obj;
+    /// Shapes adding each field, captured when the iterator is created
+    std::vector<Shape*> shapes;
 
-    size_t slotIdx = 0;
+    size_t idx = 0;
 
 public:
 
@@ -496,29 +1179,74 @@ public:
 
 int64_t murmurHash2(const void* key, size_t len, uint64_t seed);
 
+/**
+Pool of interned strings. Interned strings are unique, so that they
+can be compared by pointer. The pool is an open addressing hash table
+indexed by the hashes cached in the strings, which references the
+strings weakly.
+*/
 class StringPool
 {
 private:
-    class StringHasher
-    {
-    public:
-        size_t operator()(const std::string str) const
-        {
-            auto len = str.length();
-            auto ptr = str.c_str();
-            return (size_t)murmurHash2(ptr, len, 1337);
-        }
-    };
-    std::unordered_map<std::string, Value, StringHasher> pool;
-    Value newString(std::string str);
+
+    /// Hash table slots, null for empty slots
+    /// Note: the capacity is a power of two
+    std::vector<refptr> table;
+
+    size_t numStrings = 0;
+
+    /// Find the slot of the interned string with the given data,
+    /// or the empty slot where it would be inserted
+    size_t findSlot(const char* data, size_t len, uint32_t hash);
+
+    /// Insert a string known not to be in the pool
+    void insert(refptr str);
 
 public:
+
     StringPool();
-    Value getString(std::string str);
+
+    /// Get the interned string with the given data
+    Value getString(const char* data, size_t len);
+    Value getString(std::string str)
+    {
+        return getString(str.data(), str.length());
+    }
+
+    /// Get the interned string equal to a flat string, interning
+    /// the string itself if no equal string is in the pool
+    Value intern(Value str);
+
+    /// Update the pool after a collection, dropping unreferenced strings
+    void sweep(VM& vm);
 };
 
-/// Global virtual machine instance
-extern VM vm;
+/**
+Virtual machine instance of the isolate running on this thread.
+Each thread runs its own isolate, with its own heap, string pool
+and object shapes, so that isolate state is thread-local.
+*/
+extern thread_local VM vm;
+
+/**
+Scoped GC root, keeps a value alive and up to date
+across collections while it is in scope
+*/
+class GCRoot
+{
+private:
+
+    Value val;
+
+public:
+
+    GCRoot(Value val) : val(val) { vm.addRoot(&this->val); }
+    ~GCRoot() { vm.removeRoot(&val); }
+
+    GCRoot(const GCRoot& that) = delete;
+
+    operator Value () const { return val; }
+};
 
 /// Check if a string is a valid identifier
 bool isValidIdent(std::string identStr);
@@ -1,16 +1,67 @@
+#include <algorithm>
+#include <cstring>
 #include <unordered_set>
 #include <unordered_map>
 #include <vector>
 #include <iostream>
 #include "serialize.h"
 
-// Forward declaration
-std::string nameOrRepr(
-    Value val,
-    std::unordered_map<refptr, std::string>& valNames,
-    bool minify,
-    std::string indent
-);
+const size_t OutSink::CHUNK_SIZE;
+
+void OutSink::write(const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        if (bufLen == CHUNK_SIZE)
+            flush();
+
+        auto num = std::min(len, CHUNK_SIZE - bufLen);
+        memcpy(buf.data() + bufLen, data, num);
+        bufLen += num;
+        data += num;
+        len -= num;
+    }
+}
+
+void OutSink::flush()
+{
+    if (bufLen > 0)
+        writeChunk(buf.data(), bufLen);
+
+    bufLen = 0;
+}
+
+FileSink::FileSink(std::string fileName)
+: fileName(fileName)
+{
+    file = fopen(fileName.c_str(), "wb");
+
+    if (!file)
+        throw RunError("failed to open file \"" + fileName + "\" for writing");
+}
+
+FileSink::~FileSink()
+{
+    if (file)
+        fclose(file);
+}
+
+void FileSink::writeChunk(const char* data, size_t len)
+{
+    if (fwrite(data, 1, len, file) != len)
+        failed = true;
+}
+
+void FileSink::close()
+{
+    flush();
+
+    failed = (fclose(file) != 0) || failed;
+    file = nullptr;
+
+    if (failed)
+        throw RunError("failed to write file \"" + fileName + "\"");
+}
 
 std::string escapeStr(std::string str)
 {
@@ -70,142 +121,186 @@ std::string escapeStr(std::string str)
     return out + "\"";
 }
 
-/// Generate the output string for a value
-std::string genString(
-    Value val,
+/// Write the representation of a scalar value or string
+static void writeScalar(Value val, OutSink& out)
+{
+    switch (val.getTag())
+    {
+        // TODO: naming of long strings
+        case TAG_STRING:
+        out.write(escapeStr((std::string)val));
+        break;
+
+        case TAG_UNDEF:
+        out.write("$undef");
+        break;
+
+        case TAG_BOOL:
+        out.write((val == Value::TRUE)? "$true":"$false");
+        break;
+
+        case TAG_INT32:
+        out.write(std::to_string(int32_t(val)));
+        break;
+
+        case TAG_FLOAT32:
+        out.write(std::to_string(float(val)) + "f");
+        break;
+
+        default:
+        auto tagStr = tagToStr(val.getTag());
+        throw RunError("cannot serialize values with tag \"" + tagStr + "\"");
+    }
+}
+
+/// Write a newline, followed by some number of indentation levels
+static void writeIndent(OutSink& out, size_t indent)
+{
+    out.put('\n');
+    for (size_t i = 0; i < indent; ++i)
+        out.write("  ", 2);
+}
+
+/**
+Write the representation of a value. Values with an assigned name are
+referred to by name, except for the root value itself. Nested arrays
+and objects are written using an explicit stack rather than recursion,
+so that deeply nested graphs can't overflow the C stack.
+*/
+static void genString(
+    Value rootVal,
     std::unordered_map<refptr, std::string>& valNames,
     bool minify,
-    std::string indent
+    OutSink& out
 )
 {
-    switch (val.getTag())
+    // Array or object whose contents are being written
+    struct Frame
     {
-        case TAG_ARRAY:
-        {
-            auto arr = Array(val);
-            auto len = arr.length();
+        Value node;
 
-            std::string out = "[";
+        /// Field names, for objects
+        std::vector<std::string> fieldNames;
 
-            // For each array element
-            for (size_t i = 0; i < len; ++i)
-            {
-                auto elemVal = arr.getElem(i);
-                out += nameOrRepr(elemVal, valNames, minify, indent);
+        /// Index of the next element or field to write
+        size_t idx;
 
-                if (i < len - 1)
-                {
-                    out += ",";
-                    if (!minify)
-                        out += " ";
-                }
-            }
+        /// Indentation level of the closing bracket
+        size_t indent;
+    };
 
-            return out + "]";
+    std::vector<Frame> stack;
+
+    // Write a value, or start writing the contents of an array or object
+    auto begin = [&] (Value val, size_t indent, bool useName)
+    {
+        if (useName && val.isPointer())
+        {
+            auto itr = valNames.find((refptr)val);
+            if (itr != valNames.end())
+            {
+                out.put('@');
+                out.write(itr->second);
+                return;
+            }
         }
-        break;
 
-        case TAG_OBJECT:
+        if (val.isArray())
+        {
+            out.put('[');
+            stack.push_back({ val, {}, 0, indent });
+        }
+        else if (val.isObject())
         {
             auto obj = Object(val);
 
-            std::string out = "{";
-
-            // First field being printed
-            bool first = true;
-
-            // For each object field
+            std::vector<std::string> fieldNames;
             for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
-            {
-                auto fieldName = itr.get();
-                auto fieldVal = obj.getField(fieldName);
+                fieldNames.push_back(itr.get());
 
-                if (first)
-                    first = false;
-                else
-                    out += ",";
+            out.put('{');
+            stack.push_back({ val, std::move(fieldNames), 0, indent });
+        }
+        else
+        {
+            writeScalar(val, out);
+        }
+    };
 
-                // Indent this field
-                if (!minify)
-                {
-                    out += "\n";
-                    out += indent + "  ";
-                }
+    begin(rootVal, 0, false);
 
-                if (isValidIdent(fieldName))
-                    out += fieldName;
-                else
-                    out += escapeStr(fieldName);
+    while (!stack.empty())
+    {
+        // Note: the frame may move when children get pushed
+        auto& frame = stack.back();
+        auto indent = frame.indent;
 
-                out += ":";
+        if (frame.node.isArray())
+        {
+            auto arr = Array(frame.node);
 
-                out += nameOrRepr(
-                    fieldVal,
-                    valNames,
-                    minify,
-                    indent + "  "
-                );
+            if (frame.idx == arr.length())
+            {
+                out.put(']');
+                stack.pop_back();
+                continue;
             }
 
-            // Indent the closing brace
-            if (!minify)
+            if (frame.idx > 0)
             {
-                out += "\n";
-                out += indent;
+                out.put(',');
+                if (!minify)
+                    out.put(' ');
             }
 
-            out += "}";
-
-            return out;
+            auto elemVal = arr.getElem(frame.idx++);
+            begin(elemVal, indent, true);
         }
-        break;
-
-        // TODO: naming of long strings
-        case TAG_STRING:
+        else
         {
-            auto str = (std::string)val;
-            return escapeStr(str);
-        }
-        break;
+            auto obj = Object(frame.node);
 
-        case TAG_UNDEF:
-        return std::string("$undef");
+            if (frame.idx == frame.fieldNames.size())
+            {
+                // Indent the closing brace
+                if (!minify)
+                    writeIndent(out, indent);
 
-        case TAG_BOOL:
-        return std::string((val == Value::TRUE)? "$true":"$false");
+                out.put('}');
+                stack.pop_back();
+                continue;
+            }
 
-        case TAG_INT32:
-        return std::to_string(int32_t(val));
+            if (frame.idx > 0)
+                out.put(',');
 
-        case TAG_FLOAT32:
-        return std::to_string(float(val)) + "f";
+            // Indent this field
+            if (!minify)
+                writeIndent(out, indent + 1);
 
-        default:
-        auto tagStr = tagToStr(val.getTag());
-        throw RunError("cannot serialize values with tag \"" + tagStr + "\"");
-    }
-};
+            auto fieldName = frame.fieldNames[frame.idx++];
 
-/// Produce a value's name if it has one, otherwise its string representation
-std::string nameOrRepr(
-    Value val,
-    std::unordered_map<refptr, std::string>& valNames,
-    bool minify,
-    std::string indent
-)
-{
-    if (!val.isPointer())
-        return genString(val, valNames, minify, indent);
+            if (isValidIdent(fieldName))
+                out.write(fieldName);
+            else
+                out.write(escapeStr(fieldName));
 
-    auto ptr = (refptr)val;
-    if (valNames.find(ptr) != valNames.end())
-        return "@" + valNames[ptr];
+            out.put(':');
 
-    return genString(val, valNames, minify, indent);
-};
+            begin(obj.getField(fieldName), indent + 1, true);
+        }
+    }
+}
 
 /// Serialize the graph indirectly referenced by a root value
 std::string serialize(Value rootVal, bool minify)
+{
+    StringSink out;
+    serialize(rootVal, minify, out);
+    return std::move(out.getStr());
+}
+
+void serialize(Value rootVal, bool minify, OutSink& out)
 {
     // Visited set for the naming traversal
     std::unordered_set<refptr> visited;
@@ -309,23 +404,625 @@ std::string serialize(Value rootVal, bool minify)
         }
     }
 
-    std::string out;
-
     // For each object with an assigned name
     for (size_t i = 0; i < namedObjs.size(); ++i)
     {
         auto val = namedObjs[i];
         auto ptr = (refptr)val;
-        auto name = valNames[ptr];
 
-        out += name + " = " + genString(val, valNames, minify, "") + ";";
+        out.write(valNames[ptr]);
+        out.write(" = ");
+        genString(val, valNames, minify, out);
+        out.put(';');
 
         if (!minify)
-            out += "\n\n";
+            out.write("\n\n");
     }
 
     // Write the root/exported value
-    out += nameOrRepr(rootVal, valNames, minify, "") + ";";
+    if (rootVal.isPointer() && valNames.count((refptr)rootVal))
+    {
+        out.put('@');
+        out.write(valNames[(refptr)rootVal]);
+    }
+    else
+    {
+        genString(rootVal, valNames, minify, out);
+    }
+
+    out.put(';');
+    out.flush();
+}
+
+/*
+Binary image format (ZIB)
+
+Binary images hold the graph reachable from a root value with all
+references already resolved, so that they can be loaded without
+parsing. Integers are little-endian.
+
+    header:  magic "ZETAZIB\0", u32 version, u64 source hash,
+             u32 string count, u32 node count
+    strings: u32 length, then the characters
+    nodes:   u8 kind (array, object or buffer), u32 length, then the
+             array elements, the object fields as a u32 string index
+             (field name) followed by a value, or the u8 element type
+             and raw element data of a buffer
+    root:    value
+    trailer: u64 hash of everything between the header and the trailer
+
+Values are a u8 tag, followed by a payload for some tags: u8 for
+booleans, 4 bytes for numbers, and a u32 index in the string or
+node table for strings, arrays, objects and buffers. Images which
+stay within the process, such as messages between isolates, may also
+hold host functions, as a u64 pointer to the process-global function.
+
+The hash is chained over blocks of OutSink::CHUNK_SIZE bytes, so that
+it can be computed while the image is being written.
+*/
+
+/// Magic number and format version of binary images
+static const char ZIB_MAGIC[8] = { 'Z', 'E', 'T', 'A', 'Z', 'I', 'B', '\0' };
+static const uint32_t ZIB_VERSION = 3;
+
+/// Size of the binary image header and trailer
+static const size_t ZIB_HEADER_SIZE = 8 + 4 + 8 + 4 + 4;
+static const size_t ZIB_TRAILER_SIZE = 8;
+
+/// Node kinds in binary images
+static const uint8_t ZIB_ARRAY = 0;
+static const uint8_t ZIB_OBJECT = 1;
+static const uint8_t ZIB_BUFFER = 2;
+
+/// Hash the body of a binary image, chained over fixed-size blocks
+static uint64_t hashBlock(const char* data, size_t len, uint64_t hash)
+{
+    return (uint64_t)murmurHash2(data, len, hash);
+}
+
+/// Sink hashing the body of a binary image as it is passed on
+class ZibBodySink : public OutSink
+{
+private:
+
+    OutSink& dst;
+
+    uint64_t hash = 1337;
+
+    void writeChunk(const char* data, size_t len) override
+    {
+        hash = hashBlock(data, len, hash);
+        dst.write(data, len);
+    }
+
+public:
+
+    ZibBodySink(OutSink& dst) : dst(dst) {}
+
+    uint64_t getHash()
+    {
+        flush();
+        return hash;
+    }
+};
+
+/// Sink discarding its output
+class NullSink : public OutSink
+{
+private:
+
+    void writeChunk(const char* data, size_t len) override {}
+};
+
+/// Write an integer to a binary image, in little-endian order
+template <typename T> static void writeInt(OutSink& out, T val)
+{
+    for (size_t i = 0; i < sizeof(T); ++i)
+        out.put((char)(uint8_t)((uint64_t)val >> (8 * i)));
+}
+
+std::string serializeBin(Value rootVal, uint64_t srcHash, bool hostFns)
+{
+    StringSink out;
+    serializeBin(rootVal, srcHash, out, hostFns);
+    return std::move(out.getStr());
+}
+
+void serializeBin(
+    Value rootVal,
+    uint64_t srcHash,
+    OutSink& out,
+    bool hostFns
+)
+{
+    // Indices of the strings and nodes (arrays and objects)
+    std::unordered_map<std::string, uint32_t> strIdxs;
+    std::vector<std::string> strs;
+    std::unordered_map<refptr, uint32_t> nodeIdxs;
+    std::vector<Value> nodes;
+
+    auto getStrIdx = [&strIdxs, &strs] (std::string str)
+    {
+        auto itr = strIdxs.find(str);
+        if (itr != strIdxs.end())
+            return itr->second;
+
+        auto idx = (uint32_t)strs.size();
+        strIdxs[str] = idx;
+        strs.push_back(str);
+        return idx;
+    };
+
+    // Number the nodes in the order they are first reached
+    auto getNodeIdx = [&nodeIdxs, &nodes] (Value val)
+    {
+        auto ptr = (refptr)val;
+        auto itr = nodeIdxs.find(ptr);
+        if (itr != nodeIdxs.end())
+            return itr->second;
+
+        auto idx = (uint32_t)nodes.size();
+        nodeIdxs[ptr] = idx;
+        nodes.push_back(val);
+        return idx;
+    };
+
+    auto writeVal = [&] (Value val, OutSink& body)
+    {
+        auto tag = val.getTag();
+        body.put((char)tag);
+
+        switch (tag)
+        {
+            case TAG_UNDEF:
+            break;
+
+            case TAG_BOOL:
+            body.put((char)(val == Value::TRUE));
+            break;
+
+            case TAG_INT32:
+            writeInt(body, (uint32_t)int32_t(val));
+            break;
 
-    return out;
+            case TAG_FLOAT32:
+            {
+                float floatVal = val;
+                uint32_t bits;
+                memcpy(&bits, &floatVal, sizeof(bits));
+                writeInt(body, bits);
+            }
+            break;
+
+            case TAG_STRING:
+            writeInt(body, getStrIdx((std::string)val));
+            break;
+
+            case TAG_ARRAY:
+            case TAG_OBJECT:
+            case TAG_BUFFER:
+            writeInt(body, getNodeIdx(val));
+            break;
+
+            case TAG_HOSTFN:
+            if (!hostFns)
+                throw RunError("cannot serialize values with tag \"hostfn\"");
+            writeInt(body, (uint64_t)val.getWord().ptr);
+            break;
+
+            default:
+            auto tagStr = tagToStr(tag);
+            throw RunError("cannot serialize values with tag \"" + tagStr + "\"");
+        }
+    };
+
+    // Write the nodes and the root value. Nodes get appended to the
+    // list as they are first referenced.
+    auto writeGraph = [&] (OutSink& body)
+    {
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            auto node = nodes[i];
+
+            if (node.isArray())
+            {
+                auto arr = Array(node);
+                auto len = arr.length();
+
+                body.put((char)ZIB_ARRAY);
+                writeInt(body, (uint32_t)len);
+
+                for (size_t j = 0; j < len; ++j)
+                    writeVal(arr.getElem(j), body);
+            }
+            else if (node.isBuffer())
+            {
+                auto buf = Buffer(node);
+                auto len = buf.length();
+
+                body.put((char)ZIB_BUFFER);
+                writeInt(body, (uint32_t)len);
+                body.put((char)buf.getType());
+                body.write(
+                    (const char*)buf.getDataPtr(),
+                    len * Buffer::elemSize(buf.getType())
+                );
+            }
+            else
+            {
+                auto obj = Object(node);
+
+                std::vector<std::string> fieldNames;
+                for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
+                    fieldNames.push_back(itr.get());
+
+                body.put((char)ZIB_OBJECT);
+                writeInt(body, (uint32_t)fieldNames.size());
+
+                for (auto& fieldName : fieldNames)
+                {
+                    writeInt(body, getStrIdx(fieldName));
+                    writeVal(obj.getField(fieldName), body);
+                }
+            }
+        }
+
+        writeVal(rootVal, body);
+    };
+
+    if (rootVal.isArray() || rootVal.isObject() || rootVal.isBuffer())
+        getNodeIdx(rootVal);
+
+    // The string table precedes the nodes, so the graph is first
+    // traversed without output, to number the strings and nodes
+    NullSink numbering;
+    writeGraph(numbering);
+
+    out.write(ZIB_MAGIC, sizeof(ZIB_MAGIC));
+    writeInt(out, ZIB_VERSION);
+    writeInt(out, srcHash);
+    writeInt(out, (uint32_t)strs.size());
+    writeInt(out, (uint32_t)nodes.size());
+
+    ZibBodySink body(out);
+
+    for (auto& str : strs)
+    {
+        writeInt(body, (uint32_t)str.length());
+        body.write(str);
+    }
+
+    writeGraph(body);
+
+    writeInt(out, body.getHash());
+    out.flush();
+}
+
+/// Reader for binary images, which checks that the image is well-formed
+class ZibReader
+{
+private:
+
+    const uint8_t* ptr;
+
+    const uint8_t* limit;
+
+    std::vector<Value> strs;
+
+    std::vector<Value> nodes;
+
+    /// Whether host functions are accepted
+    bool hostFns;
+
+public:
+
+    /// Set if the image is malformed
+    bool failed = false;
+
+    ZibReader(const char* data, size_t len, bool hostFns = false)
+    : ptr((const uint8_t*)data),
+      limit((const uint8_t*)data + len),
+      hostFns(hostFns)
+    {
+    }
+
+    bool atEnd() const { return ptr == limit; }
+
+    /// Check that some number of bytes remain in the image
+    bool check(size_t numBytes)
+    {
+        if ((size_t)(limit - ptr) < numBytes)
+            failed = true;
+
+        return !failed;
+    }
+
+    template <typename T> T readInt()
+    {
+        if (!check(sizeof(T)))
+            return 0;
+
+        uint64_t val = 0;
+        for (size_t i = 0; i < sizeof(T); ++i)
+            val |= (uint64_t)ptr[i] << (8 * i);
+
+        ptr += sizeof(T);
+        return (T)val;
+    }
+
+    const char* readBytes(size_t numBytes)
+    {
+        if (!check(numBytes))
+            return nullptr;
+
+        auto bytes = (const char*)ptr;
+        ptr += numBytes;
+        return bytes;
+    }
+
+    /// Read the string table, and allocate the nodes. Nodes are filled
+    /// in afterwards, so that references can point to any node.
+    void readTables(uint32_t numStrs, uint32_t numNodes)
+    {
+        for (size_t i = 0; i < numStrs && !failed; ++i)
+        {
+            auto len = readInt<uint32_t>();
+            auto chars = readBytes(len);
+            if (chars)
+                strs.push_back(String::newString(chars, len));
+        }
+
+        // Each node takes at least 5 bytes
+        if (!check(5 * (size_t)numNodes))
+            return;
+
+        auto nodesStart = ptr;
+        for (size_t i = 0; i < numNodes && !failed; ++i)
+        {
+            auto kind = readInt<uint8_t>();
+            auto len = readInt<uint32_t>();
+
+            if (kind == ZIB_ARRAY)
+                nodes.push_back(Array(len));
+            else if (kind == ZIB_OBJECT)
+                nodes.push_back(Object::newObject(len));
+            else if (kind == ZIB_BUFFER)
+                nodes.push_back(readBuffer(len));
+            else
+                failed = true;
+
+            skipNode(kind, len);
+        }
+        ptr = nodesStart;
+    }
+
+    /// Read a buffer node, whose data is copied in as it is allocated
+    Value readBuffer(uint32_t len)
+    {
+        auto type = (Buffer::ElemType)readInt<uint8_t>();
+        if (type > Buffer::UINT8)
+        {
+            failed = true;
+            return Value::UNDEF;
+        }
+
+        auto numBytes = len * Buffer::elemSize(type);
+        auto data = readBytes(numBytes);
+        if (!data)
+            return Value::UNDEF;
+
+        auto buf = Buffer(type, len);
+        memcpy(buf.getDataPtr(), data, numBytes);
+        return buf;
+    }
+
+    /// Skip the contents of a node, without allocating anything
+    void skipNode(uint8_t kind, uint32_t len)
+    {
+        // The data of buffers was read along with their element type
+        if (kind == ZIB_BUFFER)
+            return;
+
+        for (size_t i = 0; i < len && !failed; ++i)
+        {
+            if (kind == ZIB_OBJECT)
+                readInt<uint32_t>();
+
+            switch (readInt<uint8_t>())
+            {
+                case TAG_UNDEF:
+                break;
+
+                case TAG_BOOL:
+                readBytes(1);
+                break;
+
+                case TAG_INT32:
+                case TAG_FLOAT32:
+                case TAG_STRING:
+                case TAG_ARRAY:
+                case TAG_OBJECT:
+                case TAG_BUFFER:
+                readBytes(4);
+                break;
+
+                case TAG_HOSTFN:
+                if (!hostFns)
+                    failed = true;
+                readBytes(8);
+                break;
+
+                default:
+                failed = true;
+            }
+        }
+    }
+
+    /// Get a string from the table
+    Value getStr(uint32_t idx)
+    {
+        if (idx >= strs.size())
+        {
+            failed = true;
+            return String("");
+        }
+
+        return strs[idx];
+    }
+
+    Value readVal()
+    {
+        auto tag = readInt<uint8_t>();
+
+        switch (tag)
+        {
+            case TAG_UNDEF:
+            return Value::UNDEF;
+
+            case TAG_BOOL:
+            return readInt<uint8_t>()? Value::TRUE:Value::FALSE;
+
+            case TAG_INT32:
+            return Value::int32((int32_t)readInt<uint32_t>());
+
+            case TAG_FLOAT32:
+            {
+                auto bits = readInt<uint32_t>();
+                float floatVal;
+                memcpy(&floatVal, &bits, sizeof(floatVal));
+                return Value::float32(floatVal);
+            }
+
+            case TAG_STRING:
+            return getStr(readInt<uint32_t>());
+
+            case TAG_ARRAY:
+            case TAG_OBJECT:
+            case TAG_BUFFER:
+            {
+                auto idx = readInt<uint32_t>();
+                if (idx >= nodes.size() || nodes[idx].getTag() != tag)
+                {
+                    failed = true;
+                    return Value::UNDEF;
+                }
+
+                return nodes[idx];
+            }
+
+            case TAG_HOSTFN:
+            {
+                auto ptr = (refptr)readInt<uint64_t>();
+                if (!hostFns)
+                {
+                    failed = true;
+                    return Value::UNDEF;
+                }
+
+                return Value(ptr, TAG_HOSTFN);
+            }
+
+            default:
+            failed = true;
+            return Value::UNDEF;
+        }
+    }
+
+    /// Fill in the contents of the nodes
+    void readNodes()
+    {
+        for (auto node : nodes)
+        {
+            if (failed)
+                return;
+
+            auto kind = readInt<uint8_t>();
+            auto len = readInt<uint32_t>();
+
+            if (kind == ZIB_BUFFER)
+            {
+                auto type = (Buffer::ElemType)readInt<uint8_t>();
+                readBytes(len * Buffer::elemSize(type));
+            }
+            else if (kind == ZIB_ARRAY)
+            {
+                auto arr = Array(node);
+                for (size_t i = 0; i < len && !failed; ++i)
+                    arr.push(readVal());
+            }
+            else
+            {
+                auto obj = Object(node);
+                for (size_t i = 0; i < len && !failed; ++i)
+                {
+                    auto fieldName = String(getStr(readInt<uint32_t>()));
+                    obj.setField(fieldName, readVal());
+                }
+            }
+        }
+    }
+};
+
+bool checkBinImage(const char* data, size_t len, uint64_t srcHash)
+{
+    if (len < ZIB_HEADER_SIZE + ZIB_TRAILER_SIZE ||
+        memcmp(data, ZIB_MAGIC, sizeof(ZIB_MAGIC)))
+        return false;
+
+    ZibReader reader(data + sizeof(ZIB_MAGIC), len - sizeof(ZIB_MAGIC));
+
+    if (reader.readInt<uint32_t>() != ZIB_VERSION)
+        return false;
+
+    if (reader.readInt<uint64_t>() != srcHash)
+        return false;
+
+    // Detect corrupted images
+    auto bodyLen = len - ZIB_HEADER_SIZE - ZIB_TRAILER_SIZE;
+    ZibReader trailer(data + ZIB_HEADER_SIZE + bodyLen, ZIB_TRAILER_SIZE);
+    auto bodyHash = trailer.readInt<uint64_t>();
+
+    uint64_t hash = 1337;
+    for (size_t ofs = 0; ofs < bodyLen; ofs += OutSink::CHUNK_SIZE)
+    {
+        auto blockLen = std::min(OutSink::CHUNK_SIZE, bodyLen - ofs);
+        hash = hashBlock(data + ZIB_HEADER_SIZE + ofs, blockLen, hash);
+    }
+
+    return hash == bodyHash;
+}
+
+bool deserializeBin(
+    const char* data,
+    size_t len,
+    uint64_t srcHash,
+    Value& rootVal,
+    bool checked,
+    bool hostFns
+)
+{
+    if (!checked && !checkBinImage(data, len, srcHash))
+        return false;
+
+    // Skip to the table sizes, which end the header
+    auto countsOfs = ZIB_HEADER_SIZE - 2 * sizeof(uint32_t);
+    ZibReader reader(
+        data + countsOfs,
+        len - countsOfs - ZIB_TRAILER_SIZE,
+        hostFns
+    );
+    auto numStrs = reader.readInt<uint32_t>();
+    auto numNodes = reader.readInt<uint32_t>();
+
+    // Note: allocation never triggers a collection, so the values
+    // held by the reader stay valid while loading
+    reader.readTables(numStrs, numNodes);
+    reader.readNodes();
+    auto val = reader.readVal();
+
+    if (reader.failed || !reader.atEnd())
+        return false;
+
+    rootVal = val;
+    return true;
 }
@@ -1,6 +1,135 @@
 #pragma once
 
+#include <cstdio>
 #include <string>
+#include <vector>
 #include "runtime.h"
 
+/**
+Output sink written into by the serializers. Output is buffered, and
+passed on to the destination in chunks of CHUNK_SIZE bytes, except for
+the last chunk, which is passed on when the sink is flushed.
+*/
+class OutSink
+{
+private:
+
+    std::vector<char> buf;
+
+    size_t bufLen = 0;
+
+protected:
+
+    /// Write a chunk of output to its destination
+    virtual void writeChunk(const char* data, size_t len) = 0;
+
+public:
+
+    static const size_t CHUNK_SIZE = 64 << 10;
+
+    OutSink() : buf(CHUNK_SIZE) {}
+
+    virtual ~OutSink() {}
+
+    void write(const char* data, size_t len);
+
+    void write(const std::string& str)
+    {
+        write(str.data(), str.size());
+    }
+
+    void put(char ch)
+    {
+        if (bufLen == CHUNK_SIZE)
+            flush();
+
+        buf[bufLen++] = ch;
+    }
+
+    /// Pass the buffered output on to the destination
+    void flush();
+};
+
+/// Sink accumulating its output into a string
+class StringSink : public OutSink
+{
+private:
+
+    std::string str;
+
+    void writeChunk(const char* data, size_t len) override
+    {
+        str.append(data, len);
+    }
+
+public:
+
+    std::string& getStr()
+    {
+        flush();
+        return str;
+    }
+};
+
+/// Sink writing its output to a file
+class FileSink : public OutSink
+{
+private:
+
+    std::string fileName;
+
+    FILE* file;
+
+    bool failed = false;
+
+    void writeChunk(const char* data, size_t len) override;
+
+public:
+
+    FileSink(std::string fileName);
+
+    ~FileSink();
+
+    /// Flush the output and close the file, throws on write errors
+    void close();
+};
+
 std::string serialize(Value val, bool indent);
+
+/// Serialize the graph indirectly referenced by a root value into
+/// an output sink, in the text image format (ZIM)
+void serialize(Value rootVal, bool minify, OutSink& out);
+
+/// Serialize the graph indirectly referenced by a root value into the
+/// binary image format (ZIB), tagged with the hash of its source.
+/// Host functions may only be serialized into images which are loaded
+/// by the same process.
+std::string serializeBin(
+    Value rootVal,
+    uint64_t srcHash,
+    bool hostFns = false
+);
+void serializeBin(
+    Value rootVal,
+    uint64_t srcHash,
+    OutSink& out,
+    bool hostFns = false
+);
+
+/// Check that a binary image was produced from a source with a given
+/// hash, and is neither from another format version nor corrupted.
+/// This does not touch the heap, and may be called from any thread.
+bool checkBinImage(const char* data, size_t len, uint64_t srcHash);
+
+/// Load a binary image produced from a source with a given hash.
+/// Returns false if the image is stale, from another format version,
+/// or corrupted. The checks can be skipped if the image was already
+/// validated with checkBinImage.
+bool deserializeBin(
+    const char* data,
+    size_t len,
+    uint64_t srcHash,
+    Value& rootVal,
+    bool checked = false,
+    bool hostFns = false
+);
@@ -0,0 +1,646 @@
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "simd.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+//============================================================================
+// Sine table
+//============================================================================
+
+/// The sine table covers one period, with one extra entry so that
+/// the last interval can be interpolated
+static const size_t SIN_TABLE_BITS = 12;
+static const size_t SIN_TABLE_SIZE = 1 << SIN_TABLE_BITS;
+static const float SIN_SCALE = SIN_TABLE_SIZE / 6.28318530717958647692f;
+
+static const float* getSinTable()
+{
+    static std::vector<float> table = []()
+    {
+        std::vector<float> table(SIN_TABLE_SIZE + 1);
+        for (size_t i = 0; i <= SIN_TABLE_SIZE; ++i)
+            table[i] = (float)sin(i * 6.28318530717958647692 / SIN_TABLE_SIZE);
+        return table;
+    }();
+
+    return table.data();
+}
+
+/// Look up and interpolate the sine of an angle in table units
+static float sinLookup(const float* table, float t)
+{
+    auto floor = floorf(t);
+    auto frac = t - floor;
+    auto idx = (int32_t)(int64_t)floor & (SIN_TABLE_SIZE - 1);
+    return table[idx] + frac * (table[idx + 1] - table[idx]);
+}
+
+//============================================================================
+// Portable kernels
+//============================================================================
+
+namespace scalar
+{
+    void addF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            dst[i] = a[i] + b[i];
+    }
+
+    void mulF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            dst[i] = a[i] * b[i];
+    }
+
+    void fmaF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            dst[i] = dst[i] + a[i] * b[i];
+    }
+
+    void scaleF32(float* dst, const float* src, float k, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            dst[i] = src[i] * k;
+    }
+
+    void clampF32(float* dst, float lo, float hi, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            auto v = dst[i];
+            v = (v < lo)? lo:v;
+            dst[i] = (v > hi)? hi:v;
+        }
+    }
+
+    void sinF32(float* dst, const float* src, float phase, size_t n)
+    {
+        auto table = getSinTable();
+        auto offset = phase * SIN_SCALE;
+
+        for (size_t i = 0; i < n; ++i)
+            dst[i] = sinLookup(table, src[i] * SIN_SCALE + offset);
+    }
+
+    float sumF32(const float* src, size_t n)
+    {
+        float sum = 0;
+        for (size_t i = 0; i < n; ++i)
+            sum += src[i];
+        return sum;
+    }
+
+    float minF32(const float* src, size_t n)
+    {
+        assert (n > 0);
+        auto min = src[0];
+        for (size_t i = 1; i < n; ++i)
+            min = (src[i] < min)? src[i]:min;
+        return min;
+    }
+
+    float maxF32(const float* src, size_t n)
+    {
+        assert (n > 0);
+        auto max = src[0];
+        for (size_t i = 1; i < n; ++i)
+            max = (src[i] > max)? src[i]:max;
+        return max;
+    }
+
+    void i32ToF32(float* dst, const int32_t* src, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            dst[i] = (float)src[i];
+    }
+
+    void f32ToI32(int32_t* dst, const float* src, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            dst[i] = (int32_t)src[i];
+    }
+
+    const SimdKernels kernels = {
+        "scalar",
+        addF32, mulF32, fmaF32, scaleF32, clampF32, sinF32,
+        sumF32, minF32, maxF32, i32ToF32, f32ToI32
+    };
+}
+
+//============================================================================
+// x86-64 kernels (SSE2 and AVX2)
+//============================================================================
+
+#ifdef SIMD_X86
+
+namespace sse2
+{
+    void addF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        scalar::addF32(dst + i, a + i, b + i, n - i);
+    }
+
+    void mulF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        scalar::mulF32(dst + i, a + i, b + i, n - i);
+    }
+
+    void fmaF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            auto prod = _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+            _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), prod));
+        }
+        scalar::fmaF32(dst + i, a + i, b + i, n - i);
+    }
+
+    void scaleF32(float* dst, const float* src, float k, size_t n)
+    {
+        auto kv = _mm_set1_ps(k);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), kv));
+        scalar::scaleF32(dst + i, src + i, k, n - i);
+    }
+
+    void clampF32(float* dst, float lo, float hi, size_t n)
+    {
+        auto lov = _mm_set1_ps(lo);
+        auto hiv = _mm_set1_ps(hi);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            auto v = _mm_max_ps(_mm_loadu_ps(dst + i), lov);
+            _mm_storeu_ps(dst + i, _mm_min_ps(v, hiv));
+        }
+        scalar::clampF32(dst + i, lo, hi, n - i);
+    }
+
+    /// Add up the lanes of a vector
+    float hsum(__m128 v)
+    {
+        float lanes[4];
+        _mm_storeu_ps(lanes, v);
+        return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+
+    float sumF32(const float* src, size_t n)
+    {
+        auto acc = _mm_setzero_ps();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            acc = _mm_add_ps(acc, _mm_loadu_ps(src + i));
+        return hsum(acc) + scalar::sumF32(src + i, n - i);
+    }
+
+    float minF32(const float* src, size_t n)
+    {
+        if (n < 4)
+            return scalar::minF32(src, n);
+
+        auto acc = _mm_loadu_ps(src);
+        size_t i = 4;
+        for (; i + 4 <= n; i += 4)
+            acc = _mm_min_ps(acc, _mm_loadu_ps(src + i));
+
+        float lanes[4];
+        _mm_storeu_ps(lanes, acc);
+        auto min = scalar::minF32(lanes, 4);
+        return (i < n)? std::min(min, scalar::minF32(src + i, n - i)):min;
+    }
+
+    float maxF32(const float* src, size_t n)
+    {
+        if (n < 4)
+            return scalar::maxF32(src, n);
+
+        auto acc = _mm_loadu_ps(src);
+        size_t i = 4;
+        for (; i + 4 <= n; i += 4)
+            acc = _mm_max_ps(acc, _mm_loadu_ps(src + i));
+
+        float lanes[4];
+        _mm_storeu_ps(lanes, acc);
+        auto max = scalar::maxF32(lanes, 4);
+        return (i < n)? std::max(max, scalar::maxF32(src + i, n - i)):max;
+    }
+
+    void i32ToF32(float* dst, const int32_t* src, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            auto v = _mm_loadu_si128((const __m128i*)(src + i));
+            _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(v));
+        }
+        scalar::i32ToF32(dst + i, src + i, n - i);
+    }
+
+    void f32ToI32(int32_t* dst, const float* src, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            auto v = _mm_cvttps_epi32(_mm_loadu_ps(src + i));
+            _mm_storeu_si128((__m128i*)(dst + i), v);
+        }
+        scalar::f32ToI32(dst + i, src + i, n - i);
+    }
+
+    // Note: SSE2 has no rounding or gather instructions,
+    // so the sine uses the portable kernel
+    const SimdKernels kernels = {
+        "sse2",
+        addF32, mulF32, fmaF32, scaleF32, clampF32, scalar::sinF32,
+        sumF32, minF32, maxF32, i32ToF32, f32ToI32
+    };
+}
+
+#define AVX2_FN __attribute__((target("avx2,fma")))
+
+namespace avx2
+{
+    AVX2_FN void addF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        sse2::addF32(dst + i, a + i, b + i, n - i);
+    }
+
+    AVX2_FN void mulF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        sse2::mulF32(dst + i, a + i, b + i, n - i);
+    }
+
+    AVX2_FN void fmaF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            auto v = _mm256_fmadd_ps(
+                _mm256_loadu_ps(a + i),
+                _mm256_loadu_ps(b + i),
+                _mm256_loadu_ps(dst + i)
+            );
+            _mm256_storeu_ps(dst + i, v);
+        }
+
+        // Keep the tail fused as well, so that every element is
+        // rounded the same way
+        for (; i < n; ++i)
+            dst[i] = fmaf(a[i], b[i], dst[i]);
+    }
+
+    AVX2_FN void scaleF32(float* dst, const float* src, float k, size_t n)
+    {
+        auto kv = _mm256_set1_ps(k);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(src + i), kv));
+        sse2::scaleF32(dst + i, src + i, k, n - i);
+    }
+
+    AVX2_FN void clampF32(float* dst, float lo, float hi, size_t n)
+    {
+        auto lov = _mm256_set1_ps(lo);
+        auto hiv = _mm256_set1_ps(hi);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            auto v = _mm256_max_ps(_mm256_loadu_ps(dst + i), lov);
+            _mm256_storeu_ps(dst + i, _mm256_min_ps(v, hiv));
+        }
+        sse2::clampF32(dst + i, lo, hi, n - i);
+    }
+
+    AVX2_FN void sinF32(float* dst, const float* src, float phase, size_t n)
+    {
+        auto table = getSinTable();
+        auto offset = phase * SIN_SCALE;
+
+        auto scalev = _mm256_set1_ps(SIN_SCALE);
+        auto offsetv = _mm256_set1_ps(offset);
+        auto maskv = _mm256_set1_epi32(SIN_TABLE_SIZE - 1);
+
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            // Note: the multiply and add are not fused, to match
+            // the rounding of the portable kernel
+            auto t = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), scalev), offsetv);
+            auto floor = _mm256_floor_ps(t);
+            auto frac = _mm256_sub_ps(t, floor);
+            auto idx = _mm256_and_si256(_mm256_cvttps_epi32(floor), maskv);
+            auto lo = _mm256_i32gather_ps(table, idx, 4);
+            auto hi = _mm256_i32gather_ps(table + 1, idx, 4);
+            auto diff = _mm256_sub_ps(hi, lo);
+            _mm256_storeu_ps(dst + i, _mm256_add_ps(lo, _mm256_mul_ps(frac, diff)));
+        }
+        scalar::sinF32(dst + i, src + i, phase, n - i);
+    }
+
+    AVX2_FN float sumF32(const float* src, size_t n)
+    {
+        auto acc = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+            acc = _mm256_add_ps(acc, _mm256_loadu_ps(src + i));
+
+        auto half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        return sse2::hsum(half) + scalar::sumF32(src + i, n - i);
+    }
+
+    AVX2_FN float minF32(const float* src, size_t n)
+    {
+        if (n < 8)
+            return sse2::minF32(src, n);
+
+        auto acc = _mm256_loadu_ps(src);
+        size_t i = 8;
+        for (; i + 8 <= n; i += 8)
+            acc = _mm256_min_ps(acc, _mm256_loadu_ps(src + i));
+
+        float lanes[8];
+        _mm256_storeu_ps(lanes, acc);
+        auto min = scalar::minF32(lanes, 8);
+        return (i < n)? std::min(min, scalar::minF32(src + i, n - i)):min;
+    }
+
+    AVX2_FN float maxF32(const float* src, size_t n)
+    {
+        if (n < 8)
+            return sse2::maxF32(src, n);
+
+        auto acc = _mm256_loadu_ps(src);
+        size_t i = 8;
+        for (; i + 8 <= n; i += 8)
+            acc = _mm256_max_ps(acc, _mm256_loadu_ps(src + i));
+
+        float lanes[8];
+        _mm256_storeu_ps(lanes, acc);
+        auto max = scalar::maxF32(lanes, 8);
+        return (i < n)? std::max(max, scalar::maxF32(src + i, n - i)):max;
+    }
+
+    AVX2_FN void i32ToF32(float* dst, const int32_t* src, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            auto v = _mm256_loadu_si256((const __m256i*)(src + i));
+            _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(v));
+        }
+        sse2::i32ToF32(dst + i, src + i, n - i);
+    }
+
+    AVX2_FN void f32ToI32(int32_t* dst, const float* src, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            auto v = _mm256_cvttps_epi32(_mm256_loadu_ps(src + i));
+            _mm256_storeu_si256((__m256i*)(dst + i), v);
+        }
+        sse2::f32ToI32(dst + i, src + i, n - i);
+    }
+
+    const SimdKernels kernels = {
+        "avx2",
+        addF32, mulF32, fmaF32, scaleF32, clampF32, sinF32,
+        sumF32, minF32, maxF32, i32ToF32, f32ToI32
+    };
+}
+
+#endif // SIMD_X86
+
+//============================================================================
+// AArch64 kernels (NEON)
+//============================================================================
+
+#ifdef SIMD_NEON
+
+namespace neon
+{
+    void addF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            vst1q_f32(dst + i, vaddq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+        scalar::addF32(dst + i, a + i, b + i, n - i);
+    }
+
+    void mulF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            vst1q_f32(dst + i, vmulq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+        scalar::mulF32(dst + i, a + i, b + i, n - i);
+    }
+
+    void fmaF32(float* dst, const float* a, const float* b, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            vst1q_f32(dst + i, vfmaq_f32(vld1q_f32(dst + i), vld1q_f32(a + i), vld1q_f32(b + i)));
+        for (; i < n; ++i)
+            dst[i] = fmaf(a[i], b[i], dst[i]);
+    }
+
+    void scaleF32(float* dst, const float* src, float k, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            vst1q_f32(dst + i, vmulq_n_f32(vld1q_f32(src + i), k));
+        scalar::scaleF32(dst + i, src + i, k, n - i);
+    }
+
+    void clampF32(float* dst, float lo, float hi, size_t n)
+    {
+        auto lov = vdupq_n_f32(lo);
+        auto hiv = vdupq_n_f32(hi);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            vst1q_f32(dst + i, vminq_f32(vmaxq_f32(vld1q_f32(dst + i), lov), hiv));
+        scalar::clampF32(dst + i, lo, hi, n - i);
+    }
+
+    float sumF32(const float* src, size_t n)
+    {
+        auto acc = vdupq_n_f32(0);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            acc = vaddq_f32(acc, vld1q_f32(src + i));
+        return vaddvq_f32(acc) + scalar::sumF32(src + i, n - i);
+    }
+
+    float minF32(const float* src, size_t n)
+    {
+        if (n < 4)
+            return scalar::minF32(src, n);
+
+        auto acc = vld1q_f32(src);
+        size_t i = 4;
+        for (; i + 4 <= n; i += 4)
+            acc = vminq_f32(acc, vld1q_f32(src + i));
+
+        auto min = vminvq_f32(acc);
+        return (i < n)? std::min(min, scalar::minF32(src + i, n - i)):min;
+    }
+
+    float maxF32(const float* src, size_t n)
+    {
+        if (n < 4)
+            return scalar::maxF32(src, n);
+
+        auto acc = vld1q_f32(src);
+        size_t i = 4;
+        for (; i + 4 <= n; i += 4)
+            acc = vmaxq_f32(acc, vld1q_f32(src + i));
+
+        auto max = vmaxvq_f32(acc);
+        return (i < n)? std::max(max, scalar::maxF32(src + i, n - i)):max;
+    }
+
+    void i32ToF32(float* dst, const int32_t* src, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            vst1q_f32(dst + i, vcvtq_f32_s32(vld1q_s32(src + i)));
+        scalar::i32ToF32(dst + i, src + i, n - i);
+    }
+
+    void f32ToI32(int32_t* dst, const float* src, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            vst1q_s32(dst + i, vcvtq_s32_f32(vld1q_f32(src + i)));
+        scalar::f32ToI32(dst + i, src + i, n - i);
+    }
+
+    // Note: NEON has no gather instruction, so the
+    // sine uses the portable kernel
+    const SimdKernels kernels = {
+        "neon",
+        addF32, mulF32, fmaF32, scaleF32, clampF32, scalar::sinF32,
+        sumF32, minF32, maxF32, i32ToF32, f32ToI32
+    };
+}
+
+#endif // SIMD_NEON
+
+//============================================================================
+
+/// Get the kernel sets usable on this CPU, widest first
+static std::vector<const SimdKernels*> supportedKernels()
+{
+    std::vector<const SimdKernels*> sets;
+
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        sets.push_back(&avx2::kernels);
+    sets.push_back(&sse2::kernels);
+#endif
+
+#ifdef SIMD_NEON
+    sets.push_back(&neon::kernels);
+#endif
+
+    sets.push_back(&scalar::kernels);
+    return sets;
+}
+
+const SimdKernels& simdKernels()
+{
+    static const SimdKernels* kernels = supportedKernels()[0];
+    return *kernels;
+}
+
+void testSimd()
+{
+    std::cout << "simd kernels: " << simdKernels().isa << std::endl;
+
+    // Lengths which exercise both the vector loops and their tails
+    const size_t n = 37;
+    std::vector<float> a(n), b(n);
+    std::vector<int32_t> ints(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        a[i] = (i % 7) * 0.75f - 2.0f;
+        b[i] = (i % 5) * 0.5f + 0.25f;
+        ints[i] = (int32_t)(i * 3) - 40;
+    }
+
+    auto& ref = scalar::kernels;
+
+    for (auto kernels : supportedKernels())
+    {
+        std::vector<float> out(n), expected(n);
+
+        kernels->addF32(out.data(), a.data(), b.data(), n);
+        ref.addF32(expected.data(), a.data(), b.data(), n);
+        assert (out == expected);
+
+        kernels->mulF32(out.data(), a.data(), b.data(), n);
+        ref.mulF32(expected.data(), a.data(), b.data(), n);
+        assert (out == expected);
+
+        // Note: these inputs are exact with or without fusion
+        out = b;
+        expected = b;
+        kernels->fmaF32(out.data(), a.data(), b.data(), n);
+        ref.fmaF32(expected.data(), a.data(), b.data(), n);
+        assert (out == expected);
+
+        kernels->scaleF32(out.data(), a.data(), 3.0f, n);
+        ref.scaleF32(expected.data(), a.data(), 3.0f, n);
+        assert (out == expected);
+
+        kernels->clampF32(out.data(), -1.0f, 1.0f, n);
+        ref.clampF32(expected.data(), -1.0f, 1.0f, n);
+        assert (out == expected);
+
+        kernels->sinF32(out.data(), a.data(), 0, n);
+        for (size_t i = 0; i < n; ++i)
+            assert (fabs(out[i] - sin(a[i])) < 1e-5);
+        kernels->sinF32(out.data(), a.data(), 1.57079632679f, n);
+        for (size_t i = 0; i < n; ++i)
+            assert (fabs(out[i] - cos(a[i])) < 1e-5);
+
+        assert (kernels->sumF32(a.data(), n) == ref.sumF32(a.data(), n));
+        assert (kernels->minF32(a.data(), n) == -2.0f);
+        assert (kernels->maxF32(a.data(), n) == 2.5f);
+        assert (kernels->minF32(b.data() + 1, 2) == 0.75f);
+
+        std::vector<int32_t> intOut(n);
+        kernels->i32ToF32(out.data(), ints.data(), n);
+        kernels->f32ToI32(intOut.data(), out.data(), n);
+        assert (intOut == ints);
+        kernels->f32ToI32(intOut.data(), a.data(), n);
+        for (size_t i = 0; i < n; ++i)
+            assert (intOut[i] == (int32_t)a[i]);
+    }
+}
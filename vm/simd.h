@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+Bulk numeric kernels over packed float32 and int32 data, used to
+implement the core/simd/0 package. Each kernel processes a whole
+array of n elements. The destination may be the same array as one
+of the sources.
+*/
+struct SimdKernels
+{
+    /// Name of the instruction set the kernels use
+    const char* isa;
+
+    void (*addF32)(float* dst, const float* a, const float* b, size_t n);
+    void (*mulF32)(float* dst, const float* a, const float* b, size_t n);
+
+    /// dst += a * b, fused where the instruction set supports it
+    void (*fmaF32)(float* dst, const float* a, const float* b, size_t n);
+
+    void (*scaleF32)(float* dst, const float* src, float k, size_t n);
+    void (*clampF32)(float* dst, float lo, float hi, size_t n);
+
+    /// Table-based sine, also used for the cosine with a phase offset
+    void (*sinF32)(float* dst, const float* src, float phase, size_t n);
+
+    float (*sumF32)(const float* src, size_t n);
+    float (*minF32)(const float* src, size_t n);
+    float (*maxF32)(const float* src, size_t n);
+
+    void (*i32ToF32)(float* dst, const int32_t* src, size_t n);
+
+    /// Conversion with truncation toward zero. The result is
+    /// unspecified for values out of the int32 range.
+    void (*f32ToI32)(int32_t* dst, const float* src, size_t n);
+};
+
+/// Get the kernels using the widest vector instructions the CPU
+/// supports, selected the first time this is called
+const SimdKernels& simdKernels();
+
+/// Run the simd kernel unit tests
+void testSimd();